@@ -0,0 +1,387 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// Benchmark capturing the frames of a busy switch.
+//
+// Connects a sender and a receiver port using callbacks to a switch, and
+// sends IPv4 UDP frames as fast as the relay forwards them, without a capture,
+// with a capture of entire frames, of the default snapshot length, of the
+// first 96 bytes of every frame, and with a filter matching no frame. A reader
+// thread reads the pcapng stream from the capture socket, and checks that the
+// stream has a frame for every captured frame, and that the statistics block
+// reports the dropped frames. Reports the forwarding rate, the slowdown
+// compared with no capture, the frames written to the socket, and the frames
+// dropped since the writer could not keep up.
+//
+// Usage: bench-capture [FRAMES] [FRAME_SIZE]
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broker-capture.h"
+#include "broker-relay.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+// The relay buffer size, large enough for a 1500 bytes MTU frame.
+#define MAX_FRAME_SIZE 2048
+
+#define ETHER_HEADER_SIZE 14
+#define IP_HEADER_SIZE 20
+#define UDP_HEADER_SIZE 8
+
+// pcapng blocks checked by the reader.
+#define BLOCK_SECTION_HEADER 0x0a0d0d0a
+#define BLOCK_INTERFACE_STATS 5
+#define BLOCK_ENHANCED_PACKET 6
+#define OPT_ISB_OSDROP 7
+
+#define READ_BUFFER_SIZE (1024 * 1024)
+
+struct bench_port {
+    // Sender: frames left to send.
+    uint64_t remaining;
+    size_t frame_size;
+    unsigned char frame[MAX_FRAME_SIZE];
+    // Receiver: frames received from the switch.
+    atomic_uint_fast64_t received;
+    unsigned char sink[MAX_FRAME_SIZE];
+};
+
+// A capture configuration.
+struct mode {
+    const char *name;
+    bool capture;
+    const char *filter;
+    uint32_t snaplen;
+};
+
+static const struct mode modes[] = {
+    {"none", false, NULL, 0},
+    {"all", true, NULL, CAPTURE_MAX_SNAPLEN},
+    {"default", true, NULL, 0},
+    {"headers", true, NULL, 96},
+    {"filtered", true, "tcp port 22", 0},
+};
+
+// The pcapng stream read from the capture socket.
+struct reader {
+    int fd;
+    uint64_t bytes;
+    uint64_t packets;
+    uint64_t drops;
+    bool stats;
+};
+
+static uint64_t gettime(void) {
+    struct timespec ts;
+#ifdef CLOCK_UPTIME_RAW
+    clock_gettime(CLOCK_UPTIME_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+static void put16(unsigned char *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+// Build a UDP frame from 10.0.0.1:5000 to 10.0.0.2:5001.
+static void build_frame(unsigned char *frame, size_t size) {
+    memset(frame, 0, size);
+    unsigned char *ip = frame + ETHER_HEADER_SIZE;
+    unsigned char *udp = ip + IP_HEADER_SIZE;
+
+    frame[0] = 0x02;
+    frame[5] = 0x02;
+    frame[6] = 0x02;
+    frame[11] = 0x01;
+    put16(frame + 12, 0x0800);
+    ip[0] = 0x45;
+    put16(ip + 2, size - ETHER_HEADER_SIZE);
+    ip[8] = 64;
+    ip[9] = 17;
+    ip[12] = ip[16] = 10;
+    ip[15] = 1;
+    ip[19] = 2;
+    put16(udp, 5000);
+    put16(udp + 2, 5001);
+    put16(udp + 4, size - ETHER_HEADER_SIZE - IP_HEADER_SIZE);
+}
+
+static int sender_recv(void *arg, struct relay_frame *frames, int count) {
+    struct bench_port *port = arg;
+    int n = 0;
+    while (n < count && port->remaining > 0) {
+        frames[n].data = port->frame;
+        frames[n].len = port->frame_size;
+        port->remaining--;
+        n++;
+    }
+    return n;
+}
+
+static int
+receiver_send(void *arg, const struct relay_frame *frames, int count) {
+    struct bench_port *port = arg;
+    for (int i = 0; i < count; i++) {
+        memcpy(port->sink, frames[i].data, frames[i].len);
+    }
+    atomic_fetch_add(&port->received, count);
+    return count;
+}
+
+// The sender does not receive frames, and the receiver does not send.
+static int no_recv(void *arg, struct relay_frame *frames, int count) {
+    (void)arg;
+    (void)frames;
+    (void)count;
+    return 0;
+}
+
+static int no_send(void *arg, const struct relay_frame *frames, int count) {
+    (void)arg;
+    (void)frames;
+    return count;
+}
+
+static const struct relay_port_ops sender_ops = {
+    .recv = sender_recv,
+    .send = no_send,
+};
+
+static const struct relay_port_ops receiver_ops = {
+    .recv = no_recv,
+    .send = receiver_send,
+};
+
+static void fail(const char *msg) {
+    fprintf(stderr, "invalid capture: %s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+// Find the drops in the options of an interface statistics block.
+static uint64_t read_drops(const unsigned char *options, size_t len) {
+    size_t off = 0;
+    while (off + 4 <= len) {
+        uint16_t code, size;
+        memcpy(&code, options + off, sizeof(code));
+        memcpy(&size, options + off + 2, sizeof(size));
+        if (code == OPT_ISB_OSDROP && size == 8) {
+            uint64_t drops;
+            memcpy(&drops, options + off + 4, sizeof(drops));
+            return drops;
+        }
+        off += 4 + ((size + 3) & ~3);
+    }
+    fail("no drops option");
+    return 0;
+}
+
+// Parse a pcapng block.
+static void read_block(struct reader *r, const unsigned char *block) {
+    uint32_t type, len, trailer;
+    memcpy(&type, block, sizeof(type));
+    memcpy(&len, block + 4, sizeof(len));
+    memcpy(&trailer, block + len - 4, sizeof(trailer));
+    if (r->bytes == 0 && type != BLOCK_SECTION_HEADER) {
+        fail("missing section header");
+    }
+    if (trailer != len) {
+        fail("block length mismatch");
+    }
+    if (type == BLOCK_ENHANCED_PACKET) {
+        r->packets++;
+    } else if (type == BLOCK_INTERFACE_STATS) {
+        // Type, length, interface, and timestamp, then the options and the
+        // trailer.
+        r->drops = read_drops(block + 20, len - 24);
+        r->stats = true;
+    }
+    r->bytes += len;
+}
+
+// Read pcapng blocks until the capture closes the socket.
+static void *reader_thread(void *arg) {
+    struct reader *r = arg;
+    unsigned char *buf = malloc(READ_BUFFER_SIZE);
+    if (buf == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t start = 0;
+    size_t end = 0;
+    while (true) {
+        ssize_t n = read(r->fd, buf + end, READ_BUFFER_SIZE - end);
+        if (n < 0) {
+            perror("read");
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0) {
+            break;
+        }
+        end += n;
+        while (end - start >= 8) {
+            uint32_t len;
+            memcpy(&len, buf + start + 4, sizeof(len));
+            if (len < 12 || len % 4 || len > READ_BUFFER_SIZE / 2) {
+                fail("invalid block length");
+            }
+            if (end - start < len) {
+                break;
+            }
+            read_block(r, buf + start);
+            start += len;
+        }
+        // Keep the partial block at the start of the buffer.
+        memmove(buf, buf + start, end - start);
+        end -= start;
+        start = 0;
+    }
+    if (end != 0) {
+        fail("truncated block");
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void run(const struct mode *mode, uint64_t frames, size_t frame_size) {
+    struct bench_port *sender = calloc(1, sizeof(*sender));
+    struct bench_port *receiver = calloc(1, sizeof(*receiver));
+    if (sender == NULL || receiver == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    sender->remaining = frames;
+    sender->frame_size = frame_size;
+    build_frame(sender->frame, frame_size);
+
+    struct relay *relay = relay_create(MAX_FRAME_SIZE, RELAY_BATCH);
+    if (relay == NULL) {
+        perror("relay_create");
+        exit(EXIT_FAILURE);
+    }
+    struct relay_switch *sw = relay_create_switch(relay);
+    if (sw == NULL) {
+        perror("relay_create_switch");
+        exit(EXIT_FAILURE);
+    }
+
+    struct capture *capture = NULL;
+    struct reader reader = {.fd = -1};
+    pthread_t thread;
+    if (mode->capture) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            perror("socketpair");
+            exit(EXIT_FAILURE);
+        }
+        struct capture_options options = {
+            .name = "bench",
+            .filter = mode->filter,
+            .snaplen = mode->snaplen,
+        };
+        capture = capture_start(relay, sw, fds[0], &options);
+        if (capture == NULL) {
+            perror("capture_start");
+            exit(EXIT_FAILURE);
+        }
+        reader.fd = fds[1];
+        if (pthread_create(&thread, NULL, reader_thread, &reader) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct relay_endpoint b = {
+        .fd = -1,
+        .ops = &receiver_ops,
+        .arg = receiver,
+    };
+    if (relay_add_switch_link(relay, sw, &b) == NULL) {
+        perror("relay_add_switch_link");
+        exit(EXIT_FAILURE);
+    }
+
+    struct relay_endpoint a = {.fd = -1, .ops = &sender_ops, .arg = sender};
+    uint64_t start = gettime();
+
+    // Adding the link notifies it, and the relay forwards all frames.
+    struct relay_link *link = relay_add_switch_link(relay, sw, &a);
+    if (link == NULL) {
+        perror("relay_add_switch_link");
+        exit(EXIT_FAILURE);
+    }
+    while (atomic_load(&receiver->received) < frames) {
+        usleep(100);
+    }
+
+    uint64_t end = gettime();
+
+    struct capture_stats stats = {0};
+    if (capture) {
+        capture_get_stats(capture, &stats);
+        capture_stop(capture);
+        pthread_join(thread, NULL);
+        close(reader.fd);
+        if (!reader.stats || reader.packets != stats.captured ||
+            reader.drops != stats.drops) {
+            fail("frames do not match capture counters");
+        }
+    }
+
+    relay_destroy(relay);
+    free(sender);
+    free(receiver);
+
+    double elapsed = (double)(end - start) / NANOSECONDS_PER_SECOND;
+    static double baseline;
+    if (!mode->capture) {
+        baseline = elapsed;
+    }
+    printf(
+        "%10s %10.2f %9.1f%% %10llu %10llu %10.1f\n",
+        mode->name,
+        frames / elapsed / 1e6,
+        (elapsed / baseline - 1) * 100,
+        (unsigned long long)reader.packets,
+        (unsigned long long)stats.drops,
+        reader.bytes * 8 / elapsed / 1e9
+    );
+}
+
+int main(int argc, char *argv[]) {
+    long long frames = argc > 1 ? atoll(argv[1]) : 10000000;
+    long long frame_size = argc > 2 ? atoll(argv[2]) : 1514;
+    if (frames < 1 || frame_size < 64 || frame_size > MAX_FRAME_SIZE) {
+        fprintf(stderr, "Usage: bench-capture [FRAMES] [FRAME_SIZE]\n");
+        return EXIT_FAILURE;
+    }
+
+    printf(
+        "%10s %10s %10s %10s %10s %10s\n",
+        "capture",
+        "mpps",
+        "slowdown",
+        "written",
+        "drops",
+        "gbps"
+    );
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        run(&modes[i], frames, frame_size);
+    }
+
+    return 0;
+}
@@ -0,0 +1,211 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// Benchmark peer and network record churn.
+//
+// Simulates rounds of short lived peers: every peer connects, acquires a
+// network, and disconnects. The network is removed when the last peer
+// disconnects, as when the broker is idle between test runs. Compares
+// allocating records with malloc, as the broker did before using pools, with
+// allocating records from pools, reporting the number of malloc calls per
+// cycle in the first round and in steady state.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "broker-pool.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+// Stand in for struct broker_context and struct network; the size is what
+// matters.
+struct fake_context {
+    void *connection;
+    char name[sizeof("peer 9223372036854775807")];
+    void *networks[8];
+    void *subscriber;
+    char throttle[40];
+};
+
+struct fake_network {
+    char *name;
+    char inline_name[32];
+    int peers;
+    char state[120];
+};
+
+struct bench_case {
+    int peers;
+    int rounds;
+};
+
+static const struct bench_case default_cases[] = {
+    {.peers = 1, .rounds = 100000},
+    {.peers = 16, .rounds = 10000},
+    {.peers = 256, .rounds = 1000},
+    {.peers = 4096, .rounds = 100},
+};
+
+static const char *network_name = "shared";
+
+// Number of malloc calls made by the malloc mode.
+static uint64_t mallocs;
+
+static uint64_t gettime(void) {
+    struct timespec ts;
+#ifdef CLOCK_UPTIME_RAW
+    clock_gettime(CLOCK_UPTIME_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+static void *xcalloc(size_t size) {
+    void *p = calloc(1, size);
+    if (p == NULL) {
+        fprintf(stderr, "failed to allocate %zu bytes\n", size);
+        exit(EXIT_FAILURE);
+    }
+    mallocs++;
+    return p;
+}
+
+// One round using malloc: every context and network is allocated and freed.
+static void malloc_round(struct fake_context **peers, int count) {
+    struct fake_network *net = NULL;
+
+    for (int i = 0; i < count; i++) {
+        peers[i] = xcalloc(sizeof(*peers[i]));
+        snprintf(peers[i]->name, sizeof(peers[i]->name), "peer %d", i);
+        if (net == NULL) {
+            net = xcalloc(sizeof(*net));
+            net->name = strdup(network_name);
+            mallocs++;
+        }
+        net->peers++;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (--net->peers == 0) {
+            free(net->name);
+            free(net);
+        }
+        free(peers[i]);
+    }
+}
+
+static struct pool context_pool = POOL_INITIALIZER(
+    "contexts", struct fake_context
+);
+static struct pool network_pool = POOL_INITIALIZER(
+    "networks", struct fake_network
+);
+
+// One round using pools: records are reused, and short names are inline.
+static void pool_round(struct fake_context **peers, int count) {
+    struct fake_network *net = NULL;
+
+    for (int i = 0; i < count; i++) {
+        peers[i] = pool_alloc(&context_pool);
+        snprintf(peers[i]->name, sizeof(peers[i]->name), "peer %d", i);
+        if (net == NULL) {
+            net = pool_alloc(&network_pool);
+            *net = (struct fake_network){0};
+            strcpy(net->inline_name, network_name);
+            net->name = net->inline_name;
+        }
+        net->peers++;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (--net->peers == 0) {
+            pool_free(&network_pool, net);
+        }
+        pool_free(&context_pool, peers[i]);
+    }
+}
+
+// Return the number of malloc calls made for records.
+static uint64_t count_mallocs(bool use_pools) {
+    if (use_pools) {
+        return context_pool.slabs + network_pool.slabs;
+    }
+    return mallocs;
+}
+
+static void run_case(const struct bench_case *c, bool use_pools) {
+    struct fake_context **peers = calloc(c->peers, sizeof(*peers));
+    if (peers == NULL) {
+        fprintf(stderr, "failed to allocate %d peers\n", c->peers);
+        exit(EXIT_FAILURE);
+    }
+
+    void (*round)(struct fake_context **, int) = use_pools ? pool_round
+                                                           : malloc_round;
+
+    // The first round warms up the pools.
+    uint64_t start_mallocs = count_mallocs(use_pools);
+    round(peers, c->peers);
+    uint64_t first_mallocs = count_mallocs(use_pools) - start_mallocs;
+
+    start_mallocs = count_mallocs(use_pools);
+    uint64_t start = gettime();
+    for (int r = 1; r < c->rounds; r++) {
+        round(peers, c->peers);
+    }
+    uint64_t elapsed = gettime() - start;
+    uint64_t steady_mallocs = count_mallocs(use_pools) - start_mallocs;
+
+    uint64_t cycles = (uint64_t)(c->rounds - 1) * c->peers;
+
+    printf(
+        "%8s %8d %8d %10.1f %14.3f %14.3f\n",
+        use_pools ? "pool" : "malloc",
+        c->peers,
+        c->rounds,
+        (double)elapsed / cycles,
+        (double)first_mallocs / c->peers,
+        (double)steady_mallocs / cycles
+    );
+
+    free(peers);
+}
+
+int main(int argc, char *argv[]) {
+    printf(
+        "%8s %8s %8s %10s %14s %14s\n",
+        "mode",
+        "peers",
+        "rounds",
+        "cycle-ns",
+        "first-mallocs",
+        "steady-mallocs"
+    );
+
+    if (argc == 3) {
+        struct bench_case c = {
+            .peers = atoi(argv[1]),
+            .rounds = atoi(argv[2]),
+        };
+        if (c.peers < 1 || c.rounds < 2) {
+            fprintf(stderr, "Usage: bench-churn [PEERS ROUNDS]\n");
+            return EXIT_FAILURE;
+        }
+        run_case(&c, false);
+        run_case(&c, true);
+        return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(default_cases) / sizeof(default_cases[0]);
+         i++) {
+        run_case(&default_cases[i], false);
+        run_case(&default_cases[i], true);
+    }
+
+    return 0;
+}
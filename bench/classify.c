@@ -0,0 +1,249 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// Benchmark frame classification and checksums.
+//
+// Classifies batches of RELAY_BATCH frames mixing IPv4, IPv6, ARP, VLAN
+// tagged, fragmented, and invalid frames in random order, and computes the
+// internet checksum of buffers of typical header and frame sizes. Checks that
+// the SIMD versions return the same results as the scalar versions, and
+// reports the time per frame and the classification rate, and the checksum
+// rate in Gbit/s, for both versions.
+//
+// Usage: bench-classify [ITERATIONS]
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "broker-checksum.h"
+#include "broker-classify.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+// The relay buffer size, large enough for a 1500 bytes MTU frame.
+#define MAX_FRAME_SIZE 2048
+
+// Number of different batches, so the branch predictor does not learn the
+// order of frames.
+#define BATCHES 64
+
+// The largest checksum size, a TCP segment sent by a guest using TSO.
+#define MAX_CHECKSUM_SIZE 65536
+
+static const size_t checksum_sizes[] = {20, 64, 576, 1500, 9000, 65536};
+
+// Prevent the compiler from removing the benchmarked calls.
+static volatile uint32_t sink;
+
+static uint64_t gettime(void) {
+    struct timespec ts;
+#ifdef CLOCK_UPTIME_RAW
+    clock_gettime(CLOCK_UPTIME_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+static unsigned char *put16(unsigned char *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+    return p + 2;
+}
+
+// Build frame i of a batch, of a random kind, returning its length.
+static size_t build_frame(unsigned char *frame, int i) {
+    memset(frame, 0, MAX_FRAME_SIZE);
+    unsigned char *p = frame;
+    int kind = rand() % 8;
+
+    // Destination and source addresses.
+    if (kind == 3) {
+        memset(p, 0xff, 6);
+    } else {
+        p[0] = 0x02;
+        p[5] = i;
+    }
+    p[6] = 0x02;
+    p[11] = i + 1;
+    p += 12;
+
+    if (kind == 4) {
+        p = put16(p, 0x8100);
+        p = put16(p, 100 + i);
+    }
+
+    switch (kind) {
+    case 0:
+    case 1:
+    case 4:
+    case 5:
+        // IPv4 TCP, UDP, or a fragment.
+        p = put16(p, 0x0800);
+        p[0] = 0x45;
+        p[9] = kind == 1 ? 17 : 6;
+        if (kind == 5) {
+            put16(p + 6, 0x2000 | (i & 0xff));
+        }
+        return p - frame + 20 + 20 + (i % 3) * 100;
+    case 2:
+        p = put16(p, 0x86dd);
+        p[0] = 0x60;
+        p[6] = 6;
+        return p - frame + 40 + 20 + (i % 5) * 200;
+    case 3:
+        p = put16(p, 0x0806);
+        return p - frame + 28;
+    case 6:
+        // Truncated IPv4 header.
+        p = put16(p, 0x0800);
+        p[0] = 0x45;
+        return p - frame + 10;
+    default:
+        p = put16(p, 0x88b5);
+        return p - frame + 46;
+    }
+}
+
+static double bench_classify(
+    int iterations, struct relay_frame (*frames)[RELAY_BATCH], bool simd
+) {
+    struct frame_class c;
+    uint64_t start = gettime();
+    for (int n = 0; n < iterations; n++) {
+        if (simd) {
+            classify_frames(frames[n % BATCHES], RELAY_BATCH, &c);
+        } else {
+            classify_frames_scalar(frames[n % BATCHES], RELAY_BATCH, &c);
+        }
+        sink += c.flags[n % RELAY_BATCH];
+    }
+    return (double)(gettime() - start) / iterations / RELAY_BATCH;
+}
+
+static void run_classify(int iterations) {
+    static unsigned char buffers[BATCHES][RELAY_BATCH][MAX_FRAME_SIZE];
+    static struct relay_frame frames[BATCHES][RELAY_BATCH];
+    srand(1);
+    for (int b = 0; b < BATCHES; b++) {
+        for (int i = 0; i < RELAY_BATCH; i++) {
+            frames[b][i].data = buffers[b][i];
+            frames[b][i].len = build_frame(buffers[b][i], i);
+        }
+
+        struct frame_class simd, scalar;
+        memset(&simd, 0, sizeof(simd));
+        memset(&scalar, 0, sizeof(scalar));
+        classify_frames(frames[b], RELAY_BATCH, &simd);
+        classify_frames_scalar(frames[b], RELAY_BATCH, &scalar);
+        if (memcmp(&simd, &scalar, sizeof(simd)) != 0) {
+            fprintf(stderr, "classify_frames differs from scalar version\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("%10s %8s %10s %10s\n", "classify", "batch", "ns/frame", "Mpps");
+    const char *names[] = {"scalar", "simd"};
+    for (int simd = 0; simd < 2; simd++) {
+        double ns = bench_classify(iterations, frames, simd);
+        printf(
+            "%10s %8d %10.2f %10.1f\n", names[simd], RELAY_BATCH, ns, 1e3 / ns
+        );
+    }
+}
+
+static void check_checksums(unsigned char *buf) {
+    for (size_t len = 0; len <= 4096; len++) {
+        size_t off = len % 8;
+        uint16_t expected = inet_fold(inet_sum_scalar(buf + off, len, 0));
+        uint16_t got = inet_checksum(buf + off, len);
+        if (got != expected) {
+            fprintf(
+                stderr,
+                "checksum of %zu bytes: 0x%04x, expected 0x%04x\n",
+                len,
+                got,
+                expected
+            );
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static double bench_checksum(
+    const unsigned char *buf, size_t size, int iterations, bool simd
+) {
+    uint64_t start = gettime();
+    for (int n = 0; n < iterations; n++) {
+        if (simd) {
+            sink += inet_sum(buf, size, 0);
+        } else {
+            sink += inet_sum_scalar(buf, size, 0);
+        }
+    }
+    return (double)(gettime() - start) / iterations;
+}
+
+static void run_checksum(int iterations) {
+    unsigned char *buf = malloc(MAX_CHECKSUM_SIZE + 8);
+    if (buf == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    srand(1);
+    for (size_t i = 0; i < MAX_CHECKSUM_SIZE + 8; i++) {
+        buf[i] = rand();
+    }
+    check_checksums(buf);
+
+    printf(
+        "\n%10s %8s %10s %10s %10s\n",
+        "checksum",
+        "size",
+        "ns",
+        "gbps",
+        "speedup"
+    );
+    size_t sizes = sizeof(checksum_sizes) / sizeof(checksum_sizes[0]);
+    for (size_t i = 0; i < sizes; i++) {
+        size_t size = checksum_sizes[i];
+        // Checksum about the same number of bytes for every size.
+        int n = (int)(iterations * 64 / size) + 1;
+        double scalar = bench_checksum(buf, size, n, false);
+        double simd = bench_checksum(buf, size, n, true);
+        printf(
+            "%10s %8zu %10.1f %10.1f\n",
+            "scalar",
+            size,
+            scalar,
+            size * 8 / scalar
+        );
+        printf(
+            "%10s %8zu %10.1f %10.1f %9.1fx\n",
+            "simd",
+            size,
+            simd,
+            size * 8 / simd,
+            scalar / simd
+        );
+    }
+
+    free(buf);
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+    if (iterations < 1) {
+        fprintf(stderr, "Usage: bench-classify [ITERATIONS]\n");
+        return EXIT_FAILURE;
+    }
+
+    run_classify(iterations);
+    run_checksum(iterations);
+
+    return 0;
+}
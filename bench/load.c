@@ -0,0 +1,361 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// Load generator for the installed broker.
+//
+// Starts many client processes, each acquiring and releasing networks in a
+// loop, and reports the latency distribution of acquire requests. Every client
+// process is a separate peer, so the broker handles requests from all clients
+// concurrently. The first request for a network creates it; the rest are
+// cache hits. After the run, the broker latency statistics are printed,
+// showing how long requests completed immediately and requests deferred until
+// a network is created waited, how long work waited in the fast and slow
+// lanes, and the time the broker main queue and every shard queue spent
+// handling requests during the run.
+//
+// Usage: bench-load [CLIENTS [REQUESTS]]
+
+#include <errno.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vmnet-broker.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+extern char **environ;
+
+static const char *networks[] = {"shared", "host"};
+
+static uint64_t gettime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_UPTIME_RAW, &ts);
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+static int compare_uint64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Run in a client process: acquire and release networks, writing the latency
+// of every acquire request to stdout.
+static int run_client(int requests) {
+    for (int i = 0; i < requests; i++) {
+        const char *name = networks[i % 2];
+        vmnet_broker_return_t status;
+
+        uint64_t start = gettime();
+        xpc_object_t serialization = vmnet_broker_acquire_network(
+            name, &status
+        );
+        uint64_t elapsed = gettime() - start;
+
+        if (serialization == NULL) {
+            fprintf(
+                stderr,
+                "failed to acquire network '%s': %s\n",
+                name,
+                vmnet_broker_strerror(status)
+            );
+            return EXIT_FAILURE;
+        }
+        xpc_release(serialization);
+
+        if (fwrite(&elapsed, sizeof(elapsed), 1, stdout) != 1) {
+            return EXIT_FAILURE;
+        }
+
+        status = vmnet_broker_release_network(name);
+        if (status != VMNET_BROKER_SUCCESS) {
+            fprintf(
+                stderr,
+                "failed to release network '%s': %s\n",
+                name,
+                vmnet_broker_strerror(status)
+            );
+            return EXIT_FAILURE;
+        }
+    }
+
+    return fflush(stdout) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Spawn a client process writing latencies to fd.
+static pid_t spawn_client(const char *self, const char *requests, int fd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fd, STDOUT_FILENO);
+
+    char *const argv[] = {(char *)self, "--client", (char *)requests, NULL};
+    pid_t pid;
+    int err = posix_spawn(&pid, self, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        fprintf(stderr, "failed to spawn client: %s\n", strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    return pid;
+}
+
+static xpc_object_t query_stats(void) {
+    vmnet_broker_return_t status;
+    xpc_object_t stats = vmnet_broker_stats(&status);
+    if (stats == NULL) {
+        fprintf(
+            stderr, "failed to query stats: %s\n", vmnet_broker_strerror(status)
+        );
+        exit(EXIT_FAILURE);
+    }
+    return stats;
+}
+
+// Get the number of requests handled on the broker main queue and the time
+// spent handling them.
+static void
+get_request_busy(xpc_object_t stats, uint64_t *handled, uint64_t *busy_usec) {
+    xpc_object_t watchdog = xpc_dictionary_get_dictionary(
+        stats, STATS_WATCHDOG
+    );
+    *handled = xpc_dictionary_get_uint64(
+        xpc_dictionary_get_dictionary(watchdog, WATCHDOG_HANDLED), "request"
+    );
+    *busy_usec = xpc_dictionary_get_uint64(
+        xpc_dictionary_get_dictionary(watchdog, WATCHDOG_BUSY_USEC), "request"
+    );
+}
+
+// Print the blocks run on every shard queue during the run. A shard queue is
+// saturated when its busy time reaches the elapsed time.
+static void
+print_shard_stats(xpc_object_t before, xpc_object_t stats, uint64_t elapsed) {
+    xpc_object_t shards_before = xpc_dictionary_get_array(
+        before, STATS_SHARDS
+    );
+    xpc_object_t shards = xpc_dictionary_get_array(stats, STATS_SHARDS);
+    if (shards_before == NULL || shards == NULL) {
+        return;
+    }
+
+    printf(
+        "\n%6s %10s %10s %10s %10s\n",
+        "shard",
+        "handled",
+        "wait-us",
+        "us/req",
+        "busy-%"
+    );
+
+    size_t count = xpc_array_get_count(shards);
+    for (size_t i = 0; i < count; i++) {
+        xpc_object_t a = xpc_array_get_value(shards_before, i);
+        xpc_object_t b = xpc_array_get_value(shards, i);
+        uint64_t handled = xpc_dictionary_get_uint64(b, SHARD_HANDLED) -
+                           xpc_dictionary_get_uint64(a, SHARD_HANDLED);
+        uint64_t wait = xpc_dictionary_get_uint64(b, SHARD_WAIT_USEC) -
+                        xpc_dictionary_get_uint64(a, SHARD_WAIT_USEC);
+        uint64_t busy = xpc_dictionary_get_uint64(b, SHARD_BUSY_USEC) -
+                        xpc_dictionary_get_uint64(a, SHARD_BUSY_USEC);
+        if (handled == 0) {
+            continue;
+        }
+        printf(
+            "%6zu %10llu %10.1f %10.1f %9.1f%%\n",
+            i,
+            handled,
+            (double)wait / handled,
+            (double)busy / handled,
+            100.0 * busy * 1000 / elapsed
+        );
+    }
+}
+
+static void print_latency_stats(xpc_object_t before, uint64_t elapsed) {
+    xpc_object_t stats = query_stats();
+
+    printf(
+        "\n%10s %10s %12s %14s %14s\n",
+        "latency",
+        "requests",
+        "max-pending",
+        "mean-wait-us",
+        "max-wait-us"
+    );
+
+    xpc_object_t latency = xpc_dictionary_get_dictionary(stats, STATS_LATENCY);
+    const char *names[] = {STATS_LATENCY_IMMEDIATE, STATS_LATENCY_DEFERRED};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        xpc_object_t dict = xpc_dictionary_get_dictionary(latency, names[i]);
+        uint64_t requests = xpc_dictionary_get_uint64(dict, LATENCY_REQUESTS);
+        uint64_t wait = xpc_dictionary_get_uint64(dict, LATENCY_WAIT_USEC);
+        printf(
+            "%10s %10llu %12lld %14.1f %14llu\n",
+            names[i],
+            requests,
+            xpc_dictionary_get_int64(dict, LATENCY_MAX_PENDING),
+            requests ? (double)wait / requests : 0.0,
+            xpc_dictionary_get_uint64(dict, LATENCY_MAX_WAIT_USEC)
+        );
+    }
+
+    printf(
+        "\n%10s %10s %12s %14s %14s\n",
+        "lane",
+        "queued",
+        "max-depth",
+        "mean-wait-us",
+        "max-wait-us"
+    );
+
+    xpc_object_t lanes = xpc_dictionary_get_dictionary(stats, STATS_LANES);
+    const char *lane_names[] = {STATS_LANE_FAST, STATS_LANE_SLOW};
+    for (size_t i = 0; i < sizeof(lane_names) / sizeof(lane_names[0]); i++) {
+        xpc_object_t dict = xpc_dictionary_get_dictionary(lanes, lane_names[i]);
+        uint64_t queued = xpc_dictionary_get_uint64(dict, LANE_QUEUED);
+        uint64_t wait = xpc_dictionary_get_uint64(dict, LANE_WAIT_USEC);
+        printf(
+            "%10s %10llu %12lld %14.1f %14llu\n",
+            lane_names[i],
+            queued,
+            xpc_dictionary_get_int64(dict, LANE_MAX_DEPTH),
+            queued ? (double)wait / queued : 0.0,
+            xpc_dictionary_get_uint64(dict, LANE_MAX_WAIT_USEC)
+        );
+    }
+
+    printf(
+        "\nthrottled %llu busy-creates %llu\n",
+        xpc_dictionary_get_uint64(stats, STATS_THROTTLED),
+        xpc_dictionary_get_uint64(stats, STATS_BUSY_CREATES)
+    );
+
+    // The main queue is saturated when the busy time reaches the elapsed
+    // time; requests then wait behind each other, including requests for
+    // existing networks.
+    uint64_t handled_before, busy_before, handled, busy;
+    get_request_busy(before, &handled_before, &busy_before);
+    get_request_busy(stats, &handled, &busy);
+    handled -= handled_before;
+    busy -= busy_before;
+    printf("\n%10s %12s %10s %10s\n", "handled", "busy-us", "us/req", "busy-%");
+    printf(
+        "%10llu %12llu %10.1f %9.1f%%\n",
+        handled,
+        busy,
+        handled ? (double)busy / handled : 0.0,
+        100.0 * busy * 1000 / elapsed
+    );
+
+    print_shard_stats(before, stats, elapsed);
+
+    xpc_release(stats);
+}
+
+static uint64_t percentile(const uint64_t *samples, size_t count, int p) {
+    size_t i = count * p / 100;
+    if (i >= count) {
+        i = count - 1;
+    }
+    return samples[i];
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 3 && strcmp(argv[1], "--client") == 0) {
+        return run_client(atoi(argv[2]));
+    }
+
+    int clients = argc > 1 ? atoi(argv[1]) : 32;
+    const char *requests = argc > 2 ? argv[2] : "100";
+    if (clients < 1 || atoi(requests) < 1) {
+        fprintf(stderr, "Usage: bench-load [CLIENTS [REQUESTS]]\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t count = (size_t)clients * atoi(requests);
+    uint64_t *samples = calloc(count, sizeof(*samples));
+    pid_t *pids = calloc(clients, sizeof(*pids));
+    if (samples == NULL || pids == NULL) {
+        fprintf(stderr, "failed to allocate %zu samples\n", count);
+        return EXIT_FAILURE;
+    }
+
+    int fds[2];
+    if (pipe(fds) < 0) {
+        fprintf(stderr, "failed to create pipe: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    xpc_object_t before = query_stats();
+    uint64_t start = gettime();
+
+    for (int i = 0; i < clients; i++) {
+        pids[i] = spawn_client(argv[0], requests, fds[1]);
+    }
+    close(fds[1]);
+
+    // Writes smaller than PIPE_BUF are atomic, so samples from different
+    // clients are not interleaved.
+    FILE *in = fdopen(fds[0], "r");
+    size_t received = fread(samples, sizeof(*samples), count, in);
+    fclose(in);
+
+    uint64_t elapsed = gettime() - start;
+
+    int failed = 0;
+    for (int i = 0; i < clients; i++) {
+        int wstatus;
+        if (waitpid(pids[i], &wstatus, 0) < 0 || !WIFEXITED(wstatus) ||
+            WEXITSTATUS(wstatus) != 0) {
+            failed++;
+        }
+    }
+
+    if (failed || received != count) {
+        fprintf(
+            stderr,
+            "%d clients failed, received %zu of %zu samples\n",
+            failed,
+            received,
+            count
+        );
+        return EXIT_FAILURE;
+    }
+
+    qsort(samples, count, sizeof(*samples), compare_uint64);
+
+    printf(
+        "%8s %8s %10s %10s %10s %10s %10s\n",
+        "clients",
+        "requests",
+        "req/s",
+        "p50-us",
+        "p90-us",
+        "p99-us",
+        "max-us"
+    );
+    printf(
+        "%8d %8zu %10.0f %10.1f %10.1f %10.1f %10.1f\n",
+        clients,
+        count,
+        (double)count * NANOSECONDS_PER_SECOND / elapsed,
+        percentile(samples, count, 50) / 1000.0,
+        percentile(samples, count, 90) / 1000.0,
+        percentile(samples, count, 99) / 1000.0,
+        samples[count - 1] / 1000.0
+    );
+
+    print_latency_stats(before, elapsed);
+    xpc_release(before);
+
+    free(pids);
+    free(samples);
+
+    return 0;
+}
@@ -0,0 +1,391 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// Benchmark ARP and neighbor discovery broadcasts on a switch with many guests.
+//
+// Connects guests using callbacks to a switch. Every guest announces its IPv4
+// address with an ARP announcement and its IPv6 address with an unsolicited
+// neighbor advertisement, and then sends ARP requests and neighbor
+// solicitations in turn for the addresses of the other guests. With unknown
+// targets the requests are sent for addresses no guest owns, so every request
+// is flooded to all guests, as a switch without an ARP and neighbor discovery
+// proxy does. With known targets the switch answers the requests. Guests copy
+// the frames they receive, and check the replies. Reports the rate of
+// requests, the frames delivered to guests for every request, and the
+// requests answered by the switch.
+//
+// Usage: bench-neigh [REQUESTS] [GUESTS]
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broker-checksum.h"
+#include "broker-relay.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+// The relay buffer size, large enough for a 1500 bytes MTU frame.
+#define MAX_FRAME_SIZE 2048
+
+#define ETHER_HEADER_SIZE 14
+#define IPV6_HEADER_SIZE 40
+#define ARP_FRAME_SIZE (ETHER_HEADER_SIZE + 28)
+// A neighbor solicitation or advertisement with a link-layer address option.
+#define ND_SIZE 32
+#define ND_FRAME_SIZE (ETHER_HEADER_SIZE + IPV6_HEADER_SIZE + ND_SIZE)
+
+struct guest {
+    int index;
+    int guests;
+    // Requests left to send, and the next target.
+    int remaining;
+    int next;
+    bool announced;
+    bool unknown;
+    // Frames received from the switch, and replies received.
+    uint64_t received;
+    uint64_t replies;
+    unsigned char sink[MAX_FRAME_SIZE];
+};
+
+// Guests that sent the announcements, and guests that sent all requests.
+static atomic_int announced_guests;
+static atomic_int done_guests;
+
+// Set after all guests sent the announcements.
+static atomic_bool started;
+
+static uint64_t gettime(void) {
+    struct timespec ts;
+#ifdef CLOCK_UPTIME_RAW
+    clock_gettime(CLOCK_UPTIME_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+static void put16(unsigned char *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static void set_mac(unsigned char *p, int index) {
+    static const unsigned char prefix[4] = {0x02, 0, 0, 0};
+    memcpy(p, prefix, sizeof(prefix));
+    p[4] = index >> 8;
+    p[5] = index & 0xff;
+}
+
+// Guest addresses are 10.1.x.y and fd00::x:y. Unknown addresses use 10.2.x.y
+// and fd01::x:y.
+static void set_ipv4(unsigned char *p, int index, bool unknown) {
+    p[0] = 10;
+    p[1] = unknown ? 2 : 1;
+    p[2] = index >> 8;
+    p[3] = index & 0xff;
+}
+
+static void set_ipv6(unsigned char *p, int index, bool unknown) {
+    memset(p, 0, 16);
+    p[0] = 0xfd;
+    p[1] = unknown ? 1 : 0;
+    p[14] = index >> 8;
+    p[15] = index & 0xff;
+}
+
+static size_t build_arp(
+    unsigned char *frame,
+    const struct guest *g,
+    int op,
+    int target,
+    bool unknown
+) {
+    memset(frame, 0xff, 6);
+    set_mac(frame + 6, g->index);
+    put16(frame + 12, 0x0806);
+    unsigned char *arp = frame + ETHER_HEADER_SIZE;
+    put16(arp, 1);
+    put16(arp + 2, 0x0800);
+    arp[4] = 6;
+    arp[5] = 4;
+    put16(arp + 6, op);
+    set_mac(arp + 8, g->index);
+    set_ipv4(arp + 14, g->index, false);
+    memset(arp + 18, 0, 6);
+    set_ipv4(arp + 24, target, unknown);
+    return ARP_FRAME_SIZE;
+}
+
+// Build a neighbor solicitation for target, or an unsolicited advertisement
+// of the guest address to all nodes.
+static size_t build_nd(
+    unsigned char *frame, const struct guest *g, int target, bool unknown
+) {
+    bool advert = target == -1;
+    unsigned char *ip = frame + ETHER_HEADER_SIZE;
+    unsigned char *nd = ip + IPV6_HEADER_SIZE;
+    memset(frame, 0, ND_FRAME_SIZE);
+
+    // The solicited node multicast address, or all nodes.
+    unsigned char dst[16] = {0xff, 0x02};
+    if (advert) {
+        dst[15] = 1;
+    } else {
+        dst[11] = 1;
+        dst[12] = 0xff;
+        set_ipv6(nd + 8, target, unknown);
+        memcpy(dst + 13, nd + 8 + 13, 3);
+    }
+    frame[0] = 0x33;
+    frame[1] = 0x33;
+    memcpy(frame + 2, dst + 12, 4);
+    set_mac(frame + 6, g->index);
+    put16(frame + 12, 0x86dd);
+
+    ip[0] = 0x60;
+    put16(ip + 4, ND_SIZE);
+    ip[6] = 58;
+    ip[7] = 255;
+    set_ipv6(ip + 8, g->index, false);
+    memcpy(ip + 24, dst, 16);
+
+    if (advert) {
+        nd[0] = 136;
+        nd[4] = 0x20;
+        set_ipv6(nd + 8, g->index, false);
+        nd[24] = 2;
+    } else {
+        nd[0] = 135;
+        nd[24] = 1;
+    }
+    nd[25] = 1;
+    set_mac(nd + 26, g->index);
+    return ND_FRAME_SIZE;
+}
+
+static void fail(const char *msg) {
+    fprintf(stderr, "invalid reply: %s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+// Check that a reply has the address of the guest owning the target.
+static void check_reply(const struct guest *g, const unsigned char *frame) {
+    unsigned char mac[6];
+    set_mac(mac, g->index);
+    if (memcmp(frame, mac, 6) != 0) {
+        fail("wrong destination");
+    }
+
+    unsigned char owner[6];
+    if (frame[12] == 0x08) {
+        const unsigned char *arp = frame + ETHER_HEADER_SIZE;
+        set_mac(owner, arp[16] << 8 | arp[17]);
+        if (arp[7] != 2 || memcmp(arp + 8, owner, 6) != 0) {
+            fail("wrong ARP reply");
+        }
+    } else {
+        const unsigned char *ip = frame + ETHER_HEADER_SIZE;
+        const unsigned char *nd = ip + IPV6_HEADER_SIZE;
+        set_mac(owner, nd[22] << 8 | nd[23]);
+        const unsigned char pseudo[8] = {0, 0, 0, ND_SIZE, 0, 0, 0, 58};
+        uint32_t sum = inet_sum(ip + 8, 32, 0);
+        sum = inet_sum(pseudo, sizeof(pseudo), sum);
+        sum = inet_sum(nd, ND_SIZE, sum);
+        if (nd[0] != 136 || inet_fold(sum) != 0 ||
+            memcmp(nd + 26, owner, 6) != 0) {
+            fail("wrong neighbor advertisement");
+        }
+    }
+    if (memcmp(frame + 6, owner, 6) != 0) {
+        fail("wrong source");
+    }
+}
+
+static int guest_recv(void *arg, struct relay_frame *frames, int count) {
+    struct guest *g = arg;
+    if (!g->announced) {
+        frames[0].len = build_arp(frames[0].data, g, 1, g->index, false);
+        frames[1].len = build_nd(frames[1].data, g, -1, false);
+        g->announced = true;
+        atomic_fetch_add(&announced_guests, 1);
+        return 2;
+    }
+    if (!atomic_load(&started)) {
+        return 0;
+    }
+    if (g->remaining == 0) {
+        atomic_fetch_add(&done_guests, 1);
+        g->remaining = -1;
+        return 0;
+    }
+    if (g->remaining < 0) {
+        return 0;
+    }
+
+    int n = count < g->remaining ? count : g->remaining;
+    for (int i = 0; i < n; i++) {
+        if (g->remaining % 2) {
+            frames[i].len = build_arp(
+                frames[i].data, g, 1, g->next, g->unknown
+            );
+        } else {
+            frames[i].len = build_nd(frames[i].data, g, g->next, g->unknown);
+        }
+        g->remaining--;
+        g->next = (g->next + 1) % g->guests;
+        if (g->next == g->index) {
+            g->next = (g->next + 1) % g->guests;
+        }
+    }
+    return n;
+}
+
+static int guest_send(void *arg, const struct relay_frame *frames, int count) {
+    struct guest *g = arg;
+    for (int i = 0; i < count; i++) {
+        const unsigned char *frame = frames[i].data;
+        memcpy(g->sink, frame, frames[i].len);
+        // Requests and announcements are sent to broadcast or multicast.
+        if (!(frame[0] & 1)) {
+            check_reply(g, frame);
+            g->replies++;
+        }
+    }
+    g->received += count;
+    return count;
+}
+
+static const struct relay_port_ops guest_ops = {
+    .recv = guest_recv,
+    .send = guest_send,
+};
+
+static void run(int guests, bool unknown, int requests) {
+    struct relay *relay = relay_create(MAX_FRAME_SIZE, RELAY_BATCH);
+    if (relay == NULL) {
+        perror("relay_create");
+        exit(EXIT_FAILURE);
+    }
+    struct relay_switch *sw = relay_create_switch(relay);
+    if (sw == NULL) {
+        perror("relay_create_switch");
+        exit(EXIT_FAILURE);
+    }
+
+    struct guest *gs = calloc(guests, sizeof(*gs));
+    struct relay_link **links = calloc(guests, sizeof(*links));
+    if (gs == NULL || links == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    atomic_store(&announced_guests, 0);
+    atomic_store(&done_guests, 0);
+    atomic_store(&started, false);
+    for (int i = 0; i < guests; i++) {
+        gs[i].index = i;
+        gs[i].guests = guests;
+        gs[i].remaining = requests / guests;
+        gs[i].next = (i + 1) % guests;
+        gs[i].unknown = unknown;
+    }
+
+    // Adding a link notifies it, sending the announcements.
+    for (int i = 0; i < guests; i++) {
+        struct relay_endpoint endpoint = {
+            .fd = -1,
+            .ops = &guest_ops,
+            .arg = &gs[i],
+        };
+        links[i] = relay_add_switch_link(relay, sw, &endpoint);
+        if (links[i] == NULL) {
+            perror("relay_add_switch_link");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    while (atomic_load(&announced_guests) < guests) {
+        usleep(100);
+    }
+
+    struct relay_stats before;
+    relay_get_stats(relay, &before);
+    uint64_t start = gettime();
+
+    atomic_store(&started, true);
+    for (int i = 0; i < guests; i++) {
+        relay_notify(relay, links[i]);
+    }
+
+    while (atomic_load(&done_guests) < guests) {
+        usleep(100);
+    }
+
+    uint64_t end = gettime();
+
+    struct relay_stats stats;
+    relay_get_stats(relay, &stats);
+    for (int i = 0; i < guests; i++) {
+        relay_remove_link(relay, links[i]);
+    }
+    relay_destroy_switch(relay, sw);
+    relay_destroy(relay);
+
+    uint64_t delivered = 0;
+    uint64_t replies = 0;
+    for (int i = 0; i < guests; i++) {
+        delivered += gs[i].received;
+        replies += gs[i].replies;
+    }
+    free(gs);
+    free(links);
+
+    // Do not count the announcements.
+    uint64_t sent = stats.frames - before.frames;
+    delivered -= (uint64_t)guests * (guests - 1) * 2;
+    uint64_t suppressed = stats.suppressed - before.suppressed;
+    if (replies != suppressed || (!unknown && suppressed != sent)) {
+        fail("requests not answered");
+    }
+
+    double elapsed = (double)(end - start) / NANOSECONDS_PER_SECOND;
+    printf(
+        "%6d %8s %10.0f %10.1f %10llu %10llu\n",
+        guests,
+        unknown ? "unknown" : "known",
+        sent / elapsed,
+        (double)delivered / sent,
+        (unsigned long long)(stats.flooded - before.flooded),
+        (unsigned long long)suppressed
+    );
+}
+
+int main(int argc, char *argv[]) {
+    int requests = argc > 1 ? atoi(argv[1]) : 200000;
+    int guests = argc > 2 ? atoi(argv[2]) : 200;
+    if (guests < 2 || guests > RELAY_SWITCH_PORTS || requests < guests) {
+        fprintf(stderr, "Usage: bench-neigh [REQUESTS] [GUESTS]\n");
+        return EXIT_FAILURE;
+    }
+
+    printf(
+        "%6s %8s %10s %10s %10s %10s\n",
+        "guests",
+        "targets",
+        "rps",
+        "frames",
+        "flooded",
+        "suppressed"
+    );
+
+    run(guests, true, requests);
+    run(guests, false, requests);
+
+    return 0;
+}
@@ -0,0 +1,412 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// Benchmark forwarding a bulk TCP stream with and without offloads.
+//
+// Links two ports using callbacks. The sender port sends IPv4 TCP frames of a
+// 1500 bytes MTU with complete checksums, as a guest without offloads, or 64
+// KiB frames needing segmentation and checksums, as a guest using TSO. The
+// receiver port supports offloads, receiving the large frames as is, or does
+// not, so the relay segments and checksums the frames. The receiver copies
+// the frames, as a port copies frames to guest buffers, and checks that the
+// TCP sequence numbers cover the stream without gaps. Before measuring, every
+// combination is run once checking the checksums of every segment. Reports
+// the rate of frames received by the relay, segments delivered to the
+// receiver, or the segments a receiver using offloads would create, and the
+// TCP payload rate in Gbit/s.
+//
+// Usage: bench-offload [GIB]
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broker-checksum.h"
+#include "broker-relay.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+// The relay buffer size, large enough for a 1500 bytes MTU frame.
+#define MAX_FRAME_SIZE 2048
+
+#define MTU 1500
+#define MSS 1448
+
+// Ethernet, IPv4, and TCP with the timestamp option.
+#define ETHER_HEADER_SIZE 14
+#define IP_HEADER_SIZE 20
+#define TCP_HEADER_SIZE 32
+#define HEADERS (ETHER_HEADER_SIZE + IP_HEADER_SIZE + TCP_HEADER_SIZE)
+
+// Payload of a TSO frame: 45 segments in a 64 KiB IP packet.
+#define TSO_PAYLOAD (45 * MSS)
+#define TSO_FRAME_SIZE (HEADERS + TSO_PAYLOAD)
+
+// Bytes sent when checking the checksums.
+#define CHECK_BYTES (64 << 20)
+
+#define TCP_CHECKSUM_OFFSET 16
+
+struct bench_port {
+    // Sender: use TSO, and payload bytes left to send.
+    bool tso;
+    uint64_t remaining;
+    uint32_t seq;
+    unsigned char *buffers;
+    // Receiver: supports offloads, checks checksums, and the next expected
+    // sequence number.
+    bool offloads;
+    bool check;
+    uint32_t expected;
+    uint64_t segments;
+    atomic_uint_fast64_t received;
+    unsigned char sink[TSO_FRAME_SIZE];
+};
+
+static uint64_t gettime(void) {
+    struct timespec ts;
+#ifdef CLOCK_UPTIME_RAW
+    clock_gettime(CLOCK_UPTIME_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+static void put16(unsigned char *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           p[3];
+}
+
+// Sum of the TCP pseudo header for a TCP segment of len bytes.
+static uint32_t pseudo_sum(const unsigned char *ip, size_t len) {
+    unsigned char pseudo[4] = {0, 6, len >> 8, len & 0xff};
+    return inet_sum(pseudo, sizeof(pseudo), inet_sum(ip + 12, 8, 0));
+}
+
+// Build a frame with payload bytes, and the TCP checksum completed, or the
+// sum of the pseudo header for the receiver to complete.
+static size_t build_frame(
+    unsigned char *frame, uint32_t seq, size_t payload, bool complete
+) {
+    unsigned char *ip = frame + ETHER_HEADER_SIZE;
+    unsigned char *tcp = ip + IP_HEADER_SIZE;
+    size_t tcp_len = TCP_HEADER_SIZE + payload;
+
+    memset(frame, 0, HEADERS);
+    frame[0] = 0x02;
+    frame[5] = 0x02;
+    frame[6] = 0x02;
+    frame[11] = 0x01;
+    put16(frame + 12, 0x0800);
+
+    ip[0] = 0x45;
+    put16(ip + 2, IP_HEADER_SIZE + tcp_len);
+    put16(ip + 4, seq & 0xffff);
+    put16(ip + 6, 0x4000);
+    ip[8] = 64;
+    ip[9] = 6;
+    put32(ip + 12, 0xc0a80102);
+    put32(ip + 16, 0xc0a80103);
+    uint16_t checksum = inet_checksum(ip, IP_HEADER_SIZE);
+    memcpy(ip + 10, &checksum, sizeof(checksum));
+
+    put16(tcp, 40000);
+    put16(tcp + 2, 5201);
+    put32(tcp + 4, seq);
+    put32(tcp + 8, 1);
+    tcp[12] = (TCP_HEADER_SIZE / 4) << 4;
+    // ACK and PSH.
+    tcp[13] = 0x18;
+    put16(tcp + 14, 65535);
+    // Timestamp option.
+    tcp[20] = 1;
+    tcp[21] = 1;
+    tcp[22] = 8;
+    tcp[23] = 10;
+
+    for (size_t i = 0; i < payload; i++) {
+        tcp[TCP_HEADER_SIZE + i] = (seq + i) & 0xff;
+    }
+
+    if (complete) {
+        checksum = inet_fold(inet_sum(tcp, tcp_len, pseudo_sum(ip, tcp_len)));
+    } else {
+        // The folded sum, not inverted, as a guest using offloads sends.
+        checksum = ~inet_fold(pseudo_sum(ip, tcp_len));
+    }
+    memcpy(tcp + TCP_CHECKSUM_OFFSET, &checksum, sizeof(checksum));
+    return ETHER_HEADER_SIZE + IP_HEADER_SIZE + tcp_len;
+}
+
+// Rewrite the sequence number of a frame built by build_frame(), updating a
+// complete checksum incrementally as in RFC 1624: HC' = ~(~HC + ~m + m').
+static void set_seq(unsigned char *frame, uint32_t seq, bool complete) {
+    unsigned char *tcp = frame + HEADERS - TCP_HEADER_SIZE;
+    if (!complete) {
+        put32(tcp + 4, seq);
+        return;
+    }
+
+    uint16_t checksum;
+    memcpy(&checksum, tcp + TCP_CHECKSUM_OFFSET, sizeof(checksum));
+    unsigned char old[4];
+    for (int i = 0; i < 4; i++) {
+        old[i] = ~tcp[4 + i];
+    }
+    put32(tcp + 4, seq);
+    uint32_t sum = inet_sum(old, sizeof(old), (uint16_t)~checksum);
+    checksum = inet_fold(inet_sum(tcp + 4, 4, sum));
+    memcpy(tcp + TCP_CHECKSUM_OFFSET, &checksum, sizeof(checksum));
+}
+
+static int sender_recv(void *arg, struct relay_frame *frames, int count) {
+    struct bench_port *port = arg;
+    size_t payload = port->tso ? TSO_PAYLOAD : MSS;
+    size_t size = HEADERS + payload;
+    int n = 0;
+
+    while (n < count && port->remaining > 0) {
+        unsigned char *frame = port->buffers + size * n;
+        set_seq(frame, port->seq, !port->tso);
+        frames[n] = (struct relay_frame){.data = frame, .len = size};
+        if (port->tso) {
+            frames[n].offload = (struct relay_offload){
+                .flags = RELAY_NEEDS_CSUM,
+                .gso_type = RELAY_GSO_TCPV4,
+                .hdr_len = HEADERS,
+                .gso_size = MSS,
+                .csum_start = ETHER_HEADER_SIZE + IP_HEADER_SIZE,
+                .csum_offset = TCP_CHECKSUM_OFFSET,
+            };
+        }
+        port->seq += payload;
+        port->remaining -= payload;
+        n++;
+    }
+    return n;
+}
+
+static void fail(const char *msg, uint32_t seq) {
+    fprintf(stderr, "invalid segment: %s (seq %u)\n", msg, seq);
+    exit(EXIT_FAILURE);
+}
+
+// Check the checksums of a segment sent without offloads.
+static void check_segment(const unsigned char *frame, size_t len) {
+    const unsigned char *ip = frame + ETHER_HEADER_SIZE;
+    const unsigned char *tcp = ip + IP_HEADER_SIZE;
+    size_t ip_len = (size_t)ip[2] << 8 | ip[3];
+    size_t tcp_len = ip_len - IP_HEADER_SIZE;
+    uint32_t seq = get32(tcp + 4);
+
+    if (ETHER_HEADER_SIZE + ip_len != len) {
+        fail("IP length", seq);
+    }
+    if (inet_checksum(ip, IP_HEADER_SIZE) != 0) {
+        fail("IP checksum", seq);
+    }
+    if (inet_fold(inet_sum(tcp, tcp_len, pseudo_sum(ip, tcp_len))) != 0) {
+        fail("TCP checksum", seq);
+    }
+}
+
+static int
+receiver_send(void *arg, const struct relay_frame *frames, int count) {
+    struct bench_port *port = arg;
+    uint64_t received = 0;
+
+    for (int i = 0; i < count; i++) {
+        const struct relay_frame *f = &frames[i];
+        const unsigned char *tcp = (const unsigned char *)f->data +
+                                   HEADERS - TCP_HEADER_SIZE;
+        size_t payload = f->len - HEADERS;
+
+        if (get32(tcp + 4) != port->expected) {
+            fail("unexpected sequence number", get32(tcp + 4));
+        }
+        if (f->offload.gso_type != RELAY_GSO_NONE) {
+            if (!port->offloads) {
+                fail("unexpected offloads", get32(tcp + 4));
+            }
+            // A guest receiving the frame segments it if needed.
+            port->segments += (payload + MSS - 1) / MSS;
+        } else {
+            if (port->check) {
+                check_segment(f->data, f->len);
+            }
+            port->segments++;
+        }
+        memcpy(port->sink, f->data, f->len);
+        port->expected += payload;
+        received += payload;
+    }
+
+    atomic_fetch_add(&port->received, received);
+    return count;
+}
+
+// The sender does not receive frames, and the receiver does not send.
+static int no_recv(void *arg, struct relay_frame *frames, int count) {
+    (void)arg;
+    (void)frames;
+    (void)count;
+    return 0;
+}
+
+static int no_send(void *arg, const struct relay_frame *frames, int count) {
+    (void)arg;
+    (void)frames;
+    return count;
+}
+
+static const struct relay_port_ops sender_ops = {
+    .recv = sender_recv,
+    .send = no_send,
+};
+
+static const struct relay_port_ops receiver_ops = {
+    .recv = no_recv,
+    .send = receiver_send,
+};
+
+struct result {
+    // Seconds until all bytes were received.
+    double elapsed;
+    // Frames received by the relay.
+    uint64_t frames;
+    // Segments delivered, or created by a receiver using offloads.
+    uint64_t segments;
+    // Frames segmented by the relay.
+    uint64_t segmented;
+};
+
+static void
+run(bool tso, bool offloads, uint64_t bytes, bool check, struct result *r) {
+    size_t payload = tso ? TSO_PAYLOAD : MSS;
+    size_t size = HEADERS + payload;
+
+    // Round to whole frames.
+    bytes = (bytes + payload - 1) / payload * payload;
+
+    struct bench_port sender = {.tso = tso, .remaining = bytes};
+    struct bench_port *receiver = calloc(1, sizeof(*receiver));
+    if (receiver == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    receiver->offloads = offloads;
+    receiver->check = check;
+
+    sender.buffers = malloc(size * RELAY_BATCH);
+    if (sender.buffers == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < RELAY_BATCH; i++) {
+        build_frame(sender.buffers + size * i, 0, payload, !tso);
+    }
+
+    struct relay *relay = relay_create(MAX_FRAME_SIZE, RELAY_BATCH);
+    if (relay == NULL) {
+        perror("relay_create");
+        exit(EXIT_FAILURE);
+    }
+
+    struct relay_endpoint a = {.fd = -1, .ops = &sender_ops, .arg = &sender};
+    struct relay_endpoint b = {
+        .fd = -1,
+        .ops = &receiver_ops,
+        .arg = receiver,
+        .offloads = offloads ? RELAY_OFFLOAD_CSUM | RELAY_OFFLOAD_TSO4 : 0,
+    };
+
+    uint64_t start = gettime();
+
+    // Adding the link notifies it, and the relay forwards all frames.
+    if (relay_add_link(relay, &a, &b) == NULL) {
+        perror("relay_add_link");
+        exit(EXIT_FAILURE);
+    }
+    while (atomic_load(&receiver->received) < bytes) {
+        usleep(100);
+    }
+
+    uint64_t end = gettime();
+
+    struct relay_stats stats;
+    relay_get_stats(relay, &stats);
+    relay_destroy(relay);
+    free(sender.buffers);
+
+    if (stats.drops != 0) {
+        fprintf(
+            stderr, "dropped %llu frames\n", (unsigned long long)stats.drops
+        );
+        exit(EXIT_FAILURE);
+    }
+
+    *r = (struct result){
+        .elapsed = (double)(end - start) / NANOSECONDS_PER_SECOND,
+        .frames = stats.frames,
+        .segments = receiver->segments,
+        .segmented = stats.segmented,
+    };
+    free(receiver);
+}
+
+static void measure(bool tso, bool offloads, uint64_t bytes) {
+    struct result r;
+    run(tso, offloads, CHECK_BYTES, true, &r);
+    run(tso, offloads, bytes, false, &r);
+    printf(
+        "%8s %10s %10.0f %10.0f %8.2f %10llu\n",
+        tso ? "tso" : "mtu",
+        offloads ? "offloads" : "none",
+        r.frames / r.elapsed,
+        r.segments / r.elapsed,
+        bytes * 8 / r.elapsed / 1e9,
+        (unsigned long long)r.segmented
+    );
+}
+
+int main(int argc, char *argv[]) {
+    long long gib = argc > 1 ? atoll(argv[1]) : 4;
+    if (gib < 1) {
+        fprintf(stderr, "Usage: bench-offload [GIB]\n");
+        return EXIT_FAILURE;
+    }
+    uint64_t bytes = (uint64_t)gib << 30;
+
+    printf(
+        "%8s %10s %10s %10s %8s %10s\n",
+        "sender",
+        "receiver",
+        "fps",
+        "segments/s",
+        "gbps",
+        "segmented"
+    );
+
+    measure(false, false, bytes);
+    measure(true, true, bytes);
+    measure(true, false, bytes);
+
+    return 0;
+}
@@ -0,0 +1,147 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// Benchmark peer network ownership.
+//
+// Simulates peers acquiring networks and disconnecting, measuring the cost of
+// the peer ownership operations used by acquire_network(), release_network()
+// and release_peer_networks(). Networks are fake, so the benchmark measures
+// only the broker bookkeeping, not vmnet. All networks are in one shard, the
+// worst case for a peer.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "broker-peer.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+// Stands in for struct network in network.c.
+struct fake_network {
+    int peers;
+};
+
+struct bench_case {
+    int peers;
+    int networks;
+};
+
+static const struct bench_case default_cases[] = {
+    {.peers = 1, .networks = 8},
+    {.peers = 1, .networks = 1000},
+    {.peers = 1, .networks = 10000},
+    {.peers = 10000, .networks = 8},
+    {.peers = 50000, .networks = 8},
+    {.peers = 10000, .networks = 1000},
+};
+
+static uint64_t gettime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_UPTIME_RAW, &ts);
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+static void drop_network(struct broker_context *ctx, void *network) {
+    (void)ctx;
+    struct fake_network *net = network;
+    net->peers--;
+}
+
+static void run_case(const struct bench_case *c) {
+    struct fake_network *networks = calloc(c->networks, sizeof(*networks));
+    struct broker_context *peers = calloc(c->peers, sizeof(*peers));
+    if (networks == NULL || peers == NULL) {
+        fprintf(stderr, "failed to allocate %d peers\n", c->peers);
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t ops = (uint64_t)c->peers * c->networks;
+
+    // Every peer acquires every network once.
+    uint64_t start = gettime();
+    for (int p = 0; p < c->peers; p++) {
+        for (int n = 0; n < c->networks; n++) {
+            if (peer_add_network(&peers[p], 0, &networks[n]) == 1) {
+                networks[n].peers++;
+            }
+        }
+    }
+    uint64_t acquire = gettime() - start;
+
+    // Every peer acquires every network again (membership hit).
+    start = gettime();
+    for (int p = 0; p < c->peers; p++) {
+        for (int n = 0; n < c->networks; n++) {
+            peer_add_network(&peers[p], 0, &networks[n]);
+        }
+    }
+    uint64_t reacquire = gettime() - start;
+
+    // Every peer releases the extra reference.
+    start = gettime();
+    for (int p = 0; p < c->peers; p++) {
+        for (int n = 0; n < c->networks; n++) {
+            peer_remove_network(&peers[p], 0, &networks[n]);
+        }
+    }
+    uint64_t release = gettime() - start;
+
+    // Every peer disconnects.
+    start = gettime();
+    for (int p = 0; p < c->peers; p++) {
+        peer_remove_all_networks(&peers[p], 0, drop_network);
+    }
+    uint64_t disconnect = gettime() - start;
+
+    for (int n = 0; n < c->networks; n++) {
+        if (networks[n].peers != 0) {
+            fprintf(stderr, "network %d has %d peers\n", n, networks[n].peers);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf(
+        "%8d %8d %12.1f %12.1f %12.1f %12.1f\n",
+        c->peers,
+        c->networks,
+        (double)acquire / ops,
+        (double)reacquire / ops,
+        (double)release / ops,
+        (double)disconnect / ops
+    );
+
+    for (int p = 0; p < c->peers; p++) {
+        peer_free_networks(&peers[p]);
+    }
+    free(peers);
+    free(networks);
+}
+
+int main(int argc, char *argv[]) {
+    printf(
+        "%8s %8s %12s %12s %12s %12s\n",
+        "peers",
+        "networks",
+        "acquire-ns",
+        "reacquire-ns",
+        "release-ns",
+        "disconnect-ns"
+    );
+
+    if (argc == 3) {
+        struct bench_case c = {
+            .peers = atoi(argv[1]),
+            .networks = atoi(argv[2]),
+        };
+        run_case(&c);
+        return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(default_cases) / sizeof(default_cases[0]);
+         i++) {
+        run_case(&default_cases[i]);
+    }
+
+    return 0;
+}
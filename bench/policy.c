@@ -0,0 +1,227 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// Benchmark access policy checks.
+//
+// Gets the credentials of a process connected to a unix socket, loads a test
+// policy, and verifies the access decisions. Then compares checks answered by
+// evaluating the policy rules, using a new network name for every check, with
+// checks answered from the decisions cache.
+//
+// Usage: bench-policy [CHECKS]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broker-policy.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+// Number of rules not matching the test peer, evaluated before the matching
+// rules on a cache miss.
+#define OTHER_USERS 60
+
+// Required by log.h.
+bool verbose;
+
+static uint64_t gettime(void) {
+    struct timespec ts;
+#ifdef CLOCK_UPTIME_RAW
+    clock_gettime(CLOCK_UPTIME_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+static void get_credentials(struct peer_credentials *cred) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t start = gettime();
+    int err = peer_credentials_from_socket(fds[0], cred);
+    uint64_t socket_ns = gettime() - start;
+    if (err) {
+        fprintf(stderr, "failed to get credentials: %s\n", strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    start = gettime();
+    err = peer_credentials_add_groups(cred);
+    uint64_t groups_ns = gettime() - start;
+    if (err) {
+        fprintf(stderr, "failed to get groups: %s\n", strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+
+    printf(
+        "peer uid %u gid %u pid %d groups %d\n",
+        (unsigned)cred->uid,
+        (unsigned)cred->gid,
+        (int)cred->pid,
+        cred->ngroups
+    );
+    printf(
+        "credentials %.1f us, groups %.1f us\n\n",
+        socket_ns / 1000.0,
+        groups_ns / 1000.0
+    );
+}
+
+// Write a policy where only the last rules match the test peer.
+static void
+write_policy(const char *path, const struct peer_credentials *cred) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(fp, "# Test policy\n");
+    for (int i = 0; i < OTHER_USERS; i++) {
+        fprintf(fp, "allow * user:%u\n", (unsigned)cred->uid + 1000 + i);
+    }
+    fprintf(fp, "deny host user:%u\n", (unsigned)cred->uid);
+    fprintf(fp, "allow shared group:%u\n", (unsigned)cred->gid);
+    fprintf(fp, "allow bench signing-id:TEAMID:com.example.vm\n");
+    fprintf(fp, "allow * user:%u\n", (unsigned)cred->uid);
+
+    fclose(fp);
+}
+
+static int failures;
+
+static void
+check(const struct peer_credentials *cred, const char *network, bool expected) {
+    bool allowed = policy_allows(cred, network);
+    if (allowed != expected) {
+        fprintf(
+            stderr,
+            "network '%s': expected %s, got %s\n",
+            network,
+            expected ? "allow" : "deny",
+            allowed ? "allow" : "deny"
+        );
+        failures++;
+    }
+}
+
+static void verify(const char *path, const struct peer_credentials *cred) {
+    // Without a policy everything is allowed.
+    if (load_policy("/nonexistent/policy") != 0) {
+        fprintf(stderr, "failed to load missing policy\n");
+        failures++;
+    }
+    check(cred, "host", true);
+
+    if (load_policy(path) != 0) {
+        fprintf(stderr, "failed to load policy\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Checked twice to verify cached decisions.
+    for (int i = 0; i < 2; i++) {
+        check(cred, "shared", true);
+        check(cred, "host", false);
+        check(cred, "other", true);
+    }
+
+    struct peer_credentials other = *cred;
+    other.uid += 1;
+    other.gid += 1;
+    other.ngroups = 0;
+    check(&other, "shared", false);
+
+    // A policy that failed to load denies everything.
+    FILE *fp = fopen(path, "a");
+    fprintf(fp, "permit * *\n");
+    fclose(fp);
+    if (load_policy(path) == 0) {
+        fprintf(stderr, "invalid policy loaded\n");
+        failures++;
+    }
+    check(cred, "other", false);
+
+    if (failures) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void report(const char *mode, int checks, uint64_t ns, uint64_t hits) {
+    printf(
+        "%8s %10d %10.1f %12llu\n",
+        mode,
+        checks,
+        (double)ns / checks,
+        (unsigned long long)hits
+    );
+}
+
+int main(int argc, char *argv[]) {
+    int checks = argc > 1 ? atoi(argv[1]) : 1000000;
+    if (checks < 1) {
+        fprintf(stderr, "Usage: bench-policy [CHECKS]\n");
+        return EXIT_FAILURE;
+    }
+
+    char path[] = "/tmp/bench-policy.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    struct peer_credentials cred;
+    get_credentials(&cred);
+    write_policy(path, &cred);
+    verify(path, &cred);
+
+    write_policy(path, &cred);
+    if (load_policy(path) != 0) {
+        fprintf(stderr, "failed to load policy\n");
+        return EXIT_FAILURE;
+    }
+
+    char(*names)[16] = calloc(checks, sizeof(*names));
+    if (names == NULL) {
+        fprintf(stderr, "failed to allocate %d names\n", checks);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < checks; i++) {
+        snprintf(names[i], sizeof(names[i]), "net-%d", i);
+    }
+
+    printf("%8s %10s %10s %12s\n", "mode", "checks", "check-ns", "cache-hits");
+
+    uint64_t hits = policy_stats()->cache_hits;
+    uint64_t start = gettime();
+    for (int i = 0; i < checks; i++) {
+        policy_allows(&cred, names[i]);
+    }
+    uint64_t elapsed = gettime() - start;
+    report("evaluate", checks, elapsed, policy_stats()->cache_hits - hits);
+
+    hits = policy_stats()->cache_hits;
+    start = gettime();
+    for (int i = 0; i < checks; i++) {
+        policy_allows(&cred, "shared");
+    }
+    elapsed = gettime() - start;
+    report("cached", checks, elapsed, policy_stats()->cache_hits - hits);
+
+    free(names);
+    unlink(path);
+
+    return 0;
+}
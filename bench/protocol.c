@@ -0,0 +1,179 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// Benchmark the broker protocol request rate.
+//
+// Sends info requests to the installed broker over one connection, using
+// protocol version 1 (one synchronous request at a time), and protocol version
+// 2 (many outstanding requests matched by request ID).
+//
+// The broker limits the request rate of every connection, so requests are sent
+// in bursts smaller than the allowed burst, waiting until the rate limit
+// allows the next burst. Only the time spent sending requests and receiving
+// replies is measured.
+//
+// Usage: bench-protocol [BURSTS [REQUESTS]]
+
+#include <dispatch/dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <xpc/xpc.h>
+
+#include "vmnet-broker.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+// Time to wait between bursts, allowing the broker rate limit to recover.
+#define BURST_INTERVAL_USEC 2100000
+
+static xpc_connection_t connection;
+
+// Signaled when all replies in a protocol version 2 burst were received.
+static dispatch_semaphore_t burst_done;
+static int replies_pending;
+static int reply_errors;
+
+static uint64_t gettime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_UPTIME_RAW, &ts);
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+// Handle protocol version 2 replies. Runs on the connection queue.
+static void handle_reply(xpc_object_t reply) {
+    if (xpc_get_type(reply) != XPC_TYPE_DICTIONARY ||
+        xpc_dictionary_get_value(reply, REPLY_ID) == NULL) {
+        return;
+    }
+
+    if (xpc_dictionary_get_int64(reply, REPLY_ERROR)) {
+        reply_errors++;
+    }
+
+    if (--replies_pending == 0) {
+        dispatch_semaphore_signal(burst_done);
+    }
+}
+
+static void connect_to_broker(void) {
+    connection = xpc_connection_create_mach_service(MACH_SERVICE_NAME, NULL, 0);
+    xpc_connection_set_event_handler(connection, ^(xpc_object_t event) {
+        handle_reply(event);
+    });
+    xpc_connection_resume(connection);
+}
+
+static void hello(void) {
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_HELLO);
+    xpc_dictionary_set_int64(message, REQUEST_VERSION, PROTOCOL_VERSION_2);
+
+    xpc_object_t reply = xpc_connection_send_message_with_reply_sync(
+        connection, message
+    );
+    xpc_release(message);
+
+    if (xpc_get_type(reply) != XPC_TYPE_DICTIONARY ||
+        xpc_dictionary_get_int64(reply, REPLY_VERSION) != PROTOCOL_VERSION_2) {
+        fprintf(stderr, "broker does not support protocol version 2\n");
+        exit(EXIT_FAILURE);
+    }
+
+    xpc_release(reply);
+}
+
+// Send requests one by one, waiting for the reply to every request.
+static uint64_t v1_burst(int requests) {
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_INFO);
+
+    uint64_t start = gettime();
+
+    for (int i = 0; i < requests; i++) {
+        xpc_object_t reply = xpc_connection_send_message_with_reply_sync(
+            connection, message
+        );
+        if (xpc_get_type(reply) != XPC_TYPE_DICTIONARY ||
+            xpc_dictionary_get_int64(reply, REPLY_ERROR)) {
+            reply_errors++;
+        }
+        xpc_release(reply);
+    }
+
+    uint64_t elapsed = gettime() - start;
+
+    xpc_release(message);
+    return elapsed;
+}
+
+// Send all requests, and wait until all replies are received.
+static uint64_t v2_burst(int requests, uint64_t *next_id) {
+    replies_pending = requests;
+
+    uint64_t start = gettime();
+
+    for (int i = 0; i < requests; i++) {
+        xpc_object_t message = xpc_dictionary_create_empty();
+        xpc_dictionary_set_int64(message, REQUEST_OPCODE, OPCODE_INFO);
+        xpc_dictionary_set_uint64(message, REQUEST_ID, (*next_id)++);
+        xpc_connection_send_message(connection, message);
+        xpc_release(message);
+    }
+
+    dispatch_semaphore_wait(burst_done, DISPATCH_TIME_FOREVER);
+
+    return gettime() - start;
+}
+
+static void
+report(const char *protocol, int bursts, int requests, uint64_t ns) {
+    uint64_t total = (uint64_t)bursts * requests;
+    printf(
+        "%8s %8llu %12.0f %12.1f\n",
+        protocol,
+        (unsigned long long)total,
+        (double)total * NANOSECONDS_PER_SECOND / ns,
+        (double)ns / total / 1000.0
+    );
+}
+
+int main(int argc, char *argv[]) {
+    int bursts = argc > 1 ? atoi(argv[1]) : 5;
+    int requests = argc > 2 ? atoi(argv[2]) : 150;
+    if (bursts < 1 || requests < 1) {
+        fprintf(stderr, "Usage: bench-protocol [BURSTS [REQUESTS]]\n");
+        return EXIT_FAILURE;
+    }
+
+    burst_done = dispatch_semaphore_create(0);
+    connect_to_broker();
+
+    printf("%8s %8s %12s %12s\n", "protocol", "requests", "req/s", "req-us");
+
+    uint64_t v1_ns = 0;
+    for (int i = 0; i < bursts; i++) {
+        usleep(BURST_INTERVAL_USEC);
+        v1_ns += v1_burst(requests);
+    }
+    report("v1", bursts, requests, v1_ns);
+
+    usleep(BURST_INTERVAL_USEC);
+    hello();
+
+    uint64_t next_id = 1;
+    uint64_t v2_ns = 0;
+    for (int i = 0; i < bursts; i++) {
+        usleep(BURST_INTERVAL_USEC);
+        v2_ns += v2_burst(requests, &next_id);
+    }
+    report("v2", bursts, requests, v2_ns);
+
+    if (reply_errors) {
+        fprintf(stderr, "%d requests failed\n", reply_errors);
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
@@ -0,0 +1,227 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// Benchmark the frame relay.
+//
+// Creates links between pairs of datagram socketpairs, and forwards frames
+// sent by a sender thread for every link to a receiver thread for every link.
+// Reports the forwarding rate in packets per second and Gbit/s with batches of
+// one frame, and with batches of RELAY_BATCH frames.
+//
+// Usage: bench-relay [LINKS] [FRAMES] [FRAME_SIZE]
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broker-relay.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+// The relay buffer size, large enough for a 1500 bytes MTU frame.
+#define MAX_FRAME_SIZE 2048
+
+// Socket buffer size, matching the socket buffers used for vmnet-helper.
+#define SOCKET_BUFFER_SIZE (1024 * 1024)
+
+// Time without receiving frames after the sender finished.
+#define IDLE_TIMEOUT_MS 200
+
+struct bench_link {
+    // Sender and receiver sides of the socketpairs.
+    int sender_fd;
+    int receiver_fd;
+    int frames;
+    size_t frame_size;
+    atomic_bool sent;
+    uint64_t received;
+    uint64_t last_receive;
+    pthread_t sender;
+    pthread_t receiver;
+};
+
+static uint64_t gettime(void) {
+    struct timespec ts;
+#ifdef CLOCK_UPTIME_RAW
+    clock_gettime(CLOCK_UPTIME_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+static void set_buffers(int fd) {
+    int size = SOCKET_BUFFER_SIZE;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+static void create_socketpair(int fds[2]) {
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+    set_buffers(fds[0]);
+    set_buffers(fds[1]);
+}
+
+// Send frames, blocking when the relay socket buffer is full.
+static void *sender(void *arg) {
+    struct bench_link *link = arg;
+    char frame[MAX_FRAME_SIZE];
+    memset(frame, 0xab, sizeof(frame));
+
+    for (int i = 0; i < link->frames; i++) {
+        if (send(link->sender_fd, frame, link->frame_size, 0) < 0) {
+            if (errno == EINTR || errno == ENOBUFS) {
+                i--;
+                continue;
+            }
+            perror("send");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    atomic_store(&link->sent, true);
+    return NULL;
+}
+
+// Receive frames until no frame was received for IDLE_TIMEOUT_MS after the
+// sender finished. Frames dropped by the relay are never received.
+static void *receiver(void *arg) {
+    struct bench_link *link = arg;
+    char frame[MAX_FRAME_SIZE];
+    struct timeval tv = {.tv_usec = 10 * 1000};
+    setsockopt(link->receiver_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    uint64_t idle_since = 0;
+    for (;;) {
+        ssize_t n = recv(link->receiver_fd, frame, sizeof(frame), 0);
+        if (n > 0) {
+            link->received++;
+            link->last_receive = gettime();
+            idle_since = 0;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            perror("recv");
+            exit(EXIT_FAILURE);
+        }
+        if (!atomic_load(&link->sent)) {
+            continue;
+        }
+        uint64_t now = gettime();
+        if (idle_since == 0) {
+            idle_since = now;
+        } else if (now - idle_since > IDLE_TIMEOUT_MS * 1000000ULL) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void run(int batch, int links, int frames, size_t frame_size) {
+    struct relay *relay = relay_create(MAX_FRAME_SIZE, batch);
+    if (relay == NULL) {
+        perror("relay_create");
+        exit(EXIT_FAILURE);
+    }
+
+    struct bench_link *bench_links = calloc(links, sizeof(*bench_links));
+    if (bench_links == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < links; i++) {
+        struct bench_link *link = &bench_links[i];
+        int in[2], out[2];
+        create_socketpair(in);
+        create_socketpair(out);
+        link->sender_fd = in[0];
+        link->receiver_fd = out[0];
+        link->frames = frames;
+        link->frame_size = frame_size;
+
+        struct relay_endpoint a = {.fd = in[1]};
+        struct relay_endpoint b = {.fd = out[1]};
+        if (relay_add_link(relay, &a, &b) == NULL) {
+            perror("relay_add_link");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint64_t start = gettime();
+
+    for (int i = 0; i < links; i++) {
+        struct bench_link *link = &bench_links[i];
+        pthread_create(&link->receiver, NULL, receiver, link);
+        pthread_create(&link->sender, NULL, sender, link);
+    }
+
+    uint64_t received = 0;
+    uint64_t end = start;
+    for (int i = 0; i < links; i++) {
+        struct bench_link *link = &bench_links[i];
+        pthread_join(link->sender, NULL);
+        pthread_join(link->receiver, NULL);
+        received += link->received;
+        if (link->last_receive > end) {
+            end = link->last_receive;
+        }
+        close(link->sender_fd);
+        close(link->receiver_fd);
+    }
+
+    struct relay_stats stats;
+    relay_get_stats(relay, &stats);
+    relay_destroy(relay);
+    free(bench_links);
+
+    double elapsed = (double)(end - start) / NANOSECONDS_PER_SECOND;
+    printf(
+        "%6d %6d %8zu %10.0f %8.2f %10.1f %10llu\n",
+        batch,
+        links,
+        frame_size,
+        received / elapsed,
+        received * frame_size * 8 / elapsed / 1e9,
+        stats.batches ? (double)stats.frames / stats.batches : 0,
+        (unsigned long long)stats.drops
+    );
+}
+
+int main(int argc, char *argv[]) {
+    int links = argc > 1 ? atoi(argv[1]) : 1;
+    int frames = argc > 2 ? atoi(argv[2]) : 1000000;
+    int frame_size = argc > 3 ? atoi(argv[3]) : 1514;
+    if (links < 1 || frames < 1 || frame_size < 1 ||
+        frame_size > MAX_FRAME_SIZE) {
+        fprintf(stderr, "Usage: bench-relay [LINKS] [FRAMES] [FRAME_SIZE]\n");
+        return EXIT_FAILURE;
+    }
+
+    printf(
+        "%6s %6s %8s %10s %8s %10s %10s\n",
+        "batch",
+        "links",
+        "size",
+        "pps",
+        "gbps",
+        "per-batch",
+        "drops"
+    );
+
+    run(1, links, frames, frame_size);
+    run(RELAY_BATCH, links, frames, frame_size);
+
+    return 0;
+}
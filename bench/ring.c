@@ -0,0 +1,327 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// Benchmark the shared memory transport.
+//
+// Sends frames from a parent process to a child process, as a client sends
+// frames to the broker, using a datagram socketpair, and using a shared memory
+// region created by ring_create() with a socketpair doorbell. Reports the
+// stream rate in packets per second and Gbit/s, and the round trip time of one
+// frame sent to the child and back.
+//
+// Usage: bench-ring [FRAMES] [FRAME_SIZE] [ROUND_TRIPS]
+
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broker-ring.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+// The ring slot size used by the broker, large enough for a 1500 bytes MTU
+// frame.
+#define MAX_FRAME_SIZE 2048
+
+// Number of slots in every ring.
+#define RING_SLOTS 256
+
+// Maximum number of frames published at once.
+#define BATCH 64
+
+// Socket buffer size, matching the socket buffers used for vmnet-helper.
+#define SOCKET_BUFFER_SIZE (1024 * 1024)
+
+struct transport {
+    // This side of the socketpair, used for frames, or as the doorbell for the
+    // ring. The socketpair is used in both directions.
+    int fd;
+    int ring_fd;
+    struct vmnet_broker_ring_channel channel;
+};
+
+static uint64_t gettime(void) {
+    struct timespec ts;
+#ifdef CLOCK_UPTIME_RAW
+    clock_gettime(CLOCK_UPTIME_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+static void set_buffers(int fd) {
+    int size = SOCKET_BUFFER_SIZE;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+static void create_socketpair(int fds[2]) {
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+    set_buffers(fds[0]);
+    set_buffers(fds[1]);
+}
+
+static void check(ssize_t n, const char *what) {
+    if (n < 0 && errno != EINTR) {
+        perror(what);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// MARK: - Sockets
+
+static void socket_send(int fd, const void *frame, size_t len) {
+    ssize_t n;
+    do {
+        n = send(fd, frame, len, 0);
+        check(n, "send");
+    } while (n < 0);
+}
+
+static size_t socket_recv(int fd, void *frame) {
+    ssize_t n;
+    do {
+        n = recv(fd, frame, MAX_FRAME_SIZE, 0);
+        check(n, "recv");
+    } while (n < 0);
+    return n;
+}
+
+// MARK: - Rings
+
+static void ring_doorbell(int fd) {
+    char c = 0;
+    (void)send(fd, &c, 1, MSG_DONTWAIT);
+}
+
+// Wait until the doorbell rings, and drain it.
+static void wait_doorbell(int fd) {
+    char buf[64];
+    ssize_t n;
+    do {
+        n = recv(fd, buf, sizeof(buf), 0);
+        check(n, "recv");
+    } while (n < 0);
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+}
+
+// Send count frames, waiting while the ring is full.
+static void
+ring_send(struct transport *t, const void *frame, size_t len, int count) {
+    struct vmnet_broker_ring *tx = &t->channel.tx;
+    while (count > 0) {
+        int batch = 0;
+        void *buf;
+        while (batch < count && batch < BATCH &&
+               (buf = vmnet_broker_ring_reserve(tx)) != NULL) {
+            memcpy(buf, frame, len);
+            vmnet_broker_ring_commit(tx, len);
+            batch++;
+        }
+        if (batch == 0) {
+            sched_yield();
+            continue;
+        }
+        if (vmnet_broker_ring_publish(tx)) {
+            ring_doorbell(t->fd);
+        }
+        count -= batch;
+    }
+}
+
+// Receive up to count frames, copying them to frame, as a client copies
+// frames to guest memory. Returns the number of frames received.
+static int ring_recv(struct transport *t, void *frame, int count) {
+    struct vmnet_broker_ring *rx = &t->channel.rx;
+    uint32_t n;
+    while ((n = vmnet_broker_ring_available(rx)) == 0) {
+        wait_doorbell(t->fd);
+    }
+    if (n > (uint32_t)count) {
+        n = count;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        size_t len;
+        void *data = vmnet_broker_ring_frame(rx, i, &len);
+        memcpy(frame, data, len);
+    }
+    vmnet_broker_ring_release(rx, n);
+    return n;
+}
+
+// MARK: - Benchmarks
+
+static bool is_ring(const struct transport *t) {
+    return t->ring_fd != -1;
+}
+
+static void receive_frames(struct transport *t, int frames) {
+    char frame[MAX_FRAME_SIZE];
+    int received = 0;
+    while (received < frames) {
+        if (is_ring(t)) {
+            received += ring_recv(t, frame, frames - received);
+        } else {
+            socket_recv(t->fd, frame);
+            received++;
+        }
+    }
+}
+
+static void send_frames(struct transport *t, size_t size, int frames) {
+    char frame[MAX_FRAME_SIZE];
+    memset(frame, 0xab, size);
+    if (is_ring(t)) {
+        ring_send(t, frame, size, frames);
+    } else {
+        for (int i = 0; i < frames; i++) {
+            socket_send(t->fd, frame, size);
+        }
+    }
+}
+
+// Echo frames back to the parent.
+static void echo_frames(struct transport *t, size_t size, int round_trips) {
+    char frame[MAX_FRAME_SIZE];
+    for (int i = 0; i < round_trips; i++) {
+        if (is_ring(t)) {
+            ring_recv(t, frame, 1);
+            ring_send(t, frame, size, 1);
+        } else {
+            size_t len = socket_recv(t->fd, frame);
+            socket_send(t->fd, frame, len);
+        }
+    }
+}
+
+static void ping_frames(struct transport *t, size_t size, int round_trips) {
+    char frame[MAX_FRAME_SIZE];
+    memset(frame, 0xab, size);
+    for (int i = 0; i < round_trips; i++) {
+        if (is_ring(t)) {
+            ring_send(t, frame, size, 1);
+            ring_recv(t, frame, 1);
+        } else {
+            socket_send(t->fd, frame, size);
+            socket_recv(t->fd, frame);
+        }
+    }
+}
+
+static void map_ring(struct transport *t, int side) {
+    if (vmnet_broker_ring_map(t->ring_fd, side, &t->channel) < 0) {
+        perror("vmnet_broker_ring_map");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Start a child process playing the broker, receiving frames and echoing
+// frames back.
+static pid_t
+start_child(struct transport *t, int fd, size_t size, int frames, int rtt) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid > 0) {
+        return pid;
+    }
+
+    close(t->fd);
+    t->fd = fd;
+    if (is_ring(t)) {
+        map_ring(t, VMNET_BROKER_RING_BROKER);
+    }
+
+    receive_frames(t, frames);
+    echo_frames(t, size, rtt);
+    _exit(0);
+}
+
+static void run(const char *name, bool ring, size_t size, int frames, int rtt) {
+    struct transport t = {.ring_fd = -1};
+    int fds[2];
+    create_socketpair(fds);
+    t.fd = fds[0];
+    if (ring) {
+        t.ring_fd = ring_create(RING_SLOTS, MAX_FRAME_SIZE);
+        if (t.ring_fd < 0) {
+            perror("ring_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pid_t pid = start_child(&t, fds[1], size, frames, rtt);
+    close(fds[1]);
+    if (ring) {
+        map_ring(&t, VMNET_BROKER_RING_CLIENT);
+    }
+
+    uint64_t start = gettime();
+    send_frames(&t, size, frames);
+    // Use the first round trip to wait until all frames were received.
+    ping_frames(&t, size, 1);
+    uint64_t stream_end = gettime();
+
+    ping_frames(&t, size, rtt - 1);
+    uint64_t rtt_end = gettime();
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "child failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (ring) {
+        vmnet_broker_ring_unmap(&t.channel);
+        close(t.ring_fd);
+    }
+    close(t.fd);
+
+    double elapsed = (double)(stream_end - start) / NANOSECONDS_PER_SECOND;
+    double rtt_us = (double)(rtt_end - stream_end) / (rtt - 1) / 1000;
+    printf(
+        "%-8s %8zu %10.0f %8.2f %10.2f\n",
+        name,
+        size,
+        frames / elapsed,
+        frames * size * 8 / elapsed / 1e9,
+        rtt_us
+    );
+}
+
+int main(int argc, char *argv[]) {
+    int frames = argc > 1 ? atoi(argv[1]) : 1000000;
+    int frame_size = argc > 2 ? atoi(argv[2]) : 1514;
+    int round_trips = argc > 3 ? atoi(argv[3]) : 100000;
+    if (frames < 1 || frame_size < 1 || frame_size > MAX_FRAME_SIZE ||
+        round_trips < 2) {
+        fprintf(
+            stderr, "Usage: bench-ring [FRAMES] [FRAME_SIZE] [ROUND_TRIPS]\n"
+        );
+        return EXIT_FAILURE;
+    }
+
+    printf(
+        "%-8s %8s %10s %8s %10s\n", "mode", "size", "pps", "gbps", "rtt-us"
+    );
+
+    run("socket", false, frame_size, frames, round_trips);
+    run("ring", true, frame_size, frames, round_trips);
+
+    return 0;
+}
@@ -0,0 +1,334 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// Benchmark the latency of a small packet flow competing with a bulk flow.
+//
+// Connects a bulk sender, a probe sender, and a receiver port using callbacks
+// to a switch. The bulk sender sends 1514 bytes frames faster than the link
+// rate, and the probe sender sends a timestamped 64 bytes frame every 100
+// microseconds. The receiver models a link with a device queue: frames leave
+// the queue at the link rate, and frames are not accepted when the queue is
+// full. Runs without traffic shaping, and with traffic shaping at 95% of the
+// link rate, and reports the probe latency from sending to leaving the device
+// queue, the bulk throughput, the probes lost, and the frames dropped by the
+// switch port queue.
+//
+// Usage: bench-shaping [SECONDS] [LINK_MBPS]
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broker-relay.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+#define NANOSECONDS_PER_MICROSECOND 1000ULL
+
+// The relay buffer size, large enough for a 1500 bytes MTU frame.
+#define MAX_FRAME_SIZE 2048
+
+#define BULK_FRAME_SIZE 1514
+#define PROBE_FRAME_SIZE 64
+
+// The bulk sender sends 50% more than the link rate.
+#define BULK_OVERLOAD 1.5
+
+// The probe sender sends a frame every 100 microseconds.
+#define PROBE_INTERVAL_NS (100 * NANOSECONDS_PER_MICROSECOND)
+
+// Device queue of the receiver link, in bytes of 1000 bulk frames.
+#define DEVICE_QUEUE_BYTES (1000 * BULK_FRAME_SIZE)
+
+// Offset of the probe timestamp in the frame payload.
+#define TIMESTAMP_OFFSET 16
+
+static const unsigned char receiver_mac[6] = {0x02, 0, 0, 0, 0, 0x01};
+static const unsigned char bulk_mac[6] = {0x02, 0, 0, 0, 0, 0x02};
+static const unsigned char probe_mac[6] = {0x02, 0, 0, 0, 0, 0x03};
+
+struct sender {
+    // Frames sent until now are limited by the rate since the start.
+    uint64_t start;
+    double rate;
+    uint64_t sent;
+    size_t frame_size;
+    unsigned char frame[MAX_FRAME_SIZE];
+};
+
+struct receiver {
+    bool announced;
+    unsigned char frame[PROBE_FRAME_SIZE];
+    // Link rate in bytes per second, and the time the device queue is empty.
+    double rate;
+    uint64_t busy_until;
+    // Bytes of bulk frames sent on the link.
+    uint64_t bulk_bytes;
+    // Latency of probes sent on the link, in nanoseconds.
+    uint64_t *latency;
+    uint64_t probes;
+    uint64_t max_probes;
+};
+
+static uint64_t gettime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+static void build_frame(
+    unsigned char *frame,
+    size_t size,
+    const unsigned char *dst,
+    const unsigned char *src
+) {
+    memset(frame, 0, size);
+    memcpy(frame, dst, 6);
+    memcpy(frame + 6, src, 6);
+    // A local experimental ethertype.
+    frame[12] = 0x88;
+    frame[13] = 0xb5;
+}
+
+static int sender_recv(void *arg, struct relay_frame *frames, int count) {
+    struct sender *s = arg;
+    uint64_t now = gettime();
+    uint64_t due = (now - s->start) * s->rate / NANOSECONDS_PER_SECOND;
+    int n = 0;
+    while (n < count && s->sent < due) {
+        memcpy(s->frame + TIMESTAMP_OFFSET, &now, sizeof(now));
+        frames[n].data = s->frame;
+        frames[n].len = s->frame_size;
+        s->sent++;
+        n++;
+    }
+    return n;
+}
+
+// The receiver announces its address once, so the switch learns it.
+static int receiver_recv(void *arg, struct relay_frame *frames, int count) {
+    struct receiver *r = arg;
+    if (r->announced || count < 1) {
+        return 0;
+    }
+    r->announced = true;
+    frames[0].data = r->frame;
+    frames[0].len = sizeof(r->frame);
+    return 1;
+}
+
+// Queue frames in the device queue, leaving it at the link rate.
+static int
+receiver_send(void *arg, const struct relay_frame *frames, int count) {
+    struct receiver *r = arg;
+    uint64_t now = gettime();
+    if (r->busy_until < now) {
+        r->busy_until = now;
+    }
+    for (int i = 0; i < count; i++) {
+        uint64_t backlog = (r->busy_until - now) * r->rate /
+                           NANOSECONDS_PER_SECOND;
+        if (backlog + frames[i].len > DEVICE_QUEUE_BYTES) {
+            return i;
+        }
+        r->busy_until += frames[i].len * NANOSECONDS_PER_SECOND / r->rate;
+        if (frames[i].len == PROBE_FRAME_SIZE) {
+            uint64_t sent;
+            memcpy(&sent, frames[i].data + TIMESTAMP_OFFSET, sizeof(sent));
+            if (r->probes < r->max_probes) {
+                r->latency[r->probes++] = r->busy_until - sent;
+            }
+        } else {
+            r->bulk_bytes += frames[i].len;
+        }
+    }
+    return count;
+}
+
+// The senders do not receive frames.
+static int no_send(void *arg, const struct relay_frame *frames, int count) {
+    (void)arg;
+    (void)frames;
+    return count;
+}
+
+static const struct relay_port_ops sender_ops = {
+    .recv = sender_recv,
+    .send = no_send,
+};
+
+static const struct relay_port_ops receiver_ops = {
+    .recv = receiver_recv,
+    .send = receiver_send,
+};
+
+struct timer {
+    struct relay *relay;
+    struct relay_link *links[2];
+    atomic_bool stopping;
+};
+
+// Notify the senders every 50 microseconds, as a guest would after sending.
+static void *timer_thread(void *arg) {
+    struct timer *t = arg;
+    while (!atomic_load(&t->stopping)) {
+        usleep(50);
+        relay_notify(t->relay, t->links[0]);
+        relay_notify(t->relay, t->links[1]);
+    }
+    return NULL;
+}
+
+static struct relay_link *add_port(
+    struct relay *relay,
+    struct relay_switch *sw,
+    const struct relay_port_ops *ops,
+    void *arg
+) {
+    struct relay_endpoint e = {.fd = -1, .ops = ops, .arg = arg};
+    struct relay_link *link = relay_add_switch_link(relay, sw, &e);
+    if (link == NULL) {
+        perror("relay_add_switch_link");
+        exit(EXIT_FAILURE);
+    }
+    return link;
+}
+
+static int compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const uint64_t *sorted, uint64_t n, double p) {
+    if (n == 0) {
+        return 0;
+    }
+    uint64_t i = (uint64_t)(p / 100 * (n - 1));
+    return (double)sorted[i] / NANOSECONDS_PER_MICROSECOND;
+}
+
+static void run(bool shaped, double seconds, double link_rate) {
+    struct sender *bulk = calloc(1, sizeof(*bulk));
+    struct sender *probe = calloc(1, sizeof(*probe));
+    struct receiver *receiver = calloc(1, sizeof(*receiver));
+    if (bulk == NULL || probe == NULL || receiver == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    bulk->rate = link_rate * BULK_OVERLOAD / BULK_FRAME_SIZE;
+    bulk->frame_size = BULK_FRAME_SIZE;
+    build_frame(bulk->frame, BULK_FRAME_SIZE, receiver_mac, bulk_mac);
+    probe->rate = (double)NANOSECONDS_PER_SECOND / PROBE_INTERVAL_NS;
+    probe->frame_size = PROBE_FRAME_SIZE;
+    build_frame(probe->frame, PROBE_FRAME_SIZE, receiver_mac, probe_mac);
+    build_frame(receiver->frame, PROBE_FRAME_SIZE, bulk_mac, receiver_mac);
+    receiver->rate = link_rate;
+    receiver->max_probes = seconds * probe->rate + 1;
+    receiver->latency = calloc(receiver->max_probes, sizeof(uint64_t));
+    if (receiver->latency == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    struct relay *relay = relay_create(MAX_FRAME_SIZE, RELAY_BATCH);
+    if (relay == NULL) {
+        perror("relay_create");
+        exit(EXIT_FAILURE);
+    }
+    struct relay_switch *sw = relay_create_switch(relay);
+    if (sw == NULL) {
+        perror("relay_create_switch");
+        exit(EXIT_FAILURE);
+    }
+    if (shaped) {
+        // A burst of 1 millisecond, the resolution of the relay timeout.
+        struct relay_shaping shaping = {
+            .rate = link_rate * 0.95,
+            .burst = link_rate / 1000,
+            .quantum = BULK_FRAME_SIZE,
+            .queue_len = 1024,
+        };
+        if (relay_set_shaping(relay, sw, &shaping) < 0) {
+            perror("relay_set_shaping");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct relay_link *receiver_link = add_port(
+        relay, sw, &receiver_ops, receiver
+    );
+    // Wait until the switch learns the receiver address.
+    while (!receiver->announced) {
+        usleep(100);
+    }
+
+    struct timer timer = {.relay = relay};
+    bulk->start = probe->start = gettime();
+    timer.links[0] = add_port(relay, sw, &sender_ops, bulk);
+    timer.links[1] = add_port(relay, sw, &sender_ops, probe);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, timer_thread, &timer) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    usleep(seconds * 1e6);
+
+    atomic_store(&timer.stopping, true);
+    pthread_join(thread, NULL);
+
+    struct relay_port_stats stats;
+    relay_get_port_stats(relay, receiver_link, &stats);
+    relay_destroy(relay);
+
+    // Probes sent in the last milliseconds may still be queued.
+    uint64_t n = receiver->probes;
+    qsort(receiver->latency, n, sizeof(uint64_t), compare);
+    printf(
+        "%8s %10.1f %10.1f %10.1f %10.1f %10.2f %10.2f%% %10llu\n",
+        shaped ? "shaped" : "none",
+        percentile(receiver->latency, n, 50),
+        percentile(receiver->latency, n, 99),
+        percentile(receiver->latency, n, 99.9),
+        percentile(receiver->latency, n, 100),
+        receiver->bulk_bytes * 8 / seconds / 1e9,
+        100.0 * (probe->sent - n) / probe->sent,
+        (unsigned long long)stats.queue_drops
+    );
+
+    free(receiver->latency);
+    free(receiver);
+    free(probe);
+    free(bulk);
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 5;
+    double link_mbps = argc > 2 ? atof(argv[2]) : 1000;
+    if (seconds <= 0 || link_mbps < 10) {
+        fprintf(stderr, "Usage: bench-shaping [SECONDS] [LINK_MBPS]\n");
+        return EXIT_FAILURE;
+    }
+
+    printf(
+        "%8s %10s %10s %10s %10s %10s %11s %10s\n",
+        "shaping",
+        "p50 us",
+        "p99 us",
+        "p99.9 us",
+        "max us",
+        "bulk gbps",
+        "probe loss",
+        "q drops"
+    );
+
+    run(false, seconds, link_mbps * 1e6 / 8);
+    run(true, seconds, link_mbps * 1e6 / 8);
+
+    return 0;
+}
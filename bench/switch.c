@@ -0,0 +1,257 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// Benchmark the relay switch.
+//
+// Connects ports using callbacks to a switch. Every port sends one broadcast
+// frame so the switch learns its address, and then sends unicast frames to the
+// other ports in turn. With unknown destinations the frames are sent to
+// addresses that were never seen, so every frame is flooded to all ports, as a
+// switch that does not learn does. Ports copy the frames they receive, as a
+// relay copies frames to a socket or a ring. Reports the switching rate in
+// packets per second, the number of copies per frame, and the rate of frames
+// delivered to ports in Gbit/s, as the number of ports grows.
+//
+// Usage: bench-switch [FRAMES] [FRAME_SIZE]
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broker-relay.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+// The relay buffer size, large enough for a 1500 bytes MTU frame.
+#define MAX_FRAME_SIZE 2048
+
+static const int port_counts[] = {2, 4, 16, 64, 256};
+
+struct bench_port {
+    int index;
+    int ports;
+    // Frames left to send, and the next destination.
+    int remaining;
+    int next;
+    bool announced;
+    bool unknown;
+    size_t frame_size;
+    // Frames and bytes received from the switch.
+    uint64_t received;
+    uint64_t bytes;
+    unsigned char sink[MAX_FRAME_SIZE];
+};
+
+// Ports that sent the broadcast frame, and ports that sent all their frames.
+static atomic_int announced_ports;
+static atomic_int done_ports;
+
+// Set after all ports sent the broadcast frame.
+static atomic_bool started;
+
+static uint64_t gettime(void) {
+    struct timespec ts;
+#ifdef CLOCK_UPTIME_RAW
+    clock_gettime(CLOCK_UPTIME_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+// Locally administered unicast address of a port. Unknown addresses use
+// another prefix.
+static void set_mac(unsigned char *p, int index, bool unknown) {
+    p[0] = 0x02;
+    p[1] = unknown ? 0xff : 0x00;
+    p[2] = 0;
+    p[3] = 0;
+    p[4] = index >> 8;
+    p[5] = index & 0xff;
+}
+
+static void set_header(unsigned char *frame, const struct bench_port *port) {
+    set_mac(frame + 6, port->index, false);
+    frame[12] = 0x88;
+    frame[13] = 0xb5;
+}
+
+static int port_recv(void *arg, struct relay_frame *frames, int count) {
+    struct bench_port *port = arg;
+    if (!port->announced) {
+        memset(frames[0].data, 0xff, 6);
+        set_header(frames[0].data, port);
+        frames[0].len = port->frame_size;
+        port->announced = true;
+        atomic_fetch_add(&announced_ports, 1);
+        return 1;
+    }
+    if (!atomic_load(&started)) {
+        return 0;
+    }
+    if (port->remaining == 0) {
+        atomic_fetch_add(&done_ports, 1);
+        port->remaining = -1;
+        return 0;
+    }
+    if (port->remaining < 0) {
+        return 0;
+    }
+
+    int n = count < port->remaining ? count : port->remaining;
+    for (int i = 0; i < n; i++) {
+        unsigned char *frame = frames[i].data;
+        set_mac(frame, port->next, port->unknown);
+        set_header(frame, port);
+        frames[i].len = port->frame_size;
+        port->next = (port->next + 1) % port->ports;
+        if (port->next == port->index) {
+            port->next = (port->next + 1) % port->ports;
+        }
+    }
+    port->remaining -= n;
+    return n;
+}
+
+static int port_send(void *arg, const struct relay_frame *frames, int count) {
+    struct bench_port *port = arg;
+    for (int i = 0; i < count; i++) {
+        memcpy(port->sink, frames[i].data, frames[i].len);
+        port->bytes += frames[i].len;
+    }
+    port->received += count;
+    return count;
+}
+
+static const struct relay_port_ops bench_ops = {
+    .recv = port_recv,
+    .send = port_send,
+};
+
+static void run(int ports, bool unknown, int frames, size_t frame_size) {
+    struct relay *relay = relay_create(MAX_FRAME_SIZE, RELAY_BATCH);
+    if (relay == NULL) {
+        perror("relay_create");
+        exit(EXIT_FAILURE);
+    }
+    struct relay_switch *sw = relay_create_switch(relay);
+    if (sw == NULL) {
+        perror("relay_create_switch");
+        exit(EXIT_FAILURE);
+    }
+
+    struct bench_port *bench_ports = calloc(ports, sizeof(*bench_ports));
+    struct relay_link **links = calloc(ports, sizeof(*links));
+    if (bench_ports == NULL || links == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    atomic_store(&announced_ports, 0);
+    atomic_store(&done_ports, 0);
+    atomic_store(&started, false);
+    for (int i = 0; i < ports; i++) {
+        struct bench_port *port = &bench_ports[i];
+        port->index = i;
+        port->ports = ports;
+        port->remaining = frames / ports;
+        port->next = (i + 1) % ports;
+        port->unknown = unknown;
+        port->frame_size = frame_size;
+    }
+
+    // Adding a link notifies it, sending the broadcast frame.
+    for (int i = 0; i < ports; i++) {
+        struct relay_endpoint endpoint = {
+            .fd = -1,
+            .ops = &bench_ops,
+            .arg = &bench_ports[i],
+        };
+        links[i] = relay_add_switch_link(relay, sw, &endpoint);
+        if (links[i] == NULL) {
+            perror("relay_add_switch_link");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    while (atomic_load(&announced_ports) < ports) {
+        usleep(100);
+    }
+
+    uint64_t start = gettime();
+
+    atomic_store(&started, true);
+    for (int i = 0; i < ports; i++) {
+        relay_notify(relay, links[i]);
+    }
+
+    while (atomic_load(&done_ports) < ports) {
+        usleep(100);
+    }
+
+    uint64_t end = gettime();
+
+    struct relay_stats stats;
+    relay_get_stats(relay, &stats);
+    for (int i = 0; i < ports; i++) {
+        relay_remove_link(relay, links[i]);
+    }
+    relay_destroy_switch(relay, sw);
+    relay_destroy(relay);
+
+    uint64_t delivered = 0;
+    for (int i = 0; i < ports; i++) {
+        delivered += bench_ports[i].received;
+    }
+    free(bench_ports);
+    free(links);
+
+    // Do not count the broadcast frames.
+    uint64_t switched = stats.frames - ports;
+    delivered -= (uint64_t)ports * (ports - 1);
+    uint64_t flooded = stats.flooded - ports;
+
+    double elapsed = (double)(end - start) / NANOSECONDS_PER_SECOND;
+    printf(
+        "%6d %8s %8zu %10.0f %8.1f %8.2f %10llu\n",
+        ports,
+        unknown ? "unknown" : "learned",
+        frame_size,
+        switched / elapsed,
+        (double)delivered / switched,
+        delivered * frame_size * 8 / elapsed / 1e9,
+        (unsigned long long)flooded
+    );
+}
+
+int main(int argc, char *argv[]) {
+    int frames = argc > 1 ? atoi(argv[1]) : 1000000;
+    int frame_size = argc > 2 ? atoi(argv[2]) : 1514;
+    if (frames < 256 || frame_size < 14 || frame_size > MAX_FRAME_SIZE) {
+        fprintf(stderr, "Usage: bench-switch [FRAMES] [FRAME_SIZE]\n");
+        return EXIT_FAILURE;
+    }
+
+    printf(
+        "%6s %8s %8s %10s %8s %8s %10s\n",
+        "ports",
+        "dest",
+        "size",
+        "pps",
+        "copies",
+        "gbps",
+        "flooded"
+    );
+
+    for (size_t i = 0; i < sizeof(port_counts) / sizeof(port_counts[0]); i++) {
+        run(port_counts[i], false, frames, frame_size);
+        run(port_counts[i], true, frames, frame_size);
+    }
+
+    return 0;
+}
@@ -0,0 +1,691 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// Benchmark and test the vhost-user backend.
+//
+// Starts two child processes playing QEMU with a virtio-net device. Each one
+// shares its memory and sets up the receive and transmit virtqueues using
+// vhost-user messages, as QEMU does. The parent plays the broker, connecting
+// both devices to a relay switch. One guest sends frames to the other, and the
+// receiving guest checks every frame. Reports the rate of frames received in
+// packets per second and Gbit/s, and the number of frames lost because the
+// receiving guest had no buffers.
+//
+// Usage: bench-vhost-user [FRAMES]
+
+// memfd_create and file seals are available only with _GNU_SOURCE.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broker-relay.h"
+#include "broker-vhost-user.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+// The relay buffer size, large enough for a 1500 bytes MTU frame.
+#define MAX_FRAME_SIZE 2048
+
+static const int frame_sizes[] = {64, 1514};
+
+// MARK: - Guests
+
+// Virtqueue layout from the virtio specification.
+struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct vring_avail {
+    uint16_t flags;
+    _Atomic uint16_t idx;
+    uint16_t ring[];
+};
+
+struct vring_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct vring_used {
+    uint16_t flags;
+    _Atomic uint16_t idx;
+    struct vring_used_elem ring[];
+};
+
+#define VRING_DESC_F_WRITE 2
+
+// vhost-user requests used by QEMU to start a virtio-net device.
+enum {
+    GET_FEATURES = 1,
+    SET_FEATURES = 2,
+    SET_OWNER = 3,
+    SET_MEM_TABLE = 5,
+    SET_VRING_NUM = 8,
+    SET_VRING_ADDR = 9,
+    SET_VRING_BASE = 10,
+    SET_VRING_KICK = 12,
+    SET_VRING_CALL = 13,
+    GET_PROTOCOL_FEATURES = 15,
+    SET_PROTOCOL_FEATURES = 16,
+    SET_VRING_ENABLE = 18,
+};
+
+#define VIRTIO_F_VERSION_1 (1ULL << 32)
+#define VHOST_USER_F_PROTOCOL_FEATURES (1ULL << 30)
+
+// The virtio-net header size with VIRTIO_F_VERSION_1.
+#define HEADER_SIZE 12
+
+#define RX 0
+#define TX 1
+
+#define QUEUE_SIZE 256
+#define BUFFER_SIZE 2048
+
+// Guest memory, with the rings and buffers of both queues.
+#define GUEST_ADDR 0x40000000ULL
+#define RINGS_SIZE (3 * 4096)
+#define QUEUE_MEMORY (RINGS_SIZE + QUEUE_SIZE * BUFFER_SIZE)
+#define MEMORY_SIZE (2 * QUEUE_MEMORY)
+
+// Frames sent before kicking the device.
+#define TX_BATCH 32
+
+// The receiving guest is done after not receiving frames for this time.
+#define IDLE_TIMEOUT_MS 200
+
+struct queue {
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    unsigned char *buffers;
+    uint64_t buffers_addr;
+    uint16_t avail_idx;
+    uint16_t used_idx;
+    // The guest side of the kick and call pipes.
+    int kick;
+    int call;
+};
+
+struct guest {
+    int sock;
+    int index;
+    unsigned char *memory;
+    int memory_fd;
+    struct queue queues[2];
+};
+
+struct result {
+    uint64_t received;
+    uint64_t errors;
+    uint64_t elapsed_ns;
+};
+
+static uint64_t gettime(void) {
+    struct timespec ts;
+#ifdef CLOCK_UPTIME_RAW
+    clock_gettime(CLOCK_UPTIME_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+static void fail(const char *what) {
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+// Create guest memory shared with the broker, as QEMU does with a memory
+// backend with share=on. The broker requires memory that cannot shrink: a
+// sealed memfd on Linux, or a POSIX shared memory object on macOS.
+static int create_memory(size_t size) {
+#ifdef __linux__
+    int fd = memfd_create(
+        "bench-vhost-user", MFD_CLOEXEC | MFD_ALLOW_SEALING
+    );
+#else
+    char name[32];
+    snprintf(name, sizeof(name), "/bench-vhost-user.%d", getpid());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        shm_unlink(name);
+    }
+#endif
+    if (fd < 0) {
+        fail("create_memory");
+    }
+    if (ftruncate(fd, size) < 0) {
+        fail("ftruncate");
+    }
+#ifdef __linux__
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+        fail("F_ADD_SEALS");
+    }
+#endif
+    return fd;
+}
+
+static void send_message(
+    int sock, uint32_t request, const void *payload, uint32_t size, int fd
+) {
+    uint32_t header[3] = {request, 0x1, size};
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = sizeof(header)},
+        {.iov_base = (void *)payload, .iov_len = size},
+    };
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+    if (fd != -1) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    }
+    if (sendmsg(sock, &msg, 0) < 0) {
+        fail("sendmsg");
+    }
+}
+
+static uint64_t request_u64(int sock, uint32_t request) {
+    send_message(sock, request, NULL, 0, -1);
+    struct {
+        uint32_t header[3];
+        uint64_t value;
+    } __attribute__((packed)) reply;
+    if (recv(sock, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply)) {
+        fail("recv reply");
+    }
+    return reply.value;
+}
+
+static void send_u64(int sock, uint32_t request, uint64_t value, int fd) {
+    send_message(sock, request, &value, sizeof(value), fd);
+}
+
+static void send_state(int sock, uint32_t request, uint32_t index, uint32_t n) {
+    uint32_t state[2] = {index, n};
+    send_message(sock, request, state, sizeof(state), -1);
+}
+
+static uint64_t user_addr(const void *p) {
+    return (uint64_t)(uintptr_t)p;
+}
+
+// Set up a queue, sending the broker side of the kick and call pipes.
+static void setup_queue(struct guest *g, int q) {
+    struct queue *vq = &g->queues[q];
+    unsigned char *base = g->memory + q * QUEUE_MEMORY;
+    vq->desc = (struct vring_desc *)base;
+    vq->avail = (struct vring_avail *)(base + 4096);
+    vq->used = (struct vring_used *)(base + 2 * 4096);
+    vq->buffers = base + RINGS_SIZE;
+    vq->buffers_addr = GUEST_ADDR + q * QUEUE_MEMORY + RINGS_SIZE;
+
+    int kick[2], call[2];
+    if (pipe(kick) < 0 || pipe(call) < 0) {
+        fail("pipe");
+    }
+    fcntl(kick[1], F_SETFL, O_NONBLOCK);
+    fcntl(call[0], F_SETFL, O_NONBLOCK);
+    vq->kick = kick[1];
+    vq->call = call[0];
+
+    send_state(g->sock, SET_VRING_NUM, q, QUEUE_SIZE);
+    struct {
+        uint32_t index;
+        uint32_t flags;
+        uint64_t desc;
+        uint64_t used;
+        uint64_t avail;
+        uint64_t log;
+    } addr = {
+        .index = q,
+        .desc = user_addr(vq->desc),
+        .used = user_addr(vq->used),
+        .avail = user_addr(vq->avail),
+    };
+    send_message(g->sock, SET_VRING_ADDR, &addr, sizeof(addr), -1);
+    send_state(g->sock, SET_VRING_BASE, q, 0);
+    send_u64(g->sock, SET_VRING_CALL, q, call[1]);
+    send_u64(g->sock, SET_VRING_KICK, q, kick[0]);
+    send_state(g->sock, SET_VRING_ENABLE, q, 1);
+    close(kick[0]);
+    close(call[1]);
+}
+
+// Start the device as QEMU does, and make all receive buffers available.
+static void start_guest(struct guest *g) {
+    g->memory_fd = create_memory(MEMORY_SIZE);
+    g->memory = mmap(
+        NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, g->memory_fd, 0
+    );
+    if (g->memory == MAP_FAILED) {
+        fail("mmap");
+    }
+
+    uint64_t features = request_u64(g->sock, GET_FEATURES);
+    if (!(features & VIRTIO_F_VERSION_1)) {
+        fprintf(stderr, "VIRTIO_F_VERSION_1 not offered\n");
+        exit(EXIT_FAILURE);
+    }
+    send_u64(
+        g->sock,
+        SET_FEATURES,
+        VIRTIO_F_VERSION_1 | VHOST_USER_F_PROTOCOL_FEATURES,
+        -1
+    );
+    request_u64(g->sock, GET_PROTOCOL_FEATURES);
+    send_u64(g->sock, SET_PROTOCOL_FEATURES, 0, -1);
+    send_message(g->sock, SET_OWNER, NULL, 0, -1);
+
+    struct {
+        uint32_t nregions;
+        uint32_t padding;
+        uint64_t guest_addr;
+        uint64_t size;
+        uint64_t user_addr;
+        uint64_t mmap_offset;
+    } table = {
+        .nregions = 1,
+        .guest_addr = GUEST_ADDR,
+        .size = MEMORY_SIZE,
+        .user_addr = user_addr(g->memory),
+    };
+    send_message(g->sock, SET_MEM_TABLE, &table, sizeof(table), g->memory_fd);
+
+    struct queue *rx = &g->queues[RX];
+    setup_queue(g, RX);
+    setup_queue(g, TX);
+
+    for (int i = 0; i < QUEUE_SIZE; i++) {
+        rx->desc[i] = (struct vring_desc){
+            .addr = rx->buffers_addr + i * BUFFER_SIZE,
+            .len = BUFFER_SIZE,
+            .flags = VRING_DESC_F_WRITE,
+        };
+        rx->avail->ring[i] = i;
+    }
+    rx->avail_idx = QUEUE_SIZE;
+    atomic_store_explicit(
+        &rx->avail->idx, rx->avail_idx, memory_order_release
+    );
+}
+
+static void kick(struct queue *vq) {
+    uint64_t one = 1;
+    (void)write(vq->kick, &one, sizeof(one));
+}
+
+// Wait until the device interrupts the guest, or until timeout_ms.
+static void wait_call(struct guest *g, int timeout_ms) {
+    struct pollfd fds[2] = {
+        {.fd = g->queues[RX].call, .events = POLLIN},
+        {.fd = g->queues[TX].call, .events = POLLIN},
+    };
+    if (poll(fds, 2, timeout_ms) < 0 && errno != EINTR) {
+        fail("poll");
+    }
+    char buf[64];
+    for (int i = 0; i < 2; i++) {
+        while (read(fds[i].fd, buf, sizeof(buf)) > 0) {
+        }
+    }
+}
+
+static void set_mac(unsigned char *p, int index) {
+    const unsigned char mac[6] = {0x02, 0, 0, 0, 0, index};
+    memcpy(p, mac, sizeof(mac));
+}
+
+// Queue a frame from the guest to dst, or broadcast if dst is -1. Returns
+// false if the transmit queue is full.
+static bool
+queue_frame(struct guest *g, int dst, size_t size, uint32_t seq) {
+    struct queue *tx = &g->queues[TX];
+    uint16_t used = atomic_load_explicit(&tx->used->idx, memory_order_acquire);
+    if ((uint16_t)(tx->avail_idx - used) == QUEUE_SIZE) {
+        return false;
+    }
+
+    uint16_t slot = tx->avail_idx % QUEUE_SIZE;
+    unsigned char *buf = tx->buffers + slot * BUFFER_SIZE;
+    unsigned char *frame = buf + HEADER_SIZE;
+    memset(buf, 0, HEADER_SIZE);
+    if (dst == -1) {
+        memset(frame, 0xff, 6);
+    } else {
+        set_mac(frame, dst);
+    }
+    set_mac(frame + 6, g->index);
+    frame[12] = 0x88;
+    frame[13] = 0xb5;
+    memcpy(frame + 14, &seq, sizeof(seq));
+    frame[size - 1] = seq & 0xff;
+
+    tx->desc[slot] = (struct vring_desc){
+        .addr = tx->buffers_addr + slot * BUFFER_SIZE,
+        .len = HEADER_SIZE + size,
+    };
+    tx->avail->ring[slot] = slot;
+    tx->avail_idx++;
+    return true;
+}
+
+static void publish(struct queue *vq) {
+    atomic_store_explicit(&vq->avail->idx, vq->avail_idx, memory_order_release);
+}
+
+// Process received frames, returning the buffers to the device. Returns the
+// number of frames from src, or only unicast frames from src if unicast is
+// true. Frames are checked if r is not NULL.
+static int receive_frames(
+    struct guest *g, int src, bool unicast, size_t size, struct result *r
+) {
+    struct queue *rx = &g->queues[RX];
+    uint16_t used = atomic_load_explicit(&rx->used->idx, memory_order_acquire);
+    if (rx->used_idx == used) {
+        return 0;
+    }
+
+    int count = 0;
+    while (rx->used_idx != used) {
+        struct vring_used_elem e = rx->used->ring[rx->used_idx % QUEUE_SIZE];
+        rx->used_idx++;
+        const unsigned char *frame = rx->buffers + e.id * BUFFER_SIZE +
+                                     HEADER_SIZE;
+        bool broadcast = frame[0] == 0xff;
+        if (frame[11] == src && !(unicast && broadcast)) {
+            uint32_t seq;
+            memcpy(&seq, frame + 14, sizeof(seq));
+            if (r && (e.len != HEADER_SIZE + size ||
+                      frame[size - 1] != (seq & 0xff))) {
+                r->errors++;
+            }
+            count++;
+        }
+        rx->avail->ring[rx->avail_idx % QUEUE_SIZE] = e.id;
+        rx->avail_idx++;
+    }
+    publish(rx);
+    return count;
+}
+
+// Announce the guest until the peer is seen, then send frames to the peer.
+static void run_sender(struct guest *g, int peer, int frames, size_t size) {
+    struct queue *tx = &g->queues[TX];
+
+    while (receive_frames(g, peer, false, size, NULL) == 0) {
+        if (queue_frame(g, -1, size, 0)) {
+            publish(tx);
+            kick(tx);
+        }
+        wait_call(g, 10);
+    }
+
+    int queued = 0;
+    for (int i = 0; i < frames; i++) {
+        while (!queue_frame(g, peer, size, i)) {
+            publish(tx);
+            kick(tx);
+            queued = 0;
+            wait_call(g, 10);
+        }
+        if (++queued == TX_BATCH) {
+            publish(tx);
+            kick(tx);
+            queued = 0;
+        }
+    }
+    publish(tx);
+    kick(tx);
+
+    // Wait until the device used all frames.
+    while (atomic_load_explicit(&tx->used->idx, memory_order_acquire) !=
+           tx->avail_idx) {
+        wait_call(g, 10);
+    }
+}
+
+// Announce the guest until frames are received from the peer, and receive
+// frames until the peer stops sending.
+static void
+run_receiver(struct guest *g, int peer, size_t size, struct result *r) {
+    struct queue *tx = &g->queues[TX];
+    uint64_t start = 0;
+    uint64_t last = 0;
+
+    for (;;) {
+        int n = receive_frames(g, peer, true, size, r);
+        uint64_t now = gettime();
+        if (n > 0) {
+            if (r->received == 0) {
+                start = now;
+            }
+            r->received += n;
+            last = now;
+        } else if (r->received == 0) {
+            if (queue_frame(g, -1, size, 0)) {
+                publish(tx);
+                kick(tx);
+            }
+        } else if (now - last > IDLE_TIMEOUT_MS * 1000000ULL) {
+            break;
+        }
+        wait_call(g, 10);
+    }
+
+    r->elapsed_ns = last - start;
+}
+
+static pid_t start_child(
+    int sock,
+    int index,
+    int peer,
+    bool sender,
+    int frames,
+    size_t size,
+    int result_fd
+) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        fail("fork");
+    }
+    if (pid > 0) {
+        return pid;
+    }
+
+    struct guest g = {.sock = sock, .index = index};
+    start_guest(&g);
+    if (sender) {
+        run_sender(&g, peer, frames, size);
+    } else {
+        struct result r = {0};
+        run_receiver(&g, peer, size, &r);
+        if (write(result_fd, &r, sizeof(r)) != sizeof(r)) {
+            fail("write");
+        }
+    }
+    _exit(0);
+}
+
+// MARK: - Broker
+
+struct device {
+    struct relay *relay;
+    struct relay_switch *sw;
+    struct relay_link *link;
+    struct vhost_user_dev *dev;
+    int sock;
+};
+
+static void device_start(void *arg, struct vhost_user_dev *dev) {
+    struct device *d = arg;
+    struct relay_endpoint endpoint = {
+        .fd = vhost_user_doorbell(dev),
+        .ops = &vhost_user_port_ops,
+        .arg = dev,
+        .offloads = vhost_user_offloads(dev),
+    };
+    if (endpoint.fd == -1) {
+        fail("vhost_user_doorbell");
+    }
+    d->link = relay_add_switch_link(d->relay, d->sw, &endpoint);
+    if (d->link == NULL) {
+        fail("relay_add_switch_link");
+    }
+}
+
+static void device_stop(void *arg, struct vhost_user_dev *dev) {
+    (void)dev;
+    struct device *d = arg;
+    if (d->link) {
+        relay_remove_link(d->relay, d->link);
+        d->link = NULL;
+    }
+}
+
+static const struct vhost_user_ops device_ops = {
+    .start = device_start,
+    .stop = device_stop,
+};
+
+// Handle vhost-user messages until both guests disconnect.
+static void serve(struct device *devices, int count) {
+    int open = count;
+    while (open > 0) {
+        struct pollfd fds[2];
+        for (int i = 0; i < count; i++) {
+            fds[i] = (struct pollfd){.fd = devices[i].sock, .events = POLLIN};
+        }
+        if (poll(fds, count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fail("poll");
+        }
+        for (int i = 0; i < count; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP))) {
+                continue;
+            }
+            if (vhost_user_handle(devices[i].dev) == 0) {
+                continue;
+            }
+            if (errno != ECONNRESET) {
+                fail("vhost_user_handle");
+            }
+            vhost_user_destroy(devices[i].dev);
+            close(devices[i].sock);
+            devices[i].sock = -1;
+            open--;
+        }
+    }
+}
+
+static void run(int frames, size_t size) {
+    struct relay *relay = relay_create(MAX_FRAME_SIZE, RELAY_BATCH);
+    if (relay == NULL) {
+        fail("relay_create");
+    }
+    struct relay_switch *sw = relay_create_switch(relay);
+    if (sw == NULL) {
+        fail("relay_create_switch");
+    }
+
+    int result[2];
+    if (pipe(result) < 0) {
+        fail("pipe");
+    }
+
+    struct device devices[2];
+    pid_t pids[2];
+    for (int i = 0; i < 2; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            fail("socketpair");
+        }
+        // Guest 0 sends frames to guest 1.
+        pids[i] = start_child(
+            fds[1], i, 1 - i, i == 0, frames, size, result[1]
+        );
+        close(fds[1]);
+
+        devices[i] = (struct device){.relay = relay, .sw = sw, .sock = fds[0]};
+        devices[i].dev = vhost_user_create(fds[0], &device_ops, &devices[i]);
+        if (devices[i].dev == NULL) {
+            fail("vhost_user_create");
+        }
+    }
+    close(result[1]);
+
+    serve(devices, 2);
+
+    for (int i = 0; i < 2; i++) {
+        int status;
+        waitpid(pids[i], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "guest %d failed\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct result r;
+    if (read(result[0], &r, sizeof(r)) != sizeof(r)) {
+        fail("read");
+    }
+    close(result[0]);
+
+    relay_destroy_switch(relay, sw);
+    relay_destroy(relay);
+
+    if (r.errors > 0) {
+        fprintf(stderr, "%llu invalid frames\n", (unsigned long long)r.errors);
+        exit(EXIT_FAILURE);
+    }
+
+    double elapsed = (double)r.elapsed_ns / NANOSECONDS_PER_SECOND;
+    printf(
+        "%8zu %10.0f %8.2f %10llu\n",
+        size,
+        r.received / elapsed,
+        r.received * size * 8 / elapsed / 1e9,
+        (unsigned long long)(frames - r.received)
+    );
+}
+
+int main(int argc, char *argv[]) {
+    int frames = argc > 1 ? atoi(argv[1]) : 1000000;
+    if (frames < 1) {
+        fprintf(stderr, "Usage: bench-vhost-user [FRAMES]\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%8s %10s %8s %10s\n", "size", "pps", "gbps", "lost");
+
+    for (size_t i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); i++) {
+        run(frames, frame_sizes[i]);
+    }
+
+    return 0;
+}
@@ -4,8 +4,21 @@
 #include <dispatch/dispatch.h>
 #include <signal.h>
 #include <stdlib.h>
-
+#include <string.h>
+#include <unistd.h>
+
+#include "broker-capture.h"
+#include "broker-events.h"
+#include "broker-history.h"
+#include "broker-interface.h"
+#include "broker-lane.h"
 #include "broker-network.h"
+#include "broker-policy.h"
+#include "broker-shard.h"
+#include "broker-stats.h"
+#include "broker-subnets.h"
+#include "broker-throttle.h"
+#include "broker-watchdog.h"
 #include "broker-xpc.h"
 #include "common.h"
 #include "log.h"
@@ -23,6 +36,46 @@ const struct broker_context main_context = {.name = "main"};
 // TODO: Read from user preferences.
 const int idle_timeout_sec = 120;
 
+// Maximum sustained rate of requests per peer, and the number of requests a
+// peer can send in a burst. Requests exceeding the rate are rejected with
+// VMNET_BROKER_BUSY, so a misbehaving peer cannot starve other peers.
+// TODO: Read from user preferences.
+const int peer_request_rate = 100;
+const int peer_request_burst = 200;
+
+// Maximum number of networks created concurrently. Acquiring a new network
+// when the limit is reached is rejected with VMNET_BROKER_BUSY.
+// TODO: Read from user preferences.
+const int max_creating_networks = 4;
+
+// Maximum time to wait in seconds for releasing networks when shutting down.
+// Networks not released in time are released by the system when the broker
+// exits.
+// TODO: Read from user preferences.
+const int shutdown_timeout_sec = 5;
+
+// Maximum number of networks created when the broker starts, predicted from
+// the networks used in previous runs. Set to 0 to disable.
+// TODO: Read from user preferences.
+const int precreate_budget = 2;
+
+// Time in seconds for the usage score of a network to decay by half. Networks
+// not used in the last 2 half lives are not predicted.
+// TODO: Read from user preferences.
+const int history_half_life_sec = 24 * 60 * 60;
+
+// Main queue handlers running longer than this are recorded as stalls,
+// reported in the broker stats.
+// TODO: Read from user preferences.
+const int stall_budget_ms = 50;
+
+// Maximum number of running packet captures. Starting a capture when the
+// limit is reached is rejected with VMNET_BROKER_BUSY, and the peer may retry
+// after capture_retry_ms.
+// TODO: Read from user preferences.
+const int max_captures = 8;
+const int capture_retry_ms = 1000;
+
 // Number of connected peers, used to prevent termination when peers are
 // connected. Using signed int to make it easy to detect incorrect counting.
 static int connected_peers;
@@ -30,19 +83,267 @@ static int connected_peers;
 // Used to shutdown if the broker is idle for idle_timeout_sec.
 static dispatch_source_t idle_timer;
 
-static void on_peer_request(struct broker_context *ctx, xpc_object_t event) {
-    const char *command = xpc_dictionary_get_string(event, REQUEST_COMMAND);
-    if (command == NULL) {
-        WARNF("[%s] invalid request: missing command key", ctx->name);
+// Expensive requests handled on the main queue.
+static struct slow_lane main_slow_lane;
+
+// Start relaying an acquired network on the main queue, and reply with the
+// relay socket, and the shared memory region when using RELAY_RING. Completes
+// the acquire request started by handle_acquire(), accounting its latency. If
+// the relay cannot be started, the network is released, unless the peer
+// released the network or disconnected while the relay was starting.
+static void relay_network(
+    struct broker_context *ctx,
+    xpc_object_t event,
+    const char *network_name,
+    xpc_object_t serialization,
+    enum relay_mode mode,
+    enum latency latency,
+    uint64_t start
+) {
+    if (ctx->disconnected) {
+        // The network was released on the shard queue when the peer
+        // disconnected.
+        send_xpc_error(ctx, event, VMNET_BROKER_INTERNAL_ERROR);
+        latency_end(latency, start);
+        xpc_release(event);
+        return;
+    }
+
+    start_relay(
+        ctx,
+        network_name,
+        serialization,
+        mode,
+        ^(int fd, int ring_fd, int error) {
+            if (fd == -1 && error == RELAY_STOPPED) {
+                send_xpc_error(ctx, event, VMNET_BROKER_INTERNAL_ERROR);
+            } else if (fd == -1) {
+                // The network name is owned by the request.
+                xpc_retain(event);
+                shard_async(shard_for_network(network_name), ^{
+                    release_network(ctx, network_name, ^(int release_error) {
+                        (void)release_error;
+                    });
+                    xpc_release(event);
+                });
+                send_xpc_error(ctx, event, error);
+            } else {
+                send_xpc_relay(ctx, event, network_name, fd, ring_fd);
+            }
+            latency_end(latency, start);
+            xpc_release(event);
+        }
+    );
+}
+
+// Acquire a network on the network shard queue, and reply. Relays are started
+// on the main queue.
+static void acquire(
+    struct broker_context *ctx,
+    xpc_object_t event,
+    const char *network_name,
+    const struct lease_request *lease,
+    enum relay_mode mode,
+    bool relay
+) {
+    // Acquiring an existing network completes immediately. Acquiring a new
+    // network waits until the network is created.
+    enum latency latency = network_ready(network_name) ? LATENCY_IMMEDIATE
+                                                       : LATENCY_DEFERRED;
+    uint64_t start = latency_begin(latency);
+
+    acquire_network(
+        ctx,
+        network_name,
+        lease,
+        ^(xpc_object_t network_serialization, int error) {
+            if (error == VMNET_BROKER_BUSY) {
+                send_xpc_busy(ctx, event, throttle_create(ctx));
+            } else if (network_serialization == NULL) {
+                send_xpc_error(ctx, event, error);
+            } else if (relay) {
+                // Replying waits until the interface is started.
+                xpc_retain(network_serialization);
+                dispatch_async(dispatch_get_main_queue(), ^{
+                    relay_network(
+                        ctx,
+                        event,
+                        network_name,
+                        network_serialization,
+                        mode,
+                        latency,
+                        start
+                    );
+                    xpc_release(network_serialization);
+                });
+                return;
+            } else {
+                send_xpc_network(
+                    ctx, event, network_name, network_serialization
+                );
+            }
+            latency_end(latency, start);
+            xpc_release(event);
+        }
+    );
+}
+
+static void handle_acquire(struct broker_context *ctx, xpc_object_t event) {
+    const char *network_name = xpc_dictionary_get_string(
+        event, REQUEST_NETWORK_NAME
+    );
+    if (network_name == NULL) {
+        WARNF("[%s] invalid request: missing network_name", ctx->name);
         send_xpc_error(ctx, event, VMNET_BROKER_INVALID_REQUEST);
         return;
     }
-    if (strcmp(command, COMMAND_ACQUIRE) != 0) {
-        WARNF("[%s] invalid request: unknown command '%s'", ctx->name, command);
+
+    struct lease_request lease = {
+        .token = xpc_dictionary_get_string(event, REQUEST_LEASE_TOKEN),
+    };
+    if (lease.token != NULL) {
+        // Missing or invalid values are 0.
+        int64_t duration = xpc_dictionary_get_int64(
+            event, REQUEST_LEASE_DURATION
+        );
+        if (lease.token[0] == '\0' || duration < 1 ||
+            duration > MAX_LEASE_DURATION) {
+            WARNF(
+                "[%s] invalid request: invalid lease token '%s' duration %lld",
+                ctx->name,
+                lease.token,
+                duration
+            );
+            send_xpc_error(ctx, event, VMNET_BROKER_INVALID_REQUEST);
+            return;
+        }
+        lease.duration_sec = (int)duration;
+    }
+
+    if (!policy_allows(&ctx->credentials, network_name)) {
+        WARNF(
+            "[%s] uid %d gid %d not allowed to acquire network '%s'",
+            ctx->name,
+            (int)ctx->credentials.uid,
+            (int)ctx->credentials.gid,
+            network_name
+        );
+        send_xpc_error(ctx, event, VMNET_BROKER_NOT_ALLOWED);
+        return;
+    }
+
+    enum relay_mode mode = RELAY_SOCKET;
+    if (xpc_dictionary_get_bool(event, REQUEST_VHOST_USER)) {
+        mode = RELAY_VHOST_USER;
+    } else if (xpc_dictionary_get_bool(event, REQUEST_STREAM)) {
+        mode = RELAY_STREAM;
+    } else if (xpc_dictionary_get_bool(event, REQUEST_RING)) {
+        mode = RELAY_RING;
+    }
+    bool relay = mode != RELAY_SOCKET ||
+                 xpc_dictionary_get_bool(event, REQUEST_RELAY);
+
+    // The request runs on the shard queue and may wait until the network is
+    // created, so it must be valid until then. The network name and lease
+    // token are owned by the request.
+    xpc_retain(event);
+    shard_async(shard_for_network(network_name), ^{
+        acquire(
+            ctx, event, network_name, lease.token ? &lease : NULL, mode, relay
+        );
+    });
+}
+
+// Release a network on the network shard queue, and reply.
+static void release(
+    struct broker_context *ctx, xpc_object_t event, const char *network_name
+) {
+    // Releasing a network being created waits until the network is created.
+    enum latency latency = network_creating(network_name) ? LATENCY_DEFERRED
+                                                          : LATENCY_IMMEDIATE;
+    uint64_t start = latency_begin(latency);
+
+    release_network(ctx, network_name, ^(int error) {
+        if (error) {
+            send_xpc_error(ctx, event, error);
+        } else {
+            // A release does not tell which acquire it releases, so relays
+            // are stopped on the main queue when the peer releases its last
+            // reference. Later requests of the peer start relays after that.
+            if (!network_acquired(ctx, network_name)) {
+                xpc_retain(event);
+                dispatch_async(dispatch_get_main_queue(), ^{
+                    stop_peer_relays(ctx, network_name);
+                    xpc_release(event);
+                });
+            }
+            send_xpc_success(ctx, event);
+        }
+        latency_end(latency, start);
+        xpc_release(event);
+    });
+}
+
+static void handle_release(struct broker_context *ctx, xpc_object_t event) {
+    const char *network_name = xpc_dictionary_get_string(
+        event, REQUEST_NETWORK_NAME
+    );
+    if (network_name == NULL) {
+        WARNF("[%s] invalid request: missing network_name", ctx->name);
         send_xpc_error(ctx, event, VMNET_BROKER_INVALID_REQUEST);
         return;
     }
 
+    xpc_retain(event);
+    shard_async(shard_for_network(network_name), ^{
+        release(ctx, event, network_name);
+    });
+}
+
+static void handle_subscribe(struct broker_context *ctx, xpc_object_t event) {
+    subscribe_peer(ctx);
+    send_xpc_success(ctx, event);
+}
+
+static void handle_info(struct broker_context *ctx, xpc_object_t event) {
+    // Optional, NULL for all networks.
+    const char *network_name = xpc_dictionary_get_string(
+        event, REQUEST_NETWORK_NAME
+    );
+
+    uint64_t start = latency_begin(LATENCY_IMMEDIATE);
+    xpc_retain(event);
+
+    if (network_name == NULL) {
+        get_all_networks_info(^(xpc_object_t networks) {
+            send_xpc_networks(ctx, event, networks);
+            latency_end(LATENCY_IMMEDIATE, start);
+            xpc_release(event);
+        });
+        return;
+    }
+
+    shard_async(shard_for_network(network_name), ^{
+        int error = 0;
+        xpc_object_t networks = copy_networks_info(ctx, network_name, &error);
+        if (networks == NULL) {
+            send_xpc_error(ctx, event, error);
+        } else {
+            send_xpc_networks(ctx, event, networks);
+            xpc_release(networks);
+        }
+        latency_end(LATENCY_IMMEDIATE, start);
+        xpc_release(event);
+    });
+}
+
+static void handle_stats(struct broker_context *ctx, xpc_object_t event) {
+    xpc_object_t stats = copy_stats();
+    send_xpc_stats(ctx, event, stats);
+    xpc_release(stats);
+}
+
+static void handle_capture(struct broker_context *ctx, xpc_object_t event) {
     const char *network_name = xpc_dictionary_get_string(
         event, REQUEST_NETWORK_NAME
     );
@@ -52,17 +353,218 @@ static void on_peer_request(struct broker_context *ctx, xpc_object_t event) {
         return;
     }
 
+    // Missing values are 0, using the default snapshot length.
+    int64_t snaplen = xpc_dictionary_get_int64(event, REQUEST_SNAPLEN);
+    if (snaplen < 0 || snaplen > CAPTURE_MAX_SNAPLEN) {
+        WARNF(
+            "[%s] invalid request: invalid snaplen %lld", ctx->name, snaplen
+        );
+        send_xpc_error(ctx, event, VMNET_BROKER_INVALID_REQUEST);
+        return;
+    }
+
+    // Optional, NULL to capture all frames.
+    const char *filter = xpc_dictionary_get_string(event, REQUEST_FILTER);
+
+    // Captured frames may belong to other users of the network, so the peer
+    // must be allowed to use the network.
+    if (!policy_allows(&ctx->credentials, network_name)) {
+        WARNF(
+            "[%s] uid %d gid %d not allowed to capture network '%s'",
+            ctx->name,
+            (int)ctx->credentials.uid,
+            (int)ctx->credentials.gid,
+            network_name
+        );
+        send_xpc_error(ctx, event, VMNET_BROKER_NOT_ALLOWED);
+        return;
+    }
+
     int error = 0;
-    xpc_object_t network_serialization = acquire_network(
-        ctx, network_name, &error
-    );
-    if (network_serialization == NULL) {
-        send_xpc_error(ctx, event, error);
+    int fd = start_capture(ctx, network_name, snaplen, filter, &error);
+    if (fd == -1) {
+        if (error == VMNET_BROKER_BUSY) {
+            send_xpc_busy(ctx, event, capture_retry_ms);
+        } else {
+            send_xpc_error(ctx, event, error);
+        }
         return;
     }
 
-    send_xpc_network(ctx, event, network_name, network_serialization);
-    xpc_release(network_serialization);
+    send_xpc_capture(ctx, event, network_name, fd);
+    close(fd);
+}
+
+static void handle_hello(struct broker_context *ctx, xpc_object_t event) {
+    int64_t version = xpc_dictionary_get_int64(event, REQUEST_VERSION);
+    if (version < PROTOCOL_VERSION_1) {
+        WARNF(
+            "[%s] invalid request: invalid protocol version %lld",
+            ctx->name,
+            version
+        );
+        send_xpc_error(ctx, event, VMNET_BROKER_INVALID_REQUEST);
+        return;
+    }
+
+    // Use the latest version supported by both the peer and the broker.
+    ctx->version = version < PROTOCOL_VERSION ? (int)version : PROTOCOL_VERSION;
+    INFOF("[%s] using protocol version %d", ctx->name, ctx->version);
+
+    send_xpc_version(ctx, event, ctx->version);
+}
+
+struct request_type {
+    // The command name in protocol version 1 requests.
+    const char *command;
+    void (*handle)(struct broker_context *ctx, xpc_object_t event);
+    // True if the handler accounts the request latency, since the request
+    // completes on a shard queue, and may wait until a network is created.
+    bool accounts_latency;
+};
+
+// Request types by opcode. Opcode 0 is invalid.
+static const struct request_type request_types[] = {
+    [OPCODE_HELLO] = {COMMAND_HELLO, handle_hello, false},
+    [OPCODE_ACQUIRE] = {COMMAND_ACQUIRE, handle_acquire, true},
+    [OPCODE_RELEASE] = {COMMAND_RELEASE, handle_release, true},
+    [OPCODE_SUBSCRIBE] = {COMMAND_SUBSCRIBE, handle_subscribe, false},
+    [OPCODE_INFO] = {COMMAND_INFO, handle_info, true},
+    [OPCODE_STATS] = {COMMAND_STATS, handle_stats, false},
+    [OPCODE_CAPTURE] = {COMMAND_CAPTURE, handle_capture, false},
+};
+
+// Return the request opcode, or 0 if the request is invalid. Protocol version
+// 2 requests specify the opcode, and protocol version 1 requests specify the
+// command name.
+static int64_t
+request_opcode(const struct broker_context *ctx, xpc_object_t event) {
+    // A protocol version 1 peer waits for the reply to the request, so it
+    // cannot match replies by request ID.
+    if (ctx->version < PROTOCOL_VERSION_2 &&
+        xpc_dictionary_get_value(event, REQUEST_ID) != NULL) {
+        WARNF(
+            "[%s] invalid request: request ID without protocol version 2",
+            ctx->name
+        );
+        return 0;
+    }
+
+    if (xpc_dictionary_get_value(event, REQUEST_OPCODE) != NULL) {
+        if (ctx->version < PROTOCOL_VERSION_2) {
+            WARNF(
+                "[%s] invalid request: opcode without protocol version 2",
+                ctx->name
+            );
+            return 0;
+        }
+        int64_t opcode = xpc_dictionary_get_int64(event, REQUEST_OPCODE);
+        if (opcode < 1 || opcode >= (int64_t)ARRAY_SIZE(request_types)) {
+            WARNF(
+                "[%s] invalid request: unknown opcode %lld", ctx->name, opcode
+            );
+            return 0;
+        }
+        return opcode;
+    }
+
+    const char *command = xpc_dictionary_get_string(event, REQUEST_COMMAND);
+    if (command == NULL) {
+        WARNF("[%s] invalid request: missing command key", ctx->name);
+        return 0;
+    }
+
+    for (size_t i = 1; i < ARRAY_SIZE(request_types); i++) {
+        if (strcmp(command, request_types[i].command) == 0) {
+            return (int64_t)i;
+        }
+    }
+
+    WARNF("[%s] invalid request: unknown command '%s'", ctx->name, command);
+    return 0;
+}
+
+// Classify a request. Requests for a network run in the fast lane on the
+// network shard queue, where acquiring a network that does not exist yet
+// continues in the shard slow lane. Dumping statistics or information about
+// all networks runs in the main queue slow lane.
+static enum lane classify_request(int64_t opcode, xpc_object_t event) {
+    switch (opcode) {
+    case OPCODE_STATS:
+        return LANE_SLOW;
+    case OPCODE_INFO:
+        return xpc_dictionary_get_string(event, REQUEST_NETWORK_NAME)
+                   ? LANE_FAST
+                   : LANE_SLOW;
+    default:
+        return LANE_FAST;
+    }
+}
+
+static void run_request(
+    struct broker_context *ctx,
+    xpc_object_t event,
+    const struct request_type *type
+) {
+    if (type->accounts_latency) {
+        type->handle(ctx, event);
+        return;
+    }
+
+    uint64_t start = latency_begin(LATENCY_IMMEDIATE);
+    type->handle(ctx, event);
+    latency_end(LATENCY_IMMEDIATE, start);
+}
+
+// Run the request handler, or add it to the main queue slow lane. Returns the
+// request command, or NULL if the request was rejected.
+static const char *
+dispatch_request(struct broker_context *ctx, xpc_object_t event) {
+    // Reject requests exceeding the peer request rate before doing any work,
+    // including validating the request.
+    int retry_after_ms = throttle_request(ctx);
+    if (retry_after_ms) {
+        send_xpc_busy(ctx, event, retry_after_ms);
+        return NULL;
+    }
+
+    int64_t opcode = request_opcode(ctx, event);
+    if (opcode == 0) {
+        send_xpc_error(ctx, event, VMNET_BROKER_INVALID_REQUEST);
+        return NULL;
+    }
+
+    const struct request_type *type = &request_types[opcode];
+
+    if (classify_request(opcode, event) == LANE_FAST) {
+        run_request(ctx, event, type);
+        return type->command;
+    }
+
+    // The context is released after the slow requests of a disconnected peer,
+    // which do not need a reply.
+    xpc_retain(event);
+    slow_lane_async(&main_slow_lane, ^{
+        if (!ctx->disconnected) {
+            uint64_t start = watch_begin(HANDLER_REQUEST);
+            run_request(ctx, event, type);
+            watch_end(HANDLER_REQUEST, start, ctx->name, type->command, NULL);
+        }
+        xpc_release(event);
+    });
+    return type->command;
+}
+
+static void on_peer_request(struct broker_context *ctx, xpc_object_t event) {
+    uint64_t start = watch_begin(HANDLER_REQUEST);
+    const char *command = dispatch_request(ctx, event);
+    watch_end(
+        HANDLER_REQUEST,
+        start,
+        ctx->name,
+        command,
+        xpc_dictionary_get_string(event, REQUEST_NETWORK_NAME)
+    );
 }
 
 static void shutdown_later(const struct broker_context *ctx) {
@@ -88,8 +590,31 @@ static void shutdown_later(const struct broker_context *ctx) {
     dispatch_source_set_timer(idle_timer, start, DISPATCH_TIME_FOREVER, leeway);
 
     dispatch_source_set_event_handler(idle_timer, ^{
+        uint64_t start = watch_begin(HANDLER_TIMER);
+
+        if (has_retained_leases()) {
+            // Networks are kept for disconnected peers. Check again later.
+            DEBUGF(
+                "[%s] idle timeout - leases retained, shutting down in %d "
+                "seconds",
+                main_context.name,
+                idle_timeout_sec
+            );
+            dispatch_source_set_timer(
+                idle_timer,
+                dispatch_time(
+                    DISPATCH_TIME_NOW, idle_timeout_sec * NSEC_PER_SEC
+                ),
+                DISPATCH_TIME_FOREVER,
+                leeway
+            );
+            watch_end(HANDLER_TIMER, start, NULL, "shutdown", NULL);
+            return;
+        }
+
         INFOF("[%s] idle timeout - shutting down", main_context.name);
         shutdown_networks(&main_context);
+        save_history(&main_context);
         exit(EXIT_SUCCESS);
     });
 
@@ -97,6 +622,8 @@ static void shutdown_later(const struct broker_context *ctx) {
 }
 
 static void on_peer_connect(struct broker_context *ctx) {
+    uint64_t start = watch_begin(HANDLER_CONNECT);
+
     connected_peers++;
 
     INFOF("[%s] connected (connected peers %d)", ctx->name, connected_peers);
@@ -118,14 +645,30 @@ static void on_peer_connect(struct broker_context *ctx) {
             idle_timer = NULL;
         }
     }
+
+    watch_end(HANDLER_CONNECT, start, ctx->name, NULL, NULL);
 }
 
 static void on_peer_disconnect(struct broker_context *ctx) {
+    uint64_t start = watch_begin(HANDLER_DISCONNECT);
+
     connected_peers--;
 
     INFOF("[%s] disconnected (connected peers %d)", ctx->name, connected_peers);
 
-    release_peer_networks(ctx);
+    ctx->disconnected = true;
+    unsubscribe_peer(ctx);
+    stop_peer_relays(ctx, NULL);
+    throttle_peer_disconnect(ctx);
+
+    // Requests of the peer may still run on the shard queues or wait in the
+    // slow lane, so the context is released after all shards released the
+    // peer networks, and slow requests received before disconnecting.
+    release_peer_networks(ctx, ^{
+        slow_lane_async(&main_slow_lane, ^{
+            release_context(ctx);
+        });
+    });
 
     if (connected_peers == 0) {
         // This is the last peer - end the transaction so launchd will be able
@@ -136,6 +679,8 @@ static void on_peer_disconnect(struct broker_context *ctx) {
         // Shut down if we are idle for long time.
         shutdown_later(ctx);
     }
+
+    watch_end(HANDLER_DISCONNECT, start, ctx->name, NULL, NULL);
 }
 
 static const struct broker_ops broker_ops = {
@@ -177,6 +722,7 @@ static void setup_signal_handlers(void) {
 
             INFOF("[%s] no active clients - shutting down", main_context.name);
             shutdown_networks(&main_context);
+            save_history(&main_context);
             exit(EXIT_SUCCESS);
         });
 
@@ -195,10 +741,31 @@ int main() {
 
     setup_signal_handlers();
 
+    // Peer credentials depend on the policy, so it must be loaded before
+    // accepting connections.
+    int err = load_policy(POLICY_PATH);
+    if (err) {
+        ERRORF(
+            "[%s] failed to load policy '%s': %s - denying all access",
+            main_context.name,
+            POLICY_PATH,
+            strerror(err)
+        );
+    }
+
+    // Requests are routed to the shard queues as soon as the listener starts.
+    start_shards();
+    main_slow_lane.queue = dispatch_get_main_queue();
+
     if (start_xpc_listener(&main_context, &broker_ops) != 0) {
         ERRORF("[%s] failed to start XPC listener", main_context.name);
         exit(EXIT_FAILURE);
     }
 
+    start_watchdog();
+    load_subnets(&main_context);
+    load_history(&main_context);
+    precreate_networks(&main_context);
+
     dispatch_main();
 }
@@ -0,0 +1,555 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broker-capture.h"
+#include "broker-classify.h"
+#include "broker-filter.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+// Keep the producer and consumer indexes in separate cache lines.
+#define CACHE_LINE_SIZE 64
+
+// Size of the buffer for the header and statistics blocks, holding the
+// interface description block with the largest filter.
+#define OUT_BUFFER_SIZE 4096
+
+// Bytes of frames written to the socket in one call. The space is returned to
+// the relay thread after every write.
+#define WRITE_SIZE (256 * 1024)
+
+// Time to wait for the socket, and for frames when idle, in milliseconds.
+#define POLL_INTERVAL_MS 10
+
+// Time to wait for more frames after writing less than a full buffer, in
+// milliseconds. The ring holds more than 1 millisecond of frames at 25 Gbit/s.
+#define BATCH_INTERVAL_MS 1
+
+// Time to wait for the reader after the capture was stopped, in seconds.
+#define STOP_TIMEOUT 5
+
+// pcapng block types and options.
+#define BLOCK_SECTION_HEADER 0x0a0d0d0a
+#define BLOCK_INTERFACE 1
+#define BLOCK_INTERFACE_STATS 5
+#define BLOCK_ENHANCED_PACKET 6
+#define BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define LINKTYPE_ETHERNET 1
+#define OPT_END 0
+#define OPT_SHB_USERAPPL 4
+#define OPT_IF_NAME 2
+#define OPT_IF_TSRESOL 9
+#define OPT_IF_FILTER 11
+#define OPT_ISB_IFRECV 4
+#define OPT_ISB_FILTERACCEPT 6
+#define OPT_ISB_OSDROP 7
+
+// Sending to a socket closed by the reader must not raise SIGPIPE. On macOS
+// the socket uses SO_NOSIGPIPE instead.
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+// A frame in the ring, written by the relay thread as a pcapng enhanced packet
+// block, so the writer sends the ring to the socket without copying. The block
+// is followed by caplen bytes of the frame padded to 4 bytes, and the block
+// length.
+struct record {
+    uint32_t type;
+    uint32_t block_len;
+    uint32_t interface;
+    uint32_t time_high;
+    uint32_t time_low;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+struct capture {
+    // Written by the relay thread.
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t head;
+    // The consumer index when the producer last loaded it.
+    uint64_t cached_tail;
+    _Atomic uint64_t received;
+    _Atomic uint64_t captured;
+    _Atomic uint64_t drops;
+    struct frame_class class;
+
+    // Written by the writer thread.
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t tail;
+    // The header and statistics blocks.
+    unsigned char *out;
+    size_t out_len;
+    bool failed;
+    // Time to give up writing after the capture was stopped.
+    uint64_t deadline;
+
+    // Records are written contiguously, and a record starting near the end
+    // of the ring continues after it, so the buffer is larger than the ring
+    // by the largest record.
+    unsigned char *ring;
+    uint64_t size;
+    uint32_t snaplen;
+    struct filter filter;
+    char *name;
+    char *filter_expr;
+    int fd;
+    void (*done)(void *arg);
+    void *arg;
+    struct relay *relay;
+    struct relay_tap *tap;
+    atomic_bool stopping;
+};
+
+static uint64_t realtime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+static uint64_t uptime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec;
+}
+
+static uint32_t record_size(uint32_t caplen) {
+    return sizeof(struct record) + ((caplen + 3) & ~3U) + sizeof(uint32_t);
+}
+
+static void add_counter(_Atomic uint64_t *counter, uint64_t n) {
+    // Only the relay thread modifies the counters.
+    uint64_t value = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, value + n, memory_order_relaxed);
+}
+
+// MARK: - Relay thread
+
+// Copy matching frames to the ring. The records of the batch are published
+// with one store, and the consumer index is loaded only when the ring looks
+// full, so a busy capture costs one shared cache line write per batch. Frames
+// are classified only for filtered captures, and the time is read once per
+// batch.
+static void
+capture_frames(void *arg, const struct relay_frame *frames, int count) {
+    struct capture *c = arg;
+    bool filtered = c->filter.root >= 0;
+    if (filtered) {
+        classify_frames(frames, count, &c->class);
+    }
+
+    uint64_t time = realtime();
+    uint64_t head = atomic_load_explicit(&c->head, memory_order_relaxed);
+    uint64_t captured = 0;
+    uint64_t drops = 0;
+    // The consumer index is loaded at most once per batch, so dropping
+    // frames when the writer is behind is cheap.
+    bool loaded = false;
+
+    for (int i = 0; i < count; i++) {
+        if (filtered && !filter_match(&c->filter, &frames[i], &c->class, i)) {
+            continue;
+        }
+        size_t len = frames[i].len;
+        uint32_t caplen = len < c->snaplen ? (uint32_t)len : c->snaplen;
+        uint32_t need = record_size(caplen);
+        if (head + need - c->cached_tail > c->size && !loaded) {
+            c->cached_tail = atomic_load_explicit(
+                &c->tail, memory_order_acquire
+            );
+            loaded = true;
+        }
+        if (head + need - c->cached_tail > c->size) {
+            drops++;
+            continue;
+        }
+        unsigned char *p = c->ring + (head & (c->size - 1));
+        struct record r = {
+            .type = BLOCK_ENHANCED_PACKET,
+            .block_len = need,
+            .time_high = (uint32_t)(time >> 32),
+            .time_low = (uint32_t)time,
+            .caplen = caplen,
+            .len = (uint32_t)len,
+        };
+        // Zero the padding, and copy the block over the last word.
+        uint32_t zero = 0;
+        memcpy(p + need - 2 * sizeof(uint32_t), &zero, sizeof(zero));
+        memcpy(p, &r, sizeof(r));
+        memcpy(p + sizeof(r), frames[i].data, caplen);
+        memcpy(p + need - sizeof(uint32_t), &need, sizeof(need));
+        head += need;
+        captured++;
+    }
+
+    atomic_store_explicit(&c->head, head, memory_order_release);
+    add_counter(&c->received, count);
+    add_counter(&c->captured, captured);
+    add_counter(&c->drops, drops);
+}
+
+// MARK: - pcapng blocks
+
+static void put(struct capture *c, const void *data, size_t len) {
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+static void put32(struct capture *c, uint32_t v) {
+    put(c, &v, sizeof(v));
+}
+
+static void pad(struct capture *c) {
+    static const unsigned char zeros[4];
+    put(c, zeros, -c->out_len & 3);
+}
+
+static void put_option(
+    struct capture *c, uint16_t code, const void *data, size_t len
+) {
+    uint16_t header[2] = {code, (uint16_t)len};
+    put(c, header, sizeof(header));
+    if (len) {
+        put(c, data, len);
+        pad(c);
+    }
+}
+
+// Start a block, returning its offset in the output buffer.
+static size_t begin_block(struct capture *c, uint32_t type) {
+    size_t start = c->out_len;
+    put32(c, type);
+    // The block length, set by end_block().
+    put32(c, 0);
+    return start;
+}
+
+static void end_block(struct capture *c, size_t start) {
+    uint32_t len = (uint32_t)(c->out_len - start + 4);
+    memcpy(c->out + start + 4, &len, sizeof(len));
+    put32(c, len);
+}
+
+// Write the section header and the interface description. Blocks are written
+// in the host byte order, as recorded by the byte order magic.
+static void put_headers(struct capture *c) {
+    static const char application[] = "vmnet-broker";
+    size_t start = begin_block(c, BLOCK_SECTION_HEADER);
+    put32(c, BYTE_ORDER_MAGIC);
+    // Version 1.0, and unknown section length.
+    uint16_t version[2] = {1, 0};
+    put(c, version, sizeof(version));
+    int64_t section_len = -1;
+    put(c, &section_len, sizeof(section_len));
+    put_option(c, OPT_SHB_USERAPPL, application, sizeof(application) - 1);
+    put_option(c, OPT_END, NULL, 0);
+    end_block(c, start);
+
+    start = begin_block(c, BLOCK_INTERFACE);
+    uint16_t linktype[2] = {LINKTYPE_ETHERNET, 0};
+    put(c, linktype, sizeof(linktype));
+    put32(c, c->snaplen);
+    put_option(c, OPT_IF_NAME, c->name, strlen(c->name));
+    // Nanosecond timestamps.
+    unsigned char tsresol = 9;
+    put_option(c, OPT_IF_TSRESOL, &tsresol, sizeof(tsresol));
+    if (c->filter_expr) {
+        // A filter string in the libpcap syntax.
+        unsigned char filter[1 + FILTER_MAX_SIZE] = {0};
+        size_t len = strlen(c->filter_expr);
+        memcpy(filter + 1, c->filter_expr, len);
+        put_option(c, OPT_IF_FILTER, filter, 1 + len);
+    }
+    put_option(c, OPT_END, NULL, 0);
+    end_block(c, start);
+}
+
+static void put_timestamp(struct capture *c, uint64_t time) {
+    put32(c, (uint32_t)(time >> 32));
+    put32(c, (uint32_t)time);
+}
+
+static void put_stats(struct capture *c) {
+    struct capture_stats s;
+    capture_get_stats(c, &s);
+    size_t start = begin_block(c, BLOCK_INTERFACE_STATS);
+    put32(c, 0);
+    put_timestamp(c, realtime());
+    put_option(c, OPT_ISB_IFRECV, &s.received, sizeof(s.received));
+    uint64_t accepted = s.captured + s.drops;
+    put_option(c, OPT_ISB_FILTERACCEPT, &accepted, sizeof(accepted));
+    put_option(c, OPT_ISB_OSDROP, &s.drops, sizeof(s.drops));
+    put_option(c, OPT_END, NULL, 0);
+    end_block(c, start);
+}
+
+// MARK: - Writer thread
+
+// Wait until the socket is writable, or the reader closed it. Returns -1 if
+// the capture was stopped and the reader did not read in time.
+static int wait_writable(struct capture *c) {
+    if (atomic_load(&c->stopping)) {
+        if (c->deadline == 0) {
+            c->deadline = uptime() + STOP_TIMEOUT;
+        } else if (uptime() >= c->deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    struct pollfd pfd = {.fd = c->fd, .events = POLLOUT};
+    poll(&pfd, 1, POLL_INTERVAL_MS);
+    return 0;
+}
+
+// Write len bytes to the socket. Returns -1 if writing failed.
+static int write_all(struct capture *c, const unsigned char *data, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = send(c->fd, data + written, len - written, SEND_FLAGS);
+        if (n >= 0) {
+            written += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (wait_writable(c) < 0) {
+                return -1;
+            }
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Write the output buffer to the socket. Returns -1 if writing failed.
+static int flush(struct capture *c) {
+    int ret = write_all(c, c->out, c->out_len);
+    c->out_len = 0;
+    return ret;
+}
+
+// Wait for frames for timeout milliseconds, and check if the reader closed
+// the socket. The reader is not expected to send anything, so readable means
+// closed.
+static bool reader_closed(struct capture *c, int timeout) {
+    struct pollfd pfd = {.fd = c->fd, .events = POLLIN};
+    if (poll(&pfd, 1, timeout) <= 0) {
+        return false;
+    }
+    if (pfd.revents & (POLLHUP | POLLERR)) {
+        return true;
+    }
+    char buf[64];
+    return recv(c->fd, buf, sizeof(buf), 0) == 0;
+}
+
+// Stop writing after an error, and notify the owner.
+static void fail(struct capture *c) {
+    c->failed = true;
+    c->out_len = 0;
+    if (c->done) {
+        c->done(c->arg);
+    }
+}
+
+// Write the records published by the relay thread. Records are contiguous
+// in the buffer until a record continuing after the end of the ring, so they
+// are written in one call up to that record, or up to WRITE_SIZE bytes.
+// Returns the number of bytes drained from the ring.
+static uint64_t drain(struct capture *c) {
+    uint64_t head = atomic_load_explicit(&c->head, memory_order_acquire);
+    uint64_t start = atomic_load_explicit(&c->tail, memory_order_relaxed);
+    uint64_t tail = start;
+
+    while (tail != head) {
+        uint64_t offset = tail & (c->size - 1);
+        uint64_t end = offset;
+        uint64_t next = tail;
+        while (next != head && end - offset < WRITE_SIZE) {
+            const struct record *r = (const void *)(c->ring + end);
+            next += r->block_len;
+            end += r->block_len;
+            if (end >= c->size) {
+                break;
+            }
+        }
+        if (write_all(c, c->ring + offset, end - offset) < 0) {
+            fail(c);
+            return tail - start;
+        }
+        tail = next;
+        atomic_store_explicit(&c->tail, tail, memory_order_release);
+    }
+    return tail - start;
+}
+
+// Discard records after writing failed, so the relay thread does not count
+// drops until the capture is stopped.
+static void discard(struct capture *c) {
+    uint64_t head = atomic_load_explicit(&c->head, memory_order_acquire);
+    atomic_store_explicit(&c->tail, head, memory_order_release);
+}
+
+static void free_capture(struct capture *c) {
+    free(c->ring);
+    free(c->out);
+    free(c->name);
+    free(c->filter_expr);
+    free(c);
+}
+
+static void *writer_thread(void *arg) {
+    struct capture *c = arg;
+
+    if (flush(c) < 0) {
+        fail(c);
+    }
+
+    while (true) {
+        // Frames published before stopping are written before exiting.
+        bool stopping = atomic_load(&c->stopping);
+        if (c->failed) {
+            discard(c);
+            if (stopping) {
+                break;
+            }
+            struct timespec interval = {0, POLL_INTERVAL_MS * 1000000L};
+            nanosleep(&interval, NULL);
+            continue;
+        }
+
+        uint64_t drained = drain(c);
+        if (stopping) {
+            break;
+        }
+        // Write full buffers while the relay is busy, and batch frames
+        // otherwise.
+        if (!c->failed && drained < WRITE_SIZE) {
+            int timeout = drained ? BATCH_INTERVAL_MS : POLL_INTERVAL_MS;
+            if (reader_closed(c, timeout)) {
+                fail(c);
+            }
+        }
+    }
+
+    if (!c->failed) {
+        put_stats(c);
+        flush(c);
+    }
+    close(c->fd);
+    free_capture(c);
+    return NULL;
+}
+
+// MARK: - Public interface
+
+struct capture *capture_start(
+    struct relay *relay,
+    struct relay_switch *sw,
+    int fd,
+    const struct capture_options *options
+) {
+    if (options->snaplen > CAPTURE_MAX_SNAPLEN) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct capture *c = aligned_alloc(
+        CACHE_LINE_SIZE,
+        (sizeof(*c) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1)
+    );
+    if (c == NULL) {
+        return NULL;
+    }
+    memset(c, 0, sizeof(*c));
+
+    int err;
+
+    c->fd = fd;
+    c->size = CAPTURE_RING_SIZE;
+    c->snaplen = options->snaplen ? options->snaplen : CAPTURE_DEFAULT_SNAPLEN;
+    c->done = options->done;
+    c->arg = options->arg;
+    c->relay = relay;
+
+    const char *filter = options->filter ? options->filter : "";
+    if (filter_compile(&c->filter, filter) < 0) {
+        goto failure;
+    }
+    if (filter[0]) {
+        c->filter_expr = strdup(filter);
+        if (c->filter_expr == NULL) {
+            goto failure;
+        }
+    }
+
+    c->name = strdup(options->name);
+    c->ring = malloc(c->size + record_size(c->snaplen));
+    c->out = malloc(OUT_BUFFER_SIZE);
+    if (c->name == NULL || c->ring == NULL || c->out == NULL) {
+        goto failure;
+    }
+
+    // The writer must not block when the capture is stopped, and the reader
+    // may close the socket.
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        goto failure;
+    }
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) < 0) {
+        goto failure;
+    }
+#endif
+
+    put_headers(c);
+
+    c->tap = relay_add_tap(relay, sw, capture_frames, c);
+    if (c->tap == NULL) {
+        goto failure;
+    }
+
+    pthread_t thread;
+    err = pthread_create(&thread, NULL, writer_thread, c);
+    if (err) {
+        relay_remove_tap(relay, c->tap);
+        errno = err;
+        goto failure;
+    }
+    pthread_detach(thread);
+
+    return c;
+
+failure:
+    err = errno;
+    free_capture(c);
+    errno = err;
+    return NULL;
+}
+
+void capture_stop(struct capture *c) {
+    // After removing the tap the relay thread does not access the capture,
+    // and the writer thread owns it.
+    relay_remove_tap(c->relay, c->tap);
+    atomic_store(&c->stopping, true);
+}
+
+void capture_get_stats(struct capture *c, struct capture_stats *stats) {
+    *stats = (struct capture_stats){
+        .received = atomic_load_explicit(&c->received, memory_order_relaxed),
+        .captured = atomic_load_explicit(&c->captured, memory_order_relaxed),
+        .drops = atomic_load_explicit(&c->drops, memory_order_relaxed),
+    };
+}
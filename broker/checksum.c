@@ -0,0 +1,185 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <string.h>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "broker-checksum.h"
+
+// Maximum number of steps adding to 32 bits lanes before widening them to 64
+// bits. Every step adds at most 2 words of 0xffff to a lane, so 4096 steps
+// cannot overflow.
+#define MAX_STEPS 4096
+
+// Add a 64 bits sum to a partial sum, keeping the carries. Since 2^32 and 2^16
+// are 1 modulo 0xffff, folding does not change the ones' complement sum.
+static uint32_t add_carries(uint64_t wide, uint32_t sum) {
+    wide += sum;
+    wide = (wide & 0xffffffff) + (wide >> 32);
+    wide = (wide & 0xffffffff) + (wide >> 32);
+    return (uint32_t)wide;
+}
+
+uint32_t inet_sum_scalar(const void *data, size_t len, uint32_t sum) {
+    const unsigned char *p = data;
+    uint64_t wide = 0;
+
+    while (len >= 4) {
+        uint32_t word;
+        memcpy(&word, p, sizeof(word));
+        wide += word;
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t word;
+        memcpy(&word, p, sizeof(word));
+        wide += word;
+        p += 2;
+        len -= 2;
+    }
+    // The last byte is padded with a zero byte.
+    if (len) {
+        uint16_t word = 0;
+        memcpy(&word, p, 1);
+        wide += word;
+    }
+
+    return add_carries(wide, sum);
+}
+
+#if defined(__aarch64__)
+
+// Add len bytes, a multiple of 32.
+static uint64_t sum_simd(const unsigned char *p, size_t len) {
+    uint64x2_t wide = vdupq_n_u64(0);
+
+    while (len > 0) {
+        size_t steps = len / 32 < MAX_STEPS ? len / 32 : MAX_STEPS;
+        uint32x4_t a = vdupq_n_u32(0);
+        uint32x4_t b = vdupq_n_u32(0);
+        for (size_t i = 0; i < steps; i++) {
+            a = vpadalq_u16(a, vreinterpretq_u16_u8(vld1q_u8(p)));
+            b = vpadalq_u16(b, vreinterpretq_u16_u8(vld1q_u8(p + 16)));
+            p += 32;
+        }
+        wide = vpadalq_u32(wide, a);
+        wide = vpadalq_u32(wide, b);
+        len -= steps * 32;
+    }
+
+    return vgetq_lane_u64(wide, 0) + vgetq_lane_u64(wide, 1);
+}
+
+uint32_t inet_sum(const void *data, size_t len, uint32_t sum) {
+    size_t bulk = len & ~(size_t)31;
+    sum = add_carries(sum_simd(data, bulk), sum);
+    return inet_sum_scalar((const unsigned char *)data + bulk, len - bulk, sum);
+}
+
+#elif defined(__x86_64__)
+
+// Widen the 32 bits lanes of v to 64 bits, and add them to wide.
+static __m128i widen_sse2(__m128i wide, __m128i v) {
+    __m128i zero = _mm_setzero_si128();
+    wide = _mm_add_epi64(wide, _mm_unpacklo_epi32(v, zero));
+    return _mm_add_epi64(wide, _mm_unpackhi_epi32(v, zero));
+}
+
+// Add len bytes, a multiple of 32.
+static uint64_t sum_sse2(const unsigned char *p, size_t len) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i wide = zero;
+
+    while (len > 0) {
+        size_t steps = len / 32 < MAX_STEPS ? len / 32 : MAX_STEPS;
+        __m128i a = zero;
+        __m128i b = zero;
+        for (size_t i = 0; i < steps; i++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)p);
+            __m128i w = _mm_loadu_si128((const __m128i *)(p + 16));
+            a = _mm_add_epi32(a, _mm_unpacklo_epi16(v, zero));
+            b = _mm_add_epi32(b, _mm_unpackhi_epi16(v, zero));
+            a = _mm_add_epi32(a, _mm_unpacklo_epi16(w, zero));
+            b = _mm_add_epi32(b, _mm_unpackhi_epi16(w, zero));
+            p += 32;
+        }
+        wide = widen_sse2(wide, a);
+        wide = widen_sse2(wide, b);
+        len -= steps * 32;
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, wide);
+    return lanes[0] + lanes[1];
+}
+
+__attribute__((target("avx2"))) static __m256i
+widen_avx2(__m256i wide, __m256i v) {
+    __m256i zero = _mm256_setzero_si256();
+    wide = _mm256_add_epi64(wide, _mm256_unpacklo_epi32(v, zero));
+    return _mm256_add_epi64(wide, _mm256_unpackhi_epi32(v, zero));
+}
+
+// Add len bytes, a multiple of 64.
+__attribute__((target("avx2"))) static uint64_t
+sum_avx2(const unsigned char *p, size_t len) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i wide = zero;
+
+    while (len > 0) {
+        size_t steps = len / 64 < MAX_STEPS ? len / 64 : MAX_STEPS;
+        __m256i a = zero;
+        __m256i b = zero;
+        for (size_t i = 0; i < steps; i++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)p);
+            __m256i w = _mm256_loadu_si256((const __m256i *)(p + 32));
+            a = _mm256_add_epi32(a, _mm256_unpacklo_epi16(v, zero));
+            b = _mm256_add_epi32(b, _mm256_unpackhi_epi16(v, zero));
+            a = _mm256_add_epi32(a, _mm256_unpacklo_epi16(w, zero));
+            b = _mm256_add_epi32(b, _mm256_unpackhi_epi16(w, zero));
+            p += 64;
+        }
+        wide = widen_avx2(wide, a);
+        wide = widen_avx2(wide, b);
+        len -= steps * 64;
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, wide);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+uint32_t inet_sum(const void *data, size_t len, uint32_t sum) {
+    const unsigned char *p = data;
+
+    // The AVX2 version is compiled for every x86_64 CPU, and used only if the
+    // CPU supports it.
+    if (len >= 64 && __builtin_cpu_supports("avx2")) {
+        size_t bulk = len & ~(size_t)63;
+        sum = add_carries(sum_avx2(p, bulk), sum);
+        p += bulk;
+        len -= bulk;
+    }
+    if (len >= 32) {
+        size_t bulk = len & ~(size_t)31;
+        sum = add_carries(sum_sse2(p, bulk), sum);
+        p += bulk;
+        len -= bulk;
+    }
+
+    return inet_sum_scalar(p, len, sum);
+}
+
+#else
+
+uint32_t inet_sum(const void *data, size_t len, uint32_t sum) {
+    return inet_sum_scalar(data, len, sum);
+}
+
+#endif
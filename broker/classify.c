@@ -0,0 +1,239 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+#include "broker-classify.h"
+
+#define ETHER_HEADER_SIZE 14
+#define VLAN_TAG_SIZE 4
+#define ARP_SIZE 28
+#define IPV4_HEADER_SIZE 20
+#define IPV6_HEADER_SIZE 40
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_ARP 0x0806
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88a8
+#define ETHERTYPE_IPV6 0x86dd
+
+#define IPV6_FRAGMENT 44
+
+// Frames may have an outer and an inner VLAN tag.
+#define MAX_VLAN_TAGS 2
+
+static const unsigned char broadcast[6] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+static uint16_t get16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static bool is_vlan(uint16_t type) {
+    return type == ETHERTYPE_VLAN || type == ETHERTYPE_QINQ;
+}
+
+// Read the ethernet header and VLAN tags of frame i.
+static void read_ethernet(
+    const struct relay_frame *frame, struct frame_class *c, int i
+) {
+    const unsigned char *p = frame->data;
+    size_t len = frame->len;
+    uint8_t flags = 0;
+    uint16_t type = 0;
+    uint16_t vlan = 0;
+    uint16_t l3 = 0;
+
+    if (len < ETHER_HEADER_SIZE) {
+        flags = FRAME_INVALID;
+        goto out;
+    }
+
+    if (p[0] & 1) {
+        flags |= FRAME_MULTICAST;
+        if (memcmp(p, broadcast, sizeof(broadcast)) == 0) {
+            flags |= FRAME_BROADCAST;
+        }
+    }
+
+    l3 = ETHER_HEADER_SIZE;
+    type = get16(p + 12);
+    for (int tags = 0; tags < MAX_VLAN_TAGS && is_vlan(type); tags++) {
+        if (len < (size_t)l3 + VLAN_TAG_SIZE) {
+            flags |= FRAME_INVALID;
+            type = 0;
+            break;
+        }
+        if (tags == 0) {
+            vlan = get16(p + l3) & 0xfff;
+        }
+        flags |= FRAME_VLAN;
+        type = get16(p + l3 + 2);
+        l3 += VLAN_TAG_SIZE;
+    }
+
+out:
+    c->flags[i] = flags;
+    c->proto[i] = 0;
+    c->ethertype[i] = type;
+    c->vlan[i] = vlan;
+    c->l3[i] = l3;
+    c->l4[i] = 0;
+}
+
+static uint8_t ethertype_flags(uint16_t type) {
+    switch (type) {
+    case ETHERTYPE_IPV4:
+        return FRAME_IPV4;
+    case ETHERTYPE_IPV6:
+        return FRAME_IPV6;
+    case ETHERTYPE_ARP:
+        return FRAME_ARP;
+    default:
+        return 0;
+    }
+}
+
+// Add the ethertype flags of frames [start, count).
+static void
+match_ethertypes_scalar(struct frame_class *c, int start, int count) {
+    for (int i = start; i < count; i++) {
+        c->flags[i] |= ethertype_flags(c->ethertype[i]);
+    }
+}
+
+#if defined(__aarch64__)
+
+static uint16x8_t match8(uint16x8_t types) {
+    uint16x8_t ipv4 = vceqq_u16(types, vdupq_n_u16(ETHERTYPE_IPV4));
+    uint16x8_t ipv6 = vceqq_u16(types, vdupq_n_u16(ETHERTYPE_IPV6));
+    uint16x8_t arp = vceqq_u16(types, vdupq_n_u16(ETHERTYPE_ARP));
+    uint16x8_t flags = vandq_u16(ipv4, vdupq_n_u16(FRAME_IPV4));
+    flags = vorrq_u16(flags, vandq_u16(ipv6, vdupq_n_u16(FRAME_IPV6)));
+    return vorrq_u16(flags, vandq_u16(arp, vdupq_n_u16(FRAME_ARP)));
+}
+
+static void match_ethertypes(struct frame_class *c, int count) {
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint16x8_t lo = match8(vld1q_u16(&c->ethertype[i]));
+        uint16x8_t hi = match8(vld1q_u16(&c->ethertype[i + 8]));
+        uint8x16_t flags = vcombine_u8(vmovn_u16(lo), vmovn_u16(hi));
+        vst1q_u8(&c->flags[i], vorrq_u8(vld1q_u8(&c->flags[i]), flags));
+    }
+    match_ethertypes_scalar(c, i, count);
+}
+
+#elif defined(__x86_64__)
+
+static __m128i match8(__m128i types) {
+    __m128i ipv4 = _mm_cmpeq_epi16(types, _mm_set1_epi16(ETHERTYPE_IPV4));
+    __m128i ipv6 = _mm_cmpeq_epi16(
+        types, _mm_set1_epi16((short)ETHERTYPE_IPV6)
+    );
+    __m128i arp = _mm_cmpeq_epi16(types, _mm_set1_epi16(ETHERTYPE_ARP));
+    __m128i flags = _mm_and_si128(ipv4, _mm_set1_epi16(FRAME_IPV4));
+    __m128i v6 = _mm_and_si128(ipv6, _mm_set1_epi16(FRAME_IPV6));
+    flags = _mm_or_si128(flags, v6);
+    return _mm_or_si128(flags, _mm_and_si128(arp, _mm_set1_epi16(FRAME_ARP)));
+}
+
+static void match_ethertypes(struct frame_class *c, int count) {
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i lo = match8(_mm_loadu_si128((__m128i *)&c->ethertype[i]));
+        __m128i hi = match8(_mm_loadu_si128((__m128i *)&c->ethertype[i + 8]));
+        __m128i flags = _mm_packus_epi16(lo, hi);
+        __m128i old = _mm_loadu_si128((__m128i *)&c->flags[i]);
+        _mm_storeu_si128((__m128i *)&c->flags[i], _mm_or_si128(old, flags));
+    }
+    match_ethertypes_scalar(c, i, count);
+}
+
+#else
+
+static void match_ethertypes(struct frame_class *c, int count) {
+    match_ethertypes_scalar(c, 0, count);
+}
+
+#endif
+
+// Parse the network header of frame i, after matching the ethertype.
+static void
+parse_network(const struct relay_frame *frame, struct frame_class *c, int i) {
+    const unsigned char *p = frame->data;
+    size_t len = frame->len;
+    uint16_t l3 = c->l3[i];
+
+    if (c->flags[i] & FRAME_IPV4) {
+        const unsigned char *ip = p + l3;
+        if (len < (size_t)l3 + IPV4_HEADER_SIZE) {
+            c->flags[i] |= FRAME_INVALID;
+            return;
+        }
+        size_t header_size = (ip[0] & 0xf) * 4;
+        if (ip[0] >> 4 != 4 || header_size < IPV4_HEADER_SIZE ||
+            len < l3 + header_size) {
+            c->flags[i] |= FRAME_INVALID;
+            return;
+        }
+        c->proto[i] = ip[9];
+        // More fragments, or a fragment offset.
+        uint16_t fragment = get16(ip + 6) & 0x3fff;
+        if (fragment) {
+            c->flags[i] |= FRAME_FRAGMENT;
+        }
+        // Only the first fragment has the transport header.
+        if ((fragment & 0x1fff) == 0) {
+            c->l4[i] = l3 + header_size;
+        }
+    } else if (c->flags[i] & FRAME_IPV6) {
+        const unsigned char *ip = p + l3;
+        if (len < (size_t)l3 + IPV6_HEADER_SIZE || ip[0] >> 4 != 6) {
+            c->flags[i] |= FRAME_INVALID;
+            return;
+        }
+        // Extension headers other than the fragment header are not parsed.
+        c->proto[i] = ip[6];
+        if (ip[6] == IPV6_FRAGMENT) {
+            c->flags[i] |= FRAME_FRAGMENT;
+        }
+        c->l4[i] = l3 + IPV6_HEADER_SIZE;
+    } else if (c->flags[i] & FRAME_ARP) {
+        if (len < (size_t)l3 + ARP_SIZE) {
+            c->flags[i] |= FRAME_INVALID;
+        }
+    }
+}
+
+void classify_frames(
+    const struct relay_frame *frames, int count, struct frame_class *c
+) {
+    for (int i = 0; i < count; i++) {
+        read_ethernet(&frames[i], c, i);
+    }
+    match_ethertypes(c, count);
+    for (int i = 0; i < count; i++) {
+        if (c->flags[i] & (FRAME_IPV4 | FRAME_IPV6 | FRAME_ARP)) {
+            parse_network(&frames[i], c, i);
+        }
+    }
+}
+
+void classify_frames_scalar(
+    const struct relay_frame *frames, int count, struct frame_class *c
+) {
+    for (int i = 0; i < count; i++) {
+        read_ethernet(&frames[i], c, i);
+        c->flags[i] |= ethertype_flags(c->ethertype[i]);
+        parse_network(&frames[i], c, i);
+    }
+}
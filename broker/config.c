@@ -23,6 +23,14 @@ struct network_config {
     const char *subnet;
     const char *mask;
 
+    // Traffic shaping of frames sent to every port of the switch: rate in
+    // bits per second (0 disables shaping), burst and deficit round robin
+    // quantum in bytes, and queue length in frames. See relay_set_shaping().
+    uint64_t port_rate;
+    uint32_t port_burst;
+    uint32_t port_quantum;
+    int port_queue_len;
+
     // TODO: Add rest of options:
     // - External interface: default interface per the routing table
     // - NAT44: enabled
@@ -146,6 +154,45 @@ error:
     return NULL;
 }
 
+static const char *mode_name(vmnet_mode_t mode) {
+    switch (mode) {
+    case VMNET_SHARED_MODE:
+        return "shared";
+    case VMNET_HOST_MODE:
+        return "host";
+    default:
+        return "unknown";
+    }
+}
+
+bool network_config_shaping(const char *name, struct relay_shaping *shaping) {
+    for (size_t i = 0; i < ARRAY_SIZE(builtin_networks); i++) {
+        const struct network_config *config = &builtin_networks[i];
+        if (strcmp(config->name, name) == 0) {
+            if (config->port_rate == 0) {
+                return false;
+            }
+            *shaping = (struct relay_shaping){
+                .rate = config->port_rate / 8,
+                .burst = config->port_burst,
+                .quantum = config->port_quantum,
+                .queue_len = config->port_queue_len,
+            };
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *network_config_mode(const char *name) {
+    for (size_t i = 0; i < ARRAY_SIZE(builtin_networks); i++) {
+        if (strcmp(builtin_networks[i].name, name) == 0) {
+            return mode_name(builtin_networks[i].mode);
+        }
+    }
+    return NULL;
+}
+
 vmnet_network_configuration_ref create_network_configuration(
     const struct broker_context *ctx, const char *name, int *error
 ) {
@@ -156,3 +203,21 @@ vmnet_network_configuration_ref create_network_configuration(
 
     return create_vmnet_configuration(ctx, config, error);
 }
+
+vmnet_network_configuration_ref create_network_configuration_with_subnet(
+    const struct broker_context *ctx,
+    const char *name,
+    const struct subnet *subnet,
+    int *error
+) {
+    const struct network_config *config = find_network_config(ctx, name, error);
+    if (config == NULL || config->subnet || config->mask) {
+        return NULL;
+    }
+
+    struct network_config sticky = *config;
+    sticky.subnet = subnet->subnet;
+    sticky.mask = subnet->mask;
+
+    return create_vmnet_configuration(ctx, &sticky, error);
+}
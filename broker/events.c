@@ -0,0 +1,236 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <assert.h>
+#include <dispatch/dispatch.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "broker-events.h"
+#include "broker-network.h"
+#include "log.h"
+#include "vmnet-broker.h"
+
+// Maximum number of events sent to a subscriber and not flushed yet. When a
+// subscriber falls behind, events are not queued; the broker records the
+// networks that changed and sends a single catch up event with the current
+// state of these networks when the subscriber is up to date.
+#define MAX_PENDING_EVENTS 64
+
+struct subscriber {
+    // The subscribed peer, or NULL after the peer disconnected.
+    struct broker_context *ctx;
+    xpc_connection_t connection;
+    // Number of messages sent and not flushed yet.
+    int pending;
+    // Number of references: the subscribers list and pending barriers.
+    int refs;
+    // Names of networks changed while the subscriber was behind, or NULL if the
+    // subscriber is up to date.
+    CFMutableSetRef missed;
+    // Number of events not sent while the subscriber was behind.
+    int dropped;
+    struct subscriber *next;
+};
+
+// Subscribers are accessed only on the main queue.
+static struct subscriber *subscribers;
+
+// Number of subscribers, read on the shard queues to skip creating events when
+// no peer is subscribed.
+static _Atomic int subscriber_count;
+
+static void unref_subscriber(struct subscriber *sub) {
+    if (--sub->refs > 0) {
+        return;
+    }
+    if (sub->missed) {
+        CFRelease(sub->missed);
+    }
+    xpc_release(sub->connection);
+    free(sub);
+}
+
+static void send_catch_up(struct subscriber *sub);
+
+static void flushed(struct subscriber *sub) {
+    sub->pending--;
+    if (sub->ctx && sub->missed && sub->pending == 0) {
+        send_catch_up(sub);
+    }
+    unref_subscriber(sub);
+}
+
+static void send_event(struct subscriber *sub, xpc_object_t message) {
+    xpc_connection_send_message(sub->connection, message);
+    sub->pending++;
+
+    // The barrier runs on the main queue when the message was sent.
+    sub->refs++;
+    xpc_connection_send_barrier(sub->connection, ^{
+        flushed(sub);
+    });
+}
+
+static void add_network_state(const void *value, void *context) {
+    CFStringRef name = value;
+    xpc_object_t networks = context;
+
+    char buf[256];
+    if (!CFStringGetCString(name, buf, sizeof(buf), kCFStringEncodingUTF8)) {
+        return;
+    }
+
+    xpc_object_t network = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(network, NETWORK_NAME, buf);
+    // Removed networks have no peers.
+    int peers = network_peers(buf);
+    xpc_dictionary_set_int64(network, NETWORK_PEERS, peers < 0 ? 0 : peers);
+    xpc_dictionary_set_bool(network, NETWORK_EXISTS, peers >= 0);
+    xpc_array_append_value(networks, network);
+    xpc_release(network);
+}
+
+static void send_catch_up(struct subscriber *sub) {
+    DEBUGF(
+        "[%s] send catch up event (dropped %d networks %ld)",
+        sub->ctx->name,
+        sub->dropped,
+        (long)CFSetGetCount(sub->missed)
+    );
+
+    xpc_object_t networks = xpc_array_create_empty();
+    CFSetApplyFunction(sub->missed, add_network_state, networks);
+
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, EVENT_TYPE, EVENT_CATCH_UP);
+    xpc_dictionary_set_int64(message, EVENT_DROPPED, sub->dropped);
+    xpc_dictionary_set_value(message, EVENT_NETWORKS, networks);
+    xpc_release(networks);
+
+    CFRelease(sub->missed);
+    sub->missed = NULL;
+    sub->dropped = 0;
+
+    send_event(sub, message);
+    xpc_release(message);
+}
+
+static void record_missed(struct subscriber *sub, const char *network_name) {
+    if (sub->missed == NULL) {
+        DEBUGF("[%s] subscriber is behind - coalescing events", sub->ctx->name);
+        sub->missed = CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
+        assert(sub->missed != NULL && "failed to create missed networks");
+    }
+
+    CFStringRef name = CFStringCreateWithCString(
+        NULL, network_name, kCFStringEncodingUTF8
+    );
+    CFSetAddValue(sub->missed, name);
+    CFRelease(name);
+
+    sub->dropped++;
+}
+
+// Events are created on the shard queue of the network and sent on the main
+// queue, so events for a network are sent in order.
+static void publish(xpc_object_t message) {
+    xpc_retain(message);
+    dispatch_async(dispatch_get_main_queue(), ^{
+        const char *network_name = xpc_dictionary_get_string(
+            message, NETWORK_NAME
+        );
+        for (struct subscriber *sub = subscribers; sub; sub = sub->next) {
+            if (sub->missed || sub->pending >= MAX_PENDING_EVENTS) {
+                record_missed(sub, network_name);
+            } else {
+                send_event(sub, message);
+            }
+        }
+        xpc_release(message);
+    });
+}
+
+static bool has_subscribers(void) {
+    return atomic_load_explicit(&subscriber_count, memory_order_relaxed) > 0;
+}
+
+void subscribe_peer(struct broker_context *ctx) {
+    if (ctx->subscriber) {
+        DEBUGF("[%s] already subscribed", ctx->name);
+        return;
+    }
+
+    struct subscriber *sub = calloc(1, sizeof(*sub));
+    assert(sub != NULL && "failed to allocate subscriber");
+
+    sub->ctx = ctx;
+    sub->connection = xpc_retain(ctx->connection);
+    sub->refs = 1;
+    sub->next = subscribers;
+    subscribers = sub;
+    atomic_fetch_add_explicit(&subscriber_count, 1, memory_order_relaxed);
+
+    ctx->subscriber = sub;
+
+    INFOF("[%s] subscribed to events", ctx->name);
+}
+
+void unsubscribe_peer(struct broker_context *ctx) {
+    struct subscriber *sub = ctx->subscriber;
+    if (sub == NULL) {
+        return;
+    }
+
+    for (struct subscriber **p = &subscribers; *p; p = &(*p)->next) {
+        if (*p == sub) {
+            *p = sub->next;
+            break;
+        }
+    }
+    atomic_fetch_sub_explicit(&subscriber_count, 1, memory_order_relaxed);
+
+    sub->ctx = NULL;
+    ctx->subscriber = NULL;
+    unref_subscriber(sub);
+
+    DEBUGF("[%s] unsubscribed from events", ctx->name);
+}
+
+void publish_network_created(
+    const char *network_name, const struct network_info *info
+) {
+    if (!has_subscribers()) {
+        return;
+    }
+
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, EVENT_TYPE, EVENT_CREATED);
+    xpc_dictionary_set_string(message, NETWORK_NAME, network_name);
+    xpc_dictionary_set_int64(message, NETWORK_PEERS, 0);
+    xpc_dictionary_set_string(message, NETWORK_SUBNET, info->subnet);
+    xpc_dictionary_set_string(message, NETWORK_MASK, info->mask);
+    xpc_dictionary_set_string(message, NETWORK_IPV6_PREFIX, info->ipv6_prefix);
+    xpc_dictionary_set_int64(message, NETWORK_PREFIX_LEN, info->prefix_len);
+
+    publish(message);
+    xpc_release(message);
+}
+
+void publish_network_event(
+    const char *event, const char *network_name, int peers
+) {
+    if (!has_subscribers()) {
+        return;
+    }
+
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, EVENT_TYPE, event);
+    xpc_dictionary_set_string(message, NETWORK_NAME, network_name);
+    xpc_dictionary_set_int64(message, NETWORK_PEERS, peers);
+
+    publish(message);
+    xpc_release(message);
+}
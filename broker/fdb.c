@@ -0,0 +1,137 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "broker-fdb.h"
+
+// Maximum load factor, as a fraction of 4, keeping probe sequences short.
+#define MAX_LOAD 3
+
+static uint32_t home(const struct fdb *fdb, uint64_t mac) {
+    return (uint32_t)((mac * 0x9e3779b97f4a7c15ULL) >> 32) & fdb->mask;
+}
+
+static bool
+aged(const struct fdb *fdb, const struct fdb_entry *e, uint32_t now) {
+    return now - e->seen >= fdb->age;
+}
+
+static bool full(const struct fdb *fdb) {
+    return fdb->count >= (fdb->mask + 1) / 4 * MAX_LOAD;
+}
+
+int fdb_init(struct fdb *fdb, uint32_t capacity, uint32_t age) {
+    // Keep the load factor for capacity addresses.
+    uint32_t size = 4;
+    while (size / 4 * MAX_LOAD < capacity) {
+        size *= 2;
+    }
+
+    *fdb = (struct fdb){.mask = size - 1, .age = age};
+    fdb->entries = calloc(size, sizeof(*fdb->entries));
+    if (fdb->entries == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+void fdb_destroy(struct fdb *fdb) {
+    free(fdb->entries);
+    fdb->entries = NULL;
+}
+
+// Remove entry i, moving back following entries of the probe sequence, so
+// lookups do not need tombstones.
+static void remove_at(struct fdb *fdb, uint32_t i) {
+    uint32_t j = i;
+    for (;;) {
+        j = (j + 1) & fdb->mask;
+        if (fdb->entries[j].mac == 0) {
+            break;
+        }
+        // The entry can move to i if its home is not in (i, j] cyclically.
+        uint32_t k = home(fdb, fdb->entries[j].mac);
+        bool stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+        if (!stays) {
+            fdb->entries[i] = fdb->entries[j];
+            i = j;
+        }
+    }
+    fdb->entries[i].mac = 0;
+    fdb->count--;
+}
+
+static void remove_aged(struct fdb *fdb, uint32_t now) {
+    for (uint32_t i = 0; i <= fdb->mask; i++) {
+        while (fdb->entries[i].mac && aged(fdb, &fdb->entries[i], now)) {
+            remove_at(fdb, i);
+        }
+    }
+}
+
+void fdb_learn(struct fdb *fdb, uint64_t mac, uint16_t port, uint32_t now) {
+    struct fdb_entry *reuse = NULL;
+    uint32_t i = home(fdb, mac);
+
+    for (;;) {
+        struct fdb_entry *e = &fdb->entries[i];
+        if (e->mac == mac) {
+            if (e->port != port) {
+                e->port = port;
+                fdb->moved++;
+            }
+            e->seen = now;
+            return;
+        }
+        if (e->mac == 0) {
+            break;
+        }
+        if (reuse == NULL && aged(fdb, e, now)) {
+            reuse = e;
+        }
+        i = (i + 1) & fdb->mask;
+    }
+
+    if (reuse == NULL) {
+        if (full(fdb)) {
+            remove_aged(fdb, now);
+            if (full(fdb)) {
+                return;
+            }
+            // Removing entries moves the free entries.
+            i = home(fdb, mac);
+            while (fdb->entries[i].mac) {
+                i = (i + 1) & fdb->mask;
+            }
+        }
+        reuse = &fdb->entries[i];
+        fdb->count++;
+    }
+
+    *reuse = (struct fdb_entry){.mac = mac, .seen = now, .port = port};
+    fdb->learned++;
+}
+
+int fdb_lookup(struct fdb *fdb, uint64_t mac, uint32_t now) {
+    uint32_t i = home(fdb, mac);
+    for (;;) {
+        const struct fdb_entry *e = &fdb->entries[i];
+        if (e->mac == mac) {
+            return aged(fdb, e, now) ? -1 : e->port;
+        }
+        if (e->mac == 0) {
+            return -1;
+        }
+        i = (i + 1) & fdb->mask;
+    }
+}
+
+void fdb_flush_port(struct fdb *fdb, uint16_t port) {
+    for (uint32_t i = 0; i <= fdb->mask; i++) {
+        while (fdb->entries[i].mac && fdb->entries[i].port == port) {
+            remove_at(fdb, i);
+        }
+    }
+}
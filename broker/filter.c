@@ -0,0 +1,483 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "broker-filter.h"
+
+#define ETHER_HEADER_SIZE 14
+#define ETHER_ADDR_SIZE 6
+
+#define PROTO_ICMP 1
+#define PROTO_TCP 6
+#define PROTO_UDP 17
+#define PROTO_ICMPV6 58
+
+// Filter operations.
+enum {
+    OP_AND,
+    OP_OR,
+    OP_NOT,
+    // Any of the frame flags.
+    OP_FLAGS,
+    // IP frames with the protocol.
+    OP_PROTO,
+    OP_VLAN,
+    OP_ETHER,
+    OP_HOST,
+    OP_PORT,
+};
+
+// Address and port directions.
+enum {
+    DIR_ANY,
+    DIR_SRC,
+    DIR_DST,
+};
+
+// Tokens are words such as keywords, addresses, and numbers, or operators.
+#define MAX_TOKENS 256
+#define TOKEN_SIZE 48
+
+struct parser {
+    char tokens[MAX_TOKENS][TOKEN_SIZE];
+    int count;
+    int pos;
+    struct filter *f;
+};
+
+// Keywords matching frame flags or IP protocols.
+static const struct {
+    const char *name;
+    uint8_t op;
+    uint8_t flags;
+    uint8_t proto;
+} keywords[] = {
+    {"arp", OP_FLAGS, FRAME_ARP, 0},
+    {"ip", OP_FLAGS, FRAME_IPV4, 0},
+    {"ip6", OP_FLAGS, FRAME_IPV6, 0},
+    {"broadcast", OP_FLAGS, FRAME_BROADCAST, 0},
+    {"multicast", OP_FLAGS, FRAME_MULTICAST, 0},
+    {"tcp", OP_PROTO, FRAME_IPV4 | FRAME_IPV6, PROTO_TCP},
+    {"udp", OP_PROTO, FRAME_IPV4 | FRAME_IPV6, PROTO_UDP},
+    {"icmp", OP_PROTO, FRAME_IPV4, PROTO_ICMP},
+    {"icmp6", OP_PROTO, FRAME_IPV6, PROTO_ICMPV6},
+};
+
+static uint16_t get16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+// MARK: - Parsing
+
+static bool is_word(char c) {
+    return isalnum((unsigned char)c) || c == '.' || c == ':' || c == '_' ||
+           c == '-';
+}
+
+// Split the expression to tokens. Returns -1 if the expression is too large
+// or has invalid characters.
+static int tokenize(struct parser *p, const char *expr) {
+    const char *s = expr;
+    while (*s) {
+        if (isspace((unsigned char)*s)) {
+            s++;
+            continue;
+        }
+        if (p->count == MAX_TOKENS) {
+            return -1;
+        }
+        char *token = p->tokens[p->count++];
+        size_t len;
+        if (*s == '(' || *s == ')' || *s == '!') {
+            len = 1;
+        } else if (strncmp(s, "&&", 2) == 0 || strncmp(s, "||", 2) == 0) {
+            len = 2;
+        } else {
+            len = 0;
+            while (is_word(s[len])) {
+                len++;
+            }
+            if (len == 0 || len >= TOKEN_SIZE) {
+                return -1;
+            }
+        }
+        memcpy(token, s, len);
+        token[len] = '\0';
+        s += len;
+    }
+    return 0;
+}
+
+static const char *peek(const struct parser *p, int ahead) {
+    int i = p->pos + ahead;
+    return i < p->count ? p->tokens[i] : "";
+}
+
+// Consume the next token if it is word.
+static bool match_token(struct parser *p, const char *word) {
+    if (p->pos < p->count && strcmp(p->tokens[p->pos], word) == 0) {
+        p->pos++;
+        return true;
+    }
+    return false;
+}
+
+static const char *next(struct parser *p) {
+    return p->pos < p->count ? p->tokens[p->pos++] : NULL;
+}
+
+static int add_node(struct parser *p, struct filter_node node) {
+    if (p->f->count == FILTER_MAX_NODES) {
+        return -1;
+    }
+    p->f->nodes[p->f->count] = node;
+    return p->f->count++;
+}
+
+static bool parse_number(const char *s, long max, long *value) {
+    if (!isdigit((unsigned char)*s)) {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    *value = strtol(s, &end, 10);
+    return errno == 0 && *end == '\0' && *value <= max;
+}
+
+static int parse_ether(struct parser *p) {
+    struct filter_node node = {.op = OP_ETHER, .len = ETHER_ADDR_SIZE};
+    if (match_token(p, "src")) {
+        node.dir = DIR_SRC;
+    } else if (match_token(p, "dst")) {
+        node.dir = DIR_DST;
+    } else if (!match_token(p, "host")) {
+        return -1;
+    }
+    if (node.dir != DIR_ANY) {
+        match_token(p, "host");
+    }
+
+    const char *s = next(p);
+    unsigned char *a = node.addr;
+    int len = 0;
+    if (s == NULL ||
+        sscanf(
+            s,
+            "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx%n",
+            &a[0],
+            &a[1],
+            &a[2],
+            &a[3],
+            &a[4],
+            &a[5],
+            &len
+        ) != 6 ||
+        s[len] != '\0') {
+        return -1;
+    }
+    return add_node(p, node);
+}
+
+static int parse_host(struct parser *p, int dir) {
+    struct filter_node node = {.op = OP_HOST, .dir = dir};
+    const char *s = next(p);
+    if (s == NULL) {
+        return -1;
+    }
+    if (inet_pton(AF_INET, s, node.addr) == 1) {
+        node.len = 4;
+    } else if (inet_pton(AF_INET6, s, node.addr) == 1) {
+        node.len = 16;
+    } else {
+        return -1;
+    }
+    return add_node(p, node);
+}
+
+static int parse_port(struct parser *p, int dir, uint8_t proto) {
+    long port;
+    const char *s = next(p);
+    if (s == NULL || !parse_number(s, UINT16_MAX, &port)) {
+        return -1;
+    }
+    struct filter_node node = {
+        .op = OP_PORT,
+        .dir = dir,
+        .proto = proto,
+        .port = (uint16_t)port,
+    };
+    return add_node(p, node);
+}
+
+// Parse a primitive qualified by src or dst: a host, a bare address, or a
+// port.
+static int parse_directed(struct parser *p, int dir, uint8_t proto) {
+    if (match_token(p, "port")) {
+        return parse_port(p, dir, proto);
+    }
+    if (proto) {
+        return -1;
+    }
+    match_token(p, "host");
+    return parse_host(p, dir);
+}
+
+static int parse_keyword(struct parser *p, const char *s) {
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+        if (strcmp(s, keywords[i].name) != 0) {
+            continue;
+        }
+        uint8_t proto = keywords[i].proto;
+        // A TCP or UDP port, such as "tcp port 80" or "udp dst port 53".
+        if (proto == PROTO_TCP || proto == PROTO_UDP) {
+            const char *t = peek(p, 0);
+            bool directed = strcmp(t, "src") == 0 || strcmp(t, "dst") == 0;
+            if (strcmp(t, "port") == 0 ||
+                (directed && strcmp(peek(p, 1), "port") == 0)) {
+                int dir = DIR_ANY;
+                if (match_token(p, "src")) {
+                    dir = DIR_SRC;
+                } else if (match_token(p, "dst")) {
+                    dir = DIR_DST;
+                }
+                return parse_directed(p, dir, proto);
+            }
+        }
+        struct filter_node node = {
+            .op = keywords[i].op,
+            .proto = proto,
+            .flags = keywords[i].flags,
+        };
+        return add_node(p, node);
+    }
+    return -1;
+}
+
+static int parse_vlan(struct parser *p) {
+    long vlan;
+    if (parse_number(peek(p, 0), 4095, &vlan)) {
+        p->pos++;
+        struct filter_node node = {.op = OP_VLAN, .vlan = (uint16_t)vlan};
+        return add_node(p, node);
+    }
+    struct filter_node node = {.op = OP_FLAGS, .flags = FRAME_VLAN};
+    return add_node(p, node);
+}
+
+static int parse_expr(struct parser *p, int depth);
+
+static int parse_unary(struct parser *p, int depth) {
+    if (depth > FILTER_MAX_NODES) {
+        return -1;
+    }
+    const char *s = next(p);
+    if (s == NULL) {
+        return -1;
+    }
+    if (strcmp(s, "not") == 0 || strcmp(s, "!") == 0) {
+        int operand = parse_unary(p, depth + 1);
+        if (operand < 0) {
+            return -1;
+        }
+        return add_node(p, (struct filter_node){.op = OP_NOT, .left = operand});
+    }
+    if (strcmp(s, "(") == 0) {
+        int n = parse_expr(p, depth + 1);
+        if (n < 0 || !match_token(p, ")")) {
+            return -1;
+        }
+        return n;
+    }
+    if (strcmp(s, "ether") == 0) {
+        return parse_ether(p);
+    }
+    if (strcmp(s, "host") == 0) {
+        return parse_host(p, DIR_ANY);
+    }
+    if (strcmp(s, "port") == 0) {
+        return parse_port(p, DIR_ANY, 0);
+    }
+    if (strcmp(s, "src") == 0) {
+        return parse_directed(p, DIR_SRC, 0);
+    }
+    if (strcmp(s, "dst") == 0) {
+        return parse_directed(p, DIR_DST, 0);
+    }
+    if (strcmp(s, "vlan") == 0) {
+        return parse_vlan(p);
+    }
+    return parse_keyword(p, s);
+}
+
+static int parse_expr(struct parser *p, int depth) {
+    int left = parse_unary(p, depth);
+    while (left >= 0) {
+        uint8_t op;
+        if (match_token(p, "and") || match_token(p, "&&")) {
+            op = OP_AND;
+        } else if (match_token(p, "or") || match_token(p, "||")) {
+            op = OP_OR;
+        } else {
+            break;
+        }
+        int right = parse_unary(p, depth);
+        if (right < 0) {
+            return -1;
+        }
+        struct filter_node node = {.op = op, .left = left, .right = right};
+        left = add_node(p, node);
+    }
+    return left;
+}
+
+int filter_compile(struct filter *f, const char *expr) {
+    f->count = 0;
+    f->root = -1;
+
+    if (strlen(expr) > FILTER_MAX_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct parser *p = calloc(1, sizeof(*p));
+    if (p == NULL) {
+        return -1;
+    }
+    p->f = f;
+
+    int root = -1;
+    if (tokenize(p, expr) == 0 && p->count > 0) {
+        root = parse_expr(p, 0);
+        if (p->pos != p->count) {
+            root = -1;
+        }
+    }
+    bool empty = p->count == 0;
+    free(p);
+
+    if (root < 0 && !empty) {
+        f->count = 0;
+        errno = EINVAL;
+        return -1;
+    }
+    f->root = root;
+    return 0;
+}
+
+// MARK: - Matching
+
+static bool match_addr(
+    const struct filter_node *node,
+    const unsigned char *src,
+    const unsigned char *dst
+) {
+    return (node->dir != DIR_DST && memcmp(src, node->addr, node->len) == 0) ||
+           (node->dir != DIR_SRC && memcmp(dst, node->addr, node->len) == 0);
+}
+
+static bool match_host(
+    const struct filter_node *node,
+    const unsigned char *p,
+    uint8_t flags,
+    uint16_t l3
+) {
+    if (flags & FRAME_INVALID) {
+        return false;
+    }
+    const unsigned char *h = p + l3;
+    if (node->len == 4) {
+        if (flags & FRAME_IPV4) {
+            return match_addr(node, h + 12, h + 16);
+        }
+        // ARP for IPv4 over ethernet: the sender and target protocol
+        // addresses.
+        if ((flags & FRAME_ARP) && h[4] == ETHER_ADDR_SIZE && h[5] == 4) {
+            return match_addr(node, h + 14, h + 24);
+        }
+        return false;
+    }
+    if (flags & FRAME_IPV6) {
+        return match_addr(node, h + 8, h + 24);
+    }
+    return false;
+}
+
+static bool match_port(
+    const struct filter_node *node,
+    const unsigned char *p,
+    size_t len,
+    const struct frame_class *c,
+    int i
+) {
+    uint8_t proto = c->proto[i];
+    uint16_t l4 = c->l4[i];
+    if ((c->flags[i] & FRAME_INVALID) || l4 == 0 ||
+        len < (size_t)l4 + 4) {
+        return false;
+    }
+    if (node->proto ? proto != node->proto
+                    : proto != PROTO_TCP && proto != PROTO_UDP) {
+        return false;
+    }
+    uint16_t src = get16(p + l4);
+    uint16_t dst = get16(p + l4 + 2);
+    return (node->dir != DIR_DST && src == node->port) ||
+           (node->dir != DIR_SRC && dst == node->port);
+}
+
+static bool match_node(
+    const struct filter *f,
+    int n,
+    const struct relay_frame *frame,
+    const struct frame_class *c,
+    int i
+) {
+    const struct filter_node *node = &f->nodes[n];
+    const unsigned char *p = frame->data;
+    uint8_t flags = c->flags[i];
+
+    switch (node->op) {
+    case OP_AND:
+        return match_node(f, node->left, frame, c, i) &&
+               match_node(f, node->right, frame, c, i);
+    case OP_OR:
+        return match_node(f, node->left, frame, c, i) ||
+               match_node(f, node->right, frame, c, i);
+    case OP_NOT:
+        return !match_node(f, node->left, frame, c, i);
+    case OP_FLAGS:
+        return (flags & node->flags) != 0;
+    case OP_PROTO:
+        return (flags & node->flags) && !(flags & FRAME_INVALID) &&
+               c->proto[i] == node->proto;
+    case OP_VLAN:
+        return (flags & FRAME_VLAN) && c->vlan[i] == node->vlan;
+    case OP_ETHER:
+        return frame->len >= ETHER_HEADER_SIZE &&
+               match_addr(node, p + ETHER_ADDR_SIZE, p);
+    case OP_HOST:
+        return match_host(node, p, flags, c->l3[i]);
+    case OP_PORT:
+        return match_port(node, p, frame->len, c, i);
+    default:
+        return false;
+    }
+}
+
+bool filter_match(
+    const struct filter *f,
+    const struct relay_frame *frame,
+    const struct frame_class *c,
+    int i
+) {
+    if (f->root < 0) {
+        return true;
+    }
+    return match_node(f, f->root, frame, c, i);
+}
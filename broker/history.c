@@ -0,0 +1,355 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broker-history.h"
+#include "broker-xpc.h"
+#include "common.h"
+#include "log.h"
+#include "vmnet-broker.h"
+
+extern const int history_half_life_sec;
+
+#define HISTORY_PATH "/var/db/vmnet-broker/history"
+#define HISTORY_TEMP_PATH HISTORY_PATH ".tmp"
+#define HISTORY_VERSION 1
+
+// Maximum number of networks in the history. When the history is full, the
+// least used network is replaced.
+#define HISTORY_SIZE 32
+
+// Networks with a lower score are not predicted. A network used once is
+// predicted for 2 half lives.
+#define MIN_PREDICT_SCORE 0.25
+
+// Usage of a network.
+struct usage {
+    char name[HISTORY_NAME_SIZE];
+    // Number of times the network was used after being unused.
+    uint64_t uses;
+    // Number of uses decayed by age, updated when the network is used.
+    double score;
+    // Time the score was updated.
+    time_t updated;
+    // Total time the network was used in seconds.
+    uint64_t used_sec;
+    // Time the network started being used, or 0 if the network is not used.
+    // Not saved.
+    time_t used_since;
+};
+
+// The history is updated on the shard queues, and saved and reported on the
+// main queue.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct usage history[HISTORY_SIZE];
+static int history_count;
+
+// Prediction totals since the history was created.
+static uint64_t predicted;
+static uint64_t prediction_hits;
+static uint64_t prediction_misses;
+
+// Return the score decayed to time now. The score halves every
+// history_half_life_sec seconds.
+static double current_score(const struct usage *u, time_t now) {
+    double age = difftime(now, u->updated);
+    if (age <= 0) {
+        return u->score;
+    }
+    return u->score * exp2(-age / history_half_life_sec);
+}
+
+static struct usage *find_usage(const char *name) {
+    for (int i = 0; i < history_count; i++) {
+        if (strcmp(history[i].name, name) == 0) {
+            return &history[i];
+        }
+    }
+    return NULL;
+}
+
+// Add usage for name, replacing the least used network if the history is
+// full. Returns NULL if the name cannot be recorded.
+static struct usage *add_usage(const char *name, time_t now) {
+    // Names are saved as whitespace separated fields.
+    if (strlen(name) >= HISTORY_NAME_SIZE || strpbrk(name, " \t\r\n")) {
+        return NULL;
+    }
+
+    struct usage *u = NULL;
+    if (history_count < HISTORY_SIZE) {
+        u = &history[history_count++];
+    } else {
+        for (int i = 0; i < history_count; i++) {
+            if (history[i].used_since) {
+                continue;
+            }
+            if (u == NULL ||
+                current_score(&history[i], now) < current_score(u, now)) {
+                u = &history[i];
+            }
+        }
+        if (u == NULL) {
+            return NULL;
+        }
+    }
+
+    *u = (struct usage){0};
+    strcpy(u->name, name);
+    return u;
+}
+
+void history_network_used(const char *name) {
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&lock);
+
+    struct usage *u = find_usage(name);
+    if (u == NULL) {
+        u = add_usage(name, now);
+    }
+    if (u) {
+        u->score = current_score(u, now) + 1;
+        u->updated = now;
+        u->uses++;
+        u->used_since = now;
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+void history_network_unused(const char *name) {
+    pthread_mutex_lock(&lock);
+
+    struct usage *u = find_usage(name);
+    if (u && u->used_since) {
+        u->used_sec += time(NULL) - u->used_since;
+        u->used_since = 0;
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+int predict_networks(char names[][HISTORY_NAME_SIZE], int max) {
+    time_t now = time(NULL);
+    bool taken[HISTORY_SIZE] = {0};
+    int count = 0;
+
+    pthread_mutex_lock(&lock);
+
+    // The history is small, so selecting the best network for every slot is
+    // good enough.
+    while (count < max) {
+        int best = -1;
+        double best_score = MIN_PREDICT_SCORE;
+        for (int i = 0; i < history_count; i++) {
+            double score = current_score(&history[i], now);
+            if (!taken[i] && score >= best_score) {
+                best = i;
+                best_score = score;
+            }
+        }
+        if (best == -1) {
+            break;
+        }
+        taken[best] = true;
+        strcpy(names[count++], history[best].name);
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return count;
+}
+
+void history_predicted(void) {
+    pthread_mutex_lock(&lock);
+    predicted++;
+    pthread_mutex_unlock(&lock);
+}
+
+void history_prediction_hit(void) {
+    pthread_mutex_lock(&lock);
+    prediction_hits++;
+    pthread_mutex_unlock(&lock);
+}
+
+void history_prediction_miss(void) {
+    pthread_mutex_lock(&lock);
+    prediction_misses++;
+    pthread_mutex_unlock(&lock);
+}
+
+// Must be called holding the lock.
+static void read_history(const struct broker_context *ctx) {
+    FILE *fp = fopen(HISTORY_PATH, "r");
+    if (fp == NULL) {
+        if (errno == ENOENT) {
+            DEBUGF("[%s] no usage history", ctx->name);
+        } else {
+            WARNF(
+                "[%s] failed to open '%s': %s",
+                ctx->name,
+                HISTORY_PATH,
+                strerror(errno)
+            );
+        }
+        return;
+    }
+
+    int version = 0;
+    if (fscanf(fp, "vmnet-broker-history %d\n", &version) != 1 ||
+        version != HISTORY_VERSION) {
+        WARNF("[%s] ignoring usage history version %d", ctx->name, version);
+        fclose(fp);
+        return;
+    }
+
+    unsigned long long p, h, m;
+    if (fscanf(fp, "predictions %llu %llu %llu\n", &p, &h, &m) == 3) {
+        predicted = p;
+        prediction_hits = h;
+        prediction_misses = m;
+    }
+
+    struct usage u = {0};
+    unsigned long long uses, used_sec;
+    long long updated;
+    while (history_count < HISTORY_SIZE &&
+           fscanf(
+               fp,
+               "network %63s %llu %lf %lld %llu\n",
+               u.name,
+               &uses,
+               &u.score,
+               &updated,
+               &used_sec
+           ) == 5) {
+        u.uses = uses;
+        u.updated = (time_t)updated;
+        u.used_sec = used_sec;
+        history[history_count++] = u;
+    }
+
+    fclose(fp);
+
+    INFOF(
+        "[%s] loaded usage history for %d networks (predicted %llu hits %llu "
+        "misses %llu)",
+        ctx->name,
+        history_count,
+        (unsigned long long)predicted,
+        (unsigned long long)prediction_hits,
+        (unsigned long long)prediction_misses
+    );
+}
+
+// Must be called holding the lock.
+static void write_history(const struct broker_context *ctx) {
+    time_t now = time(NULL);
+
+    // Networks may be used by retained leases when shutting down.
+    for (int i = 0; i < history_count; i++) {
+        struct usage *u = &history[i];
+        if (u->used_since) {
+            u->used_sec += now - u->used_since;
+            u->used_since = 0;
+        }
+    }
+
+    FILE *fp = fopen(HISTORY_TEMP_PATH, "w");
+    if (fp == NULL) {
+        WARNF(
+            "[%s] failed to create '%s': %s",
+            ctx->name,
+            HISTORY_TEMP_PATH,
+            strerror(errno)
+        );
+        return;
+    }
+
+    fprintf(fp, "vmnet-broker-history %d\n", HISTORY_VERSION);
+    fprintf(
+        fp,
+        "predictions %llu %llu %llu\n",
+        (unsigned long long)predicted,
+        (unsigned long long)prediction_hits,
+        (unsigned long long)prediction_misses
+    );
+    for (int i = 0; i < history_count; i++) {
+        const struct usage *u = &history[i];
+        fprintf(
+            fp,
+            "network %s %llu %f %lld %llu\n",
+            u->name,
+            (unsigned long long)u->uses,
+            current_score(u, now),
+            (long long)now,
+            (unsigned long long)u->used_sec
+        );
+    }
+
+    if (fclose(fp) != 0) {
+        WARNF(
+            "[%s] failed to write '%s': %s",
+            ctx->name,
+            HISTORY_TEMP_PATH,
+            strerror(errno)
+        );
+        unlink(HISTORY_TEMP_PATH);
+        return;
+    }
+
+    // Replace the history atomically, so a crash cannot leave a partial
+    // history.
+    if (rename(HISTORY_TEMP_PATH, HISTORY_PATH) != 0) {
+        WARNF(
+            "[%s] failed to rename '%s': %s",
+            ctx->name,
+            HISTORY_TEMP_PATH,
+            strerror(errno)
+        );
+        unlink(HISTORY_TEMP_PATH);
+        return;
+    }
+
+    DEBUGF(
+        "[%s] saved usage history for %d networks", ctx->name, history_count
+    );
+}
+
+void load_history(const struct broker_context *ctx) {
+    pthread_mutex_lock(&lock);
+    read_history(ctx);
+    pthread_mutex_unlock(&lock);
+}
+
+void save_history(const struct broker_context *ctx) {
+    pthread_mutex_lock(&lock);
+    write_history(ctx);
+    pthread_mutex_unlock(&lock);
+}
+
+void add_history_stats(xpc_object_t stats) {
+    pthread_mutex_lock(&lock);
+    uint64_t p = predicted;
+    uint64_t h = prediction_hits;
+    uint64_t m = prediction_misses;
+    pthread_mutex_unlock(&lock);
+
+    xpc_object_t dict = xpc_dictionary_create_empty();
+    xpc_dictionary_set_uint64(dict, PREDICTION_PREDICTED, p);
+    xpc_dictionary_set_uint64(dict, PREDICTION_HITS, h);
+    xpc_dictionary_set_uint64(dict, PREDICTION_MISSES, m);
+    xpc_dictionary_set_value(stats, STATS_PREDICTION, dict);
+    xpc_release(dict);
+}
@@ -0,0 +1,1017 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <Block.h>
+#include <CoreFoundation/CFBase.h>
+#include <dispatch/dispatch.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vmnet/vmnet.h>
+
+#include "broker-capture.h"
+#include "broker-config.h"
+#include "broker-interface.h"
+#include "broker-relay.h"
+#include "broker-ring.h"
+#include "broker-vhost-user.h"
+#include "common.h"
+#include "log.h"
+#include "vmnet-broker.h"
+
+extern const struct broker_context main_context;
+extern const int max_captures;
+
+// Relay frame buffer size, large enough for the vmnet maximum packet size with
+// the default MTU.
+#define RELAY_FRAME_SIZE 2048
+
+// Socket buffer sizes for the broker side of the socket. A large receive
+// buffer avoids dropping frames sent by the peer in a burst while the relay
+// thread is busy.
+#define SEND_BUFFER_SIZE (1024 * 1024)
+#define RECV_BUFFER_SIZE (4 * 1024 * 1024)
+
+// Number of slots in every ring of a shared memory region, 512 KiB of frame
+// buffers per direction.
+#define RING_SLOTS 256
+
+// The vmnet interface of a network, connected to a switch. Peers relaying the
+// network are other ports of the switch, so frames between peers are
+// forwarded by the broker, and only frames to the network go through vmnet.
+struct uplink {
+    char *network_name;
+    vmnet_network_ref network;
+    // Accessed only on the interface queue, and by the relay callbacks.
+    interface_ref iface;
+    struct relay_switch *sw;
+    struct relay_link *link;
+    // Number of interfaces using the uplink. The fields below are accessed
+    // only on the main queue.
+    int refs;
+    // True until the interface is started.
+    bool starting;
+    // Error starting the interface.
+    int error;
+    struct uplink *next;
+};
+
+// A switch port started for a peer.
+struct interface {
+    // The peer, or NULL if the peer stopped relaying the network.
+    struct broker_context *ctx;
+    struct uplink *uplink;
+    // Accessed only on the interface queue.
+    struct relay_link *link;
+    // The peer side of the socket, sent to the peer when the interface is
+    // started.
+    int peer_fd;
+    // The broker side of the socket, owned by the relay after adding the
+    // link. The doorbell when using a shared memory region, and the vhost-user
+    // socket, owned by the source when using vhost-user.
+    int relay_fd;
+    enum relay_mode mode;
+    // The region, sent to the peer when the interface is started.
+    int ring_fd;
+    struct ring_port ring_port;
+    // The vhost-user device, and the source handling its messages. Accessed
+    // only on the interface queue.
+    struct vhost_user_dev *vhost;
+    dispatch_source_t source;
+    // Called when the interface is started. NULL after calling it.
+    relay_completion_t completion;
+    // True until the interface is started.
+    bool starting;
+    struct interface *next;
+};
+
+// A packet capture of a relayed network, stopped when the reader closes the
+// socket or when the uplink stops. Accessed only on the main queue.
+struct network_capture {
+    // Identifies the capture in the done callback, running on the capture
+    // writer thread after the capture may have been stopped.
+    uint64_t id;
+    struct uplink *uplink;
+    struct capture *capture;
+    struct network_capture *next;
+};
+
+// All relays are served by one relay thread, created when the first relay is
+// started.
+static struct relay *relay;
+
+// Serial queue for starting and stopping interfaces, and for interface events.
+static dispatch_queue_t interface_queue;
+
+// Interfaces by peer, and uplinks by network, accessed only on the main queue.
+static struct interface *interfaces;
+static struct uplink *uplinks;
+
+// Running captures, the last capture id, and the counters of stopped
+// captures, accessed only on the main queue.
+static struct network_capture *captures;
+static int active_captures;
+static uint64_t last_capture_id;
+static struct capture_stats stopped_captures;
+
+// MARK: - Relay callbacks
+
+static int interface_recv(void *arg, struct relay_frame *frames, int count) {
+    struct uplink *up = arg;
+    struct iovec iovs[RELAY_BATCH];
+    struct vmpktdesc packets[RELAY_BATCH];
+
+    for (int i = 0; i < count; i++) {
+        iovs[i].iov_base = frames[i].data;
+        iovs[i].iov_len = frames[i].len;
+        packets[i] = (struct vmpktdesc){
+            .vm_pkt_size = frames[i].len,
+            .vm_pkt_iov = &iovs[i],
+            .vm_pkt_iovcnt = 1,
+        };
+    }
+
+    int n = count;
+    vmnet_return_t status = vmnet_read(up->iface, packets, &n);
+    if (status != VMNET_SUCCESS) {
+        WARNF(
+            "[%s] failed to read packets from network '%s': (%d) %s",
+            main_context.name,
+            up->network_name,
+            status,
+            vmnet_strerror(status)
+        );
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        frames[i].len = packets[i].vm_pkt_size;
+    }
+    return n;
+}
+
+static int
+interface_send(void *arg, const struct relay_frame *frames, int count) {
+    struct uplink *up = arg;
+    struct iovec iovs[RELAY_BATCH];
+    struct vmpktdesc packets[RELAY_BATCH];
+
+    for (int i = 0; i < count; i++) {
+        iovs[i].iov_base = frames[i].data;
+        iovs[i].iov_len = frames[i].len;
+        packets[i] = (struct vmpktdesc){
+            .vm_pkt_size = frames[i].len,
+            .vm_pkt_iov = &iovs[i],
+            .vm_pkt_iovcnt = 1,
+        };
+    }
+
+    int n = count;
+    vmnet_return_t status = vmnet_write(up->iface, packets, &n);
+    if (status != VMNET_SUCCESS) {
+        // The interface may be full; the frames are dropped.
+        DEBUGF(
+            "[%s] failed to write packets to network '%s': (%d) %s",
+            main_context.name,
+            up->network_name,
+            status,
+            vmnet_strerror(status)
+        );
+        return 0;
+    }
+    return n;
+}
+
+static const struct relay_port_ops interface_ops = {
+    .recv = interface_recv,
+    .send = interface_send,
+};
+
+// MARK: - Interface queue
+
+static void free_interface(struct interface *ifc) {
+    if (ifc->peer_fd != -1) {
+        close(ifc->peer_fd);
+    }
+    if (ifc->relay_fd != -1) {
+        close(ifc->relay_fd);
+    }
+    if (ifc->ring_fd != -1) {
+        close(ifc->ring_fd);
+    }
+    ring_port_destroy(&ifc->ring_port);
+    free(ifc);
+}
+
+static void free_uplink(struct uplink *up) {
+    if (up->network) {
+        CFRelease(up->network);
+    }
+    free(up->network_name);
+    free(up);
+}
+
+// Remove the peer port from the switch. Runs on the interface queue.
+static void remove_client_link(struct interface *ifc) {
+    if (ifc->link) {
+        struct relay_port_stats s;
+        relay_get_port_stats(relay, ifc->link, &s);
+        DEBUGF(
+            "[%s] network '%s' port received %llu frames (%llu bytes), "
+            "dropped %llu frames, sent %llu frames (%llu bytes), "
+            "queue max %d frames, queue dropped %llu frames",
+            main_context.name,
+            ifc->uplink->network_name,
+            s.frames,
+            s.bytes,
+            s.drops,
+            s.sent,
+            s.sent_bytes,
+            s.max_queue_len,
+            s.queue_drops
+        );
+        relay_remove_link(relay, ifc->link);
+        ifc->link = NULL;
+        ifc->relay_fd = -1;
+    }
+}
+
+// Stop handling vhost-user messages. Stopping the device removes the port
+// from the switch.
+static void stop_vhost_user(struct interface *ifc) {
+    vhost_user_destroy(ifc->vhost);
+    ifc->vhost = NULL;
+    dispatch_source_cancel(ifc->source);
+    dispatch_release(ifc->source);
+    ifc->source = NULL;
+}
+
+static void stop_client(struct interface *ifc) {
+    if (ifc->vhost) {
+        stop_vhost_user(ifc);
+    }
+    remove_client_link(ifc);
+    free_interface(ifc);
+}
+
+// Stop forwarding frames, destroy the switch, and stop the interface. Runs on
+// the interface queue after all peer ports were removed.
+static void stop_uplink(struct uplink *up) {
+    if (up->link) {
+        // Interface events run on this queue, so they cannot access the link
+        // after it is removed.
+        relay_remove_link(relay, up->link);
+        up->link = NULL;
+    }
+    if (up->sw) {
+        relay_destroy_switch(relay, up->sw);
+        up->sw = NULL;
+    }
+
+    if (up->iface == NULL) {
+        free_uplink(up);
+        return;
+    }
+
+    vmnet_return_t status = vmnet_stop_interface(
+        up->iface, interface_queue, ^(vmnet_return_t stop_status) {
+            if (stop_status != VMNET_SUCCESS) {
+                WARNF(
+                    "[%s] failed to stop interface on network '%s': (%d) %s",
+                    main_context.name,
+                    up->network_name,
+                    stop_status,
+                    vmnet_strerror(stop_status)
+                );
+            }
+            free_uplink(up);
+        }
+    );
+    if (status != VMNET_SUCCESS) {
+        WARNF(
+            "[%s] failed to stop interface on network '%s': (%d) %s",
+            main_context.name,
+            up->network_name,
+            status,
+            vmnet_strerror(status)
+        );
+        free_uplink(up);
+    }
+}
+
+static void finish_uplink(struct uplink *up, int error);
+static void finish_start(struct interface *ifc, int error);
+
+// Create the switch and connect the interface when the interface is started.
+// Runs on the interface queue. Returns 0 on success, or an error code.
+static int
+add_uplink_link(struct uplink *up, vmnet_return_t status, xpc_object_t param) {
+    if (status != VMNET_SUCCESS) {
+        WARNF(
+            "[%s] failed to start interface on network '%s': (%d) %s",
+            main_context.name,
+            up->network_name,
+            status,
+            vmnet_strerror(status)
+        );
+        return VMNET_BROKER_INTERNAL_ERROR;
+    }
+
+    uint64_t max_packet_size = xpc_dictionary_get_uint64(
+        param, vmnet_max_packet_size_key
+    );
+    if (max_packet_size > RELAY_FRAME_SIZE) {
+        WARNF(
+            "[%s] network '%s' max packet size %llu is too large for relay",
+            main_context.name,
+            up->network_name,
+            max_packet_size
+        );
+        return VMNET_BROKER_INTERNAL_ERROR;
+    }
+
+    up->sw = relay_create_switch(relay);
+    if (up->sw == NULL) {
+        WARNF(
+            "[%s] failed to create switch for network '%s': %s",
+            main_context.name,
+            up->network_name,
+            strerror(errno)
+        );
+        return VMNET_BROKER_INTERNAL_ERROR;
+    }
+
+    struct relay_shaping shaping;
+    if (network_config_shaping(up->network_name, &shaping) &&
+        relay_set_shaping(relay, up->sw, &shaping) < 0) {
+        WARNF(
+            "[%s] failed to set traffic shaping for network '%s': %s",
+            main_context.name,
+            up->network_name,
+            strerror(errno)
+        );
+    }
+
+    struct relay_endpoint endpoint = {
+        .fd = -1,
+        .ops = &interface_ops,
+        .arg = up,
+    };
+    up->link = relay_add_switch_link(relay, up->sw, &endpoint);
+    if (up->link == NULL) {
+        WARNF(
+            "[%s] failed to relay network '%s': %s",
+            main_context.name,
+            up->network_name,
+            strerror(errno)
+        );
+        return VMNET_BROKER_INTERNAL_ERROR;
+    }
+
+    vmnet_interface_set_event_callback(
+        up->iface,
+        VMNET_INTERFACE_PACKETS_AVAILABLE,
+        interface_queue,
+        ^(interface_event_t event, xpc_object_t event_param) {
+            (void)event;
+            (void)event_param;
+            if (up->link) {
+                relay_notify(relay, up->link);
+            }
+        }
+    );
+
+    return 0;
+}
+
+// Start the vmnet interface. Runs on the interface queue, so the start
+// handler runs after the interface is assigned.
+static void start_uplink(struct uplink *up) {
+    // The interface carries frames of all peers, so vmnet must accept any
+    // source address.
+    xpc_object_t desc = xpc_dictionary_create_empty();
+    xpc_dictionary_set_bool(desc, vmnet_allocate_mac_address_key, false);
+
+    up->iface = vmnet_interface_start_with_network(
+        up->network,
+        desc,
+        interface_queue,
+        ^(vmnet_return_t status, xpc_object_t param) {
+            int error = add_uplink_link(up, status, param);
+            dispatch_async(dispatch_get_main_queue(), ^{
+                finish_uplink(up, error);
+            });
+        }
+    );
+
+    xpc_release(desc);
+
+    if (up->iface == NULL) {
+        WARNF(
+            "[%s] failed to start interface on network '%s'",
+            main_context.name,
+            up->network_name
+        );
+        dispatch_async(dispatch_get_main_queue(), ^{
+            finish_uplink(up, VMNET_BROKER_INTERNAL_ERROR);
+        });
+    }
+}
+
+// Add the port of a vhost-user device when QEMU starts the device.
+static void vhost_start(void *arg, struct vhost_user_dev *dev) {
+    struct interface *ifc = arg;
+    struct relay_endpoint endpoint = {
+        .fd = vhost_user_doorbell(dev),
+        .ops = &vhost_user_port_ops,
+        .arg = dev,
+        .offloads = vhost_user_offloads(dev),
+    };
+    if (endpoint.fd != -1) {
+        ifc->link = relay_add_switch_link(relay, ifc->uplink->sw, &endpoint);
+    }
+    if (ifc->link == NULL) {
+        WARNF(
+            "[%s] failed to relay vhost-user device on network '%s': %s",
+            main_context.name,
+            ifc->uplink->network_name,
+            strerror(errno)
+        );
+        if (endpoint.fd != -1) {
+            close(endpoint.fd);
+        }
+        return;
+    }
+    DEBUGF(
+        "[%s] vhost-user device started on network '%s'",
+        main_context.name,
+        ifc->uplink->network_name
+    );
+}
+
+// Remove the port before QEMU changes the device.
+static void vhost_stop(void *arg, struct vhost_user_dev *dev) {
+    (void)dev;
+    remove_client_link(arg);
+}
+
+static const struct vhost_user_ops vhost_ops = {
+    .start = vhost_start,
+    .stop = vhost_stop,
+};
+
+// Handle vhost-user messages on the interface queue. The port is added to the
+// switch when QEMU starts the device. Returns 0 on success, or an error code.
+static int start_vhost_user(struct interface *ifc) {
+    ifc->vhost = vhost_user_create(ifc->relay_fd, &vhost_ops, ifc);
+    if (ifc->vhost == NULL) {
+        WARNF(
+            "[%s] failed to create vhost-user device: %s",
+            main_context.name,
+            strerror(errno)
+        );
+        return VMNET_BROKER_INTERNAL_ERROR;
+    }
+
+    int fd = ifc->relay_fd;
+    ifc->relay_fd = -1;
+    ifc->source = dispatch_source_create(
+        DISPATCH_SOURCE_TYPE_READ, fd, 0, interface_queue
+    );
+    dispatch_source_set_event_handler(ifc->source, ^{
+        if (vhost_user_handle(ifc->vhost) == 0) {
+            return;
+        }
+        if (errno == ECONNRESET) {
+            INFOF(
+                "[%s] vhost-user client disconnected from network '%s'",
+                main_context.name,
+                ifc->uplink->network_name
+            );
+        } else {
+            WARNF(
+                "[%s] invalid vhost-user message on network '%s': %s",
+                main_context.name,
+                ifc->uplink->network_name,
+                strerror(errno)
+            );
+        }
+        stop_vhost_user(ifc);
+    });
+    dispatch_source_set_cancel_handler(ifc->source, ^{
+        close(fd);
+    });
+    dispatch_resume(ifc->source);
+    return 0;
+}
+
+// Add the peer port to the switch. Runs on the interface queue. Returns 0 on
+// success, or an error code.
+static int add_client_link(struct interface *ifc) {
+    if (ifc->mode == RELAY_VHOST_USER) {
+        return start_vhost_user(ifc);
+    }
+
+    struct relay_endpoint endpoint = {
+        .fd = ifc->relay_fd,
+        .stream = ifc->mode == RELAY_STREAM,
+    };
+    if (ifc->mode == RELAY_RING) {
+        endpoint.ops = &ring_port_ops;
+        endpoint.arg = &ifc->ring_port;
+    }
+    ifc->link = relay_add_switch_link(relay, ifc->uplink->sw, &endpoint);
+    if (ifc->link == NULL) {
+        WARNF(
+            "[%s] failed to relay network '%s': %s",
+            main_context.name,
+            ifc->uplink->network_name,
+            strerror(errno)
+        );
+        return VMNET_BROKER_INTERNAL_ERROR;
+    }
+    return 0;
+}
+
+// MARK: - Main queue
+
+static void remove_interface(struct interface *ifc) {
+    struct interface **p = &interfaces;
+    while (*p != ifc) {
+        p = &(*p)->next;
+    }
+    *p = ifc->next;
+}
+
+static void remove_uplink(struct uplink *up) {
+    struct uplink **p = &uplinks;
+    while (*p != up) {
+        p = &(*p)->next;
+    }
+    *p = up->next;
+}
+
+static struct uplink *find_uplink(const char *network_name) {
+    for (struct uplink *up = uplinks; up; up = up->next) {
+        if (strcmp(up->network_name, network_name) == 0) {
+            return up;
+        }
+    }
+    return NULL;
+}
+
+// Stop a capture and remove it from the running captures. The capture writes
+// the frames left in the ring and closes the socket on its writer thread.
+static void stop_capture(struct network_capture *nc) {
+    struct network_capture **p = &captures;
+    while (*p != nc) {
+        p = &(*p)->next;
+    }
+    *p = nc->next;
+    active_captures--;
+
+    struct capture_stats s;
+    capture_get_stats(nc->capture, &s);
+    stopped_captures.received += s.received;
+    stopped_captures.captured += s.captured;
+    stopped_captures.drops += s.drops;
+    DEBUGF(
+        "[%s] network '%s' capture captured %llu frames, dropped %llu frames",
+        main_context.name,
+        nc->uplink->network_name,
+        s.captured,
+        s.drops
+    );
+
+    capture_stop(nc->capture);
+    free(nc);
+}
+
+// Stop the captures of an uplink, before its switch is destroyed.
+static void stop_uplink_captures(struct uplink *up) {
+    struct network_capture *nc = captures;
+    while (nc) {
+        struct network_capture *next = nc->next;
+        if (nc->uplink == up) {
+            stop_capture(nc);
+        }
+        nc = next;
+    }
+}
+
+// Called on the capture writer thread when writing to the socket failed.
+static void capture_done(void *arg) {
+    uint64_t id = (uintptr_t)arg;
+    dispatch_async(dispatch_get_main_queue(), ^{
+        for (struct network_capture *nc = captures; nc; nc = nc->next) {
+            if (nc->id == id) {
+                INFOF(
+                    "[%s] stopped capturing network '%s'",
+                    main_context.name,
+                    nc->uplink->network_name
+                );
+                stop_capture(nc);
+                return;
+            }
+        }
+    });
+}
+
+static void complete(struct interface *ifc, int fd, int ring_fd, int error) {
+    if (ifc->completion) {
+        ifc->completion(fd, ring_fd, error);
+        Block_release(ifc->completion);
+        ifc->completion = NULL;
+    }
+}
+
+// Stop the interface, and the uplink when the last interface on the network
+// is stopped.
+static void stop_interface(struct interface *ifc) {
+    struct uplink *up = ifc->uplink;
+    bool last = --up->refs == 0;
+
+    remove_interface(ifc);
+    if (last) {
+        DEBUGF(
+            "[%s] stopping switch for network '%s'",
+            main_context.name,
+            up->network_name
+        );
+        remove_uplink(up);
+        stop_uplink_captures(up);
+    }
+
+    dispatch_async(interface_queue, ^{
+        stop_client(ifc);
+        if (last) {
+            stop_uplink(up);
+        }
+    });
+}
+
+// Add the peer port after the uplink was started.
+static void start_client(struct interface *ifc) {
+    if (ifc->uplink->error) {
+        finish_start(ifc, ifc->uplink->error);
+        return;
+    }
+    dispatch_async(interface_queue, ^{
+        int error = add_client_link(ifc);
+        dispatch_async(dispatch_get_main_queue(), ^{
+            finish_start(ifc, error);
+        });
+    });
+}
+
+static void finish_uplink(struct uplink *up, int error) {
+    up->starting = false;
+    up->error = error;
+
+    // Finishing an interface may remove it from the list.
+    struct interface *ifc = interfaces;
+    while (ifc) {
+        struct interface *next = ifc->next;
+        if (ifc->uplink == up) {
+            start_client(ifc);
+        }
+        ifc = next;
+    }
+}
+
+static const char *const mode_suffixes[] = {
+    [RELAY_SOCKET] = "",
+    [RELAY_RING] = " using shared memory",
+    [RELAY_VHOST_USER] = " using vhost-user",
+    [RELAY_STREAM] = " using a stream socket",
+};
+
+static void finish_start(struct interface *ifc, int error) {
+    ifc->starting = false;
+
+    if (ifc->ctx == NULL) {
+        // The peer stopped relaying while the interface was starting.
+        stop_interface(ifc);
+        return;
+    }
+
+    if (error) {
+        complete(ifc, -1, -1, error);
+        stop_interface(ifc);
+        return;
+    }
+
+    INFOF(
+        "[%s] relaying network '%s'%s",
+        ifc->ctx->name,
+        ifc->uplink->network_name,
+        mode_suffixes[ifc->mode]
+    );
+
+    complete(ifc, ifc->peer_fd, ifc->ring_fd, 0);
+
+    // The peer has its own copies of the socket and the region.
+    close(ifc->peer_fd);
+    ifc->peer_fd = -1;
+    if (ifc->ring_fd != -1) {
+        close(ifc->ring_fd);
+        ifc->ring_fd = -1;
+    }
+}
+
+static int create_relay(void) {
+    if (relay) {
+        return 0;
+    }
+
+    relay = relay_create(RELAY_FRAME_SIZE, RELAY_BATCH);
+    if (relay == NULL) {
+        return errno;
+    }
+
+    interface_queue = dispatch_queue_create(
+        "com.github.nirs.vmnet-broker.interface", DISPATCH_QUEUE_SERIAL
+    );
+    return 0;
+}
+
+// Create a datagram socketpair for frames, or a stream socketpair for length
+// prefixed frames or vhost-user messages.
+static int create_socketpair(struct interface *ifc) {
+    int type = SOCK_DGRAM;
+    if (ifc->mode == RELAY_VHOST_USER || ifc->mode == RELAY_STREAM) {
+        type = SOCK_STREAM;
+    }
+    int fds[2];
+    if (socketpair(AF_UNIX, type, 0, fds) < 0) {
+        return errno;
+    }
+
+    if (ifc->mode != RELAY_VHOST_USER) {
+        int size = SEND_BUFFER_SIZE;
+        setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        size = RECV_BUFFER_SIZE;
+        setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+
+    ifc->peer_fd = fds[0];
+    ifc->relay_fd = fds[1];
+    return 0;
+}
+
+// Create a shared memory region, using the socket as the doorbell. The broker
+// side of the region is mapped until the interface is freed.
+static int create_ring(struct interface *ifc) {
+    ifc->ring_fd = ring_create(RING_SLOTS, RELAY_FRAME_SIZE);
+    if (ifc->ring_fd == -1) {
+        return errno;
+    }
+    if (ring_port_init(&ifc->ring_port, ifc->ring_fd, ifc->relay_fd) < 0) {
+        return errno;
+    }
+    return 0;
+}
+
+// Create the uplink of a network, and start its interface.
+static struct uplink *create_uplink(
+    struct broker_context *ctx,
+    const char *network_name,
+    xpc_object_t serialization
+) {
+    struct uplink *up = calloc(1, sizeof(*up));
+    assert(up != NULL && "failed to allocate uplink");
+
+    up->network_name = strdup(network_name);
+    assert(up->network_name != NULL && "failed to allocate network name");
+
+    vmnet_return_t status;
+    up->network = vmnet_network_create_with_serialization(
+        serialization, &status
+    );
+    if (up->network == NULL) {
+        WARNF(
+            "[%s] failed to create network '%s' from serialization: (%d) %s",
+            ctx->name,
+            network_name,
+            status,
+            vmnet_strerror(status)
+        );
+        free_uplink(up);
+        return NULL;
+    }
+
+    DEBUGF("[%s] starting switch for network '%s'", ctx->name, network_name);
+
+    up->starting = true;
+    up->next = uplinks;
+    uplinks = up;
+
+    dispatch_async(interface_queue, ^{
+        start_uplink(up);
+    });
+    return up;
+}
+
+void start_relay(
+    struct broker_context *ctx,
+    const char *network_name,
+    xpc_object_t serialization,
+    enum relay_mode mode,
+    relay_completion_t completion
+) {
+    int err = create_relay();
+    if (err) {
+        WARNF("[%s] failed to create relay: %s", ctx->name, strerror(err));
+        completion(-1, -1, VMNET_BROKER_INTERNAL_ERROR);
+        return;
+    }
+
+    struct interface *ifc = calloc(1, sizeof(*ifc));
+    assert(ifc != NULL && "failed to allocate interface");
+    ifc->peer_fd = ifc->relay_fd = ifc->ring_fd = -1;
+    ifc->mode = mode;
+
+    err = create_socketpair(ifc);
+    if (err) {
+        WARNF("[%s] failed to create socketpair: %s", ctx->name, strerror(err));
+        free_interface(ifc);
+        completion(-1, -1, VMNET_BROKER_INTERNAL_ERROR);
+        return;
+    }
+
+    if (mode == RELAY_RING) {
+        err = create_ring(ifc);
+        if (err) {
+            WARNF(
+                "[%s] failed to create shared memory: %s",
+                ctx->name,
+                strerror(err)
+            );
+            free_interface(ifc);
+            completion(-1, -1, VMNET_BROKER_INTERNAL_ERROR);
+            return;
+        }
+    }
+
+    // Peers relaying the same network share the uplink.
+    struct uplink *up = find_uplink(network_name);
+    if (up == NULL) {
+        up = create_uplink(ctx, network_name, serialization);
+        if (up == NULL) {
+            free_interface(ifc);
+            completion(-1, -1, VMNET_BROKER_INTERNAL_ERROR);
+            return;
+        }
+    }
+
+    DEBUGF("[%s] starting relay for network '%s'", ctx->name, network_name);
+
+    up->refs++;
+    ifc->uplink = up;
+    ifc->ctx = ctx;
+    ifc->completion = Block_copy(completion);
+    ifc->starting = true;
+    ifc->next = interfaces;
+    interfaces = ifc;
+
+    if (!up->starting) {
+        start_client(ifc);
+    }
+}
+
+void stop_peer_relays(struct broker_context *ctx, const char *network_name) {
+    struct interface *ifc = interfaces;
+    while (ifc) {
+        struct interface *next = ifc->next;
+        const char *name = ifc->uplink->network_name;
+        if (ifc->ctx == ctx &&
+            (network_name == NULL || strcmp(name, network_name) == 0)) {
+            DEBUGF("[%s] stopping relay for network '%s'", ctx->name, name);
+            // The peer context is not valid after the peer disconnects.
+            ifc->ctx = NULL;
+            complete(ifc, -1, -1, RELAY_STOPPED);
+            if (!ifc->starting) {
+                stop_interface(ifc);
+            }
+        }
+        ifc = next;
+    }
+}
+
+int start_capture(
+    struct broker_context *ctx,
+    const char *network_name,
+    uint32_t snaplen,
+    const char *filter,
+    int *error
+) {
+    // Frames are captured by the switch, available after the uplink was
+    // started.
+    struct uplink *up = find_uplink(network_name);
+    if (up == NULL || up->starting || up->error) {
+        WARNF("[%s] network '%s' is not relayed", ctx->name, network_name);
+        *error = VMNET_BROKER_NOT_FOUND;
+        return -1;
+    }
+
+    if (active_captures >= max_captures) {
+        WARNF(
+            "[%s] too many captures: %d/%d",
+            ctx->name,
+            active_captures,
+            max_captures
+        );
+        *error = VMNET_BROKER_BUSY;
+        return -1;
+    }
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        WARNF(
+            "[%s] failed to create socketpair: %s", ctx->name, strerror(errno)
+        );
+        *error = VMNET_BROKER_INTERNAL_ERROR;
+        return -1;
+    }
+    int size = SEND_BUFFER_SIZE;
+    setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    struct network_capture *nc = calloc(1, sizeof(*nc));
+    assert(nc != NULL && "failed to allocate capture");
+    nc->id = ++last_capture_id;
+
+    struct capture_options options = {
+        .name = network_name,
+        .filter = filter,
+        .snaplen = snaplen,
+        .done = capture_done,
+        .arg = (void *)(uintptr_t)nc->id,
+    };
+    nc->capture = capture_start(relay, up->sw, fds[1], &options);
+    if (nc->capture == NULL) {
+        int err = errno;
+        WARNF(
+            "[%s] failed to capture network '%s': %s",
+            ctx->name,
+            network_name,
+            strerror(err)
+        );
+        close(fds[0]);
+        close(fds[1]);
+        free(nc);
+        *error = err == EINVAL ? VMNET_BROKER_INVALID_REQUEST
+                               : VMNET_BROKER_INTERNAL_ERROR;
+        return -1;
+    }
+
+    INFOF(
+        "[%s] capturing network '%s' filter '%s' snaplen %u",
+        ctx->name,
+        network_name,
+        filter ? filter : "",
+        snaplen
+    );
+
+    nc->uplink = up;
+    nc->next = captures;
+    captures = nc;
+    active_captures++;
+    return fds[0];
+}
+
+void add_relay_stats(xpc_object_t stats) {
+    struct relay_stats s = {0};
+    if (relay) {
+        relay_get_stats(relay, &s);
+    }
+
+    xpc_object_t dict = xpc_dictionary_create_empty();
+    xpc_dictionary_set_int64(dict, RELAY_LINKS, s.links);
+    xpc_dictionary_set_uint64(dict, RELAY_FRAMES, s.frames);
+    xpc_dictionary_set_uint64(dict, RELAY_BYTES, s.bytes);
+    xpc_dictionary_set_uint64(dict, RELAY_BATCHES, s.batches);
+    xpc_dictionary_set_uint64(dict, RELAY_DROPS, s.drops);
+    xpc_dictionary_set_int64(dict, RELAY_SWITCHES, s.switches);
+    xpc_dictionary_set_uint64(dict, RELAY_UNICAST, s.unicast);
+    xpc_dictionary_set_uint64(dict, RELAY_FLOODED, s.flooded);
+    xpc_dictionary_set_uint64(dict, RELAY_SUPPRESSED, s.suppressed);
+    xpc_dictionary_set_uint64(dict, RELAY_SEGMENTED, s.segmented);
+    xpc_dictionary_set_uint64(dict, RELAY_QUEUED, s.queued);
+    xpc_dictionary_set_uint64(dict, RELAY_QUEUE_DROPS, s.queue_drops);
+
+    struct capture_stats cs = stopped_captures;
+    for (struct network_capture *nc = captures; nc; nc = nc->next) {
+        struct capture_stats c;
+        capture_get_stats(nc->capture, &c);
+        cs.captured += c.captured;
+        cs.drops += c.drops;
+    }
+    xpc_dictionary_set_int64(dict, RELAY_CAPTURES, active_captures);
+    xpc_dictionary_set_uint64(dict, RELAY_CAPTURED, cs.captured);
+    xpc_dictionary_set_uint64(dict, RELAY_CAPTURE_DROPS, cs.drops);
+    xpc_dictionary_set_value(stats, STATS_RELAY, dict);
+    xpc_release(dict);
+}
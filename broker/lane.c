@@ -0,0 +1,157 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <Block.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "broker-lane.h"
+#include "vmnet-broker.h"
+
+#define NANOSECONDS_PER_MICROSECOND 1000
+
+// Work is queued on the main queue and the shard queues, so the statistics are
+// updated atomically.
+struct lane_stats {
+    // Number of blocks started.
+    _Atomic uint64_t queued;
+    // Number of blocks waiting in the lane.
+    _Atomic int depth;
+    _Atomic int max_depth;
+    // Time from queuing a block until it started.
+    _Atomic uint64_t wait_ns;
+    _Atomic uint64_t max_wait_ns;
+};
+
+static const char *lane_names[LANE_COUNT] = {
+    [LANE_FAST] = STATS_LANE_FAST,
+    [LANE_SLOW] = STATS_LANE_SLOW,
+};
+
+static struct lane_stats lanes[LANE_COUNT];
+
+struct slow_work {
+    dispatch_block_t block;
+    uint64_t queued;
+    struct slow_work *next;
+};
+
+static void update_max_int(_Atomic int *max, int value) {
+    int current = atomic_load(max);
+    while (value > current &&
+           !atomic_compare_exchange_weak(max, &current, value)) {
+    }
+}
+
+static void update_max_uint64(_Atomic uint64_t *max, uint64_t value) {
+    uint64_t current = atomic_load(max);
+    while (value > current &&
+           !atomic_compare_exchange_weak(max, &current, value)) {
+    }
+}
+
+uint64_t lane_queued(enum lane lane) {
+    struct lane_stats *s = &lanes[lane];
+    update_max_int(&s->max_depth, atomic_fetch_add(&s->depth, 1) + 1);
+    return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+}
+
+void lane_started(enum lane lane, uint64_t queued) {
+    struct lane_stats *s = &lanes[lane];
+    uint64_t wait = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - queued;
+    atomic_fetch_sub(&s->depth, 1);
+    atomic_fetch_add(&s->queued, 1);
+    atomic_fetch_add(&s->wait_ns, wait);
+    update_max_uint64(&s->max_wait_ns, wait);
+}
+
+static void schedule_drain(struct slow_lane *lane);
+
+// Run the first block in the slow lane, and continue in a new block if more
+// work is waiting.
+static void drain(struct slow_lane *lane) {
+    struct slow_work *work = lane->head;
+    lane->head = work->next;
+    if (lane->head == NULL) {
+        lane->tail = NULL;
+    }
+
+    lane_started(LANE_SLOW, work->queued);
+    work->block();
+    Block_release(work->block);
+    free(work);
+
+    if (lane->head) {
+        schedule_drain(lane);
+    } else {
+        lane->draining = false;
+    }
+}
+
+// Queue a drain block at the end of the lane queue. The block runs with
+// utility QoS, so the thread running slow work does not compete with fast work
+// on other queues.
+static void schedule_drain(struct slow_lane *lane) {
+    dispatch_block_t block = dispatch_block_create_with_qos_class(
+        DISPATCH_BLOCK_ENFORCE_QOS_CLASS,
+        QOS_CLASS_UTILITY,
+        0,
+        ^{
+            drain(lane);
+        }
+    );
+    assert(block != NULL && "failed to create drain block");
+    dispatch_async(lane->queue, block);
+    Block_release(block);
+    lane->draining = true;
+}
+
+void slow_lane_async(struct slow_lane *lane, dispatch_block_t block) {
+    struct slow_work *work = calloc(1, sizeof(*work));
+    assert(work != NULL && "failed to allocate slow work");
+
+    work->block = Block_copy(block);
+    work->queued = lane_queued(LANE_SLOW);
+
+    if (lane->tail) {
+        lane->tail->next = work;
+    } else {
+        lane->head = work;
+    }
+    lane->tail = work;
+
+    if (!lane->draining) {
+        schedule_drain(lane);
+    }
+}
+
+static xpc_object_t create_lane_stats(struct lane_stats *s) {
+    xpc_object_t dict = xpc_dictionary_create_empty();
+    xpc_dictionary_set_uint64(dict, LANE_QUEUED, atomic_load(&s->queued));
+    xpc_dictionary_set_int64(dict, LANE_DEPTH, atomic_load(&s->depth));
+    xpc_dictionary_set_int64(dict, LANE_MAX_DEPTH, atomic_load(&s->max_depth));
+    xpc_dictionary_set_uint64(
+        dict,
+        LANE_WAIT_USEC,
+        atomic_load(&s->wait_ns) / NANOSECONDS_PER_MICROSECOND
+    );
+    xpc_dictionary_set_uint64(
+        dict,
+        LANE_MAX_WAIT_USEC,
+        atomic_load(&s->max_wait_ns) / NANOSECONDS_PER_MICROSECOND
+    );
+    return dict;
+}
+
+void add_lane_stats(xpc_object_t stats) {
+    xpc_object_t dict = xpc_dictionary_create_empty();
+    for (int i = 0; i < LANE_COUNT; i++) {
+        xpc_object_t lane = create_lane_stats(&lanes[i]);
+        xpc_dictionary_set_value(dict, lane_names[i], lane);
+        xpc_release(lane);
+    }
+    xpc_dictionary_set_value(stats, STATS_LANES, dict);
+    xpc_release(dict);
+}
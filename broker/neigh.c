@@ -0,0 +1,487 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "broker-checksum.h"
+#include "broker-neigh.h"
+
+// Maximum load factor, as a fraction of 4, keeping probe sequences short.
+#define MAX_LOAD 3
+
+#define ETHER_HEADER_SIZE 14
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_ARP 0x0806
+#define ETHERTYPE_IPV6 0x86dd
+
+#define ARP_SIZE 28
+#define ARP_REQUEST 1
+#define ARP_REPLY 2
+
+#define IPV4_HEADER_SIZE 20
+#define IPV6_HEADER_SIZE 40
+#define UDP_HEADER_SIZE 8
+#define PROTO_UDP 17
+#define PROTO_ICMPV6 58
+
+// Neighbor solicitation and advertisement messages, followed by options.
+#define ND_SIZE 24
+#define ND_NEIGHBOR_SOLICIT 135
+#define ND_NEIGHBOR_ADVERT 136
+#define ND_OPT_SOURCE_LINKADDR 1
+#define ND_OPT_TARGET_LINKADDR 2
+#define ND_HOP_LIMIT 255
+#define NA_FLAG_ROUTER 0x80
+#define NA_FLAG_SOLICITED 0x40
+#define NA_FLAG_OVERRIDE 0x20
+
+// A neighbor advertisement with a target link-layer address option.
+#define NA_SIZE (ND_SIZE + 8)
+
+#define BOOTP_SERVER_PORT 67
+#define BOOTP_CLIENT_PORT 68
+#define BOOTP_REPLY 2
+#define BOOTP_OPTIONS 240
+#define DHCP_MAGIC 0x63825363
+#define DHCP_OPT_PAD 0
+#define DHCP_OPT_END 255
+#define DHCP_OPT_MESSAGE_TYPE 53
+#define DHCP_ACK 5
+
+static uint32_t home(const struct neigh *n, const unsigned char *addr) {
+    uint64_t a, b;
+    memcpy(&a, addr, sizeof(a));
+    memcpy(&b, addr + 8, sizeof(b));
+    uint64_t h = (a * 0x9e3779b97f4a7c15ULL) ^ b;
+    return (uint32_t)((h * 0xc2b2ae3d27d4eb4fULL) >> 32) & n->mask;
+}
+
+static bool
+aged(const struct neigh *n, const struct neigh_entry *e, uint32_t now) {
+    return now - e->seen >= n->age;
+}
+
+static bool full(const struct neigh *n) {
+    return n->count >= (n->mask + 1) / 4 * MAX_LOAD;
+}
+
+int neigh_init(struct neigh *n, uint32_t capacity, uint32_t age) {
+    // Keep the load factor for capacity addresses.
+    uint32_t size = 4;
+    while (size / 4 * MAX_LOAD < capacity) {
+        size *= 2;
+    }
+
+    *n = (struct neigh){.mask = size - 1, .age = age};
+    n->entries = calloc(size, sizeof(*n->entries));
+    if (n->entries == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+void neigh_destroy(struct neigh *n) {
+    free(n->entries);
+    n->entries = NULL;
+}
+
+// Remove entry i, moving back following entries of the probe sequence, so
+// lookups do not need tombstones.
+static void remove_at(struct neigh *n, uint32_t i) {
+    uint32_t j = i;
+    for (;;) {
+        j = (j + 1) & n->mask;
+        if (n->entries[j].mac == 0) {
+            break;
+        }
+        // The entry can move to i if its home is not in (i, j] cyclically.
+        uint32_t k = home(n, n->entries[j].addr);
+        bool stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+        if (!stays) {
+            n->entries[i] = n->entries[j];
+            i = j;
+        }
+    }
+    n->entries[i].mac = 0;
+    n->count--;
+}
+
+static void remove_aged(struct neigh *n, uint32_t now) {
+    for (uint32_t i = 0; i <= n->mask; i++) {
+        while (n->entries[i].mac && aged(n, &n->entries[i], now)) {
+            remove_at(n, i);
+        }
+    }
+}
+
+void neigh_learn(
+    struct neigh *n,
+    const unsigned char *addr,
+    uint64_t mac,
+    bool router,
+    uint32_t now
+) {
+    struct neigh_entry *reuse = NULL;
+    uint32_t i = home(n, addr);
+
+    for (;;) {
+        struct neigh_entry *e = &n->entries[i];
+        if (e->mac && memcmp(e->addr, addr, sizeof(e->addr)) == 0) {
+            if (e->mac != mac) {
+                e->mac = mac;
+                n->moved++;
+            }
+            e->router = router;
+            e->seen = now;
+            return;
+        }
+        if (e->mac == 0) {
+            break;
+        }
+        if (reuse == NULL && aged(n, e, now)) {
+            reuse = e;
+        }
+        i = (i + 1) & n->mask;
+    }
+
+    if (reuse == NULL) {
+        if (full(n)) {
+            remove_aged(n, now);
+            if (full(n)) {
+                return;
+            }
+            // Removing entries moves the free entries.
+            i = home(n, addr);
+            while (n->entries[i].mac) {
+                i = (i + 1) & n->mask;
+            }
+        }
+        reuse = &n->entries[i];
+        n->count++;
+    }
+
+    *reuse = (struct neigh_entry){.mac = mac, .seen = now, .router = router};
+    memcpy(reuse->addr, addr, sizeof(reuse->addr));
+    n->learned++;
+}
+
+const struct neigh_entry *
+neigh_lookup(struct neigh *n, const unsigned char *addr, uint32_t now) {
+    uint32_t i = home(n, addr);
+    for (;;) {
+        const struct neigh_entry *e = &n->entries[i];
+        if (e->mac == 0) {
+            return NULL;
+        }
+        if (memcmp(e->addr, addr, sizeof(e->addr)) == 0) {
+            return aged(n, e, now) ? NULL : e;
+        }
+        i = (i + 1) & n->mask;
+    }
+}
+
+// MARK: - Frames
+
+static uint16_t get16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return (uint32_t)get16(p) << 16 | get16(p + 2);
+}
+
+static void put16(unsigned char *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static uint64_t get_mac(const unsigned char *p) {
+    return (uint64_t)p[0] << 40 | (uint64_t)p[1] << 32 | (uint64_t)p[2] << 24 |
+           (uint64_t)p[3] << 16 | (uint64_t)p[4] << 8 | (uint64_t)p[5];
+}
+
+static void put_mac(unsigned char *p, uint64_t mac) {
+    for (int i = 0; i < 6; i++) {
+        p[i] = (mac >> (40 - 8 * i)) & 0xff;
+    }
+}
+
+static bool is_multicast_mac(uint64_t mac) {
+    return mac & (1ULL << 40);
+}
+
+// Store an IPv4 address as an IPv4 mapped IPv6 address.
+static void map_ipv4(unsigned char *addr, const unsigned char *ipv4) {
+    memset(addr, 0, 10);
+    addr[10] = 0xff;
+    addr[11] = 0xff;
+    memcpy(addr + 12, ipv4, 4);
+}
+
+// True for unicast IPv4 addresses a host may own.
+static bool is_host_ipv4(const unsigned char *ipv4) {
+    return ipv4[0] != 0 && ipv4[0] < 224;
+}
+
+static void learn_ipv4(
+    struct neigh *n, const unsigned char *ipv4, uint64_t mac, uint32_t now
+) {
+    if (is_host_ipv4(ipv4) && mac && !is_multicast_mac(mac)) {
+        unsigned char addr[16];
+        map_ipv4(addr, ipv4);
+        neigh_learn(n, addr, mac, false, now);
+    }
+}
+
+static size_t arp_input(
+    struct neigh *n,
+    const unsigned char *frame,
+    size_t len,
+    uint32_t now,
+    unsigned char *reply,
+    uint64_t *target
+) {
+    if (len < ETHER_HEADER_SIZE + ARP_SIZE) {
+        return 0;
+    }
+    const unsigned char *arp = frame + ETHER_HEADER_SIZE;
+    if (get16(arp) != 1 || get16(arp + 2) != ETHERTYPE_IPV4 || arp[4] != 6 ||
+        arp[5] != 4) {
+        return 0;
+    }
+    uint16_t op = get16(arp + 6);
+    const unsigned char *sha = arp + 8;
+    const unsigned char *spa = arp + 14;
+    const unsigned char *tpa = arp + 24;
+    uint64_t sender = get_mac(sha);
+
+    // Learn only addresses sent by their owner.
+    if ((op == ARP_REQUEST || op == ARP_REPLY) &&
+        sender == get_mac(frame + 6)) {
+        learn_ipv4(n, spa, sender, now);
+    }
+
+    // Probes and announcements are flooded, so the owner of the address can
+    // defend it.
+    if (op != ARP_REQUEST || !is_multicast_mac(get_mac(frame)) ||
+        !is_host_ipv4(spa) || memcmp(spa, tpa, 4) == 0) {
+        return 0;
+    }
+
+    unsigned char addr[16];
+    map_ipv4(addr, tpa);
+    const struct neigh_entry *e = neigh_lookup(n, addr, now);
+    if (e == NULL || e->mac == sender) {
+        return 0;
+    }
+
+    memcpy(reply, sha, 6);
+    put_mac(reply + 6, e->mac);
+    put16(reply + 12, ETHERTYPE_ARP);
+    unsigned char *r = reply + ETHER_HEADER_SIZE;
+    put16(r, 1);
+    put16(r + 2, ETHERTYPE_IPV4);
+    r[4] = 6;
+    r[5] = 4;
+    put16(r + 6, ARP_REPLY);
+    put_mac(r + 8, e->mac);
+    memcpy(r + 14, tpa, 4);
+    memcpy(r + 18, sha, 6);
+    memcpy(r + 24, spa, 4);
+    *target = e->mac;
+    return ETHER_HEADER_SIZE + ARP_SIZE;
+}
+
+// Find a link-layer address option of a neighbor discovery message. Returns
+// the address, or 0 if the message has no such option.
+static uint64_t
+find_linkaddr(const unsigned char *options, size_t len, int type) {
+    size_t off = 0;
+    while (off + 8 <= len) {
+        size_t size = options[off + 1] * 8;
+        if (size == 0 || off + size > len) {
+            break;
+        }
+        if (options[off] == type) {
+            return get_mac(options + off + 2);
+        }
+        off += size;
+    }
+    return 0;
+}
+
+static bool is_unspecified_ipv6(const unsigned char *addr) {
+    static const unsigned char zero[16];
+    return memcmp(addr, zero, sizeof(zero)) == 0;
+}
+
+// Build a neighbor advertisement for the target of a solicitation.
+static size_t build_advert(
+    const unsigned char *frame,
+    const struct neigh_entry *e,
+    unsigned char *reply
+) {
+    const unsigned char *ip = frame + ETHER_HEADER_SIZE;
+    const unsigned char *ns = ip + IPV6_HEADER_SIZE;
+
+    memcpy(reply, frame + 6, 6);
+    put_mac(reply + 6, e->mac);
+    put16(reply + 12, ETHERTYPE_IPV6);
+
+    unsigned char *r = reply + ETHER_HEADER_SIZE;
+    memset(r, 0, IPV6_HEADER_SIZE + NA_SIZE);
+    r[0] = 0x60;
+    put16(r + 4, NA_SIZE);
+    r[6] = PROTO_ICMPV6;
+    r[7] = ND_HOP_LIMIT;
+    memcpy(r + 8, e->addr, 16);
+    memcpy(r + 24, ip + 8, 16);
+
+    unsigned char *na = r + IPV6_HEADER_SIZE;
+    na[0] = ND_NEIGHBOR_ADVERT;
+    na[4] = NA_FLAG_SOLICITED | NA_FLAG_OVERRIDE;
+    if (e->router) {
+        na[4] |= NA_FLAG_ROUTER;
+    }
+    memcpy(na + 8, ns + 8, 16);
+    na[ND_SIZE] = ND_OPT_TARGET_LINKADDR;
+    na[ND_SIZE + 1] = 1;
+    put_mac(na + ND_SIZE + 2, e->mac);
+
+    // The pseudo header: addresses, upper layer length, and next header.
+    const unsigned char pseudo[8] = {0, 0, 0, NA_SIZE, 0, 0, 0, PROTO_ICMPV6};
+    uint32_t sum = inet_sum(r + 8, 32, 0);
+    sum = inet_sum(pseudo, sizeof(pseudo), sum);
+    sum = inet_sum(na, NA_SIZE, sum);
+    uint16_t checksum = inet_fold(sum);
+    memcpy(na + 2, &checksum, sizeof(checksum));
+
+    return ETHER_HEADER_SIZE + IPV6_HEADER_SIZE + NA_SIZE;
+}
+
+static size_t ipv6_input(
+    struct neigh *n,
+    const unsigned char *frame,
+    size_t len,
+    uint32_t now,
+    unsigned char *reply,
+    uint64_t *target
+) {
+    if (len < ETHER_HEADER_SIZE + IPV6_HEADER_SIZE + ND_SIZE) {
+        return 0;
+    }
+    const unsigned char *ip = frame + ETHER_HEADER_SIZE;
+    const unsigned char *nd = ip + IPV6_HEADER_SIZE;
+    // Neighbor discovery messages are not forwarded by routers.
+    if (ip[6] != PROTO_ICMPV6 || ip[7] != ND_HOP_LIMIT || nd[1] != 0) {
+        return 0;
+    }
+    size_t nd_len = get16(ip + 4);
+    if (nd_len < ND_SIZE ||
+        nd_len > len - ETHER_HEADER_SIZE - IPV6_HEADER_SIZE) {
+        return 0;
+    }
+    const unsigned char *addr = nd + 8;
+    // Solicitations and advertisements are never sent for multicast targets.
+    if (addr[0] == 0xff) {
+        return 0;
+    }
+
+    if (nd[0] == ND_NEIGHBOR_ADVERT) {
+        uint64_t mac = find_linkaddr(
+            nd + ND_SIZE, nd_len - ND_SIZE, ND_OPT_TARGET_LINKADDR
+        );
+        if (mac == 0) {
+            mac = get_mac(frame + 6);
+        }
+        if (!is_multicast_mac(mac)) {
+            neigh_learn(n, addr, mac, nd[4] & NA_FLAG_ROUTER, now);
+        }
+        return 0;
+    }
+
+    // Duplicate address detection is flooded, so the owner of the address
+    // can defend it.
+    if (nd[0] != ND_NEIGHBOR_SOLICIT || !is_multicast_mac(get_mac(frame)) ||
+        is_unspecified_ipv6(ip + 8)) {
+        return 0;
+    }
+
+    const struct neigh_entry *e = neigh_lookup(n, addr, now);
+    if (e == NULL || e->mac == get_mac(frame + 6)) {
+        return 0;
+    }
+    *target = e->mac;
+    return build_advert(frame, e, reply);
+}
+
+// Learn the address assigned by a DHCP server in an acknowledgment.
+static void dhcp_input(
+    struct neigh *n, const unsigned char *frame, size_t len, uint32_t now
+) {
+    const unsigned char *ip = frame + ETHER_HEADER_SIZE;
+    size_t ihl = (ip[0] & 0x0f) * 4;
+    if (ihl < IPV4_HEADER_SIZE ||
+        len < ETHER_HEADER_SIZE + ihl + UDP_HEADER_SIZE + BOOTP_OPTIONS) {
+        return;
+    }
+    const unsigned char *udp = ip + ihl;
+    if (get16(udp) != BOOTP_SERVER_PORT ||
+        get16(udp + 2) != BOOTP_CLIENT_PORT) {
+        return;
+    }
+    const unsigned char *bootp = udp + UDP_HEADER_SIZE;
+    if (bootp[0] != BOOTP_REPLY || bootp[1] != 1 || bootp[2] != 6 ||
+        get32(bootp + 236) != DHCP_MAGIC) {
+        return;
+    }
+
+    const unsigned char *options = bootp + BOOTP_OPTIONS;
+    size_t options_len = len - (options - frame);
+    size_t off = 0;
+    while (off < options_len && options[off] != DHCP_OPT_END) {
+        if (options[off] == DHCP_OPT_PAD) {
+            off++;
+            continue;
+        }
+        if (off + 2 > options_len ||
+            off + 2 + options[off + 1] > options_len) {
+            return;
+        }
+        if (options[off] == DHCP_OPT_MESSAGE_TYPE && options[off + 1] == 1) {
+            if (options[off + 2] == DHCP_ACK) {
+                learn_ipv4(n, bootp + 16, get_mac(bootp + 28), now);
+            }
+            return;
+        }
+        off += 2 + options[off + 1];
+    }
+}
+
+size_t neigh_input(
+    struct neigh *n,
+    const unsigned char *frame,
+    size_t len,
+    uint32_t now,
+    unsigned char *reply,
+    uint64_t *target
+) {
+    if (len < ETHER_HEADER_SIZE + IPV4_HEADER_SIZE) {
+        return 0;
+    }
+    switch (get16(frame + 12)) {
+    case ETHERTYPE_ARP:
+        return arp_input(n, frame, len, now, reply, target);
+    case ETHERTYPE_IPV6:
+        return ipv6_input(n, frame, len, now, reply, target);
+    case ETHERTYPE_IPV4:
+        if (frame[ETHER_HEADER_SIZE + 9] == PROTO_UDP) {
+            dhcp_input(n, frame, len, now);
+        }
+        return 0;
+    default:
+        return 0;
+    }
+}
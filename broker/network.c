@@ -1,31 +1,121 @@
 // SPDX-FileCopyrightText: The vmnet-broker authors
 // SPDX-License-Identifier: Apache-2.0
 
+#include <Block.h>
 #include <CoreFoundation/CFBase.h>
 #include <dispatch/dispatch.h>
 #include <errno.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "broker-config.h"
+#include "broker-events.h"
+#include "broker-history.h"
+#include "broker-network.h"
+#include "broker-peer.h"
+#include "broker-pool.h"
+#include "broker-shard.h"
+#include "broker-subnets.h"
 #include "broker-xpc.h"
 #include "common.h"
 #include "log.h"
 #include "vmnet-broker.h"
 
 extern const int idle_timeout_sec;
+extern const int max_creating_networks;
+extern const int shutdown_timeout_sec;
+extern const int precreate_budget;
 
-// Shared network used by one or more peers.
+// Names shorter than this are stored in the network record.
+#define INLINE_NAME_SIZE 32
+
+// Shared network used by one or more peers. Accessed only on the queue of the
+// shard owning the network.
 struct network {
+    // Points to inline_name, or to an allocated string for long names.
     char *name;
+    char inline_name[INLINE_NAME_SIZE];
+    // The shard owning the network.
+    int shard;
     int peers; // Number of peers using this network
     vmnet_network_ref ref;
     xpc_object_t serialization;
     dispatch_source_t idle_timer;
+    // Network addresses and mode, recorded when the network is created.
+    struct network_info info;
+    const char *mode;
+    time_t created;
+    // Leases acquired for this network by token. Created when the first
+    // lease is acquired.
+    CFMutableDictionaryRef leases;
+    // True while the network is created in the shard slow lane and on the
+    // create queue, and until requests deferred while creating the network
+    // complete. Requests for the network are deferred while creating.
+    bool creating;
+    // True if the network was removed from the registry while creating.
+    bool removed;
+    // True if creating the network requested the subnet assigned when the
+    // network was last created, and the requested subnet.
+    bool sticky;
+    struct subnet last_subnet;
+    // True if the network was created because it was predicted from the usage
+    // history, until a peer acquires it.
+    bool predicted;
+    struct pending *pending_head;
+    struct pending *pending_tail;
+};
+
+// Request for a network deferred while the network is created.
+struct pending {
+    struct broker_context *ctx;
+    // Called with 0 when the network was created, or an error code if
+    // creating the network failed or the peer disconnected.
+    void (^run)(int error);
+    struct pending *next;
+};
+
+// Lease keeping a network reference after the peer holding it disconnects,
+// until the lease expires or a peer presenting the same token reclaims it.
+struct lease {
+    char *token;
+    int duration_sec;
+    struct network *network;
+    // Peer holding the lease, or NULL if the lease is retained.
+    const struct broker_context *holder;
+    // Expiration timer, running while the lease is retained.
+    dispatch_source_t timer;
+};
+
+// Number of retained leases, used to prevent termination while leases are
+// retained. Updated on the shard queues, read on the main queue.
+static _Atomic int retained_leases;
+
+// Number of networks being created in all shards.
+static _Atomic int creating_networks;
+
+// Network records are reused, so creating and removing networks does not
+// allocate memory for the record in steady state.
+static struct pool network_pool = POOL_INITIALIZER("networks", struct network);
+
+// Maximum number of networks considered for creating when the broker starts.
+#define MAX_PREDICTED 8
+
+// Maximum number of deferred requests run in one shard queue block.
+#define PENDING_BATCH 8
+
+// Network registry shard - keeps track of the networks in a shard by name.
+// Accessed only on the shard queue.
+struct registry {
+    // Created when the first network in the shard is created.
+    CFMutableDictionaryRef networks;
+    // Number of networks in the shard being created.
+    int creating;
 };
 
-// Network registry - keeps track of acquired networks by name.
-static CFMutableDictionaryRef registry;
+static struct registry registries[SHARD_COUNT];
 
 // External reference to main context (defined in broker.c)
 extern const struct broker_context main_context;
@@ -39,20 +129,35 @@ static void free_network(
         return;
     }
 
+    if (network->creating) {
+        // Creating the network owns the network now; it will be freed when
+        // creating the network completes.
+        network->removed = true;
+        return;
+    }
+
+    if (network->predicted) {
+        DEBUGF(
+            "[%s] predicted network '%s' was not acquired",
+            ctx->name,
+            network->name
+        );
+        history_prediction_miss();
+    }
+
     if (network->ref) {
-        struct network_info info;
-        network_info(network->ref, &info);
         INFOF(
             "[%s] deleted network '%s' subnet '%s' mask '%s' ipv6_prefix "
             "'%s' prefix_len %d",
             ctx->name,
             network->name,
-            info.subnet,
-            info.mask,
-            info.ipv6_prefix,
-            info.prefix_len
+            network->info.subnet,
+            network->info.mask,
+            network->info.ipv6_prefix,
+            network->info.prefix_len
         );
         CFRelease(network->ref);
+        publish_network_event(EVENT_REMOVED, network->name, 0);
     }
     if (network->serialization) {
         xpc_release(network->serialization);
@@ -61,25 +166,26 @@ static void free_network(
         dispatch_source_cancel(network->idle_timer);
         dispatch_release(network->idle_timer);
     }
-    free(network->name);
-    free(network);
+    if (network->leases) {
+        // Releasing the dictionary will call lease_release for each value.
+        CFRelease(network->leases);
+    }
+    if (network->name != network->inline_name) {
+        free(network->name);
+    }
+    pool_free(&network_pool, network);
 }
 
-static struct network *create_network(
-    const struct broker_context *ctx,
-    const char *name,
-    vmnet_network_configuration_ref config,
-    int *error
-) {
-    vmnet_return_t status;
-    struct network *network = NULL;
+static struct network *
+new_network(const struct broker_context *ctx, const char *name) {
+    struct network *network = pool_alloc(&network_pool);
+    *network = (struct network){.shard = shard_for_network(name)};
 
-    network = calloc(1, sizeof(*network));
-    if (network == NULL) {
-        WARNF(
-            "[%s] failed to allocate network: %s", ctx->name, strerror(errno)
-        );
-        goto failure;
+    size_t len = strlen(name);
+    if (len < sizeof(network->inline_name)) {
+        memcpy(network->inline_name, name, len + 1);
+        network->name = network->inline_name;
+        return network;
     }
 
     network->name = strdup(name);
@@ -89,54 +195,53 @@ static struct network *create_network(
             ctx->name,
             strerror(errno)
         );
-        goto failure;
+        pool_free(&network_pool, network);
+        return NULL;
     }
 
+    return network;
+}
+
+// Create the vmnet network. Runs on the create queue, accessing only the
+// network name, ref, serialization and info, which are not accessed on the
+// shard queue while the network is creating.
+// Returns 0 on success, or an error code.
+static int create_vmnet_network(
+    struct network *network, vmnet_network_configuration_ref config
+) {
+    vmnet_return_t status;
+
     network->ref = vmnet_network_create(config, &status);
     if (network->ref == NULL) {
         WARNF(
-            "[%s] failed to create network ref: (%d) %s",
-            ctx->name,
+            "[%s] failed to create network '%s' ref: (%d) %s",
+            main_context.name,
+            network->name,
             status,
             vmnet_strerror(status)
         );
-        goto failure;
+        return VMNET_BROKER_CREATE_FAILURE;
     }
 
-    struct network_info info;
-    network_info(network->ref, &info);
-    INFOF(
-        "[%s] created network '%s' subnet '%s' mask '%s' ipv6_prefix '%s' "
-        "prefix_len %d",
-        ctx->name,
-        name,
-        info.subnet,
-        info.mask,
-        info.ipv6_prefix,
-        info.prefix_len
-    );
-
     network->serialization = vmnet_network_copy_serialization(
         network->ref, &status
     );
     if (network->serialization == NULL) {
         WARNF(
-            "[%s] failed to create network serialization: (%d) %s",
-            ctx->name,
+            "[%s] failed to create network '%s' serialization: (%d) %s",
+            main_context.name,
+            network->name,
             status,
             vmnet_strerror(status)
         );
-        goto failure;
+        CFRelease(network->ref);
+        network->ref = NULL;
+        return VMNET_BROKER_CREATE_FAILURE;
     }
 
-    return network;
+    network_info(network->ref, &network->info);
 
-failure:
-    free_network(network, ctx);
-    if (error) {
-        *error = VMNET_BROKER_CREATE_FAILURE;
-    }
-    return NULL;
+    return 0;
 }
 
 // MARK: - Network registry functions
@@ -161,38 +266,48 @@ static const CFDictionaryValueCallBacks registry_value_callbacks = {
     .release = registry_release,
 };
 
-static void init_registry(void) {
-    if (registry == NULL) {
-        registry = CFDictionaryCreateMutable(
-            NULL, 0, &kCFTypeDictionaryKeyCallBacks, &registry_value_callbacks
-        );
-    }
+// Return the registry shard owning the named network.
+static struct registry *registry_for(const char *name) {
+    return &registries[shard_for_network(name)];
 }
 
-static void release_registry(const struct broker_context *ctx) {
-    if (registry) {
+static void
+release_registry(const struct broker_context *ctx, struct registry *r) {
+    if (r->networks) {
         DEBUGF("[%s] shutdown all networks", ctx->name);
         // Releasing the registry will call network_registry_release for each
         // value
-        CFRelease(registry);
-        registry = NULL;
+        CFRelease(r->networks);
+        r->networks = NULL;
     }
 }
 
 static struct network *registry_get(const char *name) {
+    struct registry *r = registry_for(name);
+    if (r->networks == NULL) {
+        return NULL;
+    }
     CFStringRef key = CFStringCreateWithCString(
         NULL, name, kCFStringEncodingUTF8
     );
-    struct network *net = (struct network *)CFDictionaryGetValue(registry, key);
+    struct network *net = (struct network *)CFDictionaryGetValue(
+        r->networks, key
+    );
     CFRelease(key);
     return net;
 }
 
 static void registry_set(const char *name, struct network *net) {
+    struct registry *r = registry_for(name);
+    if (r->networks == NULL) {
+        r->networks = CFDictionaryCreateMutable(
+            NULL, 0, &kCFTypeDictionaryKeyCallBacks, &registry_value_callbacks
+        );
+    }
     CFStringRef key = CFStringCreateWithCString(
         NULL, name, kCFStringEncodingUTF8
     );
-    CFDictionarySetValue(registry, key, net);
+    CFDictionarySetValue(r->networks, key, net);
     CFRelease(key);
 }
 
@@ -200,7 +315,7 @@ static void registry_remove(const char *name) {
     CFStringRef key = CFStringCreateWithCString(
         NULL, name, kCFStringEncodingUTF8
     );
-    CFDictionaryRemoveValue(registry, key);
+    CFDictionaryRemoveValue(registry_for(name)->networks, key);
     CFRelease(key);
 }
 
@@ -214,6 +329,8 @@ remove_later(const struct broker_context *ctx, struct network *net) {
         net->name,
         idle_timeout_sec
     );
+    publish_network_event(EVENT_IDLE, net->name, net->peers);
+    history_network_unused(net->name);
 
     // This is impossible since the first connected peer canceled the timer, and
     // shutdown_later is called when the last peer has disconnected.
@@ -222,7 +339,7 @@ remove_later(const struct broker_context *ctx, struct network *net) {
     );
 
     net->idle_timer = dispatch_source_create(
-        DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue()
+        DISPATCH_SOURCE_TYPE_TIMER, 0, 0, shard_queue(net->shard)
     );
 
     assert(net->idle_timer != NULL && "failed to create idle timer");
@@ -261,49 +378,479 @@ cancel_remove_later(struct broker_context *ctx, struct network *net) {
     }
 }
 
-// MARK: - Peer ownership helpers
+// MARK: - Creating networks
 
-// Check if peer already owns a network.
-static bool
-peer_owns_network(const struct broker_context *ctx, const struct network *net) {
-    for (int i = 0; i < ctx->network_count; i++) {
-        if (ctx->networks[i] == net) {
-            return true;
+// Creating a network can take a long time. Creating it on a concurrent queue
+// keeps the shard queue available for requests for other networks, and allows
+// creating different networks in the same shard in parallel. The registry is
+// accessed only on the shard queue.
+static dispatch_queue_t create_queue(void) {
+    return dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0);
+}
+
+// Start creating a network, unless max_creating_networks networks are being
+// created in all shards. Returns false if the network cannot be created now.
+static bool creating_begin(void) {
+    if (atomic_fetch_add(&creating_networks, 1) >= max_creating_networks) {
+        atomic_fetch_sub(&creating_networks, 1);
+        return false;
+    }
+    return true;
+}
+
+static void creating_end(void) { atomic_fetch_sub(&creating_networks, 1); }
+
+// Defer a request until the network is created. Requests are run in the order
+// they were deferred.
+static void defer_request(
+    struct broker_context *ctx, struct network *net, void (^run)(int error)
+) {
+    struct pending *p = calloc(1, sizeof(*p));
+    assert(p != NULL && "failed to allocate pending request");
+
+    p->ctx = ctx;
+    p->run = Block_copy(run);
+
+    if (net->pending_tail) {
+        net->pending_tail->next = p;
+    } else {
+        net->pending_head = p;
+    }
+    net->pending_tail = p;
+
+    DEBUGF("[%s] waiting until network '%s' is created", ctx->name, net->name);
+}
+
+// Run deferred requests for a network, in order. Running a small batch and
+// continuing in a new block on the shard queue lets other requests received
+// meanwhile, such as acquiring existing networks, run before the rest of the
+// deferred requests. When all deferred requests complete, the network is
+// created.
+static void drain_pending(struct network *net, int error) {
+    if (net->removed) {
+        error = VMNET_BROKER_INTERNAL_ERROR;
+    }
+
+    for (int i = 0; i < PENDING_BATCH && net->pending_head; i++) {
+        struct pending *p = net->pending_head;
+        net->pending_head = p->next;
+        if (net->pending_head == NULL) {
+            net->pending_tail = NULL;
         }
+        p->run(error);
+        Block_release(p->run);
+        free(p);
+    }
+
+    if (net->pending_head) {
+        shard_async(net->shard, ^{
+            drain_pending(net, error);
+        });
+        return;
+    }
+
+    net->creating = false;
+    registries[net->shard].creating--;
+    creating_end();
+
+    if (net->removed) {
+        // Removed from the registry during shutdown.
+        free_network(net, &main_context);
+    } else if (error) {
+        // Frees the network.
+        registry_remove(net->name);
+    } else if (net->peers == 0 && net->idle_timer == NULL) {
+        // All peers waiting for the network disconnected. If a deferred
+        // release dropped the last peer, removal is already scheduled.
+        remove_later(&main_context, net);
     }
-    return false;
 }
 
-// Assumes peer does not already own the network (caller must check first).
-static bool can_add_network_to_peer(struct broker_context *ctx, int *error) {
-    if (ctx->network_count >= MAX_PEER_NETWORKS) {
-        WARNF(
-            "[%s] peer has too many networks (%d)",
-            ctx->name,
-            ctx->network_count
+// Fail the requests of a disconnected peer, so they do not access the peer
+// context when the network is created.
+static void cancel_peer_pending(const void *key, const void *value, void *arg) {
+    (void)key;
+    struct network *net = (struct network *)value;
+    struct broker_context *ctx = arg;
+
+    if (!net->creating) {
+        return;
+    }
+
+    struct pending *prev = NULL;
+    struct pending *p = net->pending_head;
+    while (p) {
+        struct pending *next = p->next;
+        if (p->ctx == ctx) {
+            if (prev) {
+                prev->next = next;
+            } else {
+                net->pending_head = next;
+            }
+            if (net->pending_tail == p) {
+                net->pending_tail = prev;
+            }
+            p->run(VMNET_BROKER_INTERNAL_ERROR);
+            Block_release(p->run);
+            free(p);
+        } else {
+            prev = p;
+        }
+        p = next;
+    }
+}
+
+static void finish_create_network(struct network *net, int error) {
+    if (error == 0 && !net->removed) {
+        net->mode = network_config_mode(net->name);
+        net->created = time(NULL);
+        INFOF(
+            "[%s] created network '%s' subnet '%s' mask '%s' ipv6_prefix '%s' "
+            "prefix_len %d",
+            main_context.name,
+            net->name,
+            net->info.subnet,
+            net->info.mask,
+            net->info.ipv6_prefix,
+            net->info.prefix_len
+        );
+        publish_network_created(net->name, &net->info);
+        remember_subnet(
+            &main_context,
+            net->name,
+            net->sticky ? &net->last_subnet : NULL,
+            &net->info
+        );
+    }
+
+    drain_pending(net, error);
+}
+
+// Create the network configuration, and create the vmnet network on the create
+// queue. Runs in the shard slow lane, since creating the configuration is
+// expensive. If the network was created before, request the same subnet first,
+// so guests keep their addresses.
+static void create_network(struct network *net) {
+    if (net->removed) {
+        // Removed from the registry during shutdown.
+        drain_pending(net, VMNET_BROKER_INTERNAL_ERROR);
+        return;
+    }
+
+    int error = 0;
+    vmnet_network_configuration_ref config = create_network_configuration(
+        &main_context, net->name, &error
+    );
+    if (config == NULL) {
+        drain_pending(net, error);
+        return;
+    }
+
+    vmnet_network_configuration_ref sticky_config = NULL;
+    if (last_subnet(net->name, &net->last_subnet)) {
+        sticky_config = create_network_configuration_with_subnet(
+            &main_context, net->name, &net->last_subnet, NULL
         );
+        net->sticky = sticky_config != NULL;
+    }
+
+    dispatch_async(create_queue(), ^{
+        int error = VMNET_BROKER_CREATE_FAILURE;
+        if (sticky_config) {
+            error = create_vmnet_network(net, sticky_config);
+            CFRelease(sticky_config);
+        }
+        // Fall back to a dynamic subnet if the subnet is used by another
+        // network.
         if (error) {
-            *error = VMNET_BROKER_INTERNAL_ERROR;
+            error = create_vmnet_network(net, config);
         }
-        return false;
+        CFRelease(config);
+        shard_async(net->shard, ^{
+            finish_create_network(net, error);
+        });
+    });
+}
+
+// Add a network being created to the registry, and create it in the shard slow
+// lane. Requests for the network are deferred until the network is created, so
+// they keep their order. Must be called after creating_begin().
+static void
+start_create_network(const struct broker_context *ctx, struct network *net) {
+    INFOF("[%s] creating network '%s'", ctx->name, net->name);
+
+    net->creating = true;
+    registries[net->shard].creating++;
+    registry_set(net->name, net);
+
+    shard_slow_async(net->shard, ^{
+        create_network(net);
+    });
+}
+
+// MARK: - Lease functions
+
+// Like connected peers, retained leases must prevent launchd from stopping the
+// broker. Leases are retained on all shard queues, so every lease has its own
+// transaction instead of counting leases.
+static void retained_lease_begin(void) {
+    atomic_fetch_add(&retained_leases, 1);
+    xpc_transaction_begin();
+}
+
+static void retained_lease_end(void) {
+    xpc_transaction_end();
+    atomic_fetch_sub(&retained_leases, 1);
+}
+
+static void free_lease(struct lease *lease) {
+    if (lease->timer) {
+        dispatch_source_cancel(lease->timer);
+        dispatch_release(lease->timer);
+        retained_lease_end();
     }
-    return true;
+    free(lease->token);
+    free(lease);
+}
+
+// Called only by CFDictionary when adding to network leases. The lease is
+// already allocated so this does nothing.
+static const void *lease_retain(CFAllocatorRef allocator, const void *value) {
+    (void)allocator;
+    return value;
+}
+
+// Called only by CFDictionary when removing from network leases. The lease will
+// be freed.
+static void lease_release(CFAllocatorRef allocator, const void *value) {
+    (void)allocator;
+    free_lease((struct lease *)value);
+}
+
+static const CFDictionaryValueCallBacks lease_value_callbacks = {
+    .retain = lease_retain,
+    .release = lease_release,
+};
+
+static struct lease *lease_get(struct network *net, const char *token) {
+    if (net->leases == NULL) {
+        return NULL;
+    }
+    CFStringRef key = CFStringCreateWithCString(
+        NULL, token, kCFStringEncodingUTF8
+    );
+    struct lease *lease = (struct lease *)CFDictionaryGetValue(
+        net->leases, key
+    );
+    CFRelease(key);
+    return lease;
+}
+
+static void lease_set(struct network *net, struct lease *lease) {
+    if (net->leases == NULL) {
+        net->leases = CFDictionaryCreateMutable(
+            NULL, 0, &kCFTypeDictionaryKeyCallBacks, &lease_value_callbacks
+        );
+    }
+    CFStringRef key = CFStringCreateWithCString(
+        NULL, lease->token, kCFStringEncodingUTF8
+    );
+    CFDictionarySetValue(net->leases, key, lease);
+    CFRelease(key);
+}
+
+static void lease_remove(struct network *net, const char *token) {
+    CFStringRef key = CFStringCreateWithCString(
+        NULL, token, kCFStringEncodingUTF8
+    );
+    CFDictionaryRemoveValue(net->leases, key);
+    CFRelease(key);
 }
 
-// Ensure peer owns the network, adding it if not already owned.
-// Returns true on success, false on failure.
-static bool update_peer_ownership(
-    struct broker_context *ctx, struct network *net, int *error
+// Call fn for each lease of the network. fn may remove the lease.
+static void for_each_lease(
+    struct broker_context *ctx,
+    struct network *net,
+    void (*fn)(struct broker_context *ctx, struct lease *lease)
 ) {
-    if (peer_owns_network(ctx, net)) {
-        return true;
+    if (net->leases == NULL) {
+        return;
     }
 
-    if (!can_add_network_to_peer(ctx, error)) {
-        return false;
+    CFIndex count = CFDictionaryGetCount(net->leases);
+    if (count == 0) {
+        return;
+    }
+
+    const void **values = malloc(count * sizeof(*values));
+    assert(values != NULL && "failed to allocate leases");
+    CFDictionaryGetKeysAndValues(net->leases, NULL, values);
+    for (CFIndex i = 0; i < count; i++) {
+        fn(ctx, (struct lease *)values[i]);
+    }
+    free(values);
+}
+
+// Create or take over the lease for the peer. Must be called after the peer
+// owns the network.
+static void hold_lease(
+    struct broker_context *ctx,
+    struct network *net,
+    const struct lease_request *request
+) {
+    struct lease *lease = lease_get(net, request->token);
+
+    if (lease == NULL) {
+        lease = calloc(1, sizeof(*lease));
+        assert(lease != NULL && "failed to allocate lease");
+        lease->token = strdup(request->token);
+        assert(lease->token != NULL && "failed to allocate lease token");
+        lease->network = net;
+        lease_set(net, lease);
+        DEBUGF(
+            "[%s] created lease '%s' for network '%s'",
+            ctx->name,
+            lease->token,
+            net->name
+        );
+    } else if (lease->holder == NULL) {
+        // The retained lease holds a peer reference. The peer owns the network
+        // now, so drop the lease reference.
+        dispatch_source_cancel(lease->timer);
+        dispatch_release(lease->timer);
+        lease->timer = NULL;
+        retained_lease_end();
+        net->peers--;
+        INFOF(
+            "[%s] reclaimed lease '%s' for network '%s' (peers %d)",
+            ctx->name,
+            lease->token,
+            net->name,
+            net->peers
+        );
+        publish_network_event(EVENT_RELEASED, net->name, net->peers);
+    } else if (lease->holder != ctx) {
+        // The previous holder may be a restarted client whose connection was
+        // not invalidated yet.
+        DEBUGF(
+            "[%s] took over lease '%s' for network '%s' from [%s]",
+            ctx->name,
+            lease->token,
+            net->name,
+            lease->holder->name
+        );
+    }
+
+    lease->holder = ctx;
+    lease->duration_sec = request->duration_sec;
+}
+
+static void expire_lease(struct lease *lease) {
+    struct network *net = lease->network;
+
+    INFOF(
+        "[%s] lease '%s' for network '%s' expired",
+        main_context.name,
+        lease->token,
+        net->name
+    );
+
+    // Frees the lease.
+    lease_remove(net, lease->token);
+
+    net->peers--;
+    INFOF(
+        "[%s] released network '%s' (peers %d)",
+        main_context.name,
+        net->name,
+        net->peers
+    );
+    publish_network_event(EVENT_RELEASED, net->name, net->peers);
+
+    if (net->peers == 0) {
+        remove_later(&main_context, net);
+    }
+}
+
+// Keep the peer reference for the lease duration after the peer disconnects.
+static void retain_lease(struct broker_context *ctx, struct lease *lease) {
+    if (lease->holder != ctx) {
+        return;
+    }
+
+    struct network *net = lease->network;
+
+    lease->holder = NULL;
+    net->peers++;
+    retained_lease_begin();
+
+    INFOF(
+        "[%s] retaining lease '%s' for network '%s' for %d seconds",
+        ctx->name,
+        lease->token,
+        net->name,
+        lease->duration_sec
+    );
+    publish_network_event(EVENT_ACQUIRED, net->name, net->peers);
+
+    lease->timer = dispatch_source_create(
+        DISPATCH_SOURCE_TYPE_TIMER, 0, 0, shard_queue(net->shard)
+    );
+
+    assert(lease->timer != NULL && "failed to create lease timer");
+
+    dispatch_time_t start = dispatch_time(
+        DISPATCH_TIME_NOW, lease->duration_sec * NSEC_PER_SEC
+    );
+    // Allow the system up to 1 second leeway if this can improve power
+    // consumption and system performance.
+    uint64_t leeway = 1 * NSEC_PER_SEC;
+
+    dispatch_source_set_timer(
+        lease->timer, start, DISPATCH_TIME_FOREVER, leeway
+    );
+
+    dispatch_source_set_event_handler(lease->timer, ^{
+        // Frees the lease.
+        expire_lease(lease);
+    });
+
+    dispatch_resume(lease->timer);
+}
+
+// Remove the lease held by the peer, when the peer releases the network.
+static void drop_lease(struct broker_context *ctx, struct lease *lease) {
+    if (lease->holder != ctx) {
+        return;
+    }
+
+    DEBUGF(
+        "[%s] dropped lease '%s' for network '%s'",
+        ctx->name,
+        lease->token,
+        lease->network->name
+    );
+
+    // Frees the lease.
+    lease_remove(lease->network, lease->token);
+}
+
+// MARK: - Peer ownership helpers
+
+// Ensure peer owns the network, adding a peer reference.
+static void
+update_peer_ownership(struct broker_context *ctx, struct network *net) {
+    int refs = peer_add_network(ctx, net->shard, net);
+    if (refs > 1) {
+        DEBUGF(
+            "[%s] acquired network '%s' again (refs %d)",
+            ctx->name,
+            net->name,
+            refs
+        );
+        return;
     }
 
-    ctx->networks[ctx->network_count++] = net;
     net->peers++;
     INFOF(
         "[%s] acquired network '%s' (peers %d)",
@@ -311,69 +858,455 @@ static bool update_peer_ownership(
         net->name,
         net->peers
     );
+    publish_network_event(EVENT_ACQUIRED, net->name, net->peers);
 
-    return true;
+    if (net->peers == 1) {
+        history_network_used(net->name);
+    }
+}
+
+// Drop the peer ownership of the network, scheduling removal of the network if
+// this was the last peer.
+static void
+drop_peer_ownership(struct broker_context *ctx, struct network *net) {
+    net->peers--;
+    INFOF(
+        "[%s] released network '%s' (peers %d)",
+        ctx->name,
+        net->name,
+        net->peers
+    );
+    publish_network_event(EVENT_RELEASED, net->name, net->peers);
+
+    if (net->peers == 0) {
+        remove_later(ctx, net);
+    }
+}
+
+// Called for each network when the peer disconnects. Leases held by the peer
+// are retained before dropping the peer ownership, so the network is kept.
+static void disconnect_peer_network(struct broker_context *ctx, void *network) {
+    struct network *net = network;
+    for_each_lease(ctx, net, retain_lease);
+    drop_peer_ownership(ctx, net);
 }
 
 // MARK: - Public API
 
-xpc_object_t acquire_network(
-    struct broker_context *ctx, const char *network_name, int *error
+// Complete acquiring a created network.
+static void finish_acquire(
+    struct broker_context *ctx,
+    struct network *net,
+    const struct lease_request *lease,
+    acquire_completion_t completion
 ) {
-    init_registry();
+    update_peer_ownership(ctx, net);
+
+    if (net->predicted) {
+        DEBUGF("[%s] predicted network '%s' acquired", ctx->name, net->name);
+        net->predicted = false;
+        history_prediction_hit();
+    }
+
+    if (lease) {
+        hold_lease(ctx, net, lease);
+    }
 
+    cancel_remove_later(ctx, net);
+
+    completion(net->serialization, 0);
+}
+
+void acquire_network(
+    struct broker_context *ctx,
+    const char *network_name,
+    const struct lease_request *lease,
+    acquire_completion_t completion
+) {
     struct network *net = registry_get(network_name);
 
     if (net == NULL) {
-        if (!can_add_network_to_peer(ctx, error)) {
-            return NULL;
+        if (!creating_begin()) {
+            completion(NULL, VMNET_BROKER_BUSY);
+            return;
         }
 
-        vmnet_network_configuration_ref config = create_network_configuration(
-            ctx, network_name, error
-        );
-        if (config == NULL) {
-            return NULL;
+        // Creating the network configuration runs in the slow lane, so only
+        // check that the network is configured.
+        if (network_config_mode(network_name) == NULL) {
+            WARNF("[%s] network '%s' not found", ctx->name, network_name);
+            creating_end();
+            completion(NULL, VMNET_BROKER_NOT_FOUND);
+            return;
         }
 
-        net = create_network(ctx, network_name, config, error);
-        CFRelease(config);
-        config = NULL;
+        net = new_network(ctx, network_name);
         if (net == NULL) {
-            return NULL;
+            creating_end();
+            completion(NULL, VMNET_BROKER_CREATE_FAILURE);
+            return;
+        }
+
+        start_create_network(ctx, net);
+    }
+
+    if (net->creating) {
+        // The lease token is owned by the request, which is valid until
+        // completion is called.
+        bool has_lease = lease != NULL;
+        struct lease_request saved_lease = {0};
+        if (has_lease) {
+            saved_lease = *lease;
         }
+        defer_request(ctx, net, ^(int error) {
+            if (error) {
+                completion(NULL, error);
+                return;
+            }
+            finish_acquire(
+                ctx, net, has_lease ? &saved_lease : NULL, completion
+            );
+        });
+        return;
+    }
+
+    finish_acquire(ctx, net, lease, completion);
+}
+
+// Release a peer reference to a created network.
+// Returns 0 on success, or an error code.
+static int release_created_network(
+    struct broker_context *ctx, struct network *net, const char *network_name
+) {
+    int refs = net ? peer_remove_network(ctx, net->shard, net) : -1;
+    if (refs < 0) {
+        WARNF(
+            "[%s] network '%s' not acquired by peer", ctx->name, network_name
+        );
+        return VMNET_BROKER_NOT_FOUND;
+    }
+
+    if (refs > 0) {
+        DEBUGF(
+            "[%s] released network '%s' (refs %d)",
+            ctx->name,
+            net->name,
+            refs
+        );
+        return 0;
+    }
+
+    // Releasing the network explicitly ends the lease.
+    for_each_lease(ctx, net, drop_lease);
+    drop_peer_ownership(ctx, net);
+
+    return 0;
+}
+
+void release_network(
+    struct broker_context *ctx,
+    const char *network_name,
+    release_completion_t completion
+) {
+    struct network *net = registry_get(network_name);
+
+    if (net && net->creating) {
+        // Keep the order of requests for the network.
+        defer_request(ctx, net, ^(int error) {
+            if (error) {
+                completion(VMNET_BROKER_NOT_FOUND);
+                return;
+            }
+            completion(release_created_network(ctx, net, network_name));
+        });
+        return;
+    }
+
+    completion(release_created_network(ctx, net, network_name));
+}
+
+void release_peer_networks(
+    struct broker_context *ctx, dispatch_block_t completion
+) {
+    // Requests of the peer received before it disconnected run on the shard
+    // queues before the peer networks are released.
+    dispatch_group_t group = dispatch_group_create();
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        shard_group_async(i, group, ^{
+            struct registry *r = &registries[i];
+            if (r->creating > 0) {
+                CFDictionaryApplyFunction(
+                    r->networks, cancel_peer_pending, ctx
+                );
+            }
+            peer_remove_all_networks(ctx, i, disconnect_peer_network);
+        });
+    }
+    dispatch_group_notify(group, dispatch_get_main_queue(), completion);
+    dispatch_release(group);
+}
+
+static xpc_object_t create_network_info(const struct network *net) {
+    xpc_object_t info = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(info, NETWORK_NAME, net->name);
+    xpc_dictionary_set_string(info, NETWORK_SUBNET, net->info.subnet);
+    xpc_dictionary_set_string(info, NETWORK_MASK, net->info.mask);
+    xpc_dictionary_set_string(info, NETWORK_IPV6_PREFIX, net->info.ipv6_prefix);
+    xpc_dictionary_set_int64(info, NETWORK_PREFIX_LEN, net->info.prefix_len);
+    xpc_dictionary_set_string(info, NETWORK_MODE, net->mode);
+    xpc_dictionary_set_int64(info, NETWORK_PEERS, net->peers);
+    xpc_dictionary_set_int64(info, NETWORK_AGE, time(NULL) - net->created);
+    return info;
+}
 
-        registry_set(network_name, net);
+static void
+add_network_info(const void *key, const void *value, void *context) {
+    (void)key;
+    const struct network *net = value;
+    if (net->creating) {
+        return;
     }
+    xpc_object_t networks = context;
+    xpc_object_t info = create_network_info(net);
+    xpc_array_append_value(networks, info);
+    xpc_release(info);
+}
 
-    if (!update_peer_ownership(ctx, net, error)) {
+xpc_object_t copy_networks_info(
+    const struct broker_context *ctx, const char *network_name, int *error
+) {
+    struct network *net = registry_get(network_name);
+    if (net == NULL || net->creating) {
+        DEBUGF("[%s] network '%s' does not exist", ctx->name, network_name);
+        if (error) {
+            *error = VMNET_BROKER_NOT_FOUND;
+        }
         return NULL;
     }
 
-    cancel_remove_later(ctx, net);
+    xpc_object_t networks = xpc_array_create_empty();
+    add_network_info(NULL, net, networks);
+    return networks;
+}
+
+void get_all_networks_info(networks_completion_t completion) {
+    // The shards run in parallel, so every shard adds its networks to a
+    // separate array.
+    xpc_object_t *parts = calloc(SHARD_COUNT, sizeof(*parts));
+    assert(parts != NULL && "failed to allocate networks");
+
+    dispatch_group_t group = dispatch_group_create();
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        shard_group_async(i, group, ^{
+            parts[i] = xpc_array_create_empty();
+            if (registries[i].networks) {
+                CFDictionaryApplyFunction(
+                    registries[i].networks, add_network_info, parts[i]
+                );
+            }
+        });
+    }
 
-    return xpc_retain(net->serialization);
+    dispatch_group_notify(group, dispatch_get_main_queue(), ^{
+        xpc_object_t networks = xpc_array_create_empty();
+        for (int i = 0; i < SHARD_COUNT; i++) {
+            xpc_array_apply(parts[i], ^bool(size_t index, xpc_object_t value) {
+                (void)index;
+                xpc_array_append_value(networks, value);
+                return true;
+            });
+            xpc_release(parts[i]);
+        }
+        free(parts);
+        completion(networks);
+        xpc_release(networks);
+    });
+    dispatch_release(group);
 }
 
-void release_peer_networks(struct broker_context *ctx) {
-    while (ctx->network_count) {
-        struct network *net = ctx->networks[--ctx->network_count];
+bool network_ready(const char *network_name) {
+    struct network *net = registry_get(network_name);
+    return net && !net->creating;
+}
 
-        net->peers--;
+bool network_creating(const char *network_name) {
+    struct network *net = registry_get(network_name);
+    return net && net->creating;
+}
+
+int network_peers(const char *network_name) {
+    __block int peers = -1;
+    dispatch_sync(shard_queue(shard_for_network(network_name)), ^{
+        struct network *net = registry_get(network_name);
+        if (net) {
+            peers = net->peers;
+        }
+    });
+    return peers;
+}
+
+bool network_acquired(
+    const struct broker_context *ctx, const char *network_name
+) {
+    struct network *net = registry_get(network_name);
+    return net && peer_network_refs(ctx, net->shard, net) > 0;
+}
+
+bool has_retained_leases(void) { return atomic_load(&retained_leases) > 0; }
+
+static void
+precreate_network(const struct broker_context *ctx, const char *name) {
+    if (registry_get(name) || !creating_begin()) {
+        return;
+    }
+
+    struct network *net = new_network(ctx, name);
+    if (net == NULL) {
+        creating_end();
+        return;
+    }
+
+    INFOF("[%s] creating predicted network '%s'", ctx->name, name);
+    net->predicted = true;
+    history_predicted();
+    start_create_network(ctx, net);
+}
+
+void precreate_networks(const struct broker_context *ctx) {
+    char names[MAX_PREDICTED][HISTORY_NAME_SIZE];
+    int count = predict_networks(names, MAX_PREDICTED);
+    int started = 0;
+
+    for (int i = 0; i < count && started < precreate_budget; i++) {
+        // The network may have been removed from the configuration.
+        if (network_config_mode(names[i]) == NULL) {
+            continue;
+        }
+
+        char *name = strdup(names[i]);
+        assert(name != NULL && "failed to allocate network name");
+        shard_async(shard_for_network(name), ^{
+            precreate_network(ctx, name);
+            free(name);
+        });
+        started++;
+    }
+}
+
+// Detach created networks in the shard from their vmnet network, adding them to
+// refs, and returning the number of detached networks. The records are freed
+// later without releasing the network.
+static int detach_networks(
+    const struct broker_context *_Nonnull ctx,
+    struct registry *r,
+    vmnet_network_ref *refs
+) {
+    CFIndex count = CFDictionaryGetCount(r->networks);
+    const void **values = calloc(count ? count : 1, sizeof(*values));
+    assert(values != NULL && "failed to allocate networks");
+    CFDictionaryGetKeysAndValues(r->networks, NULL, values);
+
+    int detached = 0;
+    for (CFIndex i = 0; i < count; i++) {
+        struct network *net = (struct network *)values[i];
+        if (net->creating || net->ref == NULL) {
+            continue;
+        }
         INFOF(
-            "[%s] released network '%s' (peers %d)",
+            "[%s] deleted network '%s' subnet '%s' mask '%s' ipv6_prefix "
+            "'%s' prefix_len %d",
             ctx->name,
             net->name,
-            net->peers
+            net->info.subnet,
+            net->info.mask,
+            net->info.ipv6_prefix,
+            net->info.prefix_len
         );
-
-        if (net->peers == 0) {
-            remove_later(ctx, net);
-        }
+        publish_network_event(EVENT_REMOVED, net->name, 0);
+        refs[detached++] = net->ref;
+        net->ref = NULL;
     }
+
+    free(values);
+    return detached;
 }
 
 // Shutdown all networks in the registry.
+//
+// The networks in every shard are detached on the shard queue. Shard queues
+// never wait for the main queue, so waiting for them cannot deadlock. Releasing
+// a vmnet network is slow, so networks are released concurrently on the global
+// concurrent queue, waiting up to shutdown_timeout_sec for all networks.
+// Networks not released before the deadline are released by the system when
+// the broker exits.
 void shutdown_networks(const struct broker_context *ctx) {
-    release_registry(ctx);
+    uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
+    __block CFIndex count = 0;
+    __block int detached = 0;
+    __block vmnet_network_ref *refs = NULL;
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        dispatch_sync(shard_queue(i), ^{
+            struct registry *r = &registries[i];
+            if (r->networks == NULL) {
+                return;
+            }
+            CFIndex n = CFDictionaryGetCount(r->networks);
+            refs = realloc(refs, (count + n + 1) * sizeof(*refs));
+            assert(refs != NULL && "failed to allocate networks");
+            count += n;
+            detached += detach_networks(ctx, r, refs + detached);
+        });
+    }
+
+    uint64_t detach_done = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_queue_t queue = dispatch_get_global_queue(
+        QOS_CLASS_USER_INITIATED, 0
+    );
+    for (int i = 0; i < detached; i++) {
+        vmnet_network_ref ref = refs[i];
+        dispatch_group_async(group, queue, ^{
+            CFRelease(ref);
+        });
+    }
+    dispatch_time_t deadline = dispatch_time(
+        DISPATCH_TIME_NOW, shutdown_timeout_sec * NSEC_PER_SEC
+    );
+    bool timed_out = dispatch_group_wait(group, deadline) != 0;
+
+    uint64_t release_done = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
+    // The detached networks are released by the workers, so freeing the
+    // records does not block.
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        dispatch_sync(shard_queue(i), ^{
+            release_registry(ctx, &registries[i]);
+        });
+    }
+
+    uint64_t free_done = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
+    if (timed_out) {
+        WARNF(
+            "[%s] timeout releasing networks after %d seconds",
+            ctx->name,
+            shutdown_timeout_sec
+        );
+    }
+
+    dispatch_release(group);
+    free(refs);
+
+    INFOF(
+        "[%s] shutdown %ld networks in %.3f seconds (detach %.3f, release "
+        "%.3f, free %.3f)",
+        ctx->name,
+        (long)count,
+        (free_done - start) / 1e9,
+        (detach_done - start) / 1e9,
+        (release_done - detach_done) / 1e9,
+        (free_done - release_done) / 1e9
+    );
 }
@@ -0,0 +1,244 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <limits.h>
+#include <string.h>
+
+#include "broker-checksum.h"
+#include "broker-offload.h"
+
+#define ETHER_HEADER_SIZE 14
+#define VLAN_TAG_SIZE 4
+#define IPV4_HEADER_SIZE 20
+#define IPV6_HEADER_SIZE 40
+#define TCP_HEADER_SIZE 20
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88a8
+#define ETHERTYPE_IPV6 0x86dd
+
+#define PROTO_TCP 6
+
+#define TCP_FIN 0x01
+#define TCP_PSH 0x08
+#define TCP_CWR 0x80
+
+// Frames may have an outer and an inner VLAN tag.
+#define MAX_VLAN_TAGS 2
+
+static uint16_t get16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static void put16(unsigned char *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           p[3];
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+// Store a checksum computed in the host byte order.
+static void set_checksum(unsigned char *p, uint16_t checksum) {
+    memcpy(p, &checksum, sizeof(checksum));
+}
+
+bool offload_supported(const struct relay_frame *frame, int offloads) {
+    const struct relay_offload *o = &frame->offload;
+    if ((o->flags & RELAY_NEEDS_CSUM) && !(offloads & RELAY_OFFLOAD_CSUM)) {
+        return false;
+    }
+    switch (o->gso_type) {
+    case RELAY_GSO_NONE:
+        return true;
+    case RELAY_GSO_TCPV4:
+        return (offloads & RELAY_OFFLOAD_TSO4) != 0;
+    case RELAY_GSO_TCPV6:
+        return (offloads & RELAY_OFFLOAD_TSO6) != 0;
+    default:
+        return false;
+    }
+}
+
+// Parse a frame needing only a checksum.
+static int parse_checksum(
+    const struct relay_frame *frame, size_t size, struct offload_frame *f
+) {
+    const struct relay_offload *o = &frame->offload;
+    if (!(o->flags & RELAY_NEEDS_CSUM) || frame->len > size ||
+        (size_t)o->csum_start + o->csum_offset + 2 > frame->len) {
+        return 0;
+    }
+    f->l4 = o->csum_start;
+    f->segments = 1;
+    return 1;
+}
+
+// Parse a TCP frame larger than the MTU. The IP and TCP headers are parsed
+// since hdr_len is only a hint, and IPv6 extension headers are not supported.
+static int parse_tcp(
+    const struct relay_frame *frame, size_t size, struct offload_frame *f
+) {
+    const unsigned char *p = frame->data;
+    size_t len = frame->len;
+
+    if (len < ETHER_HEADER_SIZE) {
+        return 0;
+    }
+    size_t l3 = ETHER_HEADER_SIZE;
+    uint16_t type = get16(p + 12);
+    for (int tags = 0; tags < MAX_VLAN_TAGS; tags++) {
+        if (type != ETHERTYPE_VLAN && type != ETHERTYPE_QINQ) {
+            break;
+        }
+        if (len < l3 + VLAN_TAG_SIZE) {
+            return 0;
+        }
+        type = get16(p + l3 + 2);
+        l3 += VLAN_TAG_SIZE;
+    }
+
+    size_t l4;
+    if (frame->offload.gso_type == RELAY_GSO_TCPV4) {
+        if (type != ETHERTYPE_IPV4 || len < l3 + IPV4_HEADER_SIZE ||
+            p[l3] >> 4 != 4 || p[l3 + 9] != PROTO_TCP) {
+            return 0;
+        }
+        size_t header_size = (p[l3] & 0xf) * 4;
+        if (header_size < IPV4_HEADER_SIZE) {
+            return 0;
+        }
+        l4 = l3 + header_size;
+    } else {
+        if (type != ETHERTYPE_IPV6 || len < l3 + IPV6_HEADER_SIZE ||
+            p[l3] >> 4 != 6 || p[l3 + 6] != PROTO_TCP) {
+            return 0;
+        }
+        l4 = l3 + IPV6_HEADER_SIZE;
+    }
+
+    if (len < l4 + TCP_HEADER_SIZE) {
+        return 0;
+    }
+    size_t headers = l4 + (p[l4 + 12] >> 4) * 4;
+    if (headers < l4 + TCP_HEADER_SIZE || headers > len) {
+        return 0;
+    }
+
+    size_t mss = frame->offload.gso_size;
+    size_t payload = len - headers;
+    if (mss == 0 || headers + (payload < mss ? payload : mss) > size) {
+        return 0;
+    }
+    size_t segments = payload == 0 ? 1 : (payload + mss - 1) / mss;
+    if (segments > INT_MAX) {
+        return 0;
+    }
+
+    f->l3 = l3;
+    f->l4 = l4;
+    f->headers = headers;
+    f->mss = mss;
+    f->segments = (int)segments;
+    return f->segments;
+}
+
+int offload_parse(
+    const struct relay_frame *frame, size_t size, struct offload_frame *f
+) {
+    *f = (struct offload_frame){.frame = frame};
+    switch (frame->offload.gso_type) {
+    case RELAY_GSO_NONE:
+        return parse_checksum(frame, size, f);
+    case RELAY_GSO_TCPV4:
+    case RELAY_GSO_TCPV6:
+        return parse_tcp(frame, size, f);
+    default:
+        return 0;
+    }
+}
+
+// Complete the checksum of a copy of the frame. The checksum field contains
+// the sum of the pseudo header, so adding the bytes from the checksum start
+// completes it. A checksum of 0 is sent as 0xffff, since 0 means no checksum
+// in UDP.
+static void
+complete_checksum(const struct offload_frame *f, struct relay_frame *segment) {
+    const struct relay_frame *frame = f->frame;
+    unsigned char *out = segment->data;
+    memcpy(out, frame->data, frame->len);
+    uint16_t checksum = inet_fold(
+        inet_sum(out + f->l4, frame->len - f->l4, 0)
+    );
+    if (checksum == 0) {
+        checksum = 0xffff;
+    }
+    set_checksum(out + f->l4 + frame->offload.csum_offset, checksum);
+    segment->len = frame->len;
+}
+
+void offload_segment(
+    const struct offload_frame *f, int i, struct relay_frame *segment
+) {
+    const struct relay_frame *frame = f->frame;
+    segment->offload = (struct relay_offload){0};
+    if (frame->offload.gso_type == RELAY_GSO_NONE) {
+        complete_checksum(f, segment);
+        return;
+    }
+
+    const unsigned char *p = frame->data;
+    unsigned char *out = segment->data;
+    size_t offset = (size_t)i * f->mss;
+    size_t payload = frame->len - f->headers - offset;
+    if (payload > f->mss) {
+        payload = f->mss;
+    }
+    size_t len = f->headers + payload;
+    memcpy(out, p, f->headers);
+    memcpy(out + f->headers, p + f->headers + offset, payload);
+
+    unsigned char *ip = out + f->l3;
+    unsigned char *tcp = out + f->l4;
+    size_t tcp_len = len - f->l4;
+    uint32_t sum;
+
+    if (frame->offload.gso_type == RELAY_GSO_TCPV4) {
+        put16(ip + 2, (uint16_t)(len - f->l3));
+        put16(ip + 4, (uint16_t)(get16(ip + 4) + i));
+        set_checksum(ip + 10, 0);
+        set_checksum(ip + 10, inet_checksum(ip, f->l4 - f->l3));
+        // Source and destination addresses.
+        sum = inet_sum(ip + 12, 8, 0);
+    } else {
+        put16(ip + 4, (uint16_t)tcp_len);
+        sum = inet_sum(ip + 8, 32, 0);
+    }
+
+    put32(tcp + 4, get32(tcp + 4) + (uint32_t)offset);
+    // FIN and PSH are sent only in the last segment, and CWR only in the
+    // first.
+    if (i < f->segments - 1) {
+        tcp[13] &= ~(TCP_FIN | TCP_PSH);
+    }
+    if (i > 0) {
+        tcp[13] &= ~TCP_CWR;
+    }
+
+    // The rest of the pseudo header: the protocol and the TCP length.
+    unsigned char pseudo[4] = {0, PROTO_TCP, tcp_len >> 8, tcp_len & 0xff};
+    sum = inet_sum(pseudo, sizeof(pseudo), sum);
+    set_checksum(tcp + 16, 0);
+    set_checksum(tcp + 16, inet_fold(inet_sum(tcp, tcp_len, sum)));
+    segment->len = len;
+}
@@ -0,0 +1,119 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "broker-peer.h"
+
+// The peer networks dictionary maps a network pointer to the number of peer
+// references. Using NULL callbacks, keys are hashed and compared by pointer
+// value and values are stored as is, so no allocation is needed per entry
+// beyond the dictionary storage. When the peer disconnects the dictionary is
+// emptied and kept in the context, so a peer reusing the context does not
+// allocate a new dictionary. The peer has a dictionary for every shard, so
+// shard queues do not share state.
+
+// Number of networks removed without allocating memory for the keys.
+#define STACK_KEYS 16
+
+static CFMutableDictionaryRef
+peer_networks(struct broker_context *ctx, int shard) {
+    if (ctx->networks[shard] == NULL) {
+        ctx->networks[shard] = CFDictionaryCreateMutable(NULL, 0, NULL, NULL);
+        assert(
+            ctx->networks[shard] != NULL && "failed to create peer networks"
+        );
+    }
+    return ctx->networks[shard];
+}
+
+int peer_add_network(struct broker_context *ctx, int shard, void *network) {
+    CFMutableDictionaryRef networks = peer_networks(ctx, shard);
+    intptr_t refs = (intptr_t)CFDictionaryGetValue(networks, network);
+    refs++;
+    CFDictionarySetValue(networks, network, (const void *)refs);
+    return (int)refs;
+}
+
+int peer_remove_network(struct broker_context *ctx, int shard, void *network) {
+    CFMutableDictionaryRef networks = ctx->networks[shard];
+    if (networks == NULL) {
+        return -1;
+    }
+
+    intptr_t refs = (intptr_t)CFDictionaryGetValue(networks, network);
+    if (refs == 0) {
+        return -1;
+    }
+
+    refs--;
+    if (refs > 0) {
+        CFDictionarySetValue(networks, network, (const void *)refs);
+    } else {
+        CFDictionaryRemoveValue(networks, network);
+    }
+    return (int)refs;
+}
+
+int peer_network_refs(
+    const struct broker_context *ctx, int shard, void *network
+) {
+    if (ctx->networks[shard] == NULL) {
+        return 0;
+    }
+    return (int)(intptr_t)CFDictionaryGetValue(ctx->networks[shard], network);
+}
+
+void peer_remove_all_networks(
+    struct broker_context *ctx,
+    int shard,
+    void (*fn)(struct broker_context *ctx, void *network)
+) {
+    if (ctx->networks[shard] == NULL) {
+        return;
+    }
+
+    // Detach the dictionary before calling fn, so the peer does not own any
+    // network in the shard while fn is running.
+    CFMutableDictionaryRef networks = ctx->networks[shard];
+    ctx->networks[shard] = NULL;
+
+    CFIndex count = CFDictionaryGetCount(networks);
+    if (count > 0) {
+        const void *stack_keys[STACK_KEYS];
+        const void **keys = stack_keys;
+        if (count > STACK_KEYS) {
+            keys = malloc(count * sizeof(*keys));
+            assert(keys != NULL && "failed to allocate peer networks keys");
+        }
+        CFDictionaryGetKeysAndValues(networks, keys, NULL);
+        for (CFIndex i = 0; i < count; i++) {
+            fn(ctx, (void *)keys[i]);
+        }
+        if (keys != stack_keys) {
+            free(keys);
+        }
+        CFDictionaryRemoveAllValues(networks);
+    }
+
+    ctx->networks[shard] = networks;
+}
+
+void peer_free_networks(struct broker_context *ctx) {
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        if (ctx->networks[i]) {
+            CFRelease(ctx->networks[i]);
+            ctx->networks[i] = NULL;
+        }
+    }
+}
+
+int peer_network_count(const struct broker_context *ctx, int shard) {
+    if (ctx->networks[shard] == NULL) {
+        return 0;
+    }
+    return (int)CFDictionaryGetCount(ctx->networks[shard]);
+}
@@ -0,0 +1,423 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// struct ucred is available only with _GNU_SOURCE.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "broker-policy.h"
+#include "log.h"
+
+// Maximum number of rules in the policy file.
+#define MAX_RULES 64
+
+// Network names must be shorter than this to be used in rules and cached.
+#define POLICY_NAME_SIZE 64
+
+// Number of cached decisions, must be a power of 2. A cached decision is found
+// within CACHE_PROBES slots from the slot selected by the hash.
+#define CACHE_SIZE 256
+#define CACHE_PROBES 8
+
+#ifdef __APPLE__
+typedef int group_t;
+#else
+typedef gid_t group_t;
+#endif
+
+enum principal {
+    PRINCIPAL_ANY,
+    PRINCIPAL_USER,
+    PRINCIPAL_GROUP,
+    PRINCIPAL_SIGNING_ID,
+};
+
+// A policy rule: "allow|deny NETWORK PRINCIPAL".
+struct rule {
+    bool allow;
+    // Network name, or "*" for all networks.
+    char network[POLICY_NAME_SIZE];
+    enum principal principal;
+    // User or group ID for user and group principals.
+    unsigned id;
+    char signing_id[SIGNING_ID_SIZE];
+};
+
+// A cached decision for a peer identity and network.
+struct decision {
+    // Hash of the key, or 0 for an empty slot.
+    uint64_t hash;
+    uid_t uid;
+    gid_t gid;
+    char signing_id[SIGNING_ID_SIZE];
+    char network[POLICY_NAME_SIZE];
+    bool allowed;
+};
+
+static struct rule rules[MAX_RULES];
+static int rule_count;
+
+// True if the policy file exists. Without a policy file all access is allowed.
+static bool enforcing;
+
+// True if loading the policy failed. All access is denied until the policy is
+// loaded successfully.
+static bool broken;
+
+static bool uses_groups;
+static bool uses_signing_id;
+
+static struct decision cache[CACHE_SIZE];
+static struct policy_stats stats;
+
+// MARK: - Loading the policy
+
+static int parse_id(const char *s, unsigned *id) {
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || errno || value > UINT32_MAX) {
+        return EINVAL;
+    }
+    *id = (unsigned)value;
+    return 0;
+}
+
+static int parse_principal(struct rule *rule, char *s) {
+    if (strcmp(s, "*") == 0) {
+        rule->principal = PRINCIPAL_ANY;
+        return 0;
+    }
+
+    char *value = strchr(s, ':');
+    if (value == NULL) {
+        return EINVAL;
+    }
+    *value++ = '\0';
+
+    if (strcmp(s, "user") == 0) {
+        rule->principal = PRINCIPAL_USER;
+        if (parse_id(value, &rule->id) == 0) {
+            return 0;
+        }
+        struct passwd *pw = getpwnam(value);
+        if (pw == NULL) {
+            return ENOENT;
+        }
+        rule->id = pw->pw_uid;
+        return 0;
+    }
+
+    if (strcmp(s, "group") == 0) {
+        rule->principal = PRINCIPAL_GROUP;
+        uses_groups = true;
+        if (parse_id(value, &rule->id) == 0) {
+            return 0;
+        }
+        struct group *gr = getgrnam(value);
+        if (gr == NULL) {
+            return ENOENT;
+        }
+        rule->id = gr->gr_gid;
+        return 0;
+    }
+
+    if (strcmp(s, "signing-id") == 0) {
+        rule->principal = PRINCIPAL_SIGNING_ID;
+        uses_signing_id = true;
+        if (*value == '\0' || strlen(value) >= SIGNING_ID_SIZE) {
+            return EINVAL;
+        }
+        strcpy(rule->signing_id, value);
+        return 0;
+    }
+
+    return EINVAL;
+}
+
+// Parse a policy line into rule. Returns 0 if a rule was parsed, -1 for empty
+// lines and comments, or an errno value.
+static int parse_rule(struct rule *rule, char *line) {
+    char *comment = strchr(line, '#');
+    if (comment) {
+        *comment = '\0';
+    }
+
+    char *save;
+    const char *sep = " \t\r\n";
+    char *action = strtok_r(line, sep, &save);
+    if (action == NULL) {
+        return -1;
+    }
+    char *network = strtok_r(NULL, sep, &save);
+    char *principal = strtok_r(NULL, sep, &save);
+    if (network == NULL || principal == NULL ||
+        strtok_r(NULL, sep, &save) != NULL) {
+        return EINVAL;
+    }
+
+    *rule = (struct rule){0};
+
+    if (strcmp(action, "allow") == 0) {
+        rule->allow = true;
+    } else if (strcmp(action, "deny") != 0) {
+        return EINVAL;
+    }
+
+    if (strlen(network) >= POLICY_NAME_SIZE) {
+        return EINVAL;
+    }
+    strcpy(rule->network, network);
+
+    return parse_principal(rule, principal);
+}
+
+int load_policy(const char *path) {
+    rule_count = 0;
+    enforcing = false;
+    broken = false;
+    uses_groups = false;
+    uses_signing_id = false;
+    memset(cache, 0, sizeof(cache));
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        int err = errno;
+        enforcing = true;
+        broken = true;
+        return err;
+    }
+
+    enforcing = true;
+
+    char line[512];
+    int lineno = 0;
+    int err = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+
+        struct rule rule;
+        int rc = parse_rule(&rule, line);
+        if (rc == -1) {
+            continue;
+        }
+        if (rc == 0 && rule_count == MAX_RULES) {
+            rc = E2BIG;
+        }
+        if (rc != 0) {
+            WARNF(
+                "[policy] %s:%d: invalid rule: %s", path, lineno, strerror(rc)
+            );
+            err = rc;
+            continue;
+        }
+
+        rules[rule_count++] = rule;
+    }
+
+    fclose(fp);
+
+    if (err) {
+        broken = true;
+    }
+
+    return err;
+}
+
+bool policy_uses_groups(void) { return uses_groups; }
+
+bool policy_uses_signing_id(void) { return uses_signing_id; }
+
+// MARK: - Evaluating the policy
+
+static bool in_groups(const struct peer_credentials *cred, gid_t gid) {
+    if (cred->gid == gid) {
+        return true;
+    }
+    for (int i = 0; i < cred->ngroups; i++) {
+        if (cred->groups[i] == gid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool
+rule_matches(const struct rule *rule, const struct peer_credentials *cred) {
+    switch (rule->principal) {
+    case PRINCIPAL_ANY:
+        return true;
+    case PRINCIPAL_USER:
+        return cred->uid == rule->id;
+    case PRINCIPAL_GROUP:
+        return in_groups(cred, rule->id);
+    case PRINCIPAL_SIGNING_ID:
+        return strcmp(cred->signing_id, rule->signing_id) == 0;
+    }
+    return false;
+}
+
+// The first rule matching the network and the peer decides. If no rule
+// matches, access is denied.
+static bool evaluate(const struct peer_credentials *cred, const char *network) {
+    for (int i = 0; i < rule_count; i++) {
+        const struct rule *rule = &rules[i];
+        if ((strcmp(rule->network, "*") == 0 ||
+             strcmp(rule->network, network) == 0) &&
+            rule_matches(rule, cred)) {
+            return rule->allow;
+        }
+    }
+    return false;
+}
+
+// FNV-1a hash.
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t
+hash_key(const struct peer_credentials *cred, const char *network) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    h = hash_bytes(h, &cred->uid, sizeof(cred->uid));
+    h = hash_bytes(h, &cred->gid, sizeof(cred->gid));
+    h = hash_bytes(h, cred->signing_id, strlen(cred->signing_id) + 1);
+    h = hash_bytes(h, network, strlen(network));
+    // 0 marks an empty slot.
+    return h ? h : 1;
+}
+
+static bool decision_matches(
+    const struct decision *d,
+    uint64_t hash,
+    const struct peer_credentials *cred,
+    const char *network
+) {
+    return d->hash == hash && d->uid == cred->uid && d->gid == cred->gid &&
+           strcmp(d->signing_id, cred->signing_id) == 0 &&
+           strcmp(d->network, network) == 0;
+}
+
+bool policy_allows(const struct peer_credentials *cred, const char *network) {
+    stats.checks++;
+
+    if (!enforcing) {
+        return true;
+    }
+
+    if (broken) {
+        stats.denied++;
+        return false;
+    }
+
+    // Decisions depend only on the peer identity and the network, so they are
+    // valid until the policy is loaded again.
+    uint64_t hash = hash_key(cred, network);
+    struct decision *empty = NULL;
+    for (int i = 0; i < CACHE_PROBES; i++) {
+        struct decision *d = &cache[(hash + i) & (CACHE_SIZE - 1)];
+        if (d->hash == 0) {
+            empty = d;
+            break;
+        }
+        if (decision_matches(d, hash, cred, network)) {
+            stats.cache_hits++;
+            if (!d->allowed) {
+                stats.denied++;
+            }
+            return d->allowed;
+        }
+    }
+
+    bool allowed = evaluate(cred, network);
+    if (!allowed) {
+        stats.denied++;
+    }
+
+    if (strlen(network) < POLICY_NAME_SIZE) {
+        // When all probed slots are used, replace the first one.
+        struct decision *d = empty ? empty : &cache[hash & (CACHE_SIZE - 1)];
+        d->hash = hash;
+        d->uid = cred->uid;
+        d->gid = cred->gid;
+        strcpy(d->signing_id, cred->signing_id);
+        strcpy(d->network, network);
+        d->allowed = allowed;
+    }
+
+    return allowed;
+}
+
+const struct policy_stats *policy_stats(void) { return &stats; }
+
+// MARK: - Credentials
+
+int peer_credentials_add_groups(struct peer_credentials *cred) {
+    struct passwd pw;
+    struct passwd *result;
+    char buf[1024];
+    int err = getpwuid_r(cred->uid, &pw, buf, sizeof(buf), &result);
+    if (result == NULL) {
+        return err ? err : ENOENT;
+    }
+
+    group_t groups[MAX_PEER_GROUPS];
+    int ngroups = MAX_PEER_GROUPS;
+    if (getgrouplist(pw.pw_name, (group_t)cred->gid, groups, &ngroups) < 0) {
+        // The user has more groups; use the first MAX_PEER_GROUPS.
+        ngroups = MAX_PEER_GROUPS;
+    }
+
+    for (int i = 0; i < ngroups; i++) {
+        cred->groups[i] = (gid_t)groups[i];
+    }
+    cred->ngroups = ngroups;
+
+    return 0;
+}
+
+int peer_credentials_from_socket(int fd, struct peer_credentials *cred) {
+    *cred = (struct peer_credentials){0};
+
+#ifdef SO_PEERCRED
+    struct ucred uc;
+    socklen_t len = sizeof(uc);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &uc, &len) < 0) {
+        return errno;
+    }
+    cred->uid = uc.uid;
+    cred->gid = uc.gid;
+    cred->pid = uc.pid;
+#else
+    if (getpeereid(fd, &cred->uid, &cred->gid) < 0) {
+        return errno;
+    }
+#ifdef LOCAL_PEERPID
+    socklen_t len = sizeof(cred->pid);
+    if (getsockopt(fd, SOL_LOCAL, LOCAL_PEERPID, &cred->pid, &len) < 0) {
+        return errno;
+    }
+#endif
+#endif
+
+    return 0;
+}
@@ -0,0 +1,94 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "broker-pool.h"
+
+// Number of objects in a slab.
+#define SLAB_OBJECTS 32
+
+// Pools with allocated slabs, and the lock protecting the list.
+static struct pool *pools;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t object_stride(const struct pool *pool) {
+    size_t align = _Alignof(max_align_t);
+    size_t size = pool->object_size;
+    if (size < sizeof(void *)) {
+        size = sizeof(void *);
+    }
+    return (size + align - 1) / align * align;
+}
+
+static void add_slab(struct pool *pool) {
+    size_t stride = object_stride(pool);
+    char *slab = calloc(SLAB_OBJECTS, stride);
+    assert(slab != NULL && "failed to allocate pool slab");
+
+    // Link the objects so the first object is allocated first.
+    for (int i = SLAB_OBJECTS - 1; i >= 0; i--) {
+        void **object = (void **)(slab + i * stride);
+        *object = pool->free_list;
+        pool->free_list = object;
+    }
+
+    pool->slabs++;
+    pool->bytes += SLAB_OBJECTS * stride;
+
+    if (!pool->registered) {
+        pthread_mutex_lock(&pools_lock);
+        pool->next = pools;
+        pools = pool;
+        pthread_mutex_unlock(&pools_lock);
+        pool->registered = true;
+    }
+}
+
+void *pool_alloc(struct pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->free_list == NULL) {
+        add_slab(pool);
+    }
+
+    void **object = pool->free_list;
+    pool->free_list = *object;
+    *object = NULL;
+
+    pool->in_use++;
+    pool->allocs++;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return object;
+}
+
+void pool_free(struct pool *pool, void *object) {
+    if (object == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    *(void **)object = pool->free_list;
+    pool->free_list = object;
+    pool->in_use--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_for_each(void (*fn)(const struct pool *pool, void *arg), void *arg) {
+    // Pools are added to the head of the list while holding the pool lock, and
+    // never removed, so the list is walked without holding the list lock.
+    pthread_mutex_lock(&pools_lock);
+    struct pool *head = pools;
+    pthread_mutex_unlock(&pools_lock);
+
+    for (struct pool *pool = head; pool; pool = pool->next) {
+        pthread_mutex_lock(&pool->lock);
+        fn(pool, arg);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
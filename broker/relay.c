@@ -0,0 +1,1726 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// recvmmsg and sendmmsg are available only with _GNU_SOURCE.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
+
+#include "broker-fdb.h"
+#include "broker-neigh.h"
+#include "broker-offload.h"
+#include "broker-relay.h"
+#include "broker-shaper.h"
+
+// Maximum number of events handled in one wait.
+#define MAX_EVENTS 64
+
+// Frames shorter than an ethernet header cannot be switched.
+#define ETHER_HEADER_SIZE 14
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+#define NANOSECONDS_PER_MILLISECOND 1000000ULL
+
+// Number of addresses learned by a switch. Addresses are flooded when the
+// forwarding database is full.
+#define SWITCH_ADDRESSES 4096
+
+// Number of IP addresses learned by a switch, an IPv4 and a few IPv6
+// addresses for every MAC address. Requests for unknown addresses are flooded.
+#define SWITCH_NEIGHBORS 8192
+
+// Maximum number of batches forwarded from a port using callbacks or a stream
+// socket before serving other ports.
+#define MAX_CALLBACK_BATCHES 16
+
+// Every frame on a stream socket is prefixed by its length, as a 32 bits big
+// endian integer.
+#define STREAM_HEADER_SIZE 4
+
+// Size of the receive and send buffers of a stream port, holding many small
+// frames, and at least two frames of any size.
+#define STREAM_BUFFER_SIZE (64 * 1024)
+
+// Sending to a socket closed by the other side must not raise SIGPIPE. On
+// macOS sockets use SO_NOSIGPIPE instead.
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+struct relay_port {
+    struct relay_link *link;
+    // The other port of the link.
+    struct relay_port *peer;
+    // The socket, or the doorbell of a port using callbacks.
+    int fd;
+    const struct relay_port_ops *ops;
+    void *arg;
+    // The switch of a switch port, and the port index in the switch. A switch
+    // port has no peer.
+    struct relay_switch *sw;
+    uint16_t index;
+    // True if the socket was closed by the other side, or failed. Frames
+    // sent to a closed port are dropped.
+    bool closed;
+    // A stream socket using length prefixed frames.
+    bool stream;
+    // True while waiting until the stream socket is writable.
+    bool writing;
+    // Offloads the port can receive.
+    int offloads;
+    // Stream bytes received and not forwarded yet are rx[rx_start, rx_end),
+    // and rx_skip bytes of an oversized frame are not received yet.
+    unsigned char *rx;
+    size_t rx_start;
+    size_t rx_end;
+    size_t rx_skip;
+    // Stream bytes not written yet are tx[tx_start, tx_end).
+    unsigned char *tx;
+    size_t tx_start;
+    size_t tx_end;
+    // Frames received on this port.
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t batches;
+    // Frames received on this port and dropped.
+    uint64_t drops;
+    // Frames sent to this port.
+    uint64_t sent;
+    uint64_t sent_bytes;
+    // Frames segmented or checksummed before sending them to this port.
+    uint64_t segmented;
+    // Frames sent to this port by a switch using traffic shaping, allocated
+    // when the first frame is queued.
+    struct shaper *shaper;
+};
+
+struct relay_link {
+    // The second port of a switch link is not used.
+    struct relay_port ports[2];
+    // Set by relay_notify(), cleared by the relay thread.
+    atomic_bool notified;
+    // True if the link was removed. The link is freed by the relay thread,
+    // since events for the link may be pending.
+    bool removed;
+    struct relay_link *next;
+};
+
+struct relay_tap {
+    relay_tap_fn fn;
+    void *arg;
+    struct relay_switch *sw;
+    struct relay_tap *next;
+};
+
+struct relay_switch {
+    struct fdb fdb;
+    struct neigh neigh;
+    // Ports by index, NULL for unused indexes.
+    struct relay_port *ports[RELAY_SWITCH_PORTS];
+    // One more than the largest used index.
+    int port_count;
+    // Index in the switch batch targets by port index, or -1. Used only while
+    // switching a batch.
+    int16_t targets[RELAY_SWITCH_PORTS];
+    uint64_t unicast;
+    uint64_t flooded;
+    // ARP requests and neighbor solicitations answered by the switch instead
+    // of flooding them.
+    uint64_t suppressed;
+    // Taps called with frames received by the switch ports.
+    struct relay_tap *taps;
+    // Queue frames sent to the ports using the shaping configuration.
+    bool shaped;
+    struct relay_shaping shaping;
+    struct relay_switch *next;
+};
+
+struct relay {
+    int poll_fd;
+    // Pipe for waking up the relay thread.
+    int wake_fds[2];
+    pthread_t thread;
+    // Protects the links, and serializes forwarding with adding and removing
+    // links.
+    pthread_mutex_t lock;
+    struct relay_link *links;
+    struct relay_link *removed;
+    int link_count;
+    struct relay_switch *switches;
+    int switch_count;
+    // Counters of removed links.
+    struct relay_stats totals;
+    // Set when a link was notified, or the relay is stopping, and the relay
+    // thread was woken up.
+    atomic_bool woken;
+    atomic_bool stopping;
+    size_t frame_size;
+    int batch;
+    size_t stream_size;
+    // Time in seconds for aging switch addresses, updated when the relay
+    // thread wakes up.
+    uint32_t now;
+    // Frame buffers, used only by the relay thread.
+    unsigned char *buffers;
+    struct relay_frame frames[RELAY_BATCH];
+    // Frames switched to one port.
+    struct relay_frame out[RELAY_BATCH];
+    // Segments of frames needing offloads not supported by the destination,
+    // and frames sent with them.
+    unsigned char *segment_buffers;
+    struct relay_frame segments[RELAY_BATCH];
+    // Replies to ARP requests and neighbor solicitations of a batch.
+    unsigned char reply_buffers[RELAY_BATCH][NEIGH_REPLY_SIZE];
+    struct relay_frame replies[RELAY_BATCH];
+#ifdef __linux__
+    struct iovec iovs[RELAY_BATCH];
+    struct mmsghdr msgs[RELAY_BATCH];
+#endif
+    // Frame headers and buffers written to stream sockets.
+    unsigned char headers[RELAY_BATCH][STREAM_HEADER_SIZE];
+    struct iovec stream_iovs[RELAY_BATCH * 2];
+};
+
+// MARK: - Sockets
+
+static bool would_block(int err) {
+    return err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Prepare a link socket. Sending to a socket closed by the other side must
+// fail instead of terminating the process with SIGPIPE. The doorbell of a port
+// using callbacks may also be a pipe or an eventfd.
+static int setup_socket(int fd) {
+    if (set_nonblocking(fd) < 0) {
+        return -1;
+    }
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) < 0 &&
+        errno != ENOTSOCK) {
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+// Receive up to count frames from a socket into the relay buffers. Returns the
+// number of frames received, 0 if no frame is available, or -1 on error.
+static int socket_recv(struct relay *relay, int fd, int count) {
+#ifdef __linux__
+    for (int i = 0; i < count; i++) {
+        relay->iovs[i].iov_base = relay->frames[i].data;
+        relay->iovs[i].iov_len = relay->frame_size;
+        relay->msgs[i].msg_hdr = (struct msghdr){
+            .msg_iov = &relay->iovs[i],
+            .msg_iovlen = 1,
+        };
+    }
+
+    int n;
+    do {
+        n = recvmmsg(fd, relay->msgs, count, MSG_DONTWAIT, NULL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return would_block(errno) ? 0 : -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        relay->frames[i].len = relay->msgs[i].msg_len;
+        if (relay->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            relay->frames[i].len = 0;
+        }
+    }
+    return n;
+#else
+    int n = 0;
+    while (n < count) {
+        struct iovec iov = {relay->frames[n].data, relay->frame_size};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+        ssize_t len = recvmsg(fd, &msg, 0);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (would_block(errno)) {
+                break;
+            }
+            return n ? n : -1;
+        }
+        relay->frames[n].len = (msg.msg_flags & MSG_TRUNC) ? 0 : (size_t)len;
+        n++;
+    }
+    return n;
+#endif
+}
+
+// Send count frames to a socket. Returns the number of frames sent, or -1 on
+// error.
+static int socket_send(
+    struct relay *relay, int fd, const struct relay_frame *frames, int count
+) {
+#ifdef __linux__
+    for (int i = 0; i < count; i++) {
+        relay->iovs[i].iov_base = frames[i].data;
+        relay->iovs[i].iov_len = frames[i].len;
+        relay->msgs[i].msg_hdr = (struct msghdr){
+            .msg_iov = &relay->iovs[i],
+            .msg_iovlen = 1,
+        };
+    }
+
+    int sent = 0;
+    while (sent < count) {
+        int n = sendmmsg(
+            fd, &relay->msgs[sent], count - sent, MSG_DONTWAIT | MSG_NOSIGNAL
+        );
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (would_block(errno)) {
+                break;
+            }
+            return sent ? sent : -1;
+        }
+        sent += n;
+    }
+    return sent;
+#else
+    int sent = 0;
+    while (sent < count) {
+        ssize_t n = send(fd, frames[sent].data, frames[sent].len, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (would_block(errno)) {
+                break;
+            }
+            return sent ? sent : -1;
+        }
+        sent++;
+    }
+    return sent;
+#endif
+}
+
+// MARK: - Polling
+
+static int poll_create(void) {
+#ifdef __linux__
+    return epoll_create1(EPOLL_CLOEXEC);
+#else
+    return kqueue();
+#endif
+}
+
+static int poll_add(struct relay *relay, int fd, void *data) {
+#ifdef __linux__
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = data};
+    return epoll_ctl(relay->poll_fd, EPOLL_CTL_ADD, fd, &ev);
+#else
+    struct kevent kev;
+    EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, data);
+    return kevent(relay->poll_fd, &kev, 1, NULL, 0, NULL);
+#endif
+}
+
+// Wait until a stream socket is writable, or stop waiting.
+static void poll_write(struct relay *relay, struct relay_port *port, bool on) {
+#ifdef __linux__
+    struct epoll_event ev = {
+        .events = EPOLLIN | (on ? EPOLLOUT : 0),
+        .data.ptr = port,
+    };
+    epoll_ctl(relay->poll_fd, EPOLL_CTL_MOD, port->fd, &ev);
+#else
+    struct kevent kev;
+    EV_SET(&kev, port->fd, EVFILT_WRITE, on ? EV_ADD : EV_DELETE, 0, 0, port);
+    kevent(relay->poll_fd, &kev, 1, NULL, 0, NULL);
+#endif
+    port->writing = on;
+}
+
+static void poll_remove(struct relay *relay, int fd) {
+#ifdef __linux__
+    epoll_ctl(relay->poll_fd, EPOLL_CTL_DEL, fd, NULL);
+#else
+    struct kevent kev;
+    EV_SET(&kev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    kevent(relay->poll_fd, &kev, 1, NULL, 0, NULL);
+#endif
+}
+
+// MARK: - Streams
+
+static void set_stream_header(unsigned char *p, size_t len) {
+    p[0] = (len >> 24) & 0xff;
+    p[1] = (len >> 16) & 0xff;
+    p[2] = (len >> 8) & 0xff;
+    p[3] = len & 0xff;
+}
+
+static size_t get_stream_header(const unsigned char *p) {
+    return (size_t)p[0] << 24 | (size_t)p[1] << 16 | (size_t)p[2] << 8 | p[3];
+}
+
+// Parse up to count frames from the receive buffer. The frames point to the
+// buffer. An oversized frame is returned as a truncated frame, and its bytes
+// are skipped.
+static int
+stream_parse(struct relay *relay, struct relay_port *port, int count) {
+    int n = 0;
+    while (n < count) {
+        size_t avail = port->rx_end - port->rx_start;
+        if (port->rx_skip) {
+            size_t len = avail < port->rx_skip ? avail : port->rx_skip;
+            port->rx_start += len;
+            port->rx_skip -= len;
+            if (port->rx_skip) {
+                break;
+            }
+            continue;
+        }
+        if (avail < STREAM_HEADER_SIZE) {
+            break;
+        }
+        size_t len = get_stream_header(port->rx + port->rx_start);
+        if (len > relay->frame_size) {
+            port->rx_start += STREAM_HEADER_SIZE;
+            port->rx_skip = len;
+            relay->frames[n++].len = 0;
+            continue;
+        }
+        if (avail < STREAM_HEADER_SIZE + len) {
+            break;
+        }
+        relay->frames[n].data = port->rx + port->rx_start + STREAM_HEADER_SIZE;
+        relay->frames[n].len = len;
+        port->rx_start += STREAM_HEADER_SIZE + len;
+        n++;
+    }
+    return n;
+}
+
+// Receive up to count frames from a stream socket. A read may return part of
+// a frame, or many frames, so received bytes are kept until the frames are
+// complete and forwarded. Returns the number of frames received, 0 if no
+// frame is available, or -1 on error or when the other side closed the socket.
+static int
+stream_recv(struct relay *relay, struct relay_port *port, int count) {
+    // The frames of the previous batch were forwarded. Move the remaining
+    // bytes to the start when there may be no space for a frame.
+    size_t pending = port->rx_end - port->rx_start;
+    size_t space = relay->stream_size - port->rx_end;
+    if (pending == 0 || space < relay->frame_size + STREAM_HEADER_SIZE) {
+        memmove(port->rx, port->rx + port->rx_start, pending);
+        port->rx_start = 0;
+        port->rx_end = pending;
+    }
+
+    ssize_t len = -1;
+    if (port->rx_end < relay->stream_size) {
+        do {
+            len = read(
+                port->fd,
+                port->rx + port->rx_end,
+                relay->stream_size - port->rx_end
+            );
+        } while (len < 0 && errno == EINTR);
+        if (len < 0 && !would_block(errno)) {
+            return -1;
+        }
+        if (len > 0) {
+            port->rx_end += len;
+        }
+    }
+
+    int n = stream_parse(relay, port, count);
+    if (n == 0 && len == 0) {
+        return -1;
+    }
+    return n;
+}
+
+// Queue a frame in the send buffer, skipping the first off bytes of the header
+// and the frame. Returns false if there is no space.
+static bool stream_queue(
+    struct relay *relay,
+    struct relay_port *port,
+    const struct relay_frame *frame,
+    size_t off
+) {
+    size_t len = STREAM_HEADER_SIZE + frame->len - off;
+    if (relay->stream_size - port->tx_end < len && port->tx_start > 0) {
+        memmove(
+            port->tx, port->tx + port->tx_start, port->tx_end - port->tx_start
+        );
+        port->tx_end -= port->tx_start;
+        port->tx_start = 0;
+    }
+    if (relay->stream_size - port->tx_end < len) {
+        return false;
+    }
+
+    if (off < STREAM_HEADER_SIZE) {
+        unsigned char header[STREAM_HEADER_SIZE];
+        set_stream_header(header, frame->len);
+        memcpy(port->tx + port->tx_end, header + off, STREAM_HEADER_SIZE - off);
+        port->tx_end += STREAM_HEADER_SIZE - off;
+        off = STREAM_HEADER_SIZE;
+    }
+    off -= STREAM_HEADER_SIZE;
+    memcpy(
+        port->tx + port->tx_end,
+        (const unsigned char *)frame->data + off,
+        frame->len - off
+    );
+    port->tx_end += frame->len - off;
+    return true;
+}
+
+// Write the queued bytes. Returns 0 when all bytes were written or the socket
+// is full, or -1 on error.
+static int stream_flush(struct relay_port *port) {
+    while (port->tx_start < port->tx_end) {
+        ssize_t n = send(
+            port->fd,
+            port->tx + port->tx_start,
+            port->tx_end - port->tx_start,
+            SEND_FLAGS
+        );
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return would_block(errno) ? 0 : -1;
+        }
+        port->tx_start += n;
+    }
+    port->tx_start = port->tx_end = 0;
+    return 0;
+}
+
+// Send count frames to a stream socket, writing all headers and frames in one
+// call. A frame written in part is completed from the send buffer before
+// writing other frames, so frames that the socket cannot accept are queued
+// until it is writable. Returns the number of frames sent or queued, or -1 on
+// error.
+static int stream_send(
+    struct relay *relay,
+    struct relay_port *port,
+    const struct relay_frame *frames,
+    int count
+) {
+    int sent = 0;
+
+    if (port->tx_start == port->tx_end) {
+        for (int i = 0; i < count; i++) {
+            set_stream_header(relay->headers[i], frames[i].len);
+            relay->stream_iovs[i * 2] = (struct iovec){
+                .iov_base = relay->headers[i],
+                .iov_len = STREAM_HEADER_SIZE,
+            };
+            relay->stream_iovs[i * 2 + 1] = (struct iovec){
+                .iov_base = frames[i].data,
+                .iov_len = frames[i].len,
+            };
+        }
+        struct msghdr msg = {
+            .msg_iov = relay->stream_iovs,
+            .msg_iovlen = count * 2,
+        };
+
+        ssize_t n;
+        do {
+            n = sendmsg(port->fd, &msg, SEND_FLAGS);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            if (!would_block(errno)) {
+                return -1;
+            }
+            n = 0;
+        }
+
+        size_t written = n;
+        while (sent < count &&
+               written >= STREAM_HEADER_SIZE + frames[sent].len) {
+            written -= STREAM_HEADER_SIZE + frames[sent].len;
+            sent++;
+        }
+        // The send buffer has space for any frame when it is empty.
+        if (written > 0) {
+            stream_queue(relay, port, &frames[sent++], written);
+        }
+    }
+
+    while (sent < count && stream_queue(relay, port, &frames[sent], 0)) {
+        sent++;
+    }
+
+    if (port->tx_start < port->tx_end && !port->writing) {
+        poll_write(relay, port, true);
+    }
+    return sent;
+}
+
+// MARK: - Forwarding
+
+static uint32_t uptime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec;
+}
+
+static void close_port(struct relay *relay, struct relay_port *port) {
+    if (port->writing) {
+        poll_write(relay, port, false);
+    }
+    if (port->fd != -1 && !port->closed) {
+        poll_remove(relay, port->fd);
+    }
+    port->closed = true;
+}
+
+static int port_recv(struct relay *relay, struct relay_port *port) {
+    // The previous batch may point to buffers owned by a port.
+    for (int i = 0; i < relay->batch; i++) {
+        relay->frames[i] = (struct relay_frame){
+            .data = relay->buffers + relay->frame_size * i,
+            .len = relay->frame_size,
+        };
+    }
+    if (port->stream) {
+        return stream_recv(relay, port, relay->batch);
+    }
+    if (port->ops == NULL) {
+        return socket_recv(relay, port->fd, relay->batch);
+    }
+    return port->ops->recv(port->arg, relay->frames, relay->batch);
+}
+
+// Send frames to a port, closing the port on errors. Returns the number of
+// frames sent.
+static int send_frames(
+    struct relay *relay,
+    struct relay_port *port,
+    const struct relay_frame *frames,
+    int count
+) {
+    int sent;
+    if (port->stream) {
+        sent = stream_send(relay, port, frames, count);
+    } else if (port->ops == NULL) {
+        sent = socket_send(relay, port->fd, frames, count);
+    } else {
+        sent = port->ops->send(port->arg, frames, count);
+    }
+    if (sent < 0) {
+        close_port(relay, port);
+        return 0;
+    }
+    port->sent += sent;
+    for (int i = 0; i < sent; i++) {
+        port->sent_bytes += frames[i].len;
+    }
+    return sent;
+}
+
+// Send count segments and frames queued in relay->segments. Returns false if
+// the port did not accept all of them.
+static bool
+flush_segments(struct relay *relay, struct relay_port *port, int count) {
+    if (count == 0) {
+        return true;
+    }
+    if (port->closed) {
+        return false;
+    }
+    return send_frames(relay, port, relay->segments, count) == count;
+}
+
+// Send frames to a port that cannot receive the offloads of some frames,
+// segmenting and checksumming them in the relay buffers. Segments are sent in
+// batches with the other frames, keeping the order. A frame is counted as sent
+// when all its segments were sent, and invalid frames are dropped. Returns the
+// number of frames sent.
+static int send_segmented(
+    struct relay *relay,
+    struct relay_port *port,
+    const struct relay_frame *frames,
+    int count
+) {
+    int sent = 0;
+    // Frames queued completely since the last flush.
+    int queued = 0;
+    int n = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct offload_frame f;
+        bool supported = offload_supported(&frames[i], port->offloads);
+        int segments = 1;
+        if (!supported) {
+            segments = offload_parse(&frames[i], relay->frame_size, &f);
+        }
+        for (int j = 0; j < segments; j++) {
+            if (n == relay->batch) {
+                if (!flush_segments(relay, port, n)) {
+                    return sent;
+                }
+                sent += queued;
+                queued = n = 0;
+            }
+            if (supported) {
+                relay->segments[n] = frames[i];
+            } else {
+                relay->segments[n].data = relay->segment_buffers +
+                                          relay->frame_size * n;
+                offload_segment(&f, j, &relay->segments[n]);
+            }
+            n++;
+        }
+        if (segments > 0) {
+            port->segmented += !supported;
+            queued++;
+        }
+    }
+
+    if (flush_segments(relay, port, n)) {
+        sent += queued;
+    }
+    return sent;
+}
+
+// Send frames to a port, completing offloads that the port cannot receive.
+// Returns the number of frames sent.
+static int port_send(
+    struct relay *relay,
+    struct relay_port *port,
+    const struct relay_frame *frames,
+    int count
+) {
+    for (int i = 0; i < count; i++) {
+        if (!offload_supported(&frames[i], port->offloads)) {
+            return send_segmented(relay, port, frames, count);
+        }
+    }
+    return send_frames(relay, port, frames, count);
+}
+
+// MARK: - Shaping
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+// Queue frames from a switch port to a port of a switch using traffic
+// shaping. Frames larger than the relay buffers are segmented, since the queue
+// buffers have the same size. Returns the number of frames queued.
+static int queue_frames(
+    struct relay *relay,
+    struct relay_port *port,
+    struct relay_port *dst,
+    const struct relay_frame *frames,
+    int count
+) {
+    if (dst->shaper == NULL) {
+        dst->shaper = calloc(1, sizeof(*dst->shaper));
+        if (dst->shaper == NULL ||
+            shaper_init(dst->shaper, &dst->sw->shaping, relay->frame_size) <
+                0) {
+            free(dst->shaper);
+            dst->shaper = NULL;
+            return 0;
+        }
+    }
+
+    int queued = 0;
+    for (int i = 0; i < count; i++) {
+        if (frames[i].len <= relay->frame_size) {
+            queued += shaper_enqueue(dst->shaper, port->index, &frames[i]);
+            continue;
+        }
+        struct offload_frame f;
+        int segments = offload_parse(&frames[i], relay->frame_size, &f);
+        struct relay_frame segment = {.data = relay->segment_buffers};
+        bool ok = segments > 0;
+        for (int j = 0; j < segments; j++) {
+            offload_segment(&f, j, &segment);
+            ok &= shaper_enqueue(dst->shaper, port->index, &segment);
+        }
+        dst->segmented += segments > 0;
+        queued += ok;
+    }
+    return queued;
+}
+
+// Send the frames queued for a port that can be sent at time now. Frames the
+// port does not accept are dropped, as when sending without shaping.
+static void
+send_queued(struct relay *relay, struct relay_port *port, uint64_t now) {
+    struct shaper *s = port->shaper;
+    int n;
+    while ((n = shaper_dequeue(s, now, relay->out, relay->batch)) > 0) {
+        int sent = port->closed ? 0 : port_send(relay, port, relay->out, n);
+        s->drops += n - sent;
+    }
+}
+
+// Send the frames queued for the ports of a switch using traffic shaping.
+// Returns the time in nanoseconds until more frames can be sent, or -1 if no
+// frames are queued.
+static int64_t shape_switch(struct relay *relay, struct relay_switch *sw) {
+    uint64_t now = monotonic_ns();
+    int64_t delay = -1;
+    for (int i = 0; i < sw->port_count; i++) {
+        struct relay_port *port = sw->ports[i];
+        if (port == NULL || port->shaper == NULL || port->shaper->len == 0) {
+            continue;
+        }
+        send_queued(relay, port, now);
+        int64_t d = shaper_delay(port->shaper, now);
+        if (d != -1 && (delay == -1 || d < delay)) {
+            delay = d;
+        }
+    }
+    return delay;
+}
+
+// Send the frames queued for all switches. Returns the time in nanoseconds
+// until more frames can be sent, or -1 if no frames are queued.
+static int64_t shape_switches(struct relay *relay) {
+    int64_t delay = -1;
+    for (struct relay_switch *sw = relay->switches; sw; sw = sw->next) {
+        if (!sw->shaped) {
+            continue;
+        }
+        int64_t d = shape_switch(relay, sw);
+        if (d != -1 && (delay == -1 || d < delay)) {
+            delay = d;
+        }
+    }
+    return delay;
+}
+
+// Frames of a batch received on a switch port, grouped by destination.
+struct switch_batch {
+    // Frame indexes to flood.
+    int flood[RELAY_BATCH];
+    int flood_count;
+    // Destination port indexes.
+    int targets[RELAY_BATCH];
+    int target_count;
+    // Linked lists of frame indexes for every target, in the batch order.
+    int first[RELAY_BATCH];
+    int last[RELAY_BATCH];
+    int next[RELAY_BATCH];
+};
+
+static void add_target_frame(
+    struct relay_switch *sw, struct switch_batch *b, int dst, int i
+) {
+    int t = sw->targets[dst];
+    if (t == -1) {
+        t = b->target_count++;
+        sw->targets[dst] = t;
+        b->targets[t] = dst;
+        b->first[t] = i;
+    } else {
+        b->next[b->last[t]] = i;
+    }
+    b->last[t] = i;
+    b->next[i] = -1;
+}
+
+// Send the frames for target t, or -1 for no target, merged with the flooded
+// frames if flood is true.
+static void switch_send(
+    struct relay *relay,
+    struct relay_port *port,
+    struct relay_port *dst,
+    const struct switch_batch *b,
+    int t,
+    bool flood
+) {
+    int i = t == -1 ? -1 : b->first[t];
+    int f = 0;
+    int flood_count = flood ? b->flood_count : 0;
+    int n = 0;
+
+    while (i != -1 || f < flood_count) {
+        if (f < flood_count && (i == -1 || b->flood[f] < i)) {
+            relay->out[n++] = relay->frames[b->flood[f++]];
+        } else {
+            relay->out[n++] = relay->frames[i];
+            i = b->next[i];
+        }
+    }
+
+    if (n == 0) {
+        return;
+    }
+    if (dst->closed) {
+        port->drops += n;
+        return;
+    }
+    if (dst->sw->shaped) {
+        port->drops += n - queue_frames(relay, port, dst, relay->out, n);
+        return;
+    }
+    port->drops += n - port_send(relay, dst, relay->out, n);
+}
+
+// Answer an ARP request or a neighbor solicitation for an address known by the
+// switch, if the host owning it is on another port. Returns true if the frame
+// was answered, and does not need to be flooded.
+static bool proxy_frame(
+    struct relay *relay, struct relay_port *port, int i, int *replies
+) {
+    struct relay_switch *sw = port->sw;
+    unsigned char *reply = relay->reply_buffers[*replies];
+    uint64_t target;
+    size_t len = neigh_input(
+        &sw->neigh,
+        relay->frames[i].data,
+        relay->frames[i].len,
+        relay->now,
+        reply,
+        &target
+    );
+    if (len == 0) {
+        return false;
+    }
+    int d = fdb_lookup(&sw->fdb, target, relay->now);
+    if (d == -1 || d == port->index) {
+        return false;
+    }
+    relay->replies[(*replies)++] = (struct relay_frame){
+        .data = reply,
+        .len = len,
+    };
+    sw->suppressed++;
+    return true;
+}
+
+// Send replies to requests answered by the switch to the requesting port.
+static void
+send_replies(struct relay *relay, struct relay_port *port, int count) {
+    if (count == 0) {
+        return;
+    }
+    if (port->closed) {
+        port->drops += count;
+        return;
+    }
+    int sent;
+    if (port->sw->shaped) {
+        sent = queue_frames(relay, port, port, relay->replies, count);
+    } else {
+        sent = port_send(relay, port, relay->replies, count);
+    }
+    port->drops += count - sent;
+}
+
+// Learn the source addresses of frames received on a switch port, and send
+// every frame to the port where the destination was seen, or to all other
+// ports. ARP requests and neighbor solicitations for known addresses are
+// answered by the switch.
+static void
+switch_frames(struct relay *relay, struct relay_port *port, int count) {
+    struct relay_switch *sw = port->sw;
+    struct switch_batch b = {0};
+    int replies = 0;
+
+    for (int i = 0; i < count; i++) {
+        const unsigned char *frame = relay->frames[i].data;
+        if (relay->frames[i].len < ETHER_HEADER_SIZE) {
+            port->drops++;
+            continue;
+        }
+
+        uint64_t src = fdb_mac(frame + 6);
+        if (src && !fdb_is_multicast(src)) {
+            fdb_learn(&sw->fdb, src, port->index, relay->now);
+        }
+
+        if (proxy_frame(relay, port, i, &replies)) {
+            continue;
+        }
+
+        uint64_t dst = fdb_mac(frame);
+        int d = -1;
+        if (!fdb_is_multicast(dst)) {
+            d = fdb_lookup(&sw->fdb, dst, relay->now);
+        }
+        if (d == -1) {
+            b.flood[b.flood_count++] = i;
+            sw->flooded++;
+        } else if (d != port->index) {
+            add_target_frame(sw, &b, d, i);
+            sw->unicast++;
+        }
+        // Frames to the source port are filtered.
+    }
+
+    if (b.flood_count > 0) {
+        for (int j = 0; j < sw->port_count; j++) {
+            struct relay_port *dst = sw->ports[j];
+            if (dst && dst != port && !dst->closed) {
+                switch_send(relay, port, dst, &b, sw->targets[j], true);
+            }
+        }
+    } else {
+        for (int t = 0; t < b.target_count; t++) {
+            struct relay_port *dst = sw->ports[b.targets[t]];
+            switch_send(relay, port, dst, &b, t, false);
+        }
+    }
+
+    for (int t = 0; t < b.target_count; t++) {
+        sw->targets[b.targets[t]] = -1;
+    }
+
+    send_replies(relay, port, replies);
+}
+
+// Forward one batch of frames from port to its peer. Returns the number of
+// frames received.
+static int forward(struct relay *relay, struct relay_port *port) {
+    int n = port_recv(relay, port);
+    if (n < 0) {
+        close_port(relay, port);
+        return 0;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    // Drop truncated frames.
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        if (relay->frames[i].len == 0) {
+            port->drops++;
+            continue;
+        }
+        port->bytes += relay->frames[i].len;
+        relay->frames[count++] = relay->frames[i];
+    }
+    port->frames += n;
+    port->batches++;
+
+    if (port->sw) {
+        for (struct relay_tap *t = port->sw->taps; t; t = t->next) {
+            t->fn(t->arg, relay->frames, count);
+        }
+        switch_frames(relay, port, count);
+        if (port->sw->shaped) {
+            shape_switch(relay, port->sw);
+        }
+    } else {
+        struct relay_port *peer = port->peer;
+        int sent = 0;
+        if (count > 0 && !peer->closed) {
+            sent = port_send(relay, peer, relay->frames, count);
+        }
+        port->drops += count - sent;
+    }
+
+    if (port->ops && port->ops->done) {
+        port->ops->done(port->arg, n);
+    }
+
+    return n;
+}
+
+// Callback ports are notified only when frames become available, so forward
+// until no frames are available, or notify again to serve other ports first.
+static void forward_callbacks(struct relay *relay, struct relay_port *port) {
+    int batches = 0;
+    while (forward(relay, port) > 0) {
+        if (++batches == MAX_CALLBACK_BATCHES) {
+            atomic_store(&port->link->notified, true);
+            atomic_store(&relay->woken, true);
+            break;
+        }
+    }
+}
+
+// A full batch may leave complete frames in the receive buffer of a stream
+// port, so forward until a batch is not full, or notify again to serve other
+// ports first.
+static void forward_stream(struct relay *relay, struct relay_port *port) {
+    int batches = 0;
+    while (forward(relay, port) == relay->batch) {
+        if (++batches == MAX_CALLBACK_BATCHES) {
+            atomic_store(&port->link->notified, true);
+            atomic_store(&relay->woken, true);
+            break;
+        }
+    }
+}
+
+// Write bytes queued for a stream port when the socket becomes writable.
+static void stream_writable(struct relay *relay, struct relay_port *port) {
+    if (stream_flush(port) < 0) {
+        close_port(relay, port);
+    } else if (port->tx_start == port->tx_end) {
+        poll_write(relay, port, false);
+    }
+}
+
+static void forward_notified(struct relay *relay) {
+    for (struct relay_link *link = relay->links; link; link = link->next) {
+        if (!atomic_exchange(&link->notified, false)) {
+            continue;
+        }
+        for (int i = 0; i < 2; i++) {
+            struct relay_port *port = &link->ports[i];
+            if (port->closed) {
+                continue;
+            }
+            if (port->stream) {
+                forward_stream(relay, port);
+            } else if (port->ops) {
+                forward_callbacks(relay, port);
+            }
+        }
+    }
+}
+
+static void free_link_memory(struct relay_link *link) {
+    for (int i = 0; i < 2; i++) {
+        free(link->ports[i].rx);
+        if (link->ports[i].shaper) {
+            shaper_destroy(link->ports[i].shaper);
+            free(link->ports[i].shaper);
+        }
+    }
+    free(link);
+}
+
+static void free_removed(struct relay *relay) {
+    while (relay->removed) {
+        struct relay_link *link = relay->removed;
+        relay->removed = link->next;
+        free_link_memory(link);
+    }
+}
+
+static void drain_wake(struct relay *relay) {
+    char buf[64];
+    while (read(relay->wake_fds[0], buf, sizeof(buf)) > 0) {
+    }
+}
+
+static void drain_doorbell(int fd) {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+}
+
+static void *relay_thread(void *arg) {
+    struct relay *relay = arg;
+#ifdef __linux__
+    struct epoll_event events[MAX_EVENTS];
+#else
+    struct kevent events[MAX_EVENTS];
+#endif
+
+    // Time in nanoseconds until frames queued by switches using traffic
+    // shaping can be sent, or -1 if no frames are queued.
+    int64_t delay = -1;
+
+    while (!atomic_load(&relay->stopping)) {
+        // Do not wait if callback ports have more frames.
+        if (atomic_load(&relay->woken)) {
+            delay = 0;
+        }
+#ifdef __linux__
+        int timeout = -1;
+        if (delay != -1) {
+            timeout = (delay + NANOSECONDS_PER_MILLISECOND - 1) /
+                      NANOSECONDS_PER_MILLISECOND;
+        }
+        int n = epoll_wait(relay->poll_fd, events, MAX_EVENTS, timeout);
+#else
+        struct timespec timeout = {
+            .tv_sec = delay / NANOSECONDS_PER_SECOND,
+            .tv_nsec = delay % NANOSECONDS_PER_SECOND,
+        };
+        int n = kevent(
+            relay->poll_fd,
+            NULL,
+            0,
+            events,
+            MAX_EVENTS,
+            delay != -1 ? &timeout : NULL
+        );
+#endif
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        pthread_mutex_lock(&relay->lock);
+
+        relay->now = uptime();
+
+        for (int i = 0; i < n; i++) {
+#ifdef __linux__
+            struct relay_port *port = events[i].data.ptr;
+            bool eof = events[i].events & (EPOLLHUP | EPOLLERR);
+            bool readable = events[i].events & ~EPOLLOUT;
+            bool writable = events[i].events & EPOLLOUT;
+#else
+            struct relay_port *port = events[i].udata;
+            bool eof = events[i].flags & EV_EOF;
+            bool readable = events[i].filter == EVFILT_READ;
+            bool writable = events[i].filter == EVFILT_WRITE;
+#endif
+            if (port == NULL) {
+                drain_wake(relay);
+                continue;
+            }
+            // Events may be pending for links removed after waiting.
+            if (port->link->removed || port->closed) {
+                continue;
+            }
+            if (port->stream) {
+                if (writable) {
+                    stream_writable(relay, port);
+                }
+                if (readable && !port->closed) {
+                    forward_stream(relay, port);
+                }
+            } else if (port->ops) {
+                // Drain the doorbell before receiving, so frames published
+                // after receiving ring it again.
+                drain_doorbell(port->fd);
+                if (eof) {
+                    close_port(relay, port);
+                } else {
+                    forward_callbacks(relay, port);
+                }
+            } else if (forward(relay, port) == 0 && eof) {
+                close_port(relay, port);
+            }
+        }
+
+        // Clear the flag before checking the links, so links notified while
+        // forwarding wake up the relay thread again.
+        if (atomic_exchange(&relay->woken, false)) {
+            forward_notified(relay);
+        }
+
+        delay = shape_switches(relay);
+
+        free_removed(relay);
+
+        pthread_mutex_unlock(&relay->lock);
+    }
+
+    return NULL;
+}
+
+static void wake(struct relay *relay) {
+    char c = 0;
+    // If the pipe is full the relay thread is already woken up.
+    (void)write(relay->wake_fds[1], &c, 1);
+}
+
+// MARK: - Public interface
+
+struct relay *relay_create(size_t frame_size, int batch) {
+    if (frame_size == 0 || batch < 1 || batch > RELAY_BATCH) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct relay *relay = calloc(1, sizeof(*relay));
+    if (relay == NULL) {
+        return NULL;
+    }
+
+    int err;
+
+    relay->frame_size = frame_size;
+    relay->batch = batch;
+    relay->stream_size = STREAM_BUFFER_SIZE;
+    if (relay->stream_size < 2 * (frame_size + STREAM_HEADER_SIZE)) {
+        relay->stream_size = 2 * (frame_size + STREAM_HEADER_SIZE);
+    }
+    relay->now = uptime();
+    relay->poll_fd = -1;
+    relay->wake_fds[0] = relay->wake_fds[1] = -1;
+
+    relay->buffers = malloc(frame_size * batch);
+    relay->segment_buffers = malloc(frame_size * batch);
+    if (relay->buffers == NULL || relay->segment_buffers == NULL) {
+        goto failure;
+    }
+    for (int i = 0; i < batch; i++) {
+        relay->frames[i].data = relay->buffers + frame_size * i;
+    }
+
+    relay->poll_fd = poll_create();
+    if (relay->poll_fd < 0) {
+        goto failure;
+    }
+
+    if (pipe(relay->wake_fds) < 0) {
+        goto failure;
+    }
+    if (set_nonblocking(relay->wake_fds[0]) < 0 ||
+        set_nonblocking(relay->wake_fds[1]) < 0) {
+        goto failure;
+    }
+    if (poll_add(relay, relay->wake_fds[0], NULL) < 0) {
+        goto failure;
+    }
+
+    pthread_mutex_init(&relay->lock, NULL);
+
+    err = pthread_create(&relay->thread, NULL, relay_thread, relay);
+    if (err) {
+        pthread_mutex_destroy(&relay->lock);
+        errno = err;
+        goto failure;
+    }
+
+    return relay;
+
+failure:
+    err = errno;
+    if (relay->wake_fds[0] != -1) {
+        close(relay->wake_fds[0]);
+        close(relay->wake_fds[1]);
+    }
+    if (relay->poll_fd != -1) {
+        close(relay->poll_fd);
+    }
+    free(relay->buffers);
+    free(relay->segment_buffers);
+    free(relay);
+    errno = err;
+    return NULL;
+}
+
+static void free_link(struct relay_link *link) {
+    for (int i = 0; i < 2; i++) {
+        if (link->ports[i].fd != -1) {
+            close(link->ports[i].fd);
+        }
+    }
+    free_link_memory(link);
+}
+
+void relay_destroy(struct relay *relay) {
+    atomic_store(&relay->stopping, true);
+    wake(relay);
+    pthread_join(relay->thread, NULL);
+
+    free_removed(relay);
+    while (relay->links) {
+        struct relay_link *link = relay->links;
+        relay->links = link->next;
+        free_link(link);
+    }
+    while (relay->switches) {
+        struct relay_switch *sw = relay->switches;
+        relay->switches = sw->next;
+        fdb_destroy(&sw->fdb);
+        neigh_destroy(&sw->neigh);
+        free(sw);
+    }
+
+    pthread_mutex_destroy(&relay->lock);
+    close(relay->wake_fds[0]);
+    close(relay->wake_fds[1]);
+    close(relay->poll_fd);
+    free(relay->buffers);
+    free(relay->segment_buffers);
+    free(relay);
+}
+
+// Initialize a port, allocating the buffers of a stream port. Returns -1 and
+// sets errno on failure.
+static int init_port(
+    struct relay *relay,
+    struct relay_link *link,
+    struct relay_port *port,
+    struct relay_port *peer,
+    const struct relay_endpoint *endpoint
+) {
+    port->link = link;
+    port->peer = peer;
+    port->fd = endpoint->fd;
+    port->ops = endpoint->ops;
+    port->arg = endpoint->arg;
+    port->offloads = endpoint->offloads;
+    if (endpoint->stream) {
+        port->stream = true;
+        port->rx = malloc(relay->stream_size * 2);
+        if (port->rx == NULL) {
+            return -1;
+        }
+        port->tx = port->rx + relay->stream_size;
+    }
+    return 0;
+}
+
+struct relay_link *relay_add_link(
+    struct relay *relay,
+    const struct relay_endpoint *a,
+    const struct relay_endpoint *b
+) {
+    const struct relay_endpoint *endpoints[2] = {a, b};
+    for (int i = 0; i < 2; i++) {
+        if (endpoints[i]->fd == -1 && endpoints[i]->ops == NULL) {
+            errno = EINVAL;
+            return NULL;
+        }
+        if (endpoints[i]->fd != -1 && setup_socket(endpoints[i]->fd) < 0) {
+            return NULL;
+        }
+    }
+
+    struct relay_link *link = calloc(1, sizeof(*link));
+    if (link == NULL) {
+        return NULL;
+    }
+    if (init_port(relay, link, &link->ports[0], &link->ports[1], a) < 0 ||
+        init_port(relay, link, &link->ports[1], &link->ports[0], b) < 0) {
+        free_link_memory(link);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&relay->lock);
+
+    for (int i = 0; i < 2; i++) {
+        struct relay_port *port = &link->ports[i];
+        if (port->fd != -1 && poll_add(relay, port->fd, port) < 0) {
+            int err = errno;
+            if (i == 1 && link->ports[0].fd != -1) {
+                poll_remove(relay, link->ports[0].fd);
+            }
+            pthread_mutex_unlock(&relay->lock);
+            free_link_memory(link);
+            errno = err;
+            return NULL;
+        }
+    }
+
+    link->next = relay->links;
+    relay->links = link;
+    relay->link_count++;
+
+    pthread_mutex_unlock(&relay->lock);
+
+    // Forward frames queued before the link was added.
+    relay_notify(relay, link);
+
+    return link;
+}
+
+struct relay_link *relay_add_switch_link(
+    struct relay *relay,
+    struct relay_switch *sw,
+    const struct relay_endpoint *endpoint
+) {
+    if (endpoint->fd == -1 && endpoint->ops == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (endpoint->fd != -1 && setup_socket(endpoint->fd) < 0) {
+        return NULL;
+    }
+
+    struct relay_link *link = calloc(1, sizeof(*link));
+    if (link == NULL) {
+        return NULL;
+    }
+    struct relay_port *port = &link->ports[0];
+    if (init_port(relay, link, port, NULL, endpoint) < 0) {
+        free_link_memory(link);
+        return NULL;
+    }
+    port->sw = sw;
+    link->ports[1] = (struct relay_port){
+        .link = link,
+        .fd = -1,
+        .closed = true,
+    };
+
+    pthread_mutex_lock(&relay->lock);
+
+    int index = 0;
+    while (index < RELAY_SWITCH_PORTS && sw->ports[index]) {
+        index++;
+    }
+    if (index == RELAY_SWITCH_PORTS) {
+        pthread_mutex_unlock(&relay->lock);
+        free_link_memory(link);
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    if (port->fd != -1 && poll_add(relay, port->fd, port) < 0) {
+        int err = errno;
+        pthread_mutex_unlock(&relay->lock);
+        free_link_memory(link);
+        errno = err;
+        return NULL;
+    }
+
+    port->index = index;
+    sw->ports[index] = port;
+    if (index >= sw->port_count) {
+        sw->port_count = index + 1;
+    }
+
+    link->next = relay->links;
+    relay->links = link;
+    relay->link_count++;
+
+    pthread_mutex_unlock(&relay->lock);
+
+    // Forward frames queued before the link was added.
+    relay_notify(relay, link);
+
+    return link;
+}
+
+static void add_port_stats(struct relay_stats *s, const struct relay_port *p) {
+    s->frames += p->frames;
+    s->bytes += p->bytes;
+    s->batches += p->batches;
+    s->drops += p->drops;
+    s->segmented += p->segmented;
+    if (p->shaper) {
+        s->queued += p->shaper->queued;
+        s->queue_drops += p->shaper->drops;
+    }
+}
+
+// Remove a port from its switch. The port index may be reused by a new port.
+static void remove_switch_port(struct relay_port *port) {
+    struct relay_switch *sw = port->sw;
+    sw->ports[port->index] = NULL;
+    while (sw->port_count > 0 && sw->ports[sw->port_count - 1] == NULL) {
+        sw->port_count--;
+    }
+    fdb_flush_port(&sw->fdb, port->index);
+}
+
+void relay_remove_link(struct relay *relay, struct relay_link *link) {
+    pthread_mutex_lock(&relay->lock);
+
+    struct relay_link **p = &relay->links;
+    while (*p != link) {
+        p = &(*p)->next;
+    }
+    *p = link->next;
+    relay->link_count--;
+
+    if (link->ports[0].sw) {
+        remove_switch_port(&link->ports[0]);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        struct relay_port *port = &link->ports[i];
+        close_port(relay, port);
+        if (port->fd != -1) {
+            close(port->fd);
+            port->fd = -1;
+        }
+        add_port_stats(&relay->totals, port);
+    }
+
+    link->removed = true;
+    link->next = relay->removed;
+    relay->removed = link;
+
+    pthread_mutex_unlock(&relay->lock);
+
+    wake(relay);
+}
+
+struct relay_tap *relay_add_tap(
+    struct relay *relay, struct relay_switch *sw, relay_tap_fn fn, void *arg
+) {
+    struct relay_tap *tap = calloc(1, sizeof(*tap));
+    if (tap == NULL) {
+        return NULL;
+    }
+    tap->fn = fn;
+    tap->arg = arg;
+    tap->sw = sw;
+
+    pthread_mutex_lock(&relay->lock);
+    tap->next = sw->taps;
+    sw->taps = tap;
+    pthread_mutex_unlock(&relay->lock);
+
+    return tap;
+}
+
+void relay_remove_tap(struct relay *relay, struct relay_tap *tap) {
+    pthread_mutex_lock(&relay->lock);
+
+    struct relay_tap **p = &tap->sw->taps;
+    while (*p != tap) {
+        p = &(*p)->next;
+    }
+    *p = tap->next;
+
+    pthread_mutex_unlock(&relay->lock);
+
+    free(tap);
+}
+
+void relay_notify(struct relay *relay, struct relay_link *link) {
+    atomic_store(&link->notified, true);
+    if (!atomic_exchange(&relay->woken, true)) {
+        wake(relay);
+    }
+}
+
+void relay_get_stats(struct relay *relay, struct relay_stats *stats) {
+    pthread_mutex_lock(&relay->lock);
+
+    *stats = relay->totals;
+    stats->links = relay->link_count;
+    stats->switches = relay->switch_count;
+    for (struct relay_link *link = relay->links; link; link = link->next) {
+        add_port_stats(stats, &link->ports[0]);
+        add_port_stats(stats, &link->ports[1]);
+    }
+    for (struct relay_switch *sw = relay->switches; sw; sw = sw->next) {
+        stats->unicast += sw->unicast;
+        stats->flooded += sw->flooded;
+        stats->suppressed += sw->suppressed;
+    }
+
+    pthread_mutex_unlock(&relay->lock);
+}
+
+void relay_get_port_stats(
+    struct relay *relay,
+    struct relay_link *link,
+    struct relay_port_stats *stats
+) {
+    pthread_mutex_lock(&relay->lock);
+
+    const struct relay_port *port = &link->ports[0];
+    *stats = (struct relay_port_stats){
+        .frames = port->frames,
+        .bytes = port->bytes,
+        .drops = port->drops,
+        .sent = port->sent,
+        .sent_bytes = port->sent_bytes,
+    };
+    if (port->shaper) {
+        stats->queue_len = port->shaper->len;
+        stats->max_queue_len = port->shaper->max_len;
+        stats->queue_drops = port->shaper->drops;
+    }
+
+    pthread_mutex_unlock(&relay->lock);
+}
+
+struct relay_switch *relay_create_switch(struct relay *relay) {
+    struct relay_switch *sw = calloc(1, sizeof(*sw));
+    if (sw == NULL) {
+        return NULL;
+    }
+    if (fdb_init(&sw->fdb, SWITCH_ADDRESSES, RELAY_SWITCH_AGE) < 0) {
+        free(sw);
+        return NULL;
+    }
+    if (neigh_init(&sw->neigh, SWITCH_NEIGHBORS, RELAY_SWITCH_AGE) < 0) {
+        fdb_destroy(&sw->fdb);
+        free(sw);
+        return NULL;
+    }
+    for (int i = 0; i < RELAY_SWITCH_PORTS; i++) {
+        sw->targets[i] = -1;
+    }
+
+    pthread_mutex_lock(&relay->lock);
+    sw->next = relay->switches;
+    relay->switches = sw;
+    relay->switch_count++;
+    pthread_mutex_unlock(&relay->lock);
+
+    return sw;
+}
+
+int relay_set_shaping(
+    struct relay *relay,
+    struct relay_switch *sw,
+    const struct relay_shaping *shaping
+) {
+    if (shaper_check(shaping) < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&relay->lock);
+    sw->shaping = *shaping;
+    sw->shaped = true;
+    pthread_mutex_unlock(&relay->lock);
+
+    return 0;
+}
+
+void relay_destroy_switch(struct relay *relay, struct relay_switch *sw) {
+    pthread_mutex_lock(&relay->lock);
+
+    struct relay_switch **p = &relay->switches;
+    while (*p != sw) {
+        p = &(*p)->next;
+    }
+    *p = sw->next;
+    relay->switch_count--;
+    relay->totals.unicast += sw->unicast;
+    relay->totals.flooded += sw->flooded;
+    relay->totals.suppressed += sw->suppressed;
+
+    pthread_mutex_unlock(&relay->lock);
+
+    fdb_destroy(&sw->fdb);
+    neigh_destroy(&sw->neigh);
+    free(sw);
+}
@@ -0,0 +1,171 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// memfd_create and file seals are available only with _GNU_SOURCE.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "broker-ring.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// MARK: - Regions
+
+// Create an anonymous shared memory object. The client must not be able to
+// shrink the region while the broker is using it.
+static int create_shm(uint64_t size) {
+#ifdef __linux__
+    int fd = memfd_create(
+        "vmnet-broker-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING
+    );
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, size) < 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) <
+            0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+#else
+    // The size of a POSIX shared memory object cannot be changed after it
+    // was set. The name is removed immediately, so only processes receiving
+    // the descriptor can map the region.
+    static unsigned counter;
+    char name[32];
+    snprintf(name, sizeof(name), "/vmnet-broker.%d.%u", getpid(), counter++);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    shm_unlink(name);
+    if (ftruncate(fd, size) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+#endif
+}
+
+int ring_create(uint32_t slots, uint32_t slot_size) {
+    if (slots == 0 || (slots & (slots - 1)) || slot_size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct vmnet_broker_ring_header header = {
+        .magic = VMNET_BROKER_RING_MAGIC,
+        .version = VMNET_BROKER_RING_VERSION,
+        .slots = slots,
+        .slot_size = slot_size,
+    };
+    uint64_t ring_size = vmnet_broker_ring_size(slots, slot_size);
+    header.offsets[0] = vmnet_broker_ring_align(sizeof(header));
+    header.offsets[1] = header.offsets[0] + ring_size;
+    header.size = header.offsets[1] + ring_size;
+
+    int fd = create_shm(header.size);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // The new region is zeroed, so the rings are empty.
+    void *base = mmap(
+        NULL, header.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+    );
+    if (base == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    memcpy(base, &header, sizeof(header));
+    munmap(base, header.size);
+
+    return fd;
+}
+
+// MARK: - Ring ports
+
+// Receive frames from the client ring in place. The frames are released in
+// ring_done() after forwarding them.
+static int ring_recv(void *arg, struct relay_frame *frames, int count) {
+    struct ring_port *port = arg;
+    struct vmnet_broker_ring *rx = &port->channel.rx;
+
+    uint32_t n = vmnet_broker_ring_available(rx);
+    if (n > (uint32_t)count) {
+        n = count;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        frames[i].data = vmnet_broker_ring_frame(rx, i, &frames[i].len);
+    }
+    return n;
+}
+
+static void ring_done(void *arg, int count) {
+    struct ring_port *port = arg;
+    vmnet_broker_ring_release(&port->channel.rx, count);
+}
+
+// Copy frames to the broker ring, and ring the doorbell if the client may be
+// waiting. Frames that do not fit in the ring are dropped by the relay.
+static int ring_send(void *arg, const struct relay_frame *frames, int count) {
+    struct ring_port *port = arg;
+    struct vmnet_broker_ring *tx = &port->channel.tx;
+
+    int sent = 0;
+    while (sent < count && frames[sent].len <= tx->slot_size) {
+        void *buf = vmnet_broker_ring_reserve(tx);
+        if (buf == NULL) {
+            break;
+        }
+        memcpy(buf, frames[sent].data, frames[sent].len);
+        vmnet_broker_ring_commit(tx, frames[sent].len);
+        sent++;
+    }
+
+    if (vmnet_broker_ring_publish(tx)) {
+        // If the socket buffer is full the client has pending doorbells.
+        char c = 0;
+        (void)send(port->doorbell, &c, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    return sent;
+}
+
+const struct relay_port_ops ring_port_ops = {
+    .recv = ring_recv,
+    .send = ring_send,
+    .done = ring_done,
+};
+
+int ring_port_init(struct ring_port *port, int fd, int doorbell) {
+    if (vmnet_broker_ring_map(fd, VMNET_BROKER_RING_BROKER, &port->channel) <
+        0) {
+        return -1;
+    }
+    port->doorbell = doorbell;
+    return 0;
+}
+
+void ring_port_destroy(struct ring_port *port) {
+    if (port->channel.base) {
+        vmnet_broker_ring_unmap(&port->channel);
+    }
+}
@@ -0,0 +1,233 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "broker-shaper.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+// Largest queue, 128 MiB of 2 KiB frame buffers.
+#define MAX_QUEUE_LEN 65536
+
+int shaper_check(const struct relay_shaping *config) {
+    if (config->rate == 0 || config->burst == 0 || config->quantum == 0 ||
+        config->queue_len < 1 || config->queue_len > MAX_QUEUE_LEN) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int shaper_init(
+    struct shaper *s, const struct relay_shaping *config, size_t frame_size
+) {
+    if (shaper_check(config) < 0) {
+        return -1;
+    }
+
+    int n = config->queue_len;
+    *s = (struct shaper){
+        .config = *config,
+        .frame_size = frame_size,
+        .tokens = config->burst,
+    };
+    s->buffers = malloc(frame_size * n);
+    s->frames = calloc(n, sizeof(*s->frames));
+    s->next = calloc(n, sizeof(*s->next));
+    s->first = calloc(RELAY_SWITCH_PORTS, sizeof(*s->first));
+    s->last = calloc(RELAY_SWITCH_PORTS, sizeof(*s->last));
+    s->count = calloc(RELAY_SWITCH_PORTS, sizeof(*s->count));
+    s->deficit = calloc(RELAY_SWITCH_PORTS, sizeof(*s->deficit));
+    s->active = calloc(RELAY_SWITCH_PORTS, sizeof(*s->active));
+    s->is_active = calloc(RELAY_SWITCH_PORTS, sizeof(*s->is_active));
+    if (s->buffers == NULL || s->frames == NULL || s->next == NULL ||
+        s->first == NULL || s->last == NULL || s->count == NULL ||
+        s->deficit == NULL || s->active == NULL || s->is_active == NULL) {
+        shaper_destroy(s);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        s->frames[i].data = s->buffers + frame_size * i;
+        s->next[i] = i + 1 < n ? i + 1 : -1;
+    }
+    s->free = 0;
+    return 0;
+}
+
+void shaper_destroy(struct shaper *s) {
+    free(s->buffers);
+    free(s->frames);
+    free(s->next);
+    free(s->first);
+    free(s->last);
+    free(s->count);
+    free(s->deficit);
+    free(s->active);
+    free(s->is_active);
+    *s = (struct shaper){0};
+}
+
+// Remove the first frame of a flow, returning its slot to the free list. The
+// frame stays valid until the slot is reused.
+static int remove_first(struct shaper *s, int flow) {
+    int slot = s->first[flow];
+    s->first[flow] = s->next[slot];
+    s->count[flow]--;
+    s->len--;
+    s->next[slot] = s->free;
+    s->free = slot;
+    return slot;
+}
+
+// Return the flow with the most frames. All queued frames belong to flows in
+// the scheduler ring, so only the active flows are scanned.
+static int longest_flow(const struct shaper *s) {
+    int longest = s->active[s->active_head];
+    for (int i = 1; i < s->active_count; i++) {
+        int flow = s->active[(s->active_head + i) % RELAY_SWITCH_PORTS];
+        if (s->count[flow] > s->count[longest]) {
+            longest = flow;
+        }
+    }
+    return longest;
+}
+
+bool shaper_enqueue(
+    struct shaper *s, int flow, const struct relay_frame *frame
+) {
+    if (s->free == -1) {
+        // Drop the oldest frame of the longest flow, unless the frame belongs
+        // to it. Flows shrink when frames are dequeued, so the longest flow is
+        // found when the queue is full.
+        int longest = longest_flow(s);
+        if (s->count[longest] <= s->count[flow]) {
+            s->drops++;
+            return false;
+        }
+        remove_first(s, longest);
+        s->drops++;
+    }
+
+    int slot = s->free;
+    s->free = s->next[slot];
+    memcpy(s->frames[slot].data, frame->data, frame->len);
+    s->frames[slot].len = frame->len;
+    s->frames[slot].offload = frame->offload;
+    s->next[slot] = -1;
+
+    if (s->count[flow] == 0) {
+        s->first[flow] = slot;
+    } else {
+        s->next[s->last[flow]] = slot;
+    }
+    s->last[flow] = slot;
+    s->count[flow]++;
+
+    if (!s->is_active[flow]) {
+        int tail = (s->active_head + s->active_count) % RELAY_SWITCH_PORTS;
+        s->active[tail] = flow;
+        s->active_count++;
+        s->is_active[flow] = true;
+        s->deficit[flow] = 0;
+    }
+
+    s->len++;
+    if (s->len > s->max_len) {
+        s->max_len = s->len;
+    }
+    s->queued++;
+    return true;
+}
+
+// Return the tokens available at time now. Tokens are added at the configured
+// rate, up to the burst size.
+static int64_t available(const struct shaper *s, uint64_t now) {
+    uint64_t elapsed = now - s->updated;
+    // Limit the elapsed time to avoid overflow; the bucket is full anyway.
+    if (elapsed >= NANOSECONDS_PER_SECOND) {
+        return s->config.burst;
+    }
+    uint64_t added = elapsed * s->config.rate / NANOSECONDS_PER_SECOND;
+    int64_t tokens = s->tokens + (int64_t)added;
+    return tokens < s->config.burst ? tokens : s->config.burst;
+}
+
+// Add tokens for the time since the last update. The update time advances
+// only by the time of the tokens added, so rounding does not lose tokens.
+static void refill(struct shaper *s, uint64_t now) {
+    int64_t tokens = available(s, now);
+    if (tokens >= s->config.burst) {
+        s->tokens = tokens;
+        s->updated = now;
+    } else if (tokens > s->tokens) {
+        s->updated += (uint64_t)(tokens - s->tokens) * NANOSECONDS_PER_SECOND /
+                      s->config.rate;
+        s->tokens = tokens;
+    }
+}
+
+// Pop the flow at the head of the scheduler ring.
+static void pop_active(struct shaper *s) {
+    int flow = s->active[s->active_head];
+    s->is_active[flow] = false;
+    s->active_head = (s->active_head + 1) % RELAY_SWITCH_PORTS;
+    s->active_count--;
+}
+
+// Move the flow at the head of the scheduler ring to the tail.
+static void rotate_active(struct shaper *s) {
+    int flow = s->active[s->active_head];
+    s->active_head = (s->active_head + 1) % RELAY_SWITCH_PORTS;
+    int tail = (s->active_head + s->active_count - 1) % RELAY_SWITCH_PORTS;
+    s->active[tail] = flow;
+}
+
+int shaper_dequeue(
+    struct shaper *s, uint64_t now, struct relay_frame *frames, int count
+) {
+    refill(s, now);
+
+    int n = 0;
+    while (n < count && s->tokens > 0 && s->active_count > 0) {
+        int flow = s->active[s->active_head];
+        if (s->count[flow] == 0) {
+            // The frames of the flow were dropped.
+            pop_active(s);
+            continue;
+        }
+
+        size_t len = s->frames[s->first[flow]].len;
+        if ((int64_t)len > s->deficit[flow]) {
+            s->deficit[flow] += s->config.quantum;
+            rotate_active(s);
+            continue;
+        }
+
+        int slot = remove_first(s, flow);
+        frames[n++] = s->frames[slot];
+        s->deficit[flow] -= len;
+        s->tokens -= len;
+        if (s->count[flow] == 0) {
+            // An idle flow does not keep its deficit.
+            pop_active(s);
+        }
+    }
+    return n;
+}
+
+int64_t shaper_delay(const struct shaper *s, uint64_t now) {
+    if (s->len == 0) {
+        return -1;
+    }
+    int64_t tokens = available(s, now);
+    if (tokens > 0) {
+        return 0;
+    }
+    // Wait until there is at least one token.
+    return (1 - tokens) * NANOSECONDS_PER_SECOND / s->config.rate + 1;
+}
@@ -0,0 +1,145 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <assert.h>
+#include <dispatch/dispatch.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "broker-lane.h"
+#include "broker-shard.h"
+#include "vmnet-broker.h"
+
+#define NANOSECONDS_PER_MICROSECOND 1000
+
+struct shard {
+    dispatch_queue_t queue;
+    // Number of blocks queued and not started yet. Updated by the main queue
+    // and the shard queue.
+    _Atomic int pending;
+    // Number of blocks run, the time they waited on the queue, and the time
+    // spent running them. Updated by the shard queue, read by the main queue.
+    _Atomic uint64_t handled;
+    _Atomic uint64_t wait_ns;
+    _Atomic uint64_t busy_ns;
+    // Expensive work for networks in the shard.
+    struct slow_lane slow;
+};
+
+static struct shard shards[SHARD_COUNT];
+
+static uint64_t now_ns(void) { return clock_gettime_nsec_np(CLOCK_UPTIME_RAW); }
+
+// Add to a counter updated only by one queue.
+static void add_counter(_Atomic uint64_t *counter, uint64_t n) {
+    uint64_t value = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, value + n, memory_order_relaxed);
+}
+
+void start_shards(void) {
+    dispatch_queue_attr_t attr = dispatch_queue_attr_make_with_qos_class(
+        DISPATCH_QUEUE_SERIAL, QOS_CLASS_USER_INITIATED, 0
+    );
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "vmnet-broker.shard.%d", i);
+        shards[i].queue = dispatch_queue_create(label, attr);
+        assert(shards[i].queue != NULL && "failed to create shard queue");
+        shards[i].slow.queue = shards[i].queue;
+    }
+}
+
+int shard_for_network(const char *network_name) {
+    // FNV-1a is fast for short names and spreads similar names, such as
+    // "vm1" and "vm2", across shards.
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)network_name; *p;
+         p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return (int)(hash % SHARD_COUNT);
+}
+
+dispatch_queue_t shard_queue(int shard) { return shards[shard].queue; }
+
+// Run block on the shard queue in the fast lane, in group if group is not
+// NULL.
+static void
+run_async(struct shard *s, dispatch_group_t group, dispatch_block_t block) {
+    uint64_t queued = lane_queued(LANE_FAST);
+    atomic_fetch_add_explicit(&s->pending, 1, memory_order_relaxed);
+
+    dispatch_block_t run = ^{
+        uint64_t start = now_ns();
+        lane_started(LANE_FAST, queued);
+        atomic_fetch_sub_explicit(&s->pending, 1, memory_order_relaxed);
+        block();
+        add_counter(&s->handled, 1);
+        add_counter(&s->wait_ns, start - queued);
+        add_counter(&s->busy_ns, now_ns() - start);
+    };
+
+    if (group) {
+        dispatch_group_async(group, s->queue, run);
+    } else {
+        dispatch_async(s->queue, run);
+    }
+}
+
+void shard_async(int shard, dispatch_block_t block) {
+    run_async(&shards[shard], NULL, block);
+}
+
+void shard_group_async(
+    int shard, dispatch_group_t group, dispatch_block_t block
+) {
+    run_async(&shards[shard], group, block);
+}
+
+void shard_slow_async(int shard, dispatch_block_t block) {
+    // The time slow work waited is accounted by the slow lane.
+    struct shard *s = &shards[shard];
+    slow_lane_async(&s->slow, ^{
+        uint64_t start = now_ns();
+        block();
+        add_counter(&s->handled, 1);
+        add_counter(&s->busy_ns, now_ns() - start);
+    });
+}
+
+void add_shard_stats(xpc_object_t stats) {
+    xpc_object_t array = xpc_array_create_empty();
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        struct shard *s = &shards[i];
+        xpc_object_t dict = xpc_dictionary_create_empty();
+        xpc_dictionary_set_uint64(
+            dict,
+            SHARD_HANDLED,
+            atomic_load_explicit(&s->handled, memory_order_relaxed)
+        );
+        xpc_dictionary_set_int64(
+            dict,
+            SHARD_PENDING,
+            atomic_load_explicit(&s->pending, memory_order_relaxed)
+        );
+        xpc_dictionary_set_uint64(
+            dict,
+            SHARD_WAIT_USEC,
+            atomic_load_explicit(&s->wait_ns, memory_order_relaxed) /
+                NANOSECONDS_PER_MICROSECOND
+        );
+        xpc_dictionary_set_uint64(
+            dict,
+            SHARD_BUSY_USEC,
+            atomic_load_explicit(&s->busy_ns, memory_order_relaxed) /
+                NANOSECONDS_PER_MICROSECOND
+        );
+        xpc_array_append_value(array, dict);
+        xpc_release(dict);
+    }
+    xpc_dictionary_set_value(stats, STATS_SHARDS, array);
+    xpc_release(array);
+}
@@ -0,0 +1,173 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <mach/mach.h>
+#include <malloc/malloc.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "broker-history.h"
+#include "broker-interface.h"
+#include "broker-lane.h"
+#include "broker-policy.h"
+#include "broker-pool.h"
+#include "broker-shard.h"
+#include "broker-stats.h"
+#include "broker-subnets.h"
+#include "broker-throttle.h"
+#include "broker-watchdog.h"
+#include "vmnet-broker.h"
+
+#define NANOSECONDS_PER_MICROSECOND 1000
+
+// Requests start on the main queue and complete on the main queue or on a
+// shard queue, so the statistics are updated atomically.
+struct latency_stats {
+    // Number of completed requests.
+    _Atomic uint64_t requests;
+    // Number of requests in progress.
+    _Atomic int pending;
+    _Atomic int max_pending;
+    // Time from receiving a request until replying.
+    _Atomic uint64_t wait_ns;
+    _Atomic uint64_t max_wait_ns;
+};
+
+static const char *latency_names[LATENCY_COUNT] = {
+    [LATENCY_IMMEDIATE] = STATS_LATENCY_IMMEDIATE,
+    [LATENCY_DEFERRED] = STATS_LATENCY_DEFERRED,
+};
+
+static struct latency_stats latencies[LATENCY_COUNT];
+
+static void update_max_int(_Atomic int *max, int value) {
+    int current = atomic_load(max);
+    while (value > current &&
+           !atomic_compare_exchange_weak(max, &current, value)) {
+    }
+}
+
+static void update_max_uint64(_Atomic uint64_t *max, uint64_t value) {
+    uint64_t current = atomic_load(max);
+    while (value > current &&
+           !atomic_compare_exchange_weak(max, &current, value)) {
+    }
+}
+
+uint64_t latency_begin(enum latency latency) {
+    struct latency_stats *s = &latencies[latency];
+    update_max_int(&s->max_pending, atomic_fetch_add(&s->pending, 1) + 1);
+    return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+}
+
+void latency_end(enum latency latency, uint64_t start) {
+    struct latency_stats *s = &latencies[latency];
+    uint64_t wait = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+    atomic_fetch_sub(&s->pending, 1);
+    atomic_fetch_add(&s->requests, 1);
+    atomic_fetch_add(&s->wait_ns, wait);
+    update_max_uint64(&s->max_wait_ns, wait);
+}
+
+static xpc_object_t create_latency_stats(struct latency_stats *s) {
+    xpc_object_t dict = xpc_dictionary_create_empty();
+    xpc_dictionary_set_uint64(
+        dict, LATENCY_REQUESTS, atomic_load(&s->requests)
+    );
+    xpc_dictionary_set_int64(dict, LATENCY_PENDING, atomic_load(&s->pending));
+    xpc_dictionary_set_int64(
+        dict, LATENCY_MAX_PENDING, atomic_load(&s->max_pending)
+    );
+    xpc_dictionary_set_uint64(
+        dict,
+        LATENCY_WAIT_USEC,
+        atomic_load(&s->wait_ns) / NANOSECONDS_PER_MICROSECOND
+    );
+    xpc_dictionary_set_uint64(
+        dict,
+        LATENCY_MAX_WAIT_USEC,
+        atomic_load(&s->max_wait_ns) / NANOSECONDS_PER_MICROSECOND
+    );
+    return dict;
+}
+
+static void add_pool_stats(const struct pool *pool, void *arg) {
+    xpc_object_t pools = arg;
+    xpc_object_t dict = xpc_dictionary_create_empty();
+    xpc_dictionary_set_int64(dict, POOL_IN_USE, pool->in_use);
+    xpc_dictionary_set_uint64(dict, POOL_ALLOCS, pool->allocs);
+    xpc_dictionary_set_int64(dict, POOL_SLABS, pool->slabs);
+    xpc_dictionary_set_uint64(dict, POOL_BYTES, pool->bytes);
+    xpc_dictionary_set_value(pools, pool->name, dict);
+    xpc_release(dict);
+}
+
+static xpc_object_t create_policy_stats(void) {
+    const struct policy_stats *s = policy_stats();
+    xpc_object_t dict = xpc_dictionary_create_empty();
+    xpc_dictionary_set_uint64(dict, POLICY_CHECKS, s->checks);
+    xpc_dictionary_set_uint64(dict, POLICY_CACHE_HITS, s->cache_hits);
+    xpc_dictionary_set_uint64(dict, POLICY_DENIED, s->denied);
+    return dict;
+}
+
+static xpc_object_t create_memory_stats(void) {
+    xpc_object_t dict = xpc_dictionary_create_empty();
+
+    struct mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    kern_return_t kr = task_info(
+        mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count
+    );
+    if (kr == KERN_SUCCESS) {
+        xpc_dictionary_set_uint64(dict, MEMORY_RSS, info.resident_size);
+    }
+
+    malloc_statistics_t malloc_stats;
+    malloc_zone_statistics(NULL, &malloc_stats);
+    xpc_dictionary_set_uint64(
+        dict, MEMORY_MALLOC_BLOCKS, malloc_stats.blocks_in_use
+    );
+    xpc_dictionary_set_uint64(
+        dict, MEMORY_MALLOC_BYTES, malloc_stats.size_in_use
+    );
+
+    return dict;
+}
+
+xpc_object_t copy_stats(void) {
+    xpc_object_t stats = xpc_dictionary_create_empty();
+
+    xpc_object_t latency_dict = xpc_dictionary_create_empty();
+    for (int i = 0; i < LATENCY_COUNT; i++) {
+        xpc_object_t dict = create_latency_stats(&latencies[i]);
+        xpc_dictionary_set_value(latency_dict, latency_names[i], dict);
+        xpc_release(dict);
+    }
+    xpc_dictionary_set_value(stats, STATS_LATENCY, latency_dict);
+    xpc_release(latency_dict);
+
+    add_lane_stats(stats);
+
+    add_throttle_stats(stats);
+    add_history_stats(stats);
+    add_subnet_stats(stats);
+    add_watchdog_stats(stats);
+    add_shard_stats(stats);
+    add_relay_stats(stats);
+
+    xpc_object_t policy = create_policy_stats();
+    xpc_dictionary_set_value(stats, STATS_POLICY, policy);
+    xpc_release(policy);
+
+    xpc_object_t memory = create_memory_stats();
+    xpc_dictionary_set_value(stats, STATS_MEMORY, memory);
+    xpc_release(memory);
+
+    xpc_object_t pools = xpc_dictionary_create_empty();
+    pool_for_each(add_pool_stats, pools);
+    xpc_dictionary_set_value(stats, STATS_POOLS, pools);
+    xpc_release(pools);
+
+    return stats;
+}
@@ -0,0 +1,221 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "broker-subnets.h"
+#include "broker-xpc.h"
+#include "common.h"
+#include "log.h"
+#include "vmnet-broker.h"
+
+#define SUBNETS_PATH "/var/db/vmnet-broker/subnets"
+#define SUBNETS_TEMP_PATH SUBNETS_PATH ".tmp"
+#define SUBNETS_VERSION 1
+
+// Maximum number of networks with remembered subnets. When full, subnets for
+// new networks are not remembered.
+#define MAX_SUBNETS 32
+
+// Names must be shorter than this to be remembered. Must match the scanf width
+// in load_subnets().
+#define SUBNET_NAME_SIZE 64
+
+struct entry {
+    char name[SUBNET_NAME_SIZE];
+    struct subnet subnet;
+};
+
+// Subnets are used and remembered on the shard queues when creating networks.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct entry entries[MAX_SUBNETS];
+static int entry_count;
+
+// Number of times a network was created with the remembered subnet, and the
+// number of times the remembered subnet was not available.
+static uint64_t sticky_honored;
+static uint64_t sticky_conflicts;
+
+static struct entry *find_entry(const char *name) {
+    for (int i = 0; i < entry_count; i++) {
+        if (strcmp(entries[i].name, name) == 0) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+// Must be called holding the lock.
+static void read_subnets(const struct broker_context *ctx) {
+    FILE *fp = fopen(SUBNETS_PATH, "r");
+    if (fp == NULL) {
+        if (errno == ENOENT) {
+            DEBUGF("[%s] no saved subnets", ctx->name);
+        } else {
+            WARNF(
+                "[%s] failed to open '%s': %s",
+                ctx->name,
+                SUBNETS_PATH,
+                strerror(errno)
+            );
+        }
+        return;
+    }
+
+    int version = 0;
+    if (fscanf(fp, "vmnet-broker-subnets %d\n", &version) != 1 ||
+        version != SUBNETS_VERSION) {
+        WARNF("[%s] ignoring saved subnets version %d", ctx->name, version);
+        fclose(fp);
+        return;
+    }
+
+    struct entry e = {0};
+    while (entry_count < MAX_SUBNETS &&
+           fscanf(
+               fp, "%63s %15s %15s\n", e.name, e.subnet.subnet, e.subnet.mask
+           ) == 3) {
+        entries[entry_count++] = e;
+    }
+
+    fclose(fp);
+
+    INFOF("[%s] loaded subnets for %d networks", ctx->name, entry_count);
+}
+
+void load_subnets(const struct broker_context *ctx) {
+    pthread_mutex_lock(&lock);
+    read_subnets(ctx);
+    pthread_mutex_unlock(&lock);
+}
+
+// Must be called holding the lock.
+static void save_subnets(const struct broker_context *ctx) {
+    FILE *fp = fopen(SUBNETS_TEMP_PATH, "w");
+    if (fp == NULL) {
+        WARNF(
+            "[%s] failed to create '%s': %s",
+            ctx->name,
+            SUBNETS_TEMP_PATH,
+            strerror(errno)
+        );
+        return;
+    }
+
+    fprintf(fp, "vmnet-broker-subnets %d\n", SUBNETS_VERSION);
+    for (int i = 0; i < entry_count; i++) {
+        fprintf(
+            fp,
+            "%s %s %s\n",
+            entries[i].name,
+            entries[i].subnet.subnet,
+            entries[i].subnet.mask
+        );
+    }
+
+    if (fclose(fp) != 0) {
+        WARNF(
+            "[%s] failed to write '%s': %s",
+            ctx->name,
+            SUBNETS_TEMP_PATH,
+            strerror(errno)
+        );
+        unlink(SUBNETS_TEMP_PATH);
+        return;
+    }
+
+    // Replace the subnets atomically, so a crash cannot leave partial
+    // subnets.
+    if (rename(SUBNETS_TEMP_PATH, SUBNETS_PATH) != 0) {
+        WARNF(
+            "[%s] failed to rename '%s': %s",
+            ctx->name,
+            SUBNETS_TEMP_PATH,
+            strerror(errno)
+        );
+        unlink(SUBNETS_TEMP_PATH);
+    }
+}
+
+bool last_subnet(const char *name, struct subnet *subnet) {
+    pthread_mutex_lock(&lock);
+    struct entry *e = find_entry(name);
+    if (e) {
+        *subnet = e->subnet;
+    }
+    pthread_mutex_unlock(&lock);
+    return e != NULL;
+}
+
+// Must be called holding the lock.
+static void update_subnet(
+    const struct broker_context *ctx,
+    const char *name,
+    const struct subnet *requested,
+    const struct network_info *info
+) {
+    if (requested) {
+        if (strcmp(requested->subnet, info->subnet) == 0 &&
+            strcmp(requested->mask, info->mask) == 0) {
+            sticky_honored++;
+            return;
+        }
+        INFOF(
+            "[%s] subnet '%s' mask '%s' not available for network '%s'",
+            ctx->name,
+            requested->subnet,
+            requested->mask,
+            name
+        );
+        sticky_conflicts++;
+    }
+
+    struct entry *e = find_entry(name);
+    if (e == NULL) {
+        // Names are saved as whitespace separated fields.
+        if (entry_count == MAX_SUBNETS || strlen(name) >= SUBNET_NAME_SIZE ||
+            strpbrk(name, " \t\r\n")) {
+            return;
+        }
+        e = &entries[entry_count++];
+        strcpy(e->name, name);
+    } else if (strcmp(e->subnet.subnet, info->subnet) == 0 &&
+               strcmp(e->subnet.mask, info->mask) == 0) {
+        return;
+    }
+
+    strcpy(e->subnet.subnet, info->subnet);
+    strcpy(e->subnet.mask, info->mask);
+    save_subnets(ctx);
+}
+
+void remember_subnet(
+    const struct broker_context *ctx,
+    const char *name,
+    const struct subnet *requested,
+    const struct network_info *info
+) {
+    pthread_mutex_lock(&lock);
+    update_subnet(ctx, name, requested, info);
+    pthread_mutex_unlock(&lock);
+}
+
+void add_subnet_stats(xpc_object_t stats) {
+    pthread_mutex_lock(&lock);
+    uint64_t honored = sticky_honored;
+    uint64_t conflicts = sticky_conflicts;
+    pthread_mutex_unlock(&lock);
+
+    xpc_object_t dict = xpc_dictionary_create_empty();
+    xpc_dictionary_set_uint64(dict, STICKY_HONORED, honored);
+    xpc_dictionary_set_uint64(dict, STICKY_CONFLICTS, conflicts);
+    xpc_dictionary_set_value(stats, STATS_STICKY_SUBNETS, dict);
+    xpc_release(dict);
+}
@@ -0,0 +1,125 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <math.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "broker-throttle.h"
+#include "broker-xpc.h"
+#include "log.h"
+#include "vmnet-broker.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000.0
+#define MILLISECONDS_PER_SECOND 1000.0
+
+// Time for the peer to wait before retrying an acquire request rejected
+// because too many networks are created.
+#define CREATE_RETRY_AFTER_MS 250
+
+extern const int peer_request_rate;
+extern const int peer_request_burst;
+
+// Accessed only on the main queue.
+static uint64_t throttled_requests;
+
+// Updated on the shard queues.
+static _Atomic uint64_t busy_creates;
+
+// Connected peers with throttled requests.
+static struct broker_context *throttled_peers;
+
+static void add_throttled_peer(struct broker_context *ctx) {
+    ctx->throttle.next = throttled_peers;
+    throttled_peers = ctx;
+}
+
+int throttle_request(struct broker_context *ctx) {
+    struct throttle *t = &ctx->throttle;
+    uint64_t now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
+    if (t->updated == 0) {
+        t->tokens = peer_request_burst;
+    } else {
+        double elapsed = (now - t->updated) / NANOSECONDS_PER_SECOND;
+        t->tokens = fmin(
+            t->tokens + elapsed * peer_request_rate, peer_request_burst
+        );
+    }
+    t->updated = now;
+
+    if (t->tokens >= 1.0) {
+        t->tokens -= 1.0;
+        t->limited = false;
+        return 0;
+    }
+
+    if (t->throttled == 0) {
+        add_throttled_peer(ctx);
+    }
+    t->throttled++;
+    throttled_requests++;
+
+    // Logging every rejected request would make a misbehaving peer as
+    // expensive as serving it.
+    if (!t->limited) {
+        WARNF(
+            "[%s] peer exceeded %d requests per second, throttling",
+            ctx->name,
+            peer_request_rate
+        );
+        t->limited = true;
+    }
+
+    double wait = (1.0 - t->tokens) / peer_request_rate;
+    return (int)ceil(wait * MILLISECONDS_PER_SECOND);
+}
+
+int throttle_create(struct broker_context *ctx) {
+    DEBUGF("[%s] too many networks created, retry later", ctx->name);
+    atomic_fetch_add(&busy_creates, 1);
+    return CREATE_RETRY_AFTER_MS;
+}
+
+void throttle_peer_disconnect(struct broker_context *ctx) {
+    if (ctx->throttle.throttled == 0) {
+        return;
+    }
+
+    INFOF(
+        "[%s] throttled %llu requests",
+        ctx->name,
+        (unsigned long long)ctx->throttle.throttled
+    );
+
+    struct broker_context **p = &throttled_peers;
+    while (*p) {
+        if (*p == ctx) {
+            *p = ctx->throttle.next;
+            break;
+        }
+        p = &(*p)->throttle.next;
+    }
+    ctx->throttle.next = NULL;
+}
+
+void add_throttle_stats(xpc_object_t stats) {
+    xpc_dictionary_set_uint64(stats, STATS_THROTTLED, throttled_requests);
+    xpc_dictionary_set_uint64(
+        stats, STATS_BUSY_CREATES, atomic_load(&busy_creates)
+    );
+
+    xpc_object_t peers = xpc_array_create_empty();
+    for (struct broker_context *ctx = throttled_peers; ctx;
+         ctx = ctx->throttle.next) {
+        xpc_object_t peer = xpc_dictionary_create_empty();
+        xpc_dictionary_set_string(peer, PEER_NAME, ctx->name);
+        xpc_dictionary_set_uint64(
+            peer, PEER_THROTTLED, ctx->throttle.throttled
+        );
+        xpc_array_append_value(peers, peer);
+        xpc_release(peer);
+    }
+    xpc_dictionary_set_value(stats, STATS_THROTTLED_PEERS, peers);
+    xpc_release(peers);
+}
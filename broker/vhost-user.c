@@ -0,0 +1,1040 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+// File seals are available only with _GNU_SOURCE.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "broker-vhost-user.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Requests from the vhost-user specification.
+enum {
+    GET_FEATURES = 1,
+    SET_FEATURES = 2,
+    SET_OWNER = 3,
+    RESET_OWNER = 4,
+    SET_MEM_TABLE = 5,
+    SET_LOG_BASE = 6,
+    SET_LOG_FD = 7,
+    SET_VRING_NUM = 8,
+    SET_VRING_ADDR = 9,
+    SET_VRING_BASE = 10,
+    GET_VRING_BASE = 11,
+    SET_VRING_KICK = 12,
+    SET_VRING_CALL = 13,
+    SET_VRING_ERR = 14,
+    GET_PROTOCOL_FEATURES = 15,
+    SET_PROTOCOL_FEATURES = 16,
+    GET_QUEUE_NUM = 17,
+    SET_VRING_ENABLE = 18,
+};
+
+// Message header flags.
+#define FLAG_VERSION 0x1
+#define FLAG_REPLY 0x4
+
+// Features offered: the virtio 1.0 header layout, vhost-user protocol
+// features, so rings can be enabled and disabled, and checksum and TCP
+// segmentation offloads in both directions. Offloads are described in the
+// virtio-net header of every frame.
+#define VIRTIO_NET_F_CSUM (1ULL << 0)
+#define VIRTIO_NET_F_GUEST_CSUM (1ULL << 1)
+#define VIRTIO_NET_F_GUEST_TSO4 (1ULL << 7)
+#define VIRTIO_NET_F_GUEST_TSO6 (1ULL << 8)
+#define VIRTIO_NET_F_HOST_TSO4 (1ULL << 11)
+#define VIRTIO_NET_F_HOST_TSO6 (1ULL << 12)
+#define VIRTIO_F_VERSION_1 (1ULL << 32)
+#define VHOST_USER_F_PROTOCOL_FEATURES (1ULL << 30)
+#define OFFLOAD_FEATURES                                                       \
+    (VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_GUEST_TSO4 |   \
+     VIRTIO_NET_F_GUEST_TSO6 | VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6)
+#define FEATURES                                                               \
+    (VIRTIO_F_VERSION_1 | VHOST_USER_F_PROTOCOL_FEATURES | OFFLOAD_FEATURES)
+
+// Size of the virtio-net header, with and without VIRTIO_F_VERSION_1.
+#define HEADER_SIZE 12
+#define LEGACY_HEADER_SIZE 10
+
+// The virtio-net header flag for frames needing a checksum.
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+
+// Buffers for TCP frames larger than the MTU sent by the guest in many
+// descriptors, holding a 64 KiB IP packet with an ethernet header and VLAN
+// tags. A batch ends early when all buffers are used.
+#define GSO_BUFFERS 4
+#define GSO_BUFFER_SIZE (64 * 1024 + 32)
+
+#define VRING_DESC_F_NEXT 1
+#define VRING_DESC_F_WRITE 2
+#define VRING_DESC_F_INDIRECT 4
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+
+// The vring index and the no file descriptor flag in kick and call messages.
+#define VRING_INDEX_MASK 0xff
+#define VRING_NOFD (1 << 8)
+
+#define MAX_REGIONS 8
+#define MAX_QUEUE_SIZE 32768
+
+// Queue 0 receives frames for the guest, queue 1 transmits frames sent by the
+// guest.
+#define RX 0
+#define TX 1
+#define QUEUES 2
+
+struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct vring_avail {
+    uint16_t flags;
+    _Atomic uint16_t idx;
+    uint16_t ring[];
+};
+
+struct vring_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct vring_used {
+    uint16_t flags;
+    _Atomic uint16_t idx;
+    struct vring_used_elem ring[];
+};
+
+struct message_header {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;
+};
+
+struct vring_state {
+    uint32_t index;
+    uint32_t num;
+};
+
+struct vring_addr {
+    uint32_t index;
+    uint32_t flags;
+    uint64_t desc;
+    uint64_t used;
+    uint64_t avail;
+    uint64_t log;
+};
+
+struct memory_region {
+    uint64_t guest_addr;
+    uint64_t size;
+    uint64_t user_addr;
+    uint64_t mmap_offset;
+};
+
+struct memory_table {
+    uint32_t nregions;
+    uint32_t padding;
+    struct memory_region regions[MAX_REGIONS];
+};
+
+union payload {
+    uint64_t u64;
+    struct vring_state state;
+    struct vring_addr addr;
+    struct memory_table memory;
+};
+
+// A message received in parts when the socket is readable, so a client
+// sending a partial message cannot block the queue handling messages.
+struct message {
+    struct message_header header;
+    union payload payload;
+    // Bytes of the header and the payload received.
+    size_t received;
+    int fds[MAX_REGIONS];
+    int nfds;
+};
+
+// A guest memory region mapped in the broker.
+struct region {
+    uint64_t guest_addr;
+    uint64_t user_addr;
+    uint64_t size;
+    unsigned char *host;
+    void *map;
+    size_t map_size;
+};
+
+struct vring {
+    uint32_t num;
+    struct vring_addr addr;
+    bool has_addr;
+    // Mapped when the device starts running.
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    // Next available entry to process, and next used entry to fill.
+    uint16_t last_avail;
+    uint16_t last_used;
+    int kick;
+    int call;
+    // True from the kick message until the vring base is requested.
+    bool started;
+    bool enabled;
+};
+
+struct vhost_user_dev {
+    int fd;
+    const struct vhost_user_ops *ops;
+    void *arg;
+    uint64_t features;
+    uint64_t protocol_features;
+    size_t header_size;
+    struct region regions[MAX_REGIONS];
+    int nregions;
+    struct vring vrings[QUEUES];
+    struct message message;
+    // True after calling ops->start, until calling ops->stop.
+    bool running;
+    // Heads of the frames received from the transmit virtqueue, used after
+    // forwarding them.
+    uint16_t heads[RELAY_BATCH];
+    // Allocated when the guest may send TCP frames larger than the MTU, and
+    // the number of buffers used by the current batch.
+    unsigned char *gso_buffers;
+    int gso_used;
+};
+
+// MARK: - Guest memory
+
+// Return a pointer to len bytes of guest memory at a guest physical address,
+// or a QEMU virtual address if user is true. Returns NULL if the range is not
+// mapped.
+static void *
+translate(struct vhost_user_dev *dev, uint64_t addr, uint64_t len, bool user) {
+    for (int i = 0; i < dev->nregions; i++) {
+        struct region *r = &dev->regions[i];
+        uint64_t start = user ? r->user_addr : r->guest_addr;
+        if (addr >= start && addr - start <= r->size &&
+            len <= r->size - (addr - start)) {
+            return r->host + (addr - start);
+        }
+    }
+    return NULL;
+}
+
+static void unmap_memory(struct vhost_user_dev *dev) {
+    for (int i = 0; i < dev->nregions; i++) {
+        munmap(dev->regions[i].map, dev->regions[i].map_size);
+    }
+    dev->nregions = 0;
+}
+
+// Check that a guest memory descriptor covers the region, and that the client
+// cannot shrink it while it is mapped: accessing a mapping beyond the end of
+// the object raises SIGBUS, terminating the broker. On Linux the descriptor
+// must be a memfd sealed with F_SEAL_SHRINK, as QEMU creates with
+// memory-backend-memfd. On macOS the size of a POSIX shared memory object
+// cannot be changed after it was set, as QEMU creates with
+// memory-backend-shm, so descriptors that can be truncated are rejected.
+static int check_memory_fd(int fd, size_t map_size) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    if (st.st_size < 0 || (uint64_t)st.st_size < map_size) {
+        errno = EPROTO;
+        return -1;
+    }
+#ifdef F_GET_SEALS
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        errno = EPERM;
+        return -1;
+    }
+#else
+    // Truncating to the current size does not change the object.
+    if (ftruncate(fd, st.st_size) == 0) {
+        errno = EPERM;
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static int map_memory(
+    struct vhost_user_dev *dev, const struct memory_table *m, int *fds, int nfds
+) {
+    if (m->nregions == 0 || m->nregions > MAX_REGIONS ||
+        (int)m->nregions != nfds) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < m->nregions; i++) {
+        const struct memory_region *mr = &m->regions[i];
+        if (mr->size == 0 || mr->mmap_offset > SIZE_MAX - mr->size) {
+            errno = EPROTO;
+            return -1;
+        }
+        size_t map_size = mr->size + mr->mmap_offset;
+        if (check_memory_fd(fds[i], map_size) < 0) {
+            return -1;
+        }
+        void *map = mmap(
+            NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], 0
+        );
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        dev->regions[dev->nregions++] = (struct region){
+            .guest_addr = mr->guest_addr,
+            .user_addr = mr->user_addr,
+            .size = mr->size,
+            .host = (unsigned char *)map + mr->mmap_offset,
+            .map = map,
+            .map_size = map_size,
+        };
+    }
+    return 0;
+}
+
+// Map the vring in guest memory. Returns false if the vring is not mapped.
+static bool map_vring(struct vhost_user_dev *dev, struct vring *vq) {
+    if (!vq->has_addr || vq->num == 0) {
+        return false;
+    }
+    uint64_t num = vq->num;
+    vq->desc = translate(
+        dev, vq->addr.desc, num * sizeof(struct vring_desc), true
+    );
+    vq->avail = translate(
+        dev, vq->addr.avail, 4 + num * sizeof(uint16_t), true
+    );
+    vq->used = translate(
+        dev, vq->addr.used, 4 + num * sizeof(struct vring_used_elem), true
+    );
+    return vq->desc && vq->avail && vq->used;
+}
+
+// MARK: - Virtqueues
+
+// Return the number of buffers made available by the guest, or -1 if the
+// guest published an invalid index.
+static int available(const struct vring *vq) {
+    uint16_t idx = atomic_load_explicit(&vq->avail->idx, memory_order_acquire);
+    uint16_t n = idx - vq->last_avail;
+    if (n > vq->num) {
+        return -1;
+    }
+    return n;
+}
+
+static uint16_t avail_head(const struct vring *vq, uint16_t i) {
+    return vq->avail->ring[(uint16_t)(vq->last_avail + i) & (vq->num - 1)];
+}
+
+static void put_used(struct vring *vq, uint16_t head, uint32_t len) {
+    struct vring_used_elem *e = &vq->used->ring[vq->last_used & (vq->num - 1)];
+    e->id = head;
+    e->len = len;
+    vq->last_used++;
+}
+
+// Publish the used buffers, and interrupt the guest unless it is polling.
+static void publish_used(struct vring *vq) {
+    atomic_store_explicit(&vq->used->idx, vq->last_used, memory_order_release);
+    // Read the flags after publishing, so a guest enabling interrupts after
+    // checking the used index is interrupted.
+    atomic_thread_fence(memory_order_seq_cst);
+    uint16_t flags = *(volatile uint16_t *)&vq->avail->flags;
+    if (vq->call != -1 && !(flags & VRING_AVAIL_F_NO_INTERRUPT)) {
+        // The call descriptor is an eventfd or a pipe. If the pipe is full the
+        // guest has pending interrupts.
+        uint64_t one = 1;
+        (void)write(vq->call, &one, sizeof(one));
+    }
+}
+
+// Copy a descriptor, so the guest cannot change it after checking it.
+static bool read_desc(
+    const struct vring *vq, uint16_t i, uint32_t n, struct vring_desc *d
+) {
+    if (i >= vq->num || n >= vq->num) {
+        return false;
+    }
+    *d = vq->desc[i];
+    return !(d->flags & VRING_DESC_F_INDIRECT);
+}
+
+// MARK: - Offloads
+
+static uint16_t get_le16(const unsigned char *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static void put_le16(unsigned char *p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+// Read the offloads of a frame sent by the guest from the virtio-net header.
+// Returns false if the guest used offloads that were not negotiated.
+static bool read_offload(
+    const struct vhost_user_dev *dev,
+    const unsigned char *header,
+    struct relay_offload *o
+) {
+    *o = (struct relay_offload){0};
+    // Without offloads the header is ignored.
+    if (!(dev->features & VIRTIO_NET_F_CSUM)) {
+        return true;
+    }
+
+    o->flags = header[0] & VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    o->gso_type = header[1];
+    o->hdr_len = get_le16(header + 2);
+    o->gso_size = get_le16(header + 4);
+    o->csum_start = get_le16(header + 6);
+    o->csum_offset = get_le16(header + 8);
+
+    switch (o->gso_type) {
+    case RELAY_GSO_NONE:
+        return true;
+    case RELAY_GSO_TCPV4:
+        return (dev->features & VIRTIO_NET_F_HOST_TSO4) && o->gso_size > 0;
+    case RELAY_GSO_TCPV6:
+        return (dev->features & VIRTIO_NET_F_HOST_TSO6) && o->gso_size > 0;
+    default:
+        return false;
+    }
+}
+
+// Write the virtio-net header of a frame sent to the guest. The relay sends
+// only offloads negotiated by the guest.
+static void
+write_offload(unsigned char *header, const struct relay_offload *o) {
+    header[0] = o->flags;
+    header[1] = o->gso_type;
+    put_le16(header + 2, o->hdr_len);
+    put_le16(header + 4, o->gso_size);
+    put_le16(header + 6, o->csum_start);
+    put_le16(header + 8, o->csum_offset);
+    // The number of buffers, used only with VIRTIO_F_VERSION_1.
+    put_le16(header + 10, 1);
+}
+
+int vhost_user_offloads(struct vhost_user_dev *dev) {
+    int offloads = 0;
+    if (dev->features & VIRTIO_NET_F_GUEST_CSUM) {
+        offloads |= RELAY_OFFLOAD_CSUM;
+        if (dev->features & VIRTIO_NET_F_GUEST_TSO4) {
+            offloads |= RELAY_OFFLOAD_TSO4;
+        }
+        if (dev->features & VIRTIO_NET_F_GUEST_TSO6) {
+            offloads |= RELAY_OFFLOAD_TSO6;
+        }
+    }
+    return offloads;
+}
+
+// Read a frame sent by the guest, after the virtio-net header. A frame in one
+// buffer is used in place, otherwise it is copied to the relay buffer, or to a
+// GSO buffer for TCP frames larger than the MTU. Frames larger than the buffer
+// and frames with invalid offloads are truncated to 0 bytes and dropped.
+// Returns false if the descriptor chain is invalid.
+static bool read_frame(
+    struct vhost_user_dev *dev, uint16_t head, struct relay_frame *frame
+) {
+    const struct vring *vq = &dev->vrings[TX];
+    unsigned char *buf = frame->data;
+    size_t size = frame->len;
+    unsigned char header[HEADER_SIZE];
+    size_t skip = dev->header_size;
+    bool valid = true;
+    unsigned char *data = NULL;
+    size_t len = 0;
+    bool copied = false;
+
+    struct vring_desc d;
+    uint16_t i = head;
+    for (uint32_t n = 0;; n++) {
+        if (!read_desc(vq, i, n, &d) || (d.flags & VRING_DESC_F_WRITE)) {
+            return false;
+        }
+        unsigned char *p = translate(dev, d.addr, d.len, false);
+        if (p == NULL) {
+            return false;
+        }
+
+        size_t l = d.len;
+        size_t s = skip < l ? skip : l;
+        memcpy(header + dev->header_size - skip, p, s);
+        p += s;
+        l -= s;
+        skip -= s;
+
+        if (l > 0 && data == NULL) {
+            // The header was read before the frame.
+            valid = read_offload(dev, header, &frame->offload);
+            if (valid && frame->offload.gso_type != RELAY_GSO_NONE) {
+                buf = dev->gso_buffers + GSO_BUFFER_SIZE * dev->gso_used;
+                size = GSO_BUFFER_SIZE;
+            }
+            data = p;
+            len = l;
+        } else if (l > 0) {
+            if (!copied && len <= size) {
+                memcpy(buf, data, len);
+                copied = true;
+                if (frame->offload.gso_type != RELAY_GSO_NONE) {
+                    dev->gso_used++;
+                }
+            }
+            if (len + l <= size) {
+                memcpy(buf + len, p, l);
+            }
+            len += l;
+        }
+
+        if (!(d.flags & VRING_DESC_F_NEXT)) {
+            break;
+        }
+        i = d.next;
+    }
+
+    const struct relay_offload *o = &frame->offload;
+    if ((o->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+        (size_t)o->csum_start + o->csum_offset + 2 > len) {
+        valid = false;
+    }
+
+    frame->data = copied ? buf : data;
+    frame->len = valid && len <= size ? len : 0;
+    return true;
+}
+
+// Copy a frame to a guest buffer after a virtio-net header. Returns the number
+// of bytes written, 0 if the frame does not fit in the buffer, or -1 if the
+// descriptor chain is invalid.
+static int64_t write_frame(
+    struct vhost_user_dev *dev, uint16_t head, const struct relay_frame *frame
+) {
+    const struct vring *vq = &dev->vrings[RX];
+    unsigned char header[HEADER_SIZE];
+    write_offload(header, &frame->offload);
+    size_t header_size = dev->header_size;
+    size_t total = header_size + frame->len;
+    size_t off = 0;
+
+    struct vring_desc d;
+    uint16_t i = head;
+    for (uint32_t n = 0;; n++) {
+        if (!read_desc(vq, i, n, &d) || !(d.flags & VRING_DESC_F_WRITE)) {
+            return -1;
+        }
+        unsigned char *p = translate(dev, d.addr, d.len, false);
+        if (p == NULL) {
+            return -1;
+        }
+
+        size_t l = d.len < total - off ? d.len : total - off;
+        while (l > 0) {
+            const unsigned char *src;
+            size_t m = l;
+            if (off < header_size) {
+                src = header + off;
+                if (m > header_size - off) {
+                    m = header_size - off;
+                }
+            } else {
+                src = (const unsigned char *)frame->data + off - header_size;
+            }
+            memcpy(p, src, m);
+            p += m;
+            off += m;
+            l -= m;
+        }
+
+        if (off == total || !(d.flags & VRING_DESC_F_NEXT)) {
+            break;
+        }
+        i = d.next;
+    }
+
+    return off == total ? (int64_t)total : 0;
+}
+
+// MARK: - Relay port
+
+static int vhost_recv(void *arg, struct relay_frame *frames, int count) {
+    struct vhost_user_dev *dev = arg;
+    const struct vring *vq = &dev->vrings[TX];
+
+    int n = available(vq);
+    if (n < 0) {
+        return -1;
+    }
+    if (n > count) {
+        n = count;
+    }
+    dev->gso_used = 0;
+    for (int i = 0; i < n; i++) {
+        if (dev->gso_used == GSO_BUFFERS) {
+            n = i;
+            break;
+        }
+        dev->heads[i] = avail_head(vq, i);
+        if (!read_frame(dev, dev->heads[i], &frames[i])) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+// Return the transmitted buffers to the guest after forwarding the frames.
+static void vhost_done(void *arg, int count) {
+    struct vhost_user_dev *dev = arg;
+    struct vring *vq = &dev->vrings[TX];
+
+    for (int i = 0; i < count; i++) {
+        put_used(vq, dev->heads[i], 0);
+    }
+    vq->last_avail += count;
+    publish_used(vq);
+}
+
+// Copy frames to the receive buffers of the guest. Frames are dropped by the
+// relay when the guest has no buffers. A frame that does not fit in the buffer
+// is returned empty, and dropped by the guest.
+static int vhost_send(void *arg, const struct relay_frame *frames, int count) {
+    struct vhost_user_dev *dev = arg;
+    struct vring *vq = &dev->vrings[RX];
+
+    int n = available(vq);
+    if (n < 0) {
+        return -1;
+    }
+    if (n > count) {
+        n = count;
+    }
+    for (int i = 0; i < n; i++) {
+        uint16_t head = avail_head(vq, 0);
+        int64_t len = write_frame(dev, head, &frames[i]);
+        if (len < 0) {
+            return -1;
+        }
+        put_used(vq, head, (uint32_t)len);
+        vq->last_avail++;
+    }
+    if (n > 0) {
+        publish_used(vq);
+    }
+    return n;
+}
+
+const struct relay_port_ops vhost_user_port_ops = {
+    .recv = vhost_recv,
+    .send = vhost_send,
+    .done = vhost_done,
+};
+
+// MARK: - Messages
+
+static void close_fd(int *fd) {
+    if (*fd != -1) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+static bool vring_ready(struct vhost_user_dev *dev, struct vring *vq) {
+    // Without protocol features rings are enabled when started.
+    bool enabled = vq->enabled ||
+                   !(dev->features & VHOST_USER_F_PROTOCOL_FEATURES);
+    return vq->started && enabled && vq->kick != -1 && map_vring(dev, vq);
+}
+
+static void start(struct vhost_user_dev *dev) {
+    if (!dev->running && dev->nregions > 0 &&
+        vring_ready(dev, &dev->vrings[RX]) &&
+        vring_ready(dev, &dev->vrings[TX])) {
+        dev->running = true;
+        dev->ops->start(dev->arg, dev);
+    }
+}
+
+static void stop(struct vhost_user_dev *dev) {
+    if (dev->running) {
+        dev->ops->stop(dev->arg, dev);
+        dev->running = false;
+    }
+}
+
+static void reset_vrings(struct vhost_user_dev *dev) {
+    for (int i = 0; i < QUEUES; i++) {
+        struct vring *vq = &dev->vrings[i];
+        close_fd(&vq->kick);
+        close_fd(&vq->call);
+        *vq = (struct vring){.kick = -1, .call = -1};
+    }
+}
+
+static int reply(
+    struct vhost_user_dev *dev,
+    const struct message_header *request,
+    const void *payload,
+    uint32_t size
+) {
+    struct message_header header = {
+        .request = request->request,
+        .flags = FLAG_VERSION | FLAG_REPLY,
+        .size = size,
+    };
+    struct iovec iov[2] = {
+        {.iov_base = &header, .iov_len = sizeof(header)},
+        {.iov_base = (void *)payload, .iov_len = size},
+    };
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+    ssize_t n;
+    do {
+        n = sendmsg(dev->fd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    // The socket is non-blocking. A client not reading replies with a full
+    // socket buffer is broken.
+    if (n != (ssize_t)(sizeof(header) + size)) {
+        if (n >= 0) {
+            errno = EAGAIN;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Receive more of the current message and the descriptors sent with it,
+// reading only the bytes of this message. Returns 1 when the message is
+// complete, 0 if more bytes are needed, or -1 and sets errno on failure, or
+// to EAGAIN if no bytes are available.
+static int recv_message(struct vhost_user_dev *dev) {
+    struct message *m = &dev->message;
+    struct iovec iov;
+    if (m->received < sizeof(m->header)) {
+        iov.iov_base = (char *)&m->header + m->received;
+        iov.iov_len = sizeof(m->header) - m->received;
+    } else {
+        iov.iov_base = (char *)&m->payload + m->received - sizeof(m->header);
+        iov.iov_len = sizeof(m->header) + m->header.size - m->received;
+    }
+    char control[CMSG_SPACE(sizeof(int) * MAX_REGIONS)];
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    ssize_t n;
+    do {
+        n = recvmsg(dev->fd, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        if (n == 0) {
+            errno = ECONNRESET;
+        } else if (errno == EWOULDBLOCK) {
+            errno = EAGAIN;
+        }
+        return -1;
+    }
+
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+                if (m->nfds < MAX_REGIONS) {
+                    m->fds[m->nfds++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    m->received += n;
+    if (m->received == sizeof(m->header) &&
+        ((m->header.flags & 0x3) != FLAG_VERSION ||
+         m->header.size > sizeof(m->payload))) {
+        errno = EPROTO;
+        return -1;
+    }
+    return m->received >= sizeof(m->header) &&
+           m->received == sizeof(m->header) + m->header.size;
+}
+
+// Close the descriptors not used by the current message, and start receiving
+// the next message.
+static void discard_message(struct vhost_user_dev *dev) {
+    struct message *m = &dev->message;
+    for (int i = 0; i < m->nfds; i++) {
+        if (m->fds[i] != -1) {
+            close(m->fds[i]);
+        }
+    }
+    *m = (struct message){0};
+}
+
+// Return the vring of a message, or NULL if the index is invalid.
+static struct vring *get_vring(struct vhost_user_dev *dev, uint32_t index) {
+    if (index >= QUEUES) {
+        errno = EPROTO;
+        return NULL;
+    }
+    return &dev->vrings[index];
+}
+
+// Take the descriptor sent with a kick or call message.
+static int take_fd(uint64_t u64, int *fds, int nfds) {
+    if ((u64 & VRING_NOFD) || nfds != 1) {
+        return -1;
+    }
+    int fd = fds[0];
+    fds[0] = -1;
+    return fd;
+}
+
+static int handle_message(
+    struct vhost_user_dev *dev,
+    const struct message_header *header,
+    const union payload *p,
+    int *fds,
+    int nfds
+) {
+    struct vring *vq;
+    uint64_t u64;
+
+    switch (header->request) {
+    case GET_FEATURES:
+        u64 = FEATURES;
+        return reply(dev, header, &u64, sizeof(u64));
+
+    case SET_FEATURES:
+        stop(dev);
+        dev->features = p->u64 & FEATURES;
+        dev->header_size = (dev->features & VIRTIO_F_VERSION_1)
+                               ? HEADER_SIZE
+                               : LEGACY_HEADER_SIZE;
+        if ((dev->features &
+             (VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6)) &&
+            dev->gso_buffers == NULL) {
+            dev->gso_buffers = malloc(GSO_BUFFERS * GSO_BUFFER_SIZE);
+            if (dev->gso_buffers == NULL) {
+                return -1;
+            }
+        }
+        return 0;
+
+    case SET_OWNER:
+        return 0;
+
+    case RESET_OWNER:
+        stop(dev);
+        reset_vrings(dev);
+        return 0;
+
+    case GET_PROTOCOL_FEATURES:
+        u64 = 0;
+        return reply(dev, header, &u64, sizeof(u64));
+
+    case SET_PROTOCOL_FEATURES:
+        dev->protocol_features = p->u64;
+        return 0;
+
+    case GET_QUEUE_NUM:
+        u64 = 1;
+        return reply(dev, header, &u64, sizeof(u64));
+
+    case SET_MEM_TABLE:
+        stop(dev);
+        unmap_memory(dev);
+        return map_memory(dev, &p->memory, fds, nfds);
+
+    case SET_LOG_BASE:
+    case SET_LOG_FD:
+    case SET_VRING_ERR:
+        // Logging is not offered, and errors are not reported.
+        return 0;
+
+    case SET_VRING_NUM:
+        if ((vq = get_vring(dev, p->state.index)) == NULL) {
+            return -1;
+        }
+        // The ring indexes wrap at 65536, so entries are found by the index
+        // modulo the ring size only if the size is a power of 2.
+        if (p->state.num == 0 || p->state.num > MAX_QUEUE_SIZE ||
+            (p->state.num & (p->state.num - 1))) {
+            errno = EPROTO;
+            return -1;
+        }
+        stop(dev);
+        vq->num = p->state.num;
+        return 0;
+
+    case SET_VRING_ADDR:
+        if ((vq = get_vring(dev, p->addr.index)) == NULL) {
+            return -1;
+        }
+        stop(dev);
+        vq->addr = p->addr;
+        vq->has_addr = true;
+        return 0;
+
+    case SET_VRING_BASE:
+        if ((vq = get_vring(dev, p->state.index)) == NULL) {
+            return -1;
+        }
+        stop(dev);
+        vq->last_avail = vq->last_used = (uint16_t)p->state.num;
+        return 0;
+
+    case GET_VRING_BASE: {
+        if ((vq = get_vring(dev, p->state.index)) == NULL) {
+            return -1;
+        }
+        stop(dev);
+        vq->started = false;
+        close_fd(&vq->kick);
+        struct vring_state state = {
+            .index = p->state.index,
+            .num = vq->last_avail,
+        };
+        return reply(dev, header, &state, sizeof(state));
+    }
+
+    case SET_VRING_KICK:
+        if ((vq = get_vring(dev, p->u64 & VRING_INDEX_MASK)) == NULL) {
+            return -1;
+        }
+        stop(dev);
+        close_fd(&vq->kick);
+        vq->kick = take_fd(p->u64, fds, nfds);
+        vq->started = true;
+        return 0;
+
+    case SET_VRING_CALL:
+        if ((vq = get_vring(dev, p->u64 & VRING_INDEX_MASK)) == NULL) {
+            return -1;
+        }
+        stop(dev);
+        close_fd(&vq->call);
+        vq->call = take_fd(p->u64, fds, nfds);
+        // Interrupting the guest must not block the relay thread.
+        if (vq->call != -1) {
+            int flags = fcntl(vq->call, F_GETFL);
+            if (flags >= 0) {
+                fcntl(vq->call, F_SETFL, flags | O_NONBLOCK);
+            }
+        }
+        return 0;
+
+    case SET_VRING_ENABLE:
+        if ((vq = get_vring(dev, p->state.index)) == NULL) {
+            return -1;
+        }
+        stop(dev);
+        vq->enabled = p->state.num != 0;
+        return 0;
+
+    default:
+        errno = ENOTSUP;
+        return -1;
+    }
+}
+
+// MARK: - Devices
+
+struct vhost_user_dev *vhost_user_create(
+    int fd, const struct vhost_user_ops *ops, void *arg
+) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return NULL;
+    }
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) < 0) {
+        return NULL;
+    }
+#endif
+
+    struct vhost_user_dev *dev = calloc(1, sizeof(*dev));
+    if (dev == NULL) {
+        return NULL;
+    }
+    dev->fd = fd;
+    dev->ops = ops;
+    dev->arg = arg;
+    dev->header_size = LEGACY_HEADER_SIZE;
+    for (int i = 0; i < QUEUES; i++) {
+        dev->vrings[i].kick = -1;
+        dev->vrings[i].call = -1;
+    }
+    return dev;
+}
+
+void vhost_user_destroy(struct vhost_user_dev *dev) {
+    stop(dev);
+    reset_vrings(dev);
+    unmap_memory(dev);
+    discard_message(dev);
+    free(dev->gso_buffers);
+    free(dev);
+}
+
+int vhost_user_handle(struct vhost_user_dev *dev) {
+    int ret;
+    while ((ret = recv_message(dev)) == 0) {
+    }
+    if (ret < 0) {
+        return errno == EAGAIN ? 0 : -1;
+    }
+
+    struct message *m = &dev->message;
+    ret = handle_message(dev, &m->header, &m->payload, m->fds, m->nfds);
+
+    int err = errno;
+    discard_message(dev);
+    errno = err;
+
+    if (ret == 0) {
+        start(dev);
+    }
+    return ret;
+}
+
+int vhost_user_doorbell(struct vhost_user_dev *dev) {
+    return dup(dev->vrings[TX].kick);
+}
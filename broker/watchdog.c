@@ -0,0 +1,255 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include <assert.h>
+#include <dispatch/dispatch.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "broker-watchdog.h"
+#include "common.h"
+#include "log.h"
+#include "vmnet-broker.h"
+
+#define NANOSECONDS_PER_MICROSECOND 1000
+#define NANOSECONDS_PER_MILLISECOND 1000000
+
+extern const int stall_budget_ms;
+
+// Number of recent stalls kept in the trace buffer.
+#define TRACE_SIZE 32
+
+// Number of slowest handlers kept.
+#define SLOWEST_SIZE 8
+
+// Interval for checking if the main queue is blocked.
+#define WATCHDOG_INTERVAL_SEC 1
+
+// A handler that ran longer than the stall budget.
+struct trace {
+    enum handler handler;
+    time_t time;
+    uint64_t duration_ns;
+    char peer[32];
+    char command[16];
+    char network[64];
+};
+
+static const char *handler_names[HANDLER_COUNT] = {
+    [HANDLER_REQUEST] = "request",
+    [HANDLER_CONNECT] = "connect",
+    [HANDLER_DISCONNECT] = "disconnect",
+    [HANDLER_TIMER] = "timer",
+};
+
+// Number of stalls per handler.
+static uint64_t stalls[HANDLER_COUNT];
+
+// Number of handlers run, and the time spent running them, per handler.
+static uint64_t handled[HANDLER_COUNT];
+static uint64_t busy_ns[HANDLER_COUNT];
+
+// Recent stalls, oldest first starting at trace_next when the buffer is full.
+static struct trace recent[TRACE_SIZE];
+static int trace_count;
+static int trace_next;
+
+// Slowest stalls, slowest first.
+static struct trace slowest[SLOWEST_SIZE];
+static int slowest_count;
+
+// Start time of the running handler, or 0 if the main queue is idle, and the
+// running handler. Read by the watchdog queue.
+static _Atomic uint64_t running_since;
+static _Atomic int running_handler;
+
+// Number of times the watchdog found the main queue blocked. Updated by the
+// watchdog queue.
+static _Atomic uint64_t blocked;
+
+static uint64_t now_ns(void) { return clock_gettime_nsec_np(CLOCK_UPTIME_RAW); }
+
+uint64_t watch_begin(enum handler handler) {
+    uint64_t start = now_ns();
+    atomic_store_explicit(&running_handler, handler, memory_order_relaxed);
+    atomic_store_explicit(&running_since, start, memory_order_release);
+    return start;
+}
+
+static void add_slowest(const struct trace *t) {
+    int i = slowest_count < SLOWEST_SIZE ? slowest_count++ : SLOWEST_SIZE - 1;
+    if (i == SLOWEST_SIZE - 1 && slowest[i].duration_ns >= t->duration_ns) {
+        return;
+    }
+    // Insert keeping the slowest first.
+    while (i > 0 && slowest[i - 1].duration_ns < t->duration_ns) {
+        slowest[i] = slowest[i - 1];
+        i--;
+    }
+    slowest[i] = *t;
+}
+
+void watch_end(
+    enum handler handler,
+    uint64_t start,
+    const char *peer,
+    const char *command,
+    const char *network
+) {
+    atomic_store_explicit(&running_since, 0, memory_order_relaxed);
+
+    uint64_t duration = now_ns() - start;
+    handled[handler]++;
+    busy_ns[handler] += duration;
+    if (duration < (uint64_t)stall_budget_ms * NANOSECONDS_PER_MILLISECOND) {
+        return;
+    }
+
+    stalls[handler]++;
+
+    struct trace *t = &recent[trace_next];
+    *t = (struct trace){
+        .handler = handler,
+        .time = time(NULL),
+        .duration_ns = duration,
+    };
+    snprintf(t->peer, sizeof(t->peer), "%s", peer ? peer : "");
+    snprintf(t->command, sizeof(t->command), "%s", command ? command : "");
+    snprintf(t->network, sizeof(t->network), "%s", network ? network : "");
+    trace_next = (trace_next + 1) % TRACE_SIZE;
+    if (trace_count < TRACE_SIZE) {
+        trace_count++;
+    }
+
+    add_slowest(t);
+
+    WARNF(
+        "[%s] %s handler stalled the main queue for %.3f ms (command '%s' "
+        "network '%s')",
+        t->peer[0] ? t->peer : "main",
+        handler_names[handler],
+        (double)duration / NANOSECONDS_PER_MILLISECOND,
+        t->command,
+        t->network
+    );
+}
+
+void start_watchdog(void) {
+    dispatch_queue_t queue = dispatch_queue_create(
+        "com.github.nirs.vmnet-broker.watchdog", DISPATCH_QUEUE_SERIAL
+    );
+    dispatch_source_t timer = dispatch_source_create(
+        DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue
+    );
+    assert(timer != NULL && "failed to create watchdog timer");
+
+    uint64_t interval = WATCHDOG_INTERVAL_SEC * NSEC_PER_SEC;
+    dispatch_source_set_timer(
+        timer, dispatch_time(DISPATCH_TIME_NOW, interval), interval, interval
+    );
+
+    // The start time of the last blocking handler reported, so every blocking
+    // handler is reported once.
+    __block uint64_t reported = 0;
+
+    dispatch_source_set_event_handler(timer, ^{
+        uint64_t since = atomic_load_explicit(
+            &running_since, memory_order_acquire
+        );
+        if (since == 0 || since == reported) {
+            return;
+        }
+        uint64_t elapsed = now_ns() - since;
+        if (elapsed < interval) {
+            return;
+        }
+        reported = since;
+        atomic_fetch_add_explicit(&blocked, 1, memory_order_relaxed);
+        int handler = atomic_load_explicit(
+            &running_handler, memory_order_relaxed
+        );
+        WARNF(
+            "[watchdog] main queue blocked for %.1f seconds in %s handler",
+            (double)elapsed / NSEC_PER_SEC,
+            handler_names[handler]
+        );
+    });
+
+    dispatch_resume(timer);
+}
+
+static xpc_object_t create_trace(const struct trace *t) {
+    xpc_object_t dict = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(dict, TRACE_HANDLER, handler_names[t->handler]);
+    xpc_dictionary_set_int64(dict, TRACE_TIME, t->time);
+    xpc_dictionary_set_uint64(
+        dict, TRACE_DURATION_USEC, t->duration_ns / NANOSECONDS_PER_MICROSECOND
+    );
+    if (t->peer[0]) {
+        xpc_dictionary_set_string(dict, TRACE_PEER, t->peer);
+    }
+    if (t->command[0]) {
+        xpc_dictionary_set_string(dict, TRACE_COMMAND, t->command);
+    }
+    if (t->network[0]) {
+        xpc_dictionary_set_string(dict, TRACE_NETWORK, t->network);
+    }
+    return dict;
+}
+
+void add_watchdog_stats(xpc_object_t stats) {
+    xpc_object_t dict = xpc_dictionary_create_empty();
+
+    xpc_dictionary_set_int64(dict, WATCHDOG_BUDGET_MSEC, stall_budget_ms);
+    xpc_dictionary_set_uint64(
+        dict,
+        WATCHDOG_BLOCKED,
+        atomic_load_explicit(&blocked, memory_order_relaxed)
+    );
+
+    xpc_object_t counts = xpc_dictionary_create_empty();
+    for (int i = 0; i < HANDLER_COUNT; i++) {
+        xpc_dictionary_set_uint64(counts, handler_names[i], stalls[i]);
+    }
+    xpc_dictionary_set_value(dict, WATCHDOG_STALLS, counts);
+    xpc_release(counts);
+
+    counts = xpc_dictionary_create_empty();
+    xpc_object_t busy = xpc_dictionary_create_empty();
+    for (int i = 0; i < HANDLER_COUNT; i++) {
+        xpc_dictionary_set_uint64(counts, handler_names[i], handled[i]);
+        xpc_dictionary_set_uint64(
+            busy, handler_names[i], busy_ns[i] / NANOSECONDS_PER_MICROSECOND
+        );
+    }
+    xpc_dictionary_set_value(dict, WATCHDOG_HANDLED, counts);
+    xpc_dictionary_set_value(dict, WATCHDOG_BUSY_USEC, busy);
+    xpc_release(counts);
+    xpc_release(busy);
+
+    // Most recent first.
+    xpc_object_t traces = xpc_array_create_empty();
+    for (int i = 1; i <= trace_count; i++) {
+        int index = (trace_next - i + TRACE_SIZE) % TRACE_SIZE;
+        xpc_object_t trace = create_trace(&recent[index]);
+        xpc_array_append_value(traces, trace);
+        xpc_release(trace);
+    }
+    xpc_dictionary_set_value(dict, WATCHDOG_RECENT, traces);
+    xpc_release(traces);
+
+    traces = xpc_array_create_empty();
+    for (int i = 0; i < slowest_count; i++) {
+        xpc_object_t trace = create_trace(&slowest[i]);
+        xpc_array_append_value(traces, trace);
+        xpc_release(trace);
+    }
+    xpc_dictionary_set_value(dict, WATCHDOG_SLOWEST, traces);
+    xpc_release(traces);
+
+    xpc_dictionary_set_value(stats, STATS_WATCHDOG, dict);
+    xpc_release(dict);
+}
@@ -1,11 +1,13 @@
 // SPDX-FileCopyrightText: The vmnet-broker authors
 // SPDX-License-Identifier: Apache-2.0
 
+#include <Security/Security.h>
 #include <dispatch/dispatch.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "broker-pool.h"
 #include "broker-xpc.h"
 #include "log.h"
 #include "vmnet-broker.h"
@@ -13,50 +15,180 @@
 static xpc_connection_t listener;
 static const struct broker_ops *ops;
 
+// Peer contexts are reused for new connections, keeping the peer networks
+// dictionary, so connecting and disconnecting peers does not allocate memory
+// for the context in steady state.
+static struct pool context_pool = POOL_INITIALIZER(
+    "contexts", struct broker_context
+);
+
+// Not declared in the public headers, but exported by libxpc since macOS 10.7
+// and used by system daemons for the same purpose.
+void xpc_connection_get_audit_token(xpc_connection_t, audit_token_t *);
+
+// Copy the code signing identity of the peer, "TEAMID:identifier". Only code
+// signed with a certificate issued by Apple has a team identifier, so the
+// identity cannot be claimed by other code.
+static void copy_signing_id(
+    const struct broker_context *ctx,
+    xpc_connection_t connection,
+    struct peer_credentials *cred
+) {
+    // The code is looked up by the audit token, identifying the process that
+    // sent the connection messages. Looking up by pid is racy: the peer can
+    // exec another program, or exit and have its pid reused, between
+    // connecting and the lookup.
+    audit_token_t token;
+    xpc_connection_get_audit_token(connection, &token);
+    CFDataRef audit = CFDataCreate(
+        NULL, (const UInt8 *)&token, sizeof(token)
+    );
+    const void *keys[] = {kSecGuestAttributeAudit};
+    const void *values[] = {audit};
+    CFDictionaryRef attributes = CFDictionaryCreate(
+        NULL,
+        keys,
+        values,
+        1,
+        &kCFTypeDictionaryKeyCallBacks,
+        &kCFTypeDictionaryValueCallBacks
+    );
+    CFRelease(audit);
+
+    SecCodeRef code = NULL;
+    CFDictionaryRef info = NULL;
+    OSStatus status = SecCodeCopyGuestWithAttributes(
+        NULL, attributes, kSecCSDefaultFlags, &code
+    );
+    CFRelease(attributes);
+    if (status != errSecSuccess) {
+        WARNF("[%s] failed to get peer code: %d", ctx->name, (int)status);
+        return;
+    }
+
+    // The signing information is trusted only if the signature is valid.
+    status = SecCodeCheckValidity(code, kSecCSDefaultFlags, NULL);
+    if (status != errSecSuccess) {
+        DEBUGF("[%s] peer signature is not valid: %d", ctx->name, (int)status);
+        goto out;
+    }
+
+    status = SecCodeCopySigningInformation(
+        (SecStaticCodeRef)code, kSecCSSigningInformation, &info
+    );
+    if (status != errSecSuccess) {
+        WARNF(
+            "[%s] failed to get peer signing info: %d", ctx->name, (int)status
+        );
+        goto out;
+    }
+
+    CFStringRef team = CFDictionaryGetValue(info, kSecCodeInfoTeamIdentifier);
+    CFStringRef identifier = CFDictionaryGetValue(
+        info, kSecCodeInfoIdentifier
+    );
+    if (team == NULL || identifier == NULL) {
+        goto out;
+    }
+
+    char team_id[32];
+    char id[SIGNING_ID_SIZE];
+    if (CFStringGetCString(
+            team, team_id, sizeof(team_id), kCFStringEncodingUTF8
+        ) &&
+        CFStringGetCString(identifier, id, sizeof(id), kCFStringEncodingUTF8)) {
+        snprintf(
+            cred->signing_id, sizeof(cred->signing_id), "%s:%s", team_id, id
+        );
+    }
+
+out:
+    if (info) {
+        CFRelease(info);
+    }
+    CFRelease(code);
+}
+
+// Get the peer identity. Groups and the code signing identity are slow to look
+// up, so they are added only if the policy uses them.
 static void
-init_context(struct broker_context *ctx, xpc_connection_t connection) {
-    ctx->connection = connection;
+get_credentials(struct broker_context *ctx, xpc_connection_t connection) {
+    struct peer_credentials *cred = &ctx->credentials;
+    *cred = (struct peer_credentials){
+        .uid = xpc_connection_get_euid(connection),
+        .gid = xpc_connection_get_egid(connection),
+        .pid = xpc_connection_get_pid(connection),
+    };
+
+    if (policy_uses_groups()) {
+        int err = peer_credentials_add_groups(cred);
+        if (err) {
+            WARNF(
+                "[%s] failed to get groups for uid %d: %s",
+                ctx->name,
+                (int)cred->uid,
+                strerror(err)
+            );
+        }
+    }
+
+    if (policy_uses_signing_id()) {
+        copy_signing_id(ctx, connection, cred);
+    }
+}
+
+static struct broker_context *create_context(xpc_connection_t connection) {
+    struct broker_context *ctx = pool_alloc(&context_pool);
+    // Replies may be sent on the shard queues after the connection was
+    // invalidated, so the context keeps a reference until it is released.
+    ctx->connection = xpc_retain(connection);
     snprintf(
         ctx->name,
         sizeof(ctx->name),
         "peer %d",
         xpc_connection_get_pid(connection)
     );
-    memset(ctx->networks, 0, sizeof(ctx->networks));
-    ctx->network_count = 0;
+    ctx->version = PROTOCOL_VERSION_1;
+    // ctx->networks are NULL for a new context, or empty dictionaries kept by
+    // the previous peer.
+    ctx->subscriber = NULL;
+    ctx->throttle = (struct throttle){0};
+    ctx->disconnected = false;
+    get_credentials(ctx, connection);
+    return ctx;
 }
 
 static void handle_connection(xpc_connection_t connection) {
-    // Allocate context on stack - it will be captured by the block below
-    // Use __block to ensure &ctx always refers to the same instance,
-    // even if ctx is moved to heap when the block is copied
-    __block struct broker_context ctx;
-    init_context(&ctx, connection);
+    // The context is owned by the connection until the connection is
+    // invalidated, and returned to the pool by the broker when the peer
+    // requests complete. The event handler is not called after that.
+    struct broker_context *ctx = create_context(connection);
 
     // Notify broker of new peer
     if (ops->on_peer_connect) {
-        ops->on_peer_connect(&ctx);
+        ops->on_peer_connect(ctx);
     }
 
-    // NOTE: The block captures ctx, so it lives as long as the connection
     xpc_connection_set_event_handler(connection, ^(xpc_object_t event) {
         xpc_type_t type = xpc_get_type(event);
         if (type == XPC_TYPE_ERROR) {
             if (event == XPC_ERROR_CONNECTION_INVALID) {
                 // Client connection is dead
                 if (ops->on_peer_disconnect) {
-                    ops->on_peer_disconnect(&ctx);
+                    ops->on_peer_disconnect(ctx);
+                } else {
+                    release_context(ctx);
                 }
             } else {
                 const char *desc = xpc_dictionary_get_string(
                     event, XPC_ERROR_KEY_DESCRIPTION
                 );
-                WARNF("[%s] unexpected error: %s", ctx.name, desc);
+                WARNF("[%s] unexpected error: %s", ctx->name, desc);
             }
         } else if (type == XPC_TYPE_DICTIONARY) {
             // Forward request to broker
             if (ops->on_peer_request) {
-                ops->on_peer_request(&ctx, event);
+                ops->on_peer_request(ctx, event);
             }
         }
     });
@@ -64,8 +196,28 @@ static void handle_connection(xpc_connection_t connection) {
     xpc_connection_resume(connection);
 }
 
+void release_context(struct broker_context *ctx) {
+    xpc_release(ctx->connection);
+    ctx->connection = NULL;
+    pool_free(&context_pool, ctx);
+}
+
 static xpc_object_t
 create_reply(const struct broker_context *ctx, xpc_object_t event) {
+    // Protocol version 2 requests are sent without waiting for a reply. The
+    // reply is sent as a message on the connection, and the peer matches it to
+    // the request by the request ID. Protocol version 1 requests with a request
+    // ID are rejected, using a reply to the request.
+    xpc_object_t request_id = NULL;
+    if (ctx->version >= PROTOCOL_VERSION_2) {
+        request_id = xpc_dictionary_get_value(event, REQUEST_ID);
+    }
+    if (request_id != NULL) {
+        xpc_object_t reply = xpc_dictionary_create_empty();
+        xpc_dictionary_set_value(reply, REPLY_ID, request_id);
+        return reply;
+    }
+
     xpc_object_t reply = xpc_dictionary_create_reply(event);
     if (reply == NULL) {
         // Event does not include the return address.
@@ -92,6 +244,37 @@ void send_xpc_error(
     xpc_release(reply);
 }
 
+void send_xpc_busy(
+    const struct broker_context *ctx, xpc_object_t event, int retry_after_ms
+) {
+    DEBUGF(
+        "[%s] send busy to peer: retry_after=%d", ctx->name, retry_after_ms
+    );
+
+    xpc_object_t reply = create_reply(ctx, event);
+    if (reply == NULL) {
+        return;
+    }
+
+    xpc_dictionary_set_int64(reply, REPLY_ERROR, VMNET_BROKER_BUSY);
+    xpc_dictionary_set_int64(reply, REPLY_RETRY_AFTER, retry_after_ms);
+
+    xpc_connection_send_message(ctx->connection, reply);
+    xpc_release(reply);
+}
+
+void send_xpc_success(const struct broker_context *ctx, xpc_object_t event) {
+    DEBUGF("[%s] send success to peer", ctx->name);
+
+    xpc_object_t reply = create_reply(ctx, event);
+    if (reply == NULL) {
+        return;
+    }
+
+    xpc_connection_send_message(ctx->connection, reply);
+    xpc_release(reply);
+}
+
 void send_xpc_network(
     const struct broker_context *ctx,
     xpc_object_t event,
@@ -110,6 +293,99 @@ void send_xpc_network(
     xpc_release(reply);
 }
 
+void send_xpc_relay(
+    const struct broker_context *ctx,
+    xpc_object_t event,
+    const char *network_name,
+    int fd,
+    int ring_fd
+) {
+    DEBUGF("[%s] send relay for network '%s' to peer", ctx->name, network_name);
+
+    xpc_object_t reply = create_reply(ctx, event);
+    if (reply == NULL) {
+        return;
+    }
+
+    // The reply has copies of the socket and the region.
+    xpc_dictionary_set_fd(reply, REPLY_RELAY_FD, fd);
+    if (ring_fd != -1) {
+        xpc_dictionary_set_fd(reply, REPLY_RING_FD, ring_fd);
+    }
+    xpc_connection_send_message(ctx->connection, reply);
+    xpc_release(reply);
+}
+
+void send_xpc_capture(
+    const struct broker_context *ctx,
+    xpc_object_t event,
+    const char *network_name,
+    int fd
+) {
+    DEBUGF(
+        "[%s] send capture for network '%s' to peer", ctx->name, network_name
+    );
+
+    xpc_object_t reply = create_reply(ctx, event);
+    if (reply == NULL) {
+        return;
+    }
+
+    // The reply has a copy of the socket.
+    xpc_dictionary_set_fd(reply, REPLY_CAPTURE_FD, fd);
+    xpc_connection_send_message(ctx->connection, reply);
+    xpc_release(reply);
+}
+
+void send_xpc_networks(
+    const struct broker_context *ctx, xpc_object_t event, xpc_object_t networks
+) {
+    DEBUGF(
+        "[%s] send %zu networks to peer",
+        ctx->name,
+        xpc_array_get_count(networks)
+    );
+
+    xpc_object_t reply = create_reply(ctx, event);
+    if (reply == NULL) {
+        return;
+    }
+
+    xpc_dictionary_set_value(reply, REPLY_NETWORKS, networks);
+    xpc_connection_send_message(ctx->connection, reply);
+    xpc_release(reply);
+}
+
+void send_xpc_version(
+    const struct broker_context *ctx, xpc_object_t event, int version
+) {
+    DEBUGF("[%s] send version to peer: version=%d", ctx->name, version);
+
+    xpc_object_t reply = create_reply(ctx, event);
+    if (reply == NULL) {
+        return;
+    }
+
+    xpc_dictionary_set_int64(reply, REPLY_VERSION, version);
+    xpc_connection_send_message(ctx->connection, reply);
+    xpc_release(reply);
+}
+
+void send_xpc_stats(
+    const struct broker_context *ctx, xpc_object_t event, xpc_object_t stats
+) {
+    DEBUGF("[%s] send stats to peer", ctx->name);
+
+    xpc_object_t reply = create_reply(ctx, event);
+    if (reply == NULL) {
+        return;
+    }
+
+    xpc_dictionary_set_value(reply, REPLY_STATS, stats);
+    xpc_connection_send_message(ctx->connection, reply);
+    xpc_release(reply);
+}
+
 int start_xpc_listener(
     const struct broker_context *ctx, const struct broker_ops *broker_ops
 ) {
@@ -121,9 +397,8 @@ int start_xpc_listener(
 
     DEBUGF("[%s] setting up listener", ctx->name);
 
-    // We use the main queue to minimize memory. The broker is mostly idle and
-    // handles few clients in its lifetime. There is no reason to have more than
-    // one thread.
+    // Connection events are cheap; they are validated on the main queue, and
+    // network requests are routed to the shard queues. See broker-shard.h.
     listener = xpc_connection_create_mach_service(
         MACH_SERVICE_NAME,
         dispatch_get_main_queue(),
@@ -146,9 +421,8 @@ int start_xpc_listener(
             exit(EXIT_FAILURE);
         } else if (type == XPC_TYPE_CONNECTION) {
             xpc_connection_t connection = (xpc_connection_t)event;
-            // Use the same queue for all peers. This ensures that we don't need
-            // any locks when modifying internal state, and all events are
-            // serialized.
+            // Use the same queue for all peers, so peer state does not need
+            // locks. Network state is accessed on the shard queues.
             xpc_connection_set_target_queue(
                 connection, dispatch_get_main_queue()
             );
@@ -2,58 +2,103 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include "vmnet-broker.h"
+#include <Block.h>
+#include <unistd.h>
 #include <xpc/xpc.h>
 
+// Maximum time to wait for a busy broker before failing with
+// VMNET_BROKER_BUSY.
+#define MAX_BUSY_WAIT_MS 5000
+
 // The connection must be kept open during the lifetime of the client. The
 // kernel invalidates the broker connection after the client terminates.
 static xpc_connection_t connection;
 
+// Set by vmnet_broker_subscribe().
+static vmnet_broker_event_handler_t event_handler;
+
 static void connect_to_broker(void) {
     connection = xpc_connection_create_mach_service(MACH_SERVICE_NAME, NULL, 0);
 
-    // Must set the event handler but we don't use it. Errors are logged when we
-    // receive a reply.
+    // Errors are logged when we receive a reply. Dictionaries are events sent
+    // by the broker after subscribing.
     xpc_connection_set_event_handler(connection, ^(xpc_object_t event) {
-        (void)event;
+        if (event_handler && xpc_get_type(event) == XPC_TYPE_DICTIONARY) {
+            event_handler(event);
+        }
     });
 
     xpc_connection_resume(connection);
 }
 
-xpc_object_t vmnet_broker_acquire_network(
-    const char *network_name, vmnet_broker_return_t *status
-) {
+// Send a request to the broker and wait for the reply. On success, *reply is
+// set to the reply dictionary, which the caller must release using
+// xpc_release(). On failure, *reply is set to NULL. If the broker is busy, the
+// request is retried after the time specified by the broker.
+static vmnet_broker_return_t
+send_request(xpc_object_t message, xpc_object_t *reply) {
     if (connection == NULL) {
         connect_to_broker();
     }
 
-    xpc_object_t message = xpc_dictionary_create_empty();
-    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_ACQUIRE);
-    xpc_dictionary_set_string(message, REQUEST_NETWORK_NAME, network_name);
+    int64_t busy_wait_ms = 0;
 
-    xpc_object_t reply = xpc_connection_send_message_with_reply_sync(
-        connection, message
-    );
-    xpc_release(message);
-    message = NULL;
+retry:
+    *reply = xpc_connection_send_message_with_reply_sync(connection, message);
 
-    xpc_object_t serialization = NULL;
     vmnet_broker_return_t ret = VMNET_BROKER_INTERNAL_ERROR;
-    xpc_type_t reply_type = xpc_get_type(reply);
+    xpc_type_t reply_type = xpc_get_type(*reply);
 
     if (reply_type == XPC_TYPE_ERROR) {
         ret = VMNET_BROKER_XPC_FAILURE;
-        goto out;
+        goto failure;
     }
 
     if (reply_type != XPC_TYPE_DICTIONARY) {
         ret = VMNET_BROKER_INVALID_REPLY;
-        goto out;
+        goto failure;
     }
 
-    int32_t error = xpc_dictionary_get_int64(reply, REPLY_ERROR);
+    int32_t error = xpc_dictionary_get_int64(*reply, REPLY_ERROR);
+    if (error == VMNET_BROKER_BUSY && busy_wait_ms < MAX_BUSY_WAIT_MS) {
+        int64_t retry_after_ms = xpc_dictionary_get_int64(
+            *reply, REPLY_RETRY_AFTER
+        );
+        if (retry_after_ms < 1) {
+            retry_after_ms = 1;
+        } else if (retry_after_ms > MAX_BUSY_WAIT_MS - busy_wait_ms) {
+            retry_after_ms = MAX_BUSY_WAIT_MS - busy_wait_ms;
+        }
+        xpc_release(*reply);
+        usleep((useconds_t)retry_after_ms * 1000);
+        busy_wait_ms += retry_after_ms;
+        goto retry;
+    }
     if (error) {
         ret = (vmnet_broker_return_t)error;
+        goto failure;
+    }
+
+    return VMNET_BROKER_SUCCESS;
+
+failure:
+    xpc_release(*reply);
+    *reply = NULL;
+    return ret;
+}
+
+// Send an acquire request and return the network serialization from the reply.
+// Consumes the message.
+static xpc_object_t
+acquire_network(xpc_object_t message, vmnet_broker_return_t *status) {
+    xpc_object_t reply;
+    vmnet_broker_return_t ret = send_request(message, &reply);
+    xpc_release(message);
+    message = NULL;
+
+    xpc_object_t serialization = NULL;
+
+    if (ret != VMNET_BROKER_SUCCESS) {
         goto out;
     }
 
@@ -63,11 +108,12 @@ xpc_object_t vmnet_broker_acquire_network(
         goto out;
     }
 
-    ret = VMNET_BROKER_SUCCESS;
     xpc_retain(serialization);
 
 out:
-    xpc_release(reply);
+    if (reply) {
+        xpc_release(reply);
+    }
 
     if (status) {
         *status = ret;
@@ -75,6 +121,267 @@ out:
     return serialization;
 }
 
+xpc_object_t vmnet_broker_acquire_network(
+    const char *network_name, vmnet_broker_return_t *status
+) {
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_ACQUIRE);
+    xpc_dictionary_set_string(message, REQUEST_NETWORK_NAME, network_name);
+
+    return acquire_network(message, status);
+}
+
+xpc_object_t vmnet_broker_acquire_network_with_lease(
+    const char *network_name,
+    const char *lease_token,
+    uint32_t lease_duration,
+    vmnet_broker_return_t *status
+) {
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_ACQUIRE);
+    xpc_dictionary_set_string(message, REQUEST_NETWORK_NAME, network_name);
+    xpc_dictionary_set_string(message, REQUEST_LEASE_TOKEN, lease_token);
+    xpc_dictionary_set_int64(message, REQUEST_LEASE_DURATION, lease_duration);
+
+    return acquire_network(message, status);
+}
+
+// Consumes the message. Returns the socket in the reply key.
+static int receive_socket(
+    xpc_object_t message, const char *key, vmnet_broker_return_t *status
+) {
+    xpc_object_t reply;
+    vmnet_broker_return_t ret = send_request(message, &reply);
+    xpc_release(message);
+
+    int fd = -1;
+
+    if (ret != VMNET_BROKER_SUCCESS) {
+        goto out;
+    }
+
+    fd = xpc_dictionary_dup_fd(reply, key);
+    if (fd == -1) {
+        ret = VMNET_BROKER_INVALID_REPLY;
+        goto out;
+    }
+
+out:
+    if (reply) {
+        xpc_release(reply);
+    }
+
+    if (status) {
+        *status = ret;
+    }
+    return fd;
+}
+
+int vmnet_broker_acquire_relay(
+    const char *network_name, vmnet_broker_return_t *status
+) {
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_ACQUIRE);
+    xpc_dictionary_set_string(message, REQUEST_NETWORK_NAME, network_name);
+    xpc_dictionary_set_bool(message, REQUEST_RELAY, true);
+
+    return receive_socket(message, REPLY_RELAY_FD, status);
+}
+
+int vmnet_broker_acquire_vhost_user(
+    const char *network_name, vmnet_broker_return_t *status
+) {
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_ACQUIRE);
+    xpc_dictionary_set_string(message, REQUEST_NETWORK_NAME, network_name);
+    xpc_dictionary_set_bool(message, REQUEST_VHOST_USER, true);
+
+    return receive_socket(message, REPLY_RELAY_FD, status);
+}
+
+int vmnet_broker_acquire_stream(
+    const char *network_name, vmnet_broker_return_t *status
+) {
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_ACQUIRE);
+    xpc_dictionary_set_string(message, REQUEST_NETWORK_NAME, network_name);
+    xpc_dictionary_set_bool(message, REQUEST_STREAM, true);
+
+    return receive_socket(message, REPLY_RELAY_FD, status);
+}
+
+int vmnet_broker_acquire_ring(
+    const char *network_name, int *doorbell, vmnet_broker_return_t *status
+) {
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_ACQUIRE);
+    xpc_dictionary_set_string(message, REQUEST_NETWORK_NAME, network_name);
+    xpc_dictionary_set_bool(message, REQUEST_RING, true);
+
+    xpc_object_t reply;
+    vmnet_broker_return_t ret = send_request(message, &reply);
+    xpc_release(message);
+
+    int fd = -1;
+    *doorbell = -1;
+
+    if (ret != VMNET_BROKER_SUCCESS) {
+        goto out;
+    }
+
+    fd = xpc_dictionary_dup_fd(reply, REPLY_RING_FD);
+    *doorbell = xpc_dictionary_dup_fd(reply, REPLY_RELAY_FD);
+    if (fd == -1 || *doorbell == -1) {
+        if (fd != -1) {
+            close(fd);
+            fd = -1;
+        }
+        if (*doorbell != -1) {
+            close(*doorbell);
+            *doorbell = -1;
+        }
+        ret = VMNET_BROKER_INVALID_REPLY;
+        goto out;
+    }
+
+out:
+    if (reply) {
+        xpc_release(reply);
+    }
+
+    if (status) {
+        *status = ret;
+    }
+    return fd;
+}
+
+int vmnet_broker_capture(
+    const char *network_name,
+    uint32_t snaplen,
+    const char *filter,
+    vmnet_broker_return_t *status
+) {
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_CAPTURE);
+    xpc_dictionary_set_string(message, REQUEST_NETWORK_NAME, network_name);
+    xpc_dictionary_set_int64(message, REQUEST_SNAPLEN, snaplen);
+    if (filter) {
+        xpc_dictionary_set_string(message, REQUEST_FILTER, filter);
+    }
+
+    return receive_socket(message, REPLY_CAPTURE_FD, status);
+}
+
+vmnet_broker_return_t vmnet_broker_release_network(const char *network_name) {
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_RELEASE);
+    xpc_dictionary_set_string(message, REQUEST_NETWORK_NAME, network_name);
+
+    xpc_object_t reply;
+    vmnet_broker_return_t ret = send_request(message, &reply);
+    xpc_release(message);
+
+    if (reply) {
+        xpc_release(reply);
+    }
+
+    return ret;
+}
+
+xpc_object_t vmnet_broker_network_info(
+    const char *network_name, vmnet_broker_return_t *status
+) {
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_INFO);
+    if (network_name) {
+        xpc_dictionary_set_string(message, REQUEST_NETWORK_NAME, network_name);
+    }
+
+    xpc_object_t reply;
+    vmnet_broker_return_t ret = send_request(message, &reply);
+    xpc_release(message);
+
+    xpc_object_t networks = NULL;
+
+    if (ret != VMNET_BROKER_SUCCESS) {
+        goto out;
+    }
+
+    networks = xpc_dictionary_get_array(reply, REPLY_NETWORKS);
+    if (networks == NULL) {
+        ret = VMNET_BROKER_INVALID_REPLY;
+        goto out;
+    }
+
+    xpc_retain(networks);
+
+out:
+    if (reply) {
+        xpc_release(reply);
+    }
+
+    if (status) {
+        *status = ret;
+    }
+    return networks;
+}
+
+xpc_object_t vmnet_broker_stats(vmnet_broker_return_t *status) {
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_STATS);
+
+    xpc_object_t reply;
+    vmnet_broker_return_t ret = send_request(message, &reply);
+    xpc_release(message);
+
+    xpc_object_t stats = NULL;
+
+    if (ret != VMNET_BROKER_SUCCESS) {
+        goto out;
+    }
+
+    stats = xpc_dictionary_get_dictionary(reply, REPLY_STATS);
+    if (stats == NULL) {
+        ret = VMNET_BROKER_INVALID_REPLY;
+        goto out;
+    }
+
+    xpc_retain(stats);
+
+out:
+    if (reply) {
+        xpc_release(reply);
+    }
+
+    if (status) {
+        *status = ret;
+    }
+    return stats;
+}
+
+vmnet_broker_return_t
+vmnet_broker_subscribe(vmnet_broker_event_handler_t handler) {
+    // Set the handler before subscribing, since events may be received before
+    // the reply.
+    if (event_handler) {
+        Block_release(event_handler);
+    }
+    event_handler = Block_copy(handler);
+
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_SUBSCRIBE);
+
+    xpc_object_t reply;
+    vmnet_broker_return_t ret = send_request(message, &reply);
+    xpc_release(message);
+
+    if (reply) {
+        xpc_release(reply);
+    }
+
+    return ret;
+}
+
 const char *vmnet_broker_strerror(vmnet_broker_return_t status) {
     switch (status) {
     case VMNET_BROKER_SUCCESS:
@@ -93,6 +400,8 @@ const char *vmnet_broker_strerror(vmnet_broker_return_t status) {
         return "Failed to create network";
     case VMNET_BROKER_INTERNAL_ERROR:
         return "Internal or unknown error";
+    case VMNET_BROKER_BUSY:
+        return "Broker is busy, try again later";
     default:
         return "(unknown status)";
     }
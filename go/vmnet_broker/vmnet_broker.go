@@ -10,10 +10,20 @@ package vmnet_broker
 #cgo CFLAGS: -I${SRCDIR}/../../include -Wall -Wextra -O2
 #include "vmnet-broker.h"
 #include <stdlib.h>
+
+static const char *key_name = NETWORK_NAME;
+static const char *key_subnet = NETWORK_SUBNET;
+static const char *key_mask = NETWORK_MASK;
+static const char *key_ipv6_prefix = NETWORK_IPV6_PREFIX;
+static const char *key_prefix_len = NETWORK_PREFIX_LEN;
+static const char *key_mode = NETWORK_MODE;
+static const char *key_peers = NETWORK_PEERS;
+static const char *key_age = NETWORK_AGE;
 */
 import "C"
 import (
 	"runtime"
+	"time"
 	"unsafe"
 )
 
@@ -29,6 +39,7 @@ const (
 	ErrNotFound       = Error(C.VMNET_BROKER_NOT_FOUND)
 	ErrCreateFailure  = Error(C.VMNET_BROKER_CREATE_FAILURE)
 	ErrInternalError  = Error(C.VMNET_BROKER_INTERNAL_ERROR)
+	ErrBusy           = Error(C.VMNET_BROKER_BUSY)
 )
 
 // Error returns a message describing the error, retrieved from the C library.
@@ -62,6 +73,40 @@ func AcquireNetwork(networkName string) (*Serialization, error) {
 		return nil, Error(status)
 	}
 
+	return newSerialization(obj), nil
+}
+
+// AcquireNetworkWithLease acquires a shared lock on a configured network like
+// [AcquireNetwork], keeping the network after this process terminates for the
+// lease duration.
+//
+// When the process terminates without releasing the network, the broker keeps
+// the network for leaseDuration. If a process acquires the network with the
+// same leaseToken before the lease expires, it gets the same network instead of
+// a new network with a different subnet. This allows a VM launcher to restart
+// without disrupting running VMs.
+//
+// The lease duration is rounded down to whole seconds, and must be between 1
+// second and 1 hour. Releasing the network with [ReleaseNetwork] ends the
+// lease.
+func AcquireNetworkWithLease(networkName, leaseToken string, leaseDuration time.Duration) (*Serialization, error) {
+	cName := C.CString(networkName)
+	defer C.free(unsafe.Pointer(cName))
+
+	cToken := C.CString(leaseToken)
+	defer C.free(unsafe.Pointer(cToken))
+
+	var status C.vmnet_broker_return_t
+	obj := C.vmnet_broker_acquire_network_with_lease(
+		cName, cToken, C.uint32_t(leaseDuration/time.Second), &status)
+	if obj == nil {
+		return nil, Error(status)
+	}
+
+	return newSerialization(obj), nil
+}
+
+func newSerialization(obj C.xpc_object_t) *Serialization {
 	serialization := &Serialization{ptr: obj}
 
 	// Release obj when it becomes unreachable.
@@ -69,7 +114,93 @@ func AcquireNetwork(networkName string) (*Serialization, error) {
 		C.xpc_release(obj)
 	}, obj)
 
-	return serialization, nil
+	return serialization
+}
+
+// ReleaseNetwork releases a shared lock on a network acquired with
+// [AcquireNetwork].
+//
+// Each call releases one reference acquired by this process. When the last
+// reference is released, the broker stops tracking the network for this
+// process, and if no other process is using the network, the broker removes it
+// after a delay.
+//
+// The caller must stop using the network before releasing the last reference.
+// Releasing a network is optional; all references are released when the
+// process terminates.
+func ReleaseNetwork(networkName string) error {
+	cName := C.CString(networkName)
+	defer C.free(unsafe.Pointer(cName))
+
+	status := C.vmnet_broker_release_network(cName)
+	if status != C.VMNET_BROKER_SUCCESS {
+		return Error(status)
+	}
+
+	return nil
+}
+
+// NetworkInfo describes a network created by the broker.
+type NetworkInfo struct {
+	Name       string
+	Mode       string
+	Subnet     string
+	Mask       string
+	IPv6Prefix string
+	PrefixLen  int
+	Peers      int
+	Age        time.Duration
+}
+
+// GetNetworkInfo returns information about a network created by the broker.
+//
+// The information is recorded when the network is created. Querying the
+// information does not acquire the network or create it. If the network was
+// not created by the broker, returns [ErrNotFound].
+func GetNetworkInfo(networkName string) (*NetworkInfo, error) {
+	cName := C.CString(networkName)
+	defer C.free(unsafe.Pointer(cName))
+
+	networks, err := networkInfo(cName)
+	if err != nil {
+		return nil, err
+	}
+	if len(networks) != 1 {
+		return nil, ErrInvalidReply
+	}
+	return &networks[0], nil
+}
+
+// ListNetworks returns information about all networks created by the broker.
+func ListNetworks() ([]NetworkInfo, error) {
+	return networkInfo(nil)
+}
+
+func networkInfo(cName *C.char) ([]NetworkInfo, error) {
+	var status C.vmnet_broker_return_t
+	obj := C.vmnet_broker_network_info(cName, &status)
+	if obj == nil {
+		return nil, Error(status)
+	}
+	defer C.xpc_release(obj)
+
+	count := int(C.xpc_array_get_count(obj))
+	networks := make([]NetworkInfo, count)
+	for i := range networks {
+		info := C.xpc_array_get_value(obj, C.size_t(i))
+		networks[i] = NetworkInfo{
+			Name:       C.GoString(C.xpc_dictionary_get_string(info, C.key_name)),
+			Mode:       C.GoString(C.xpc_dictionary_get_string(info, C.key_mode)),
+			Subnet:     C.GoString(C.xpc_dictionary_get_string(info, C.key_subnet)),
+			Mask:       C.GoString(C.xpc_dictionary_get_string(info, C.key_mask)),
+			IPv6Prefix: C.GoString(C.xpc_dictionary_get_string(info, C.key_ipv6_prefix)),
+			PrefixLen:  int(C.xpc_dictionary_get_int64(info, C.key_prefix_len)),
+			Peers:      int(C.xpc_dictionary_get_int64(info, C.key_peers)),
+			Age:        time.Duration(C.xpc_dictionary_get_int64(info, C.key_age)) * time.Second,
+		}
+	}
+
+	return networks, nil
 }
 
 // Raw returns the underlying xpc_object_t as [unsafe.Pointer].
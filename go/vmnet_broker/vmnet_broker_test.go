@@ -6,6 +6,7 @@ package vmnet_broker_test
 import (
 	"errors"
 	"testing"
+	"time"
 
 	"github.com/nirs/vmnet-broker/go/vmnet_broker"
 )
@@ -40,6 +41,74 @@ func TestAcquireNetwork(t *testing.T) {
 	})
 }
 
+func TestAcquireNetworkWithLease(t *testing.T) {
+	// Note: These tests requires installation of the vmnet-broker launchd daemon.
+
+	t.Run("ValidLease", func(t *testing.T) {
+		s, err := vmnet_broker.AcquireNetworkWithLease("shared", "go-test", 10*time.Second)
+		if err != nil {
+			t.Fatalf("Expected success for 'shared' network, got error: %v", err)
+		}
+		if s == nil || s.Raw() == nil {
+			t.Fatal("Expected valid serialization, got nil")
+		}
+	})
+
+	t.Run("InvalidDuration", func(t *testing.T) {
+		_, err := vmnet_broker.AcquireNetworkWithLease("shared", "go-test", 0)
+		if !errors.Is(err, vmnet_broker.ErrInvalidRequest) {
+			t.Fatalf("Expected ErrInvalidRequest, got: %v", err)
+		}
+	})
+}
+
+func TestReleaseNetwork(t *testing.T) {
+	// Note: These tests requires installation of the vmnet-broker launchd daemon.
+
+	t.Run("AcquiredNetwork", func(t *testing.T) {
+		if _, err := vmnet_broker.AcquireNetwork("shared"); err != nil {
+			t.Fatalf("Failed to acquire 'shared' network: %v", err)
+		}
+		if err := vmnet_broker.ReleaseNetwork("shared"); err != nil {
+			t.Fatalf("Expected success for 'shared' network, got error: %v", err)
+		}
+	})
+
+	t.Run("NonAcquiredNetwork", func(t *testing.T) {
+		err := vmnet_broker.ReleaseNetwork("host")
+		if !errors.Is(err, vmnet_broker.ErrNotFound) {
+			t.Fatalf("Expected ErrNotFound, got: %v", err)
+		}
+	})
+}
+
+func TestGetNetworkInfo(t *testing.T) {
+	// Note: These tests requires installation of the vmnet-broker launchd daemon.
+
+	t.Run("AcquiredNetwork", func(t *testing.T) {
+		if _, err := vmnet_broker.AcquireNetwork("shared"); err != nil {
+			t.Fatalf("Failed to acquire 'shared' network: %v", err)
+		}
+		info, err := vmnet_broker.GetNetworkInfo("shared")
+		if err != nil {
+			t.Fatalf("Expected success for 'shared' network, got error: %v", err)
+		}
+		if info.Name != "shared" || info.Mode != "shared" {
+			t.Fatalf("Unexpected network info: %+v", info)
+		}
+		if info.Subnet == "" || info.Peers < 1 {
+			t.Fatalf("Unexpected network info: %+v", info)
+		}
+	})
+
+	t.Run("NonExistingNetwork", func(t *testing.T) {
+		_, err := vmnet_broker.GetNetworkInfo("no-such-network")
+		if !errors.Is(err, vmnet_broker.ErrNotFound) {
+			t.Fatalf("Expected ErrNotFound, got: %v", err)
+		}
+	})
+}
+
 func TestError(t *testing.T) {
 
 	t.Run("known status", func(t *testing.T) {
@@ -0,0 +1,78 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_CAPTURE_H
+#define BROKER_CAPTURE_H
+
+#include <stdint.h>
+
+#include "broker-relay.h"
+
+// Packet capture of a relayed network. A tap on the network switch copies
+// frames matching the capture filter, truncated to the snapshot length, to a
+// lock-free single producer single consumer ring, and a writer thread drains
+// the ring and writes the frames to a stream socket in pcapng format, readable
+// by tcpdump and Wireshark. The relay thread never waits for the writer: when
+// the ring is full, frames are dropped and counted. The capture does not
+// depend on XPC, so it can be tested and benchmarked on any platform.
+
+// The largest snapshot length.
+#define CAPTURE_MAX_SNAPLEN 65535
+
+// The default snapshot length, holding the headers of TCP and UDP frames and
+// the start of the payload. Copying entire frames of a busy network costs
+// more than forwarding them, so entire frames are captured only on request.
+#define CAPTURE_DEFAULT_SNAPLEN 256
+
+// Size of the capture ring, holding about 2700 full size frames.
+#define CAPTURE_RING_SIZE (4 * 1024 * 1024)
+
+struct capture_options {
+    // Interface name written to the capture, usually the network name.
+    const char *name;
+    // Optional filter expression, see broker-filter.h. NULL or empty to
+    // capture all frames.
+    const char *filter;
+    // Capture up to snaplen bytes of every frame, or CAPTURE_DEFAULT_SNAPLEN
+    // if 0.
+    uint32_t snaplen;
+    // Optional. Called once on the writer thread when writing to the socket
+    // failed, usually since the reader closed it. The capture must be stopped
+    // by calling capture_stop().
+    void (*done)(void *arg);
+    void *arg;
+};
+
+// Capture counters.
+struct capture_stats {
+    // Number of frames received by the switch.
+    uint64_t received;
+    // Number of frames matching the filter and copied to the ring.
+    uint64_t captured;
+    // Number of frames matching the filter and dropped since the ring was
+    // full.
+    uint64_t drops;
+};
+
+struct capture;
+
+// Start capturing frames received by the switch ports, writing them to a
+// stream socket owned by the capture. Returns NULL and sets errno on failure,
+// EINVAL if the filter or snaplen are invalid. On failure the socket is not
+// closed.
+struct capture *capture_start(
+    struct relay *relay,
+    struct relay_switch *sw,
+    int fd,
+    const struct capture_options *options
+);
+
+// Stop capturing. The writer thread writes the frames left in the ring and
+// the capture counters, closes the socket, and frees the capture. The capture
+// must not be used after calling this.
+void capture_stop(struct capture *c);
+
+// Get the capture counters. May be called from any thread.
+void capture_get_stats(struct capture *c, struct capture_stats *stats);
+
+#endif // BROKER_CAPTURE_H
@@ -0,0 +1,40 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_CHECKSUM_H
+#define BROKER_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Internet checksum (RFC 1071) of IPv4, TCP, UDP, and ICMP headers. The ones'
+// complement sum does not depend on the byte order, so words are added in the
+// host byte order, and the checksum is returned in the byte order of the
+// frame: store it with memcpy, without converting it.
+//
+// Uses NEON on arm64, and SSE2 or AVX2 on x86_64, adding 16 or 32 bytes in
+// every step. The scalar versions are used on other platforms, and for
+// comparing in the benchmarks.
+
+// Add the 16 bits words of data to a partial sum. A sum of many parts is the
+// sum of the parts in order; all parts except the last must have an even
+// length.
+uint32_t inet_sum(const void *data, size_t len, uint32_t sum);
+
+// Like inet_sum(), adding 32 bits words without SIMD.
+uint32_t inet_sum_scalar(const void *data, size_t len, uint32_t sum);
+
+// Fold a partial sum to a checksum.
+static inline uint16_t inet_fold(uint32_t sum) {
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+// Return the checksum of data. Computing the checksum of data including a
+// valid checksum returns 0.
+static inline uint16_t inet_checksum(const void *data, size_t len) {
+    return inet_fold(inet_sum(data, len, 0));
+}
+
+#endif // BROKER_CHECKSUM_H
@@ -0,0 +1,59 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_CLASSIFY_H
+#define BROKER_CLASSIFY_H
+
+#include <stdint.h>
+
+#include "broker-relay.h"
+
+// Classification of a batch of frames received by the relay. Parses the
+// ethernet, VLAN, ARP, IPv4, and IPv6 headers of every frame into arrays
+// indexed by the frame index in the batch, so later stages use the fields
+// without parsing the frames again.
+//
+// The batch is classified in stages: reading the ethernet headers of all
+// frames, matching the ethertypes of 16 frames at a time using NEON on arm64
+// or SSE2 on x86_64, and parsing the IP headers of IP frames. The scalar
+// version classifies every frame in one pass, for comparing in the
+// benchmarks.
+
+// Flags of a frame.
+#define FRAME_MULTICAST (1 << 0)
+#define FRAME_BROADCAST (1 << 1)
+#define FRAME_VLAN (1 << 2)
+#define FRAME_ARP (1 << 3)
+#define FRAME_IPV4 (1 << 4)
+#define FRAME_IPV6 (1 << 5)
+// An IPv4 fragment, or an IPv6 packet with a fragment header.
+#define FRAME_FRAGMENT (1 << 6)
+// The frame is too short for its headers, or has an invalid IP header.
+#define FRAME_INVALID (1 << 7)
+
+struct frame_class {
+    uint8_t flags[RELAY_BATCH];
+    // IPv4 protocol or IPv6 next header, or 0.
+    uint8_t proto[RELAY_BATCH];
+    // Ethertype after the VLAN tags, in host byte order, or 0.
+    uint16_t ethertype[RELAY_BATCH];
+    // VLAN ID of the outer tag, or 0.
+    uint16_t vlan[RELAY_BATCH];
+    // Offset of the network header, or 0.
+    uint16_t l3[RELAY_BATCH];
+    // Offset of the transport header, or 0 if the frame is not IP, or is an
+    // IPv4 fragment other than the first.
+    uint16_t l4[RELAY_BATCH];
+};
+
+// Classify count frames, at most RELAY_BATCH.
+void classify_frames(
+    const struct relay_frame *frames, int count, struct frame_class *c
+);
+
+// Like classify_frames(), without SIMD.
+void classify_frames_scalar(
+    const struct relay_frame *frames, int count, struct frame_class *c
+);
+
+#endif // BROKER_CLASSIFY_H
@@ -4,8 +4,11 @@
 #ifndef BROKER_CONFIG_H
 #define BROKER_CONFIG_H
 
+#include <stdbool.h>
 #include <vmnet/vmnet.h>
 
+#include "broker-relay.h"
+#include "broker-subnets.h"
 #include "broker-xpc.h"
 
 // Create a network configuration for the named network.
@@ -17,4 +20,23 @@ vmnet_network_configuration_ref create_network_configuration(
     const struct broker_context *ctx, const char *name, int *error
 );
 
+// Create a network configuration for the named network requesting subnet
+// instead of a dynamic subnet. Returns NULL if the network has a configured
+// subnet, or on failure. The caller is responsible for releasing the returned
+// object using CFRelease().
+vmnet_network_configuration_ref create_network_configuration_with_subnet(
+    const struct broker_context *ctx,
+    const char *name,
+    const struct subnet *subnet,
+    int *error
+);
+
+// Return the mode of the named network ("shared", "host"), or NULL if the
+// network is not configured.
+const char *network_config_mode(const char *name);
+
+// Get the traffic shaping configuration of the named network. Returns false if
+// the network does not use traffic shaping, or is not configured.
+bool network_config_shaping(const char *name, struct relay_shaping *shaping);
+
 #endif // BROKER_CONFIG_H
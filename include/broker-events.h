@@ -0,0 +1,32 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_EVENTS_H
+#define BROKER_EVENTS_H
+
+#include "broker-xpc.h"
+#include "common.h"
+
+// Subscribe a peer to network lifecycle events. Events are sent to the peer
+// connection until the peer disconnects.
+void subscribe_peer(struct broker_context *ctx);
+
+// Unsubscribe a peer. Does nothing if the peer is not subscribed.
+void unsubscribe_peer(struct broker_context *ctx);
+
+// Subscribing and unsubscribing must be done on the main queue. Events may be
+// published on any queue, and are sent on the main queue in the order they were
+// published.
+
+// Publish a network created event with the network addresses.
+void publish_network_created(
+    const char *network_name, const struct network_info *info
+);
+
+// Publish a network event (acquired, released, idle, removed) with the current
+// number of peers using the network.
+void publish_network_event(
+    const char *event, const char *network_name, int peers
+);
+
+#endif // BROKER_EVENTS_H
@@ -0,0 +1,64 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_FDB_H
+#define BROKER_FDB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// MAC forwarding database of a relay switch, mapping a MAC address to the port
+// where it was last seen. An open addressing hash table with linear probing
+// and 16 bytes entries, so a lookup usually reads one cache line. Entries not
+// seen for the aging time are ignored by lookups, and reused by learning.
+//
+// Not thread safe; used only by the relay thread and under the relay lock.
+
+struct fdb_entry {
+    // The MAC address in the low 48 bits, or 0 for an empty entry.
+    uint64_t mac;
+    // Time the address was last seen, in seconds.
+    uint32_t seen;
+    uint16_t port;
+};
+
+struct fdb {
+    struct fdb_entry *entries;
+    uint32_t mask;
+    // Number of used entries, including aged entries.
+    uint32_t count;
+    // Entries not seen for age seconds are aged.
+    uint32_t age;
+    // Number of addresses learned, and moved to another port.
+    uint64_t learned;
+    uint64_t moved;
+};
+
+// Initialize a database for up to capacity addresses, rounded up to a power of
+// 2. Returns 0, or -1 and sets errno on failure.
+int fdb_init(struct fdb *fdb, uint32_t capacity, uint32_t age);
+
+void fdb_destroy(struct fdb *fdb);
+
+// Learn that mac was seen on port at time now. Addresses are not learned if the
+// database is full of entries that did not age.
+void fdb_learn(struct fdb *fdb, uint64_t mac, uint16_t port, uint32_t now);
+
+// Return the port where mac was seen, or -1 if it is unknown or aged.
+int fdb_lookup(struct fdb *fdb, uint64_t mac, uint32_t now);
+
+// Forget all addresses seen on port.
+void fdb_flush_port(struct fdb *fdb, uint16_t port);
+
+// Read a MAC address from a frame.
+static inline uint64_t fdb_mac(const unsigned char *p) {
+    return (uint64_t)p[0] << 40 | (uint64_t)p[1] << 32 | (uint64_t)p[2] << 24 |
+           (uint64_t)p[3] << 16 | (uint64_t)p[4] << 8 | (uint64_t)p[5];
+}
+
+// True for broadcast and multicast addresses.
+static inline bool fdb_is_multicast(uint64_t mac) {
+    return mac & (1ULL << 40);
+}
+
+#endif // BROKER_FDB_H
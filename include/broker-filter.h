@@ -0,0 +1,78 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_FILTER_H
+#define BROKER_FILTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "broker-classify.h"
+
+// Capture filters, using a subset of the pcap-filter(7) language of tcpdump.
+// The filter is compiled to a small expression tree when the capture starts,
+// and evaluated using the fields of classified frames, so matching a frame
+// does not parse its headers again.
+//
+// Supported primitives:
+//
+//   ether host|src|dst MAC    ethernet addresses
+//   host|src host|dst host ADDR
+//                             IPv4 or IPv6 addresses, and ARP IPv4 addresses
+//   [tcp|udp] port|src port|dst port PORT
+//                             TCP or UDP ports
+//   vlan [ID]                 VLAN tagged frames
+//   arp, ip, ip6, tcp, udp, icmp, icmp6, broadcast, multicast
+//
+// Primitives are combined with not, and, or (or !, &&, ||) and parentheses.
+// As in pcap-filter, and and or have the same precedence and associate to
+// the left. Unlike pcap-filter, primitives match frames with or without VLAN
+// tags.
+
+// Maximum number of nodes in a compiled filter.
+#define FILTER_MAX_NODES 64
+
+// Maximum length of a filter expression.
+#define FILTER_MAX_SIZE 1024
+
+struct filter_node {
+    uint8_t op;
+    // Match the source, the destination, or either address or port.
+    uint8_t dir;
+    // Protocol of a port primitive, or 0 for TCP and UDP.
+    uint8_t proto;
+    // Length of an address.
+    uint8_t len;
+    // Operands of not, and, and or.
+    int16_t left;
+    int16_t right;
+    // Address, port, VLAN ID, or frame flags.
+    union {
+        unsigned char addr[16];
+        uint16_t port;
+        uint16_t vlan;
+        uint8_t flags;
+    };
+};
+
+struct filter {
+    struct filter_node nodes[FILTER_MAX_NODES];
+    int count;
+    // The root node, or -1 for an empty filter matching all frames.
+    int root;
+};
+
+// Compile a filter expression. An empty expression matches all frames.
+// Returns 0 on success, or -1 and sets errno on failure, EINVAL if the
+// expression is invalid or too large.
+int filter_compile(struct filter *f, const char *expr);
+
+// Return true if frame i of a classified batch matches the filter.
+bool filter_match(
+    const struct filter *f,
+    const struct relay_frame *frame,
+    const struct frame_class *c,
+    int i
+);
+
+#endif // BROKER_FILTER_H
@@ -0,0 +1,44 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_HISTORY_H
+#define BROKER_HISTORY_H
+
+#include <xpc/xpc.h>
+
+struct broker_context;
+
+// Network usage history, saved when the broker shuts down and loaded when the
+// broker starts. Used to create the networks likely to be acquired soon after
+// the broker is started on demand. The history may be used on any queue.
+
+// Names must be shorter than this to be recorded. Must match the scanf width
+// in load_history().
+#define HISTORY_NAME_SIZE 64
+
+// Load the history saved by the previous broker run.
+void load_history(const struct broker_context *ctx);
+
+// Save the history, replacing the previously saved history.
+void save_history(const struct broker_context *ctx);
+
+// Record that the network is used by a peer after being unused.
+void history_network_used(const char *name);
+
+// Record that the network is not used by any peer.
+void history_network_unused(const char *name);
+
+// Copy to names up to max networks likely to be acquired soon, most likely
+// first. Returns the number of networks.
+int predict_networks(char names[][HISTORY_NAME_SIZE], int max);
+
+// Record the outcome of creating a predicted network: a hit if a peer acquired
+// the network, or a miss if the network was removed without being acquired.
+void history_predicted(void);
+void history_prediction_hit(void);
+void history_prediction_miss(void);
+
+// Add prediction statistics to the stats dictionary.
+void add_history_stats(xpc_object_t stats);
+
+#endif // BROKER_HISTORY_H
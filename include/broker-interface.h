@@ -0,0 +1,80 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_INTERFACE_H
+#define BROKER_INTERFACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xpc/xpc.h>
+
+#include "broker-xpc.h"
+
+// Relay mode: the broker forwards frames between a datagram socket passed to
+// a peer and the network. Peers that cannot use vmnet, such as QEMU and
+// libkrun, join the network without running a vmnet-helper process per VM.
+// All interfaces share one relay thread.
+//
+// Peers relaying the same network are ports of a learning switch, with one
+// vmnet interface on the network as another port, so frames between peers do
+// not go through vmnet. The vmnet interface is started for the first peer and
+// stopped after the last peer stops.
+//
+// With a shared memory region, frames are exchanged using the rings in the
+// region, and the socket is used only as the doorbell. With vhost-user, the
+// peer passes a stream socket to QEMU, and frames are exchanged using
+// virtqueues in guest memory. With a stream socket, every frame is prefixed by
+// its length.
+
+// How frames are exchanged with the peer.
+enum relay_mode {
+    RELAY_SOCKET,
+    RELAY_RING,
+    RELAY_VHOST_USER,
+    RELAY_STREAM,
+};
+
+// Error passed to the relay completion when the peer stops relaying the
+// network before the interface is started, because it released the network or
+// disconnected. The network reference was already released by the peer.
+#define RELAY_STOPPED (-1)
+
+// Called when starting a relay completes, with the peer socket, the shared
+// memory region or -1, and 0 on success, or -1, -1, and an error code on
+// failure. The descriptors are valid only during the call.
+typedef void (^relay_completion_t)(int fd, int ring_fd, int error);
+
+// Add a switch port for the network acquired by a peer, and relay frames
+// between the switch and a new socket, a new shared memory region, or a
+// vhost-user device. Completion is called on the main queue after the port is
+// added. If the peer stops relaying before the interface is started,
+// completion is called with RELAY_STOPPED.
+void start_relay(
+    struct broker_context *ctx,
+    const char *network_name,
+    xpc_object_t serialization,
+    enum relay_mode mode,
+    relay_completion_t completion
+);
+
+// Stop relaying the named network for a peer, or all networks if network_name
+// is NULL. Called when the peer releases its last reference to the network, or
+// disconnects.
+void stop_peer_relays(struct broker_context *ctx, const char *network_name);
+
+// Capture the frames of a relayed network, writing them in pcapng format to a
+// new stream socket. Returns the peer side of the socket, or -1 and sets error
+// on failure. The caller must close the socket. The capture stops when the
+// peer closes the socket, or when the network relay stops.
+int start_capture(
+    struct broker_context *ctx,
+    const char *network_name,
+    uint32_t snaplen,
+    const char *filter,
+    int *error
+);
+
+// Add relay statistics to the stats dictionary.
+void add_relay_stats(xpc_object_t stats);
+
+#endif // BROKER_INTERFACE_H
@@ -0,0 +1,50 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_LANE_H
+#define BROKER_LANE_H
+
+#include <dispatch/dispatch.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <xpc/xpc.h>
+
+// Request lanes. Requests are classified when they are received. Cheap work,
+// such as acquiring an existing network, releasing a network, and network info,
+// runs in the fast lane as soon as its queue reaches it. Expensive work, such
+// as creating a network configuration, or dumping statistics and information
+// about all networks, is added to the slow lane of its queue, and runs one
+// block at a time behind fast work queued meanwhile.
+enum lane {
+    LANE_FAST,
+    LANE_SLOW,
+    LANE_COUNT,
+};
+
+struct slow_work;
+
+// Slow lane of a serial queue. Accessed only on the queue.
+struct slow_lane {
+    dispatch_queue_t queue;
+    struct slow_work *head;
+    struct slow_work *tail;
+    // True if a drain block is queued.
+    bool draining;
+};
+
+// Account work queued in lane. Returns the time the work was queued, to pass
+// to lane_started(). May be called on any queue.
+uint64_t lane_queued(enum lane lane);
+
+// Account work queued in lane at queued, starting to run.
+void lane_started(enum lane lane, uint64_t queued);
+
+// Add block to the slow lane. Must be called on the lane queue. Blocks run in
+// the order they were added, each in a new low priority block at the end of
+// the queue, so fast work queued before it runs first.
+void slow_lane_async(struct slow_lane *lane, dispatch_block_t block);
+
+// Add lane statistics to the stats dictionary.
+void add_lane_stats(xpc_object_t stats);
+
+#endif // BROKER_LANE_H
@@ -0,0 +1,85 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_NEIGH_H
+#define BROKER_NEIGH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Neighbor table of a relay switch, mapping IPv4 and IPv6 addresses to MAC
+// addresses, for answering ARP requests and IPv6 neighbor solicitations on
+// behalf of known hosts instead of flooding them to all ports.
+//
+// Addresses are learned from ARP requests and replies, IPv6 neighbor
+// advertisements, and DHCP acknowledgments. IPv6 addresses are not learned
+// from neighbor solicitations, since they do not tell if the sender is a
+// router, and advertising a router as a host removes it from the default
+// routers of the requester. An open addressing hash table with linear probing
+// and 32 bytes entries, aged like the forwarding database.
+//
+// Not thread safe; used only by the relay thread and under the relay lock.
+
+// Size of a reply buffer, large enough for an ARP reply or a neighbor
+// advertisement.
+#define NEIGH_REPLY_SIZE 96
+
+struct neigh_entry {
+    // IPv6 address, or IPv4 mapped IPv6 address.
+    unsigned char addr[16];
+    // The MAC address in the low 48 bits, or 0 for an empty entry.
+    uint64_t mac;
+    // Time the address was last seen, in seconds.
+    uint32_t seen;
+    // The host advertised itself as an IPv6 router.
+    bool router;
+};
+
+struct neigh {
+    struct neigh_entry *entries;
+    uint32_t mask;
+    // Number of used entries, including aged entries.
+    uint32_t count;
+    // Entries not seen for age seconds are aged.
+    uint32_t age;
+    // Number of addresses learned, and moved to another MAC address.
+    uint64_t learned;
+    uint64_t moved;
+};
+
+// Initialize a table for up to capacity addresses, rounded up to a power of 2.
+// Returns 0, or -1 and sets errno on failure.
+int neigh_init(struct neigh *n, uint32_t capacity, uint32_t age);
+
+void neigh_destroy(struct neigh *n);
+
+// Learn that addr belongs to mac at time now. Addresses are not learned if the
+// table is full of entries that did not age.
+void neigh_learn(
+    struct neigh *n,
+    const unsigned char *addr,
+    uint64_t mac,
+    bool router,
+    uint32_t now
+);
+
+// Return the entry of addr, or NULL if it is unknown or aged.
+const struct neigh_entry *
+neigh_lookup(struct neigh *n, const unsigned char *addr, uint32_t now);
+
+// Learn the addresses in a frame. If the frame is a broadcast ARP request or
+// a multicast neighbor solicitation for a known address, build the reply in
+// reply, a buffer of NEIGH_REPLY_SIZE bytes, and set *target to the MAC
+// address of the host the reply is sent for. Returns the length of the reply,
+// or 0.
+size_t neigh_input(
+    struct neigh *n,
+    const unsigned char *frame,
+    size_t len,
+    uint32_t now,
+    unsigned char *reply,
+    uint64_t *target
+);
+
+#endif // BROKER_NEIGH_H
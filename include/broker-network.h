@@ -4,23 +4,116 @@
 #ifndef BROKER_NETWORK_H
 #define BROKER_NETWORK_H
 
+#include <dispatch/dispatch.h>
+#include <stdbool.h>
+
 #include "broker-xpc.h"
 
+// The network registry is partitioned into shards, see broker-shard.h. Unless
+// noted otherwise, functions taking a network name must be called on the queue
+// of the shard owning the network, and call their completion on that queue.
+
+// Lease requested by a peer when acquiring a network. When the peer
+// disconnects without releasing the network, the network reference is kept for
+// duration_sec seconds, and a peer acquiring the network with the same token
+// reclaims it.
+struct lease_request {
+    const char *token;
+    int duration_sec;
+};
+
+// Called when acquiring a network completes, with the network serialization
+// and 0 on success, or NULL and an error code on failure. The serialization is
+// valid only during the call.
+typedef void (^acquire_completion_t)(xpc_object_t serialization, int error);
+
+// Called when releasing a network completes, with 0 on success, or an error
+// code on failure.
+typedef void (^release_completion_t)(int error);
+
+// Called with the information about all networks. The array is valid only
+// during the call.
+typedef void (^networks_completion_t)(xpc_object_t networks);
+
 // Acquire a network by name, creating it if necessary.
-// Returns a retained xpc_object_t serialization on success, or NULL on failure.
-// The caller is responsible for releasing the returned object using
-// xpc_release(). On failure, *error is set to the error code if error is not
-// NULL. Increments the network peer count; call release_network when done.
-xpc_object_t acquire_network(
-    struct broker_context *ctx, const char *network_name, int *error
+// Creating a network runs on a concurrent queue, so the shard queue is not
+// blocked while the network is created. Requests for the network are deferred
+// until the network is created, and completion may be called after this
+// function returns. If the peer disconnects before the network is created,
+// completion is called with VMNET_BROKER_INTERNAL_ERROR.
+// Increments the network peer count; call release_network when done.
+// If lease is not NULL, the peer holds the lease until it releases the network
+// or disconnects.
+void acquire_network(
+    struct broker_context *ctx,
+    const char *network_name,
+    const struct lease_request *lease,
+    acquire_completion_t completion
+);
+
+// Release one reference to a network acquired by a peer.
+// When the peer releases the last reference, the peer count of the network is
+// decremented. When no peers are using the network,
+// the network is deleted. If the network is being created, completion is called
+// after previous requests for the network complete.
+void release_network(
+    struct broker_context *ctx,
+    const char *network_name,
+    release_completion_t completion
 );
 
-// Release all networks acquired by a peer.
-// Decrements the peer count for each network.
+// Release all networks acquired by a disconnected peer.
+// Decrements the peer count for each network. Leases held by the peer are
+// retained, keeping the network until the lease expires or is reclaimed.
 // When no peers are using a network, the network is deleted.
-void release_peer_networks(struct broker_context *ctx);
+// Must be called on the main queue. The networks are released on every shard
+// queue after the peer requests queued before, and completion is called on the
+// main queue when all shards are done.
+void release_peer_networks(
+    struct broker_context *ctx, dispatch_block_t completion
+);
+
+// Return information about the named network, without acquiring or creating
+// it. Returns a retained XPC array with one dictionary on success, or NULL on
+// failure. The caller is responsible for releasing the returned object using
+// xpc_release(). On failure, *error is set to the error code if error is not
+// NULL.
+xpc_object_t copy_networks_info(
+    const struct broker_context *ctx, const char *network_name, int *error
+);
+
+// Get information about all networks. Must be called on the main queue;
+// completion is called on the main queue after all shards added their networks.
+void get_all_networks_info(networks_completion_t completion);
+
+// Return true if the network exists and requests for it are not deferred.
+bool network_ready(const char *network_name);
+
+// Return true if requests for the network are deferred until the network is
+// created.
+bool network_creating(const char *network_name);
+
+// Return the number of peers using the network, or -1 if the network does not
+// exist. Must be called on the main queue; waits for the shard queue.
+int network_peers(const char *network_name);
+
+// Return true if the peer holds references to the network.
+bool network_acquired(
+    const struct broker_context *ctx, const char *network_name
+);
+
+// Return true if leases of disconnected peers are retained. May be called on
+// any queue.
+bool has_retained_leases(void);
+
+// Create the networks likely to be acquired soon, predicted from the usage
+// history, up to precreate_budget networks. A created network is removed after
+// idle_timeout_sec seconds if no peer acquires it. Must be called on the main
+// queue; the networks are created on their shard queues.
+void precreate_networks(const struct broker_context *ctx);
 
-// Shutdown all networks in the registry.
+// Shutdown all networks in the registry. Must be called on the main queue;
+// waits for every shard queue.
 void shutdown_networks(const struct broker_context *ctx);
 
 #endif // BROKER_NETWORK_H
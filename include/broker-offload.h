@@ -0,0 +1,49 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_OFFLOAD_H
+#define BROKER_OFFLOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "broker-relay.h"
+
+// Software segmentation and checksums for frames sent by guests using
+// virtio-net offloads, when the destination cannot receive the offloads. A
+// TCP frame larger than the MTU is split to segments of gso_size bytes of
+// payload, copying the headers to every segment and fixing the IP length and
+// id, the TCP sequence number and flags, and the checksums, as the guest
+// would without offloads. The frame is never modified, since it may be
+// forwarded to other ports, or point to guest memory.
+
+// A frame parsed for segmenting.
+struct offload_frame {
+    const struct relay_frame *frame;
+    // Offsets of the IP and TCP headers, and size of all headers. Only l4 is
+    // used for frames needing only a checksum.
+    size_t l3;
+    size_t l4;
+    size_t headers;
+    // Payload bytes in every segment but the last.
+    size_t mss;
+    int segments;
+};
+
+// Return true if a port supporting offloads, as RELAY_OFFLOAD_ flags, can
+// receive the frame as is.
+bool offload_supported(const struct relay_frame *frame, int offloads);
+
+// Parse a frame needing offloads. Returns the number of segments, or 0 if the
+// frame is invalid, or a segment is larger than size bytes.
+int offload_parse(
+    const struct relay_frame *frame, size_t size, struct offload_frame *f
+);
+
+// Write segment i of a parsed frame to the buffer of segment. The segment is
+// a complete frame with valid checksums and no offloads.
+void offload_segment(
+    const struct offload_frame *f, int i, struct relay_frame *segment
+);
+
+#endif // BROKER_OFFLOAD_H
@@ -0,0 +1,47 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_PEER_H
+#define BROKER_PEER_H
+
+#include "broker-xpc.h"
+
+// Peer network ownership. Networks are opaque pointers managed by network.c.
+// The set of networks grows as needed, and all operations on a single network
+// take constant time. Networks are owned per shard; functions taking a shard
+// must be called on the shard queue.
+
+// Add a reference to a network for the peer.
+// Returns the number of peer references to the network after adding; 1 when
+// the peer acquired the network for the first time.
+int peer_add_network(struct broker_context *ctx, int shard, void *network);
+
+// Remove a reference to a network for the peer.
+// Returns the number of peer references to the network after removing; 0 when
+// the peer does not own the network anymore. Returns -1 if the peer does not
+// own the network.
+int peer_remove_network(struct broker_context *ctx, int shard, void *network);
+
+// Return the number of peer references to a network, or 0 if the peer does not
+// own the network.
+int peer_network_refs(
+    const struct broker_context *ctx, int shard, void *network
+);
+
+// Remove all networks in the shard owned by the peer, calling fn for each
+// network. The peer networks dictionary is kept for reusing the context.
+void peer_remove_all_networks(
+    struct broker_context *ctx,
+    int shard,
+    void (*fn)(struct broker_context *ctx, void *network)
+);
+
+// Release the empty networks dictionaries kept by peer_remove_all_networks().
+// Must be called before freeing a context that is not reused, when no shard
+// queue is using the context.
+void peer_free_networks(struct broker_context *ctx);
+
+// Return the number of networks in the shard owned by the peer.
+int peer_network_count(const struct broker_context *ctx, int shard);
+
+#endif // BROKER_PEER_H
@@ -0,0 +1,71 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_POLICY_H
+#define BROKER_POLICY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Access policy restricting which users, groups, and code signing identities
+// may acquire which networks. The policy does not depend on XPC, so it can be
+// tested and benchmarked on any platform.
+
+#define POLICY_PATH "/etc/vmnet-broker.d/policy"
+
+// Maximum number of groups checked for a peer.
+#define MAX_PEER_GROUPS 32
+
+// Signing identifiers must be shorter than this.
+#define SIGNING_ID_SIZE 128
+
+// Identity of a peer process, used to evaluate the policy.
+struct peer_credentials {
+    uid_t uid;
+    gid_t gid;
+    pid_t pid;
+    // Supplementary groups of the user, if the policy has group rules.
+    gid_t groups[MAX_PEER_GROUPS];
+    int ngroups;
+    // Code signing identifier, if the policy has signing identifier rules.
+    // Empty if the process is not signed.
+    char signing_id[SIGNING_ID_SIZE];
+};
+
+// Access decisions counters.
+struct policy_stats {
+    // Number of access checks.
+    uint64_t checks;
+    // Number of checks answered from the decisions cache.
+    uint64_t cache_hits;
+    // Number of checks denying access.
+    uint64_t denied;
+};
+
+// Load the policy from path, replacing the current policy and dropping cached
+// decisions. If the file does not exist, all peers may acquire all networks.
+// Returns 0 on success, or an errno value. If loading the policy failed, all
+// access is denied.
+int load_policy(const char *path);
+
+// Return true if the policy has rules matching groups or code signing
+// identifiers, and credentials must include them.
+bool policy_uses_groups(void);
+bool policy_uses_signing_id(void);
+
+// Return true if the peer may acquire the network.
+bool policy_allows(const struct peer_credentials *cred, const char *network);
+
+// Return access decisions counters.
+const struct policy_stats *policy_stats(void);
+
+// Add the supplementary groups of the credentials user. Returns 0 on success,
+// or an errno value.
+int peer_credentials_add_groups(struct peer_credentials *cred);
+
+// Get the credentials of the process connected to a unix socket. Returns 0 on
+// success, or an errno value.
+int peer_credentials_from_socket(int fd, struct peer_credentials *cred);
+
+#endif // BROKER_POLICY_H
@@ -0,0 +1,56 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_POOL_H
+#define BROKER_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed size object pool. Objects are carved from slabs allocated with
+// malloc, and freed objects are kept on a free list for reuse, so in steady
+// state allocating and freeing objects does not allocate memory. Slabs are
+// never freed; the pool size is bounded by the peak number of objects in use.
+//
+// New objects are zeroed. A freed object keeps its content when it is reused,
+// except the first pointer-sized word, which links free objects. This allows
+// keeping resources in an object for the next user.
+//
+// Pools are thread safe; network records are allocated and freed on the shard
+// queues. Allocating and freeing take the pool lock, which is not contended in
+// practice since every shard queue holds it only briefly.
+struct pool {
+    const char *name;
+    size_t object_size;
+    pthread_mutex_t lock;
+    void *free_list;
+    // Number of objects in use.
+    int in_use;
+    // Number of slabs, and the number of bytes allocated for them.
+    int slabs;
+    size_t bytes;
+    // Number of objects allocated since the broker started.
+    uint64_t allocs;
+    // Next pool with allocated slabs, for reporting stats.
+    struct pool *next;
+    bool registered;
+};
+
+#define POOL_INITIALIZER(pool_name, type)                                      \
+    {                                                                          \
+        .name = (pool_name), .object_size = sizeof(type),                      \
+        .lock = PTHREAD_MUTEX_INITIALIZER,                                     \
+    }
+
+// Allocate an object from the pool. Never fails.
+void *pool_alloc(struct pool *pool);
+
+// Return an object to the pool.
+void pool_free(struct pool *pool, void *object);
+
+// Call fn for every pool with allocated slabs, holding the pool lock.
+void pool_for_each(void (*fn)(const struct pool *pool, void *arg), void *arg);
+
+#endif // BROKER_POOL_H
@@ -0,0 +1,253 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_RELAY_H
+#define BROKER_RELAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Frame relay forwarding every frame received on one port of a link to the
+// other port. All links are served by a single thread waiting for events with
+// epoll or kqueue, and frames are received and sent in batches, using recvmmsg
+// and sendmmsg where available. The relay does not depend on XPC or vmnet, so
+// it can be tested and benchmarked on any platform.
+//
+// A link connects two endpoints, or one endpoint to a switch. A switch learns
+// the source MAC address of frames received on every port, forwards unicast
+// frames to the port where the destination was seen, and floods broadcast,
+// multicast, and unknown unicast frames to all other ports. A switch also
+// learns the IP addresses of the hosts on its ports, and answers ARP requests
+// and IPv6 neighbor solicitations for known addresses instead of flooding
+// them, see broker-neigh.h.
+//
+// A switch using traffic shaping queues the frames sent to every port, and
+// sends them at a limited rate, scheduling frames from different source ports
+// fairly, so one port sending a bulk transfer cannot starve the other ports.
+
+// Maximum number of frames received or sent in one batch.
+#define RELAY_BATCH 64
+
+// Maximum number of ports in a switch.
+#define RELAY_SWITCH_PORTS 1024
+
+// Addresses not seen for this time are forgotten, as in IEEE 802.1D.
+#define RELAY_SWITCH_AGE 300
+
+// Frame offloads, using the values of the virtio-net header.
+#define RELAY_NEEDS_CSUM 1
+#define RELAY_GSO_NONE 0
+#define RELAY_GSO_TCPV4 1
+#define RELAY_GSO_TCPV6 4
+
+// Offloads a port can receive.
+#define RELAY_OFFLOAD_CSUM (1 << 0)
+#define RELAY_OFFLOAD_TSO4 (1 << 1)
+#define RELAY_OFFLOAD_TSO6 (1 << 2)
+
+// Work left to the receiver of a frame sent by a guest using virtio-net
+// offloads, as in the virtio-net header. With RELAY_NEEDS_CSUM the checksum
+// at csum_start + csum_offset contains the sum of the pseudo header, and must
+// be completed with the bytes from csum_start to the end of the frame. A TCP
+// frame larger than the MTU must be split to segments of gso_size bytes of
+// payload. Zero for complete frames.
+struct relay_offload {
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+};
+
+// A frame buffer. When receiving, len is the buffer size, and is set to the
+// frame length. Ports using callbacks may point data to their own buffers.
+// Frames with offloads may be larger than the relay buffers.
+struct relay_frame {
+    void *data;
+    size_t len;
+    struct relay_offload offload;
+};
+
+// Port receiving and sending frames using callbacks, such as a vmnet
+// interface. The callbacks are called on the relay thread.
+struct relay_port_ops {
+    // Receive up to count frames. Returns the number of frames received, 0 if
+    // no frame is available, or -1 on error.
+    int (*recv)(void *arg, struct relay_frame *frames, int count);
+    // Send count frames. Returns the number of frames sent, or -1 on error.
+    int (*send)(void *arg, const struct relay_frame *frames, int count);
+    // Optional. Called after forwarding count frames received with recv, to
+    // release buffers owned by the port.
+    void (*done)(void *arg, int count);
+};
+
+// One side of a link: a datagram socket, a stream socket, or a port using
+// callbacks.
+struct relay_endpoint {
+    // The socket is owned by the relay, and closed when the link is removed.
+    // For a port using callbacks, an optional doorbell socket, pipe, or
+    // eventfd, readable when frames are available, or -1. The relay drains the
+    // doorbell before receiving frames.
+    int fd;
+    // The socket is a stream socket, and every frame is prefixed by its length
+    // as a 32 bits big endian integer, as QEMU stream netdev does. Frames may
+    // be received and sent in parts, so the relay keeps partial frames in
+    // buffers of the port.
+    bool stream;
+    const struct relay_port_ops *ops;
+    void *arg;
+    // Offloads the port can receive, as RELAY_OFFLOAD_ flags. Frames needing
+    // other offloads are segmented and checksummed by the relay before
+    // sending them to the port.
+    int offloads;
+};
+
+// Traffic shaping of a switch. Frames sent to every port are queued, and sent
+// at up to rate bytes per second, sending up to quantum bytes from every
+// source port in turn, see broker-shaper.h. Frames larger than the relay
+// buffers are segmented before queueing them.
+struct relay_shaping {
+    // Maximum rate of frames sent to every port, in bytes per second.
+    uint64_t rate;
+    // Bytes sent at once to a port that was idle. Queued frames may wait up
+    // to a millisecond until the relay thread wakes up, so this should be at
+    // least the bytes sent in a millisecond at rate.
+    uint32_t burst;
+    // Bytes sent from every source port in turn. Smaller values interleave
+    // the frames of different ports more finely.
+    uint32_t quantum;
+    // Maximum number of frames queued for every port.
+    int queue_len;
+};
+
+// Forwarding counters for all links, including removed links.
+struct relay_stats {
+    int links;
+    // Number of frames and bytes received.
+    uint64_t frames;
+    uint64_t bytes;
+    // Number of batches received.
+    uint64_t batches;
+    // Number of frames dropped because the destination could not accept them.
+    // A frame flooded to many ports is counted for every port dropping it.
+    uint64_t drops;
+    int switches;
+    // Number of frames switched to one port, and flooded to all ports.
+    uint64_t unicast;
+    uint64_t flooded;
+    // Number of ARP requests and neighbor solicitations answered by the
+    // switches instead of flooding them.
+    uint64_t suppressed;
+    // Number of frames segmented or checksummed by the relay, since the
+    // destination could not receive their offloads.
+    uint64_t segmented;
+    // Number of frames queued by switches using traffic shaping, and dropped
+    // since the queue was full or the port did not accept them.
+    uint64_t queued;
+    uint64_t queue_drops;
+};
+
+// Counters of one port.
+struct relay_port_stats {
+    // Number of frames and bytes received.
+    uint64_t frames;
+    uint64_t bytes;
+    // Number of frames received and dropped.
+    uint64_t drops;
+    // Number of frames and bytes sent.
+    uint64_t sent;
+    uint64_t sent_bytes;
+    // Number of frames queued for this port by a switch using traffic
+    // shaping, the largest number of frames queued, and the number of frames
+    // dropped since the queue was full or the port did not accept them.
+    int queue_len;
+    int max_queue_len;
+    uint64_t queue_drops;
+};
+
+// Called on the relay thread with every batch of frames received by the
+// ports of a switch, before forwarding them. The frames are valid only during
+// the call, and the callback must not block.
+typedef void (*relay_tap_fn)(
+    void *arg, const struct relay_frame *frames, int count
+);
+
+struct relay;
+struct relay_link;
+struct relay_switch;
+struct relay_tap;
+
+// Create a relay and start the relay thread. Frames larger than frame_size
+// are dropped, except frames with offloads received by ports using callbacks,
+// which are sent to ports without offloads in segments of up to frame_size
+// bytes. Up to batch frames are received and sent in one call, at most
+// RELAY_BATCH. Returns NULL and sets errno on failure.
+struct relay *relay_create(size_t frame_size, int batch);
+
+// Stop the relay thread, remove all links and switches, and free the relay.
+void relay_destroy(struct relay *relay);
+
+// Start forwarding frames between two endpoints. Sockets are made
+// non-blocking. Returns NULL and sets errno on failure. On failure the sockets
+// are not closed.
+struct relay_link *relay_add_link(
+    struct relay *relay,
+    const struct relay_endpoint *a,
+    const struct relay_endpoint *b
+);
+
+// Stop forwarding frames and close the link sockets. When this returns, the
+// link callbacks are not called again.
+void relay_remove_link(struct relay *relay, struct relay_link *link);
+
+// Create a switch with no ports. Returns NULL and sets errno on failure.
+struct relay_switch *relay_create_switch(struct relay *relay);
+
+// Queue frames sent to the switch ports, and send them at a limited rate with
+// fair scheduling between source ports. Must be called before adding ports.
+// Returns -1 and sets errno on failure, EINVAL if the shaping is invalid.
+int relay_set_shaping(
+    struct relay *relay,
+    struct relay_switch *sw,
+    const struct relay_shaping *shaping
+);
+
+// Free a switch. All switch links and taps must be removed before.
+void relay_destroy_switch(struct relay *relay, struct relay_switch *sw);
+
+// Add a port connecting an endpoint to a switch. Remove it with
+// relay_remove_link(). Returns NULL and sets errno on failure.
+struct relay_link *relay_add_switch_link(
+    struct relay *relay,
+    struct relay_switch *sw,
+    const struct relay_endpoint *endpoint
+);
+
+// Call fn with every batch of frames received by the ports of a switch, for
+// capturing the frames of a network. Returns NULL and sets errno on failure.
+struct relay_tap *relay_add_tap(
+    struct relay *relay, struct relay_switch *sw, relay_tap_fn fn, void *arg
+);
+
+// Remove a tap from its switch. When this returns, the tap function is not
+// called again.
+void relay_remove_tap(struct relay *relay, struct relay_tap *tap);
+
+// Notify the relay that frames are available on link ports using callbacks.
+// May be called from any thread.
+void relay_notify(struct relay *relay, struct relay_link *link);
+
+// Get the forwarding counters. May be called from any thread.
+void relay_get_stats(struct relay *relay, struct relay_stats *stats);
+
+// Get the counters of the first endpoint of a link. May be called from any
+// thread.
+void relay_get_port_stats(
+    struct relay *relay,
+    struct relay_link *link,
+    struct relay_port_stats *stats
+);
+
+#endif // BROKER_RELAY_H
@@ -0,0 +1,37 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_RING_H
+#define BROKER_RING_H
+
+#include <stdint.h>
+
+#include "broker-relay.h"
+#include "vmnet-broker-ring.h"
+
+// Broker side of the shared memory transport. A ring port is a relay port
+// using callbacks: frames received from the client are forwarded in place
+// from the client ring, and frames sent to the client are copied to the
+// broker ring. The relay link socket is the doorbell.
+
+// Create a shared memory region with two rings of slots buffers of slot_size
+// bytes. slots must be a power of 2. Returns the region file descriptor, or -1
+// and sets errno on failure.
+int ring_create(uint32_t slots, uint32_t slot_size);
+
+struct ring_port {
+    struct vmnet_broker_ring_channel channel;
+    // The doorbell socket, owned by the relay.
+    int doorbell;
+};
+
+extern const struct relay_port_ops ring_port_ops;
+
+// Map a region created by ring_create() for a ring port. Returns 0 on
+// success, or -1 and sets errno on failure.
+int ring_port_init(struct ring_port *port, int fd, int doorbell);
+
+// Unmap the region. Must be called after removing the relay link.
+void ring_port_destroy(struct ring_port *port);
+
+#endif // BROKER_RING_H
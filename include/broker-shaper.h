@@ -0,0 +1,85 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_SHAPER_H
+#define BROKER_SHAPER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "broker-relay.h"
+
+// Egress queue of a switch port using traffic shaping. Frames sent to the port
+// are copied to the queue, keeping a separate flow for every source port, and
+// dequeued by a deficit round robin scheduler, sending up to quantum bytes
+// from every flow in turn, so a bulk sender cannot delay the frames of other
+// senders. A token bucket limits the rate of frames dequeued. When the queue
+// is full, the oldest frame of the longest flow is dropped, so a bulk sender
+// filling the queue does not cause drops for other senders.
+//
+// Not thread safe; used only by the relay thread and under the relay lock.
+
+struct shaper {
+    struct relay_shaping config;
+    size_t frame_size;
+    // Frame buffers and frames by slot, and the next slot of the same flow,
+    // or the next free slot.
+    unsigned char *buffers;
+    struct relay_frame *frames;
+    int32_t *next;
+    int32_t free;
+    // First and last slot, number of frames, and deficit in bytes of every
+    // flow, by source port index.
+    int32_t *first;
+    int32_t *last;
+    int32_t *count;
+    int64_t *deficit;
+    // Flows with frames, in the scheduler order, as a ring of port indexes.
+    // A flow may stay in the ring after its frames were dropped.
+    uint16_t *active;
+    bool *is_active;
+    int active_head;
+    int active_count;
+    // Bytes that can be sent now, negative after sending a frame larger than
+    // the tokens left, and the time tokens were added in nanoseconds.
+    int64_t tokens;
+    uint64_t updated;
+    // Number of queued frames, and the largest number of queued frames.
+    int len;
+    int max_len;
+    // Number of frames queued, and dropped because the queue was full.
+    uint64_t queued;
+    uint64_t drops;
+};
+
+// Check a shaping configuration. Returns 0, or -1 and sets errno to EINVAL if
+// the configuration is invalid.
+int shaper_check(const struct relay_shaping *config);
+
+// Initialize a queue of config->queue_len frames of up to frame_size bytes.
+// Returns 0, or -1 and sets errno on failure.
+int shaper_init(
+    struct shaper *s, const struct relay_shaping *config, size_t frame_size
+);
+
+void shaper_destroy(struct shaper *s);
+
+// Copy a frame from source port flow to the queue. The frame must not be
+// larger than frame_size. Returns false if the frame was dropped.
+bool shaper_enqueue(
+    struct shaper *s, int flow, const struct relay_frame *frame
+);
+
+// Dequeue up to count frames that can be sent at time now, in nanoseconds.
+// The frames point to the queue buffers, valid until the next call to
+// shaper_enqueue(). Returns the number of frames dequeued.
+int shaper_dequeue(
+    struct shaper *s, uint64_t now, struct relay_frame *frames, int count
+);
+
+// Return the time in nanoseconds until frames can be dequeued, 0 if frames
+// can be dequeued now, or -1 if the queue is empty.
+int64_t shaper_delay(const struct shaper *s, uint64_t now);
+
+#endif // BROKER_SHAPER_H
@@ -0,0 +1,47 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_SHARD_H
+#define BROKER_SHARD_H
+
+#include <dispatch/dispatch.h>
+#include <xpc/xpc.h>
+
+// Networks are partitioned by name into shards, each with a serial queue. The
+// state of the networks in a shard, including their timers, is accessed only on
+// the shard queue, so requests for networks in different shards run in
+// parallel, while requests for the same network run in the order they were
+// received.
+//
+// Peer connections target the main queue, which validates requests and routes
+// network requests to the shard owning the network. Shard queues never wait for
+// the main queue, so the main queue may wait for a shard queue.
+
+// Number of shards.
+#define SHARD_COUNT 8
+
+// Create the shard queues. Must be called before routing requests.
+void start_shards(void);
+
+// Return the shard owning the named network.
+int shard_for_network(const char *network_name);
+
+// Return the shard queue, for timers of networks in the shard.
+dispatch_queue_t shard_queue(int shard);
+
+// Run block on the shard queue in the fast lane, accounting the time the block
+// waited and ran.
+void shard_async(int shard, dispatch_block_t block);
+
+// Like shard_async(), associating the block with group.
+void shard_group_async(
+    int shard, dispatch_group_t group, dispatch_block_t block
+);
+
+// Add block to the shard slow lane. Must be called on the shard queue.
+void shard_slow_async(int shard, dispatch_block_t block);
+
+// Add shard statistics to the stats dictionary.
+void add_shard_stats(xpc_object_t stats);
+
+#endif // BROKER_SHARD_H
@@ -0,0 +1,33 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_STATS_H
+#define BROKER_STATS_H
+
+#include <stdint.h>
+#include <xpc/xpc.h>
+
+// Request latency classes. Requests are accounted by whether they complete
+// immediately, such as acquiring an existing network, or are deferred until a
+// network is created. Requests for a network run on the network shard queue in
+// the order they are received; the classes only separate their latency
+// statistics. Latency may be accounted on any queue.
+enum latency {
+    LATENCY_IMMEDIATE,
+    LATENCY_DEFERRED,
+    LATENCY_COUNT,
+};
+
+// Start accounting the latency of a request.
+// Returns the start time, to pass to latency_end() when the request completes.
+uint64_t latency_begin(enum latency latency);
+
+// Account the latency of a completed request.
+void latency_end(enum latency latency, uint64_t start);
+
+// Return the broker statistics.
+// Returns a retained XPC dictionary. The caller is responsible for releasing
+// the returned object using xpc_release().
+xpc_object_t copy_stats(void);
+
+#endif // BROKER_STATS_H
@@ -0,0 +1,45 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_SUBNETS_H
+#define BROKER_SUBNETS_H
+
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <xpc/xpc.h>
+
+struct broker_context;
+struct network_info;
+
+// IPv4 subnet assigned to a network.
+struct subnet {
+    char subnet[INET_ADDRSTRLEN];
+    char mask[INET_ADDRSTRLEN];
+};
+
+// Subnets assigned to networks with dynamic subnets, saved when a network is
+// created with a new subnet and loaded when the broker starts. Used to request
+// the same subnet when the network is created again, so guests keep their
+// addresses. The subnets may be used on any queue.
+
+// Load the subnets saved by previous broker runs.
+void load_subnets(const struct broker_context *ctx);
+
+// Copy to subnet the subnet assigned to the network when it was last created.
+// Returns false if the network was not created before.
+bool last_subnet(const char *name, struct subnet *subnet);
+
+// Remember the subnet assigned to the network, saving the subnets if the
+// subnet has changed. requested is the subnet requested when creating the
+// network, or NULL if the subnet was allocated dynamically.
+void remember_subnet(
+    const struct broker_context *ctx,
+    const char *name,
+    const struct subnet *requested,
+    const struct network_info *info
+);
+
+// Add sticky subnet statistics to the stats dictionary.
+void add_subnet_stats(xpc_object_t stats);
+
+#endif // BROKER_SUBNETS_H
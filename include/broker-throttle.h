@@ -0,0 +1,44 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_THROTTLE_H
+#define BROKER_THROTTLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xpc/xpc.h>
+
+struct broker_context;
+
+// Peer admission state, embedded in the peer context. A zeroed struct is a
+// peer with a full token bucket.
+struct throttle {
+    // Token bucket: available tokens, and the time the bucket was updated in
+    // nanoseconds, or 0 if the peer did not send any request yet.
+    double tokens;
+    uint64_t updated;
+    // Number of requests rejected because the peer exceeded the request rate.
+    uint64_t throttled;
+    // True if the last request was rejected.
+    bool limited;
+    // Next peer in the throttled peers list.
+    struct broker_context *next;
+};
+
+// Admit a request from a peer.
+// Returns 0 if the request is admitted, or the time in milliseconds until the
+// peer may retry if the peer exceeded the request rate.
+int throttle_request(struct broker_context *ctx);
+
+// Account an acquire request rejected because too many networks are created.
+// Returns the time in milliseconds until the peer may retry. May be called on
+// any queue.
+int throttle_create(struct broker_context *ctx);
+
+// Forget a disconnected peer.
+void throttle_peer_disconnect(struct broker_context *ctx);
+
+// Add throttling counters to the broker stats dictionary.
+void add_throttle_stats(xpc_object_t stats);
+
+#endif // BROKER_THROTTLE_H
@@ -0,0 +1,67 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_VHOST_USER_H
+#define BROKER_VHOST_USER_H
+
+#include "broker-relay.h"
+
+// vhost-user backend of a virtio-net device, so QEMU can exchange frames with
+// the relay using virtqueues in guest memory shared with the broker. The
+// device handles the vhost-user messages received on a connected stream
+// socket. When both virtqueues are running the device is a relay port using
+// vhost_user_port_ops: frames sent by the guest are forwarded in place from
+// guest memory, and frames sent to the guest are copied directly to the guest
+// buffers.
+//
+// Messages are handled on one thread, and the port callbacks are called on
+// the relay thread. The device stops the port before changing the memory
+// table or the virtqueues, so the port callbacks never see them changing.
+//
+// The guest memory is not trusted: descriptors are copied before using them,
+// and every address is checked against the memory table.
+//
+// Checksum and TCP segmentation offloads are offered in both directions.
+// Frames sent by the guest carry the offloads of the virtio-net header, and
+// the relay sends frames needing offloads to the guest only if the guest
+// negotiated them.
+
+struct vhost_user_dev;
+
+// Called when handling messages.
+struct vhost_user_ops {
+    // Both virtqueues started running. Add the port to the relay, using
+    // vhost_user_doorbell() as the doorbell.
+    void (*start)(void *arg, struct vhost_user_dev *dev);
+    // The virtqueues are about to change. Remove the port from the relay.
+    void (*stop)(void *arg, struct vhost_user_dev *dev);
+};
+
+// Port callbacks, using the device as the argument.
+extern const struct relay_port_ops vhost_user_port_ops;
+
+// Create a device handling messages received on a connected stream socket.
+// The socket is not owned by the device, but is made non-blocking. Returns
+// NULL and sets errno on failure.
+struct vhost_user_dev *vhost_user_create(
+    int fd, const struct vhost_user_ops *ops, void *arg
+);
+
+// Stop the device, unmap the guest memory, and free the device.
+void vhost_user_destroy(struct vhost_user_dev *dev);
+
+// Call when the socket is readable to receive the available bytes of the next
+// message, and handle it when it is complete. A partial message is kept until
+// the rest is received. Returns 0 on success, or -1 and sets errno if the
+// client disconnected (ECONNRESET), or sent an invalid or unsupported message.
+int vhost_user_handle(struct vhost_user_dev *dev);
+
+// Return the offloads the guest can receive, as RELAY_OFFLOAD_ flags, for the
+// offloads of the relay endpoint. Call when the device starts running.
+int vhost_user_offloads(struct vhost_user_dev *dev);
+
+// Return a new descriptor of the transmit virtqueue kick, readable when the
+// guest sends frames, or -1 and sets errno on failure.
+int vhost_user_doorbell(struct vhost_user_dev *dev);
+
+#endif // BROKER_VHOST_USER_H
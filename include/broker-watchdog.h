@@ -0,0 +1,39 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BROKER_WATCHDOG_H
+#define BROKER_WATCHDOG_H
+
+#include <stdint.h>
+#include <xpc/xpc.h>
+
+// Main queue handlers watched for stalls.
+enum handler {
+    HANDLER_REQUEST,
+    HANDLER_CONNECT,
+    HANDLER_DISCONNECT,
+    HANDLER_TIMER,
+    HANDLER_COUNT,
+};
+
+// Start watching a main queue handler. Returns the start time, to pass to
+// watch_end().
+uint64_t watch_begin(enum handler handler);
+
+// Finish watching a handler. If the handler ran longer than the stall budget,
+// record it with the peer name, command, and network name, which may be NULL.
+void watch_end(
+    enum handler handler,
+    uint64_t start,
+    const char *peer,
+    const char *command,
+    const char *network
+);
+
+// Start checking from another queue if the main queue is blocked.
+void start_watchdog(void);
+
+// Add stall statistics and traces to the stats dictionary.
+void add_watchdog_stats(xpc_object_t stats);
+
+#endif // BROKER_WATCHDOG_H
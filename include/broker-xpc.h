@@ -4,20 +4,35 @@
 #ifndef BROKER_XPC_H
 #define BROKER_XPC_H
 
+#include <CoreFoundation/CoreFoundation.h>
 #include <xpc/xpc.h>
 
-// Maximum number of networks a single peer can acquire
-#define MAX_PEER_NETWORKS 8
+#include "broker-policy.h"
+#include "broker-shard.h"
+#include "broker-throttle.h"
 
 // Context structure managed by XPC layer
-// Allocated on stack in handle_connection and captured by the event handler
+// Allocated from a pool in handle_connection and captured by the event handler
 // block
 struct broker_context {
     xpc_connection_t connection;
     char name[sizeof("peer 9223372036854775807")];
-    // Networks acquired by this peer (opaque pointers managed by network.c)
-    void *networks[MAX_PEER_NETWORKS];
-    int network_count;
+    // Protocol version negotiated by the peer.
+    int version;
+    // Networks acquired by this peer in each shard, managed by peer.c. Created
+    // when the peer acquires the first network in the shard, and accessed only
+    // on the shard queue.
+    CFMutableDictionaryRef networks[SHARD_COUNT];
+    // Events subscription, managed by events.c. NULL if the peer is not
+    // subscribed.
+    struct subscriber *subscriber;
+    // Request admission state, managed by throttle.c.
+    struct throttle throttle;
+    // Peer identity, used to check the access policy.
+    struct peer_credentials credentials;
+    // True after the peer disconnected, until the context is released.
+    // Accessed only on the main queue.
+    bool disconnected;
 };
 
 // Broker operations interface - called by XPC layer when events occur
@@ -28,6 +43,8 @@ struct broker_ops {
     void (*on_peer_connect)(struct broker_context *ctx);
 
     // Called when a peer disconnects
+    // Requests of the peer may still run on shard queues, so the context is
+    // valid until the broker calls release_context().
     void (*on_peer_disconnect)(struct broker_context *ctx);
 
     // Called when a peer sends a request
@@ -40,12 +57,19 @@ int start_xpc_listener(
     const struct broker_context *ctx, const struct broker_ops *ops
 );
 
+// Return the context of a disconnected peer to the pool. Must be called on the
+// main queue.
+void release_context(struct broker_context *ctx);
+
 // XPC protocol helpers for sending replies
 // Send an error reply to a peer
 void send_xpc_error(
     const struct broker_context *ctx, xpc_object_t event, int code
 );
 
+// Send a successful reply without a payload to a peer
+void send_xpc_success(const struct broker_context *ctx, xpc_object_t event);
+
 // Send a network serialization reply to a peer
 void send_xpc_network(
     const struct broker_context *ctx,
@@ -54,4 +78,43 @@ void send_xpc_network(
     xpc_object_t network_serialization
 );
 
+// Send a relay socket reply to a peer, with the shared memory region if
+// ring_fd is not -1
+void send_xpc_relay(
+    const struct broker_context *ctx,
+    xpc_object_t event,
+    const char *network_name,
+    int fd,
+    int ring_fd
+);
+
+// Send a capture socket reply to a peer
+void send_xpc_capture(
+    const struct broker_context *ctx,
+    xpc_object_t event,
+    const char *network_name,
+    int fd
+);
+
+// Send a networks info reply to a peer
+void send_xpc_networks(
+    const struct broker_context *ctx, xpc_object_t event, xpc_object_t networks
+);
+
+// Send a busy error reply to a peer, with the time in milliseconds until the
+// peer may retry
+void send_xpc_busy(
+    const struct broker_context *ctx, xpc_object_t event, int retry_after_ms
+);
+
+// Send a hello reply with the negotiated protocol version to a peer
+void send_xpc_version(
+    const struct broker_context *ctx, xpc_object_t event, int version
+);
+
+// Send a broker stats reply to a peer
+void send_xpc_stats(
+    const struct broker_context *ctx, xpc_object_t event, xpc_object_t stats
+);
+
 #endif // BROKER_XPC_H
@@ -0,0 +1,332 @@
+// SPDX-FileCopyrightText: The vmnet-broker authors
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef VMNET_BROKER_RING_H
+#define VMNET_BROKER_RING_H
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*!
+ * @header vmnet-broker-ring.h
+ *
+ * @discussion
+ * Shared memory transport for relayed frames. The region returned by
+ * `vmnet_broker_acquire_ring` contains two single producer, single consumer
+ * rings: one for frames sent by the client to the broker, and one for frames
+ * sent by the broker to the client. Every ring has a fixed number of slots, and
+ * every slot owns a buffer in the region, so frames are exchanged without
+ * system calls.
+ *
+ * The producer writes frames into reserved slots, and publishes them. When
+ * `vmnet_broker_ring_publish` returns true the ring was empty, and the consumer
+ * may be waiting, so the producer must ring the doorbell by sending one byte to
+ * the doorbell socket. The consumer waits until the doorbell socket is
+ * readable, drains it, and receives frames until
+ * `vmnet_broker_ring_available` returns 0.
+ *
+ * The functions are inline so clients do not need another library. They
+ * require C11 atomics.
+ */
+
+#define VMNET_BROKER_RING_MAGIC 0x676e6972
+#define VMNET_BROKER_RING_VERSION 1
+
+// Sides of the region. The ring of a side contains the frames sent by the
+// side.
+#define VMNET_BROKER_RING_CLIENT 0
+#define VMNET_BROKER_RING_BROKER 1
+
+// Alignment of the ring indexes, the cache line size on Apple silicon. The
+// producer and consumer indexes are in different cache lines, so updating one
+// does not invalidate the other.
+#define VMNET_BROKER_RING_ALIGN 128
+
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2, "ring indexes must be lock free");
+
+// The header at the start of the region. Written once when the region is
+// created.
+struct vmnet_broker_ring_header {
+    uint32_t magic;
+    uint32_t version;
+    // Number of slots in every ring, a power of 2.
+    uint32_t slots;
+    // Size of the buffer of every slot.
+    uint32_t slot_size;
+    // Size of the region.
+    uint64_t size;
+    // Offset of the ring of every side.
+    uint64_t offsets[2];
+};
+
+// The shared indexes of a ring, followed by the frame lengths and the slot
+// buffers. The indexes are free running, and the slot of an index is the index
+// modulo the number of slots.
+struct vmnet_broker_ring_indexes {
+    // Next slot published by the producer.
+    _Alignas(VMNET_BROKER_RING_ALIGN) _Atomic uint32_t tail;
+    // Next slot released by the consumer.
+    _Alignas(VMNET_BROKER_RING_ALIGN) _Atomic uint32_t head;
+};
+
+// One side of a ring, private to the process.
+struct vmnet_broker_ring {
+    struct vmnet_broker_ring_indexes *indexes;
+    uint32_t *lens;
+    unsigned char *buffers;
+    uint32_t mask;
+    uint32_t slot_size;
+    // Producer: next slot to write. Consumer: next slot to read.
+    uint32_t next;
+    // Producer: last head seen. Consumer: last tail seen. Avoids reading the
+    // cache line of the other side for every frame.
+    uint32_t cached;
+    // Producer: last tail published.
+    uint32_t published;
+};
+
+// A mapped region.
+struct vmnet_broker_ring_channel {
+    void *base;
+    size_t size;
+    // Frames sent to the other side.
+    struct vmnet_broker_ring tx;
+    // Frames received from the other side.
+    struct vmnet_broker_ring rx;
+};
+
+static inline uint64_t vmnet_broker_ring_align(uint64_t n) {
+    uint64_t mask = VMNET_BROKER_RING_ALIGN - 1;
+    return (n + mask) & ~mask;
+}
+
+// Size of one ring with its frame lengths and buffers.
+static inline uint64_t
+vmnet_broker_ring_size(uint32_t slots, uint32_t slot_size) {
+    return sizeof(struct vmnet_broker_ring_indexes) +
+           vmnet_broker_ring_align((uint64_t)slots * sizeof(uint32_t)) +
+           vmnet_broker_ring_align((uint64_t)slots * slot_size);
+}
+
+static inline bool vmnet_broker_ring_valid(
+    const struct vmnet_broker_ring_header *header, uint64_t size
+) {
+    if (header->magic != VMNET_BROKER_RING_MAGIC ||
+        header->version != VMNET_BROKER_RING_VERSION ||
+        header->size != size) {
+        return false;
+    }
+    if (header->slots == 0 || (header->slots & (header->slots - 1)) ||
+        header->slot_size == 0) {
+        return false;
+    }
+    uint64_t ring_size = vmnet_broker_ring_size(
+        header->slots, header->slot_size
+    );
+    for (int i = 0; i < 2; i++) {
+        uint64_t offset = header->offsets[i];
+        if (offset % VMNET_BROKER_RING_ALIGN || offset > size ||
+            ring_size > size - offset) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline void vmnet_broker_ring_init(
+    struct vmnet_broker_ring *ring,
+    const struct vmnet_broker_ring_header *header,
+    unsigned char *base,
+    int side,
+    bool producer
+) {
+    unsigned char *p = base + header->offsets[side];
+    ring->indexes = (struct vmnet_broker_ring_indexes *)p;
+    p += sizeof(struct vmnet_broker_ring_indexes);
+    ring->lens = (uint32_t *)p;
+    p += vmnet_broker_ring_align((uint64_t)header->slots * sizeof(uint32_t));
+    ring->buffers = p;
+    ring->mask = header->slots - 1;
+    ring->slot_size = header->slot_size;
+    uint32_t tail = atomic_load_explicit(
+        &ring->indexes->tail, memory_order_acquire
+    );
+    uint32_t head = atomic_load_explicit(
+        &ring->indexes->head, memory_order_acquire
+    );
+    ring->next = producer ? tail : head;
+    ring->cached = producer ? head : tail;
+    ring->published = tail;
+}
+
+/*!
+ * @function vmnet_broker_ring_map
+ *
+ * @abstract
+ * Map a region returned by `vmnet_broker_acquire_ring`.
+ *
+ * @param fd
+ * The region file descriptor. The caller may close it after mapping.
+ *
+ * @param side
+ * `VMNET_BROKER_RING_CLIENT` for clients.
+ *
+ * @param channel
+ * Set to the mapped rings on success.
+ *
+ * @result
+ * 0 on success, or -1 and errno on failure.
+ */
+static inline int vmnet_broker_ring_map(
+    int fd, int side, struct vmnet_broker_ring_channel *channel
+) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    if ((uint64_t)st.st_size < sizeof(struct vmnet_broker_ring_header)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *base = mmap(
+        NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+    );
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+
+    // Copy the header, since the other side may modify the region.
+    const struct vmnet_broker_ring_header *shared = base;
+    struct vmnet_broker_ring_header header = *shared;
+    if (!vmnet_broker_ring_valid(&header, st.st_size)) {
+        munmap(base, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    channel->base = base;
+    channel->size = st.st_size;
+    vmnet_broker_ring_init(&channel->tx, &header, base, side, true);
+    vmnet_broker_ring_init(&channel->rx, &header, base, !side, false);
+    return 0;
+}
+
+static inline void
+vmnet_broker_ring_unmap(struct vmnet_broker_ring_channel *channel) {
+    munmap(channel->base, channel->size);
+    channel->base = NULL;
+}
+
+// MARK: - Producer
+
+/*!
+ * @function vmnet_broker_ring_reserve
+ *
+ * @abstract
+ * Return the buffer of the next free slot, or NULL if the ring is full. The
+ * buffer size is the ring slot size. Call `vmnet_broker_ring_commit` after
+ * writing the frame.
+ */
+static inline void *vmnet_broker_ring_reserve(struct vmnet_broker_ring *ring) {
+    if (ring->next - ring->cached > ring->mask) {
+        ring->cached = atomic_load_explicit(
+            &ring->indexes->head, memory_order_acquire
+        );
+        if (ring->next - ring->cached > ring->mask) {
+            return NULL;
+        }
+    }
+    return ring->buffers + (size_t)(ring->next & ring->mask) * ring->slot_size;
+}
+
+// Commit the frame written to the reserved buffer. The frame is not visible to
+// the consumer before publishing.
+static inline void
+vmnet_broker_ring_commit(struct vmnet_broker_ring *ring, uint32_t len) {
+    ring->lens[ring->next & ring->mask] = len;
+    ring->next++;
+}
+
+/*!
+ * @function vmnet_broker_ring_publish
+ *
+ * @abstract
+ * Make committed frames visible to the consumer.
+ *
+ * @result
+ * True if the ring was empty, and the doorbell must be rung.
+ */
+static inline bool vmnet_broker_ring_publish(struct vmnet_broker_ring *ring) {
+    uint32_t tail = ring->published;
+    if (tail == ring->next) {
+        return false;
+    }
+    ring->published = ring->next;
+    atomic_store_explicit(
+        &ring->indexes->tail, ring->next, memory_order_release
+    );
+    // Pairs with the fence in vmnet_broker_ring_available(): either the
+    // consumer sees the new tail, or we see that it consumed everything.
+    atomic_thread_fence(memory_order_seq_cst);
+    ring->cached = atomic_load_explicit(
+        &ring->indexes->head, memory_order_acquire
+    );
+    return ring->cached == tail;
+}
+
+// MARK: - Consumer
+
+/*!
+ * @function vmnet_broker_ring_available
+ *
+ * @abstract
+ * Return the number of frames available for reading. When this returns 0
+ * after releasing all frames, the producer will ring the doorbell when
+ * publishing the next frame.
+ */
+static inline uint32_t
+vmnet_broker_ring_available(struct vmnet_broker_ring *ring) {
+    if (ring->cached == ring->next) {
+        atomic_thread_fence(memory_order_seq_cst);
+        ring->cached = atomic_load_explicit(
+            &ring->indexes->tail, memory_order_acquire
+        );
+    }
+    uint32_t count = ring->cached - ring->next;
+    // The producer may be broken.
+    return count > ring->mask + 1 ? ring->mask + 1 : count;
+}
+
+/*!
+ * @function vmnet_broker_ring_frame
+ *
+ * @abstract
+ * Return frame i of the available frames, and set len to the frame length.
+ * The frame is valid until it is released. Frames with an invalid length are
+ * returned with len 0.
+ */
+static inline void *vmnet_broker_ring_frame(
+    struct vmnet_broker_ring *ring, uint32_t i, size_t *len
+) {
+    uint32_t slot = (ring->next + i) & ring->mask;
+    uint32_t n = ring->lens[slot];
+    *len = n <= ring->slot_size ? n : 0;
+    return ring->buffers + (size_t)slot * ring->slot_size;
+}
+
+// Release count frames, returning their slots to the producer.
+static inline void
+vmnet_broker_ring_release(struct vmnet_broker_ring *ring, uint32_t count) {
+    ring->next += count;
+    atomic_store_explicit(
+        &ring->indexes->head, ring->next, memory_order_release
+    );
+}
+
+#endif // VMNET_BROKER_RING_H
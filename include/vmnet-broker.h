@@ -9,16 +9,189 @@
 // The broker Mach service name.
 #define MACH_SERVICE_NAME "com.github.nirs.vmnet-broker"
 
+// Protocol versions. Clients use protocol version 1 unless they negotiate a
+// newer version with a hello request.
+#define PROTOCOL_VERSION_1 1
+#define PROTOCOL_VERSION_2 2
+#define PROTOCOL_VERSION PROTOCOL_VERSION_2
+
 // Request keys.
 #define REQUEST_COMMAND "command"
+#define REQUEST_VERSION "version"
+#define REQUEST_OPCODE "opcode"
+#define REQUEST_ID "request_id"
 #define REQUEST_NETWORK_NAME "network_name"
+#define REQUEST_LEASE_TOKEN "lease_token"
+#define REQUEST_LEASE_DURATION "lease_duration"
+#define REQUEST_RELAY "relay"
+#define REQUEST_RING "ring"
+#define REQUEST_VHOST_USER "vhost_user"
+#define REQUEST_STREAM "stream"
+#define REQUEST_SNAPLEN "snaplen"
+#define REQUEST_FILTER "filter"
+
+// Maximum lease duration in seconds.
+#define MAX_LEASE_DURATION 3600
 
 // Request commands.
+#define COMMAND_HELLO "hello"
 #define COMMAND_ACQUIRE "acquire"
+#define COMMAND_RELEASE "release"
+#define COMMAND_SUBSCRIBE "subscribe"
+#define COMMAND_INFO "info"
+#define COMMAND_STATS "stats"
+#define COMMAND_CAPTURE "capture"
+
+// Request opcodes, used instead of commands in protocol version 2.
+#define OPCODE_HELLO 1
+#define OPCODE_ACQUIRE 2
+#define OPCODE_RELEASE 3
+#define OPCODE_SUBSCRIBE 4
+#define OPCODE_INFO 5
+#define OPCODE_STATS 6
+#define OPCODE_CAPTURE 7
 
 // Reply keys
 #define REPLY_NETWORK "network"
+#define REPLY_NETWORKS "networks"
+#define REPLY_STATS "stats"
 #define REPLY_ERROR "error"
+#define REPLY_RETRY_AFTER "retry_after"
+#define REPLY_VERSION "version"
+#define REPLY_ID "request_id"
+#define REPLY_RELAY_FD "relay_fd"
+#define REPLY_RING_FD "ring_fd"
+#define REPLY_CAPTURE_FD "capture_fd"
+
+// Network state keys, used in events and info replies.
+#define NETWORK_NAME "network_name"
+#define NETWORK_PEERS "peers"
+#define NETWORK_SUBNET "subnet"
+#define NETWORK_MASK "mask"
+#define NETWORK_IPV6_PREFIX "ipv6_prefix"
+#define NETWORK_PREFIX_LEN "prefix_len"
+#define NETWORK_MODE "mode"
+#define NETWORK_AGE "age"
+#define NETWORK_EXISTS "exists"
+
+// Event keys.
+#define EVENT_TYPE "event"
+#define EVENT_DROPPED "dropped"
+#define EVENT_NETWORKS "networks"
+
+// Event types.
+#define EVENT_CREATED "created"
+#define EVENT_ACQUIRED "acquired"
+#define EVENT_RELEASED "released"
+#define EVENT_IDLE "idle"
+#define EVENT_REMOVED "removed"
+#define EVENT_CATCH_UP "catch_up"
+
+// Stats keys.
+#define STATS_LATENCY "latency"
+#define STATS_THROTTLED "throttled"
+#define STATS_BUSY_CREATES "busy_creates"
+#define STATS_THROTTLED_PEERS "throttled_peers"
+#define STATS_MEMORY "memory"
+#define STATS_POOLS "pools"
+#define STATS_PREDICTION "prediction"
+#define STATS_STICKY_SUBNETS "sticky_subnets"
+#define STATS_POLICY "policy"
+#define STATS_WATCHDOG "watchdog"
+#define STATS_RELAY "relay"
+#define STATS_SHARDS "shards"
+#define STATS_LANES "lanes"
+
+// Stats latency classes.
+#define STATS_LATENCY_IMMEDIATE "immediate"
+#define STATS_LATENCY_DEFERRED "deferred"
+
+// Stats latency keys.
+#define LATENCY_REQUESTS "requests"
+#define LATENCY_PENDING "pending"
+#define LATENCY_MAX_PENDING "max_pending"
+#define LATENCY_WAIT_USEC "wait_usec"
+#define LATENCY_MAX_WAIT_USEC "max_wait_usec"
+
+// Stats lanes.
+#define STATS_LANE_FAST "fast"
+#define STATS_LANE_SLOW "slow"
+
+// Stats lane keys.
+#define LANE_QUEUED "queued"
+#define LANE_DEPTH "depth"
+#define LANE_MAX_DEPTH "max_depth"
+#define LANE_WAIT_USEC "wait_usec"
+#define LANE_MAX_WAIT_USEC "max_wait_usec"
+
+// Stats peer keys.
+#define PEER_NAME "peer"
+#define PEER_THROTTLED "throttled"
+
+// Stats memory keys.
+#define MEMORY_RSS "rss"
+#define MEMORY_MALLOC_BLOCKS "malloc_blocks"
+#define MEMORY_MALLOC_BYTES "malloc_bytes"
+
+// Stats pool keys.
+#define POOL_IN_USE "in_use"
+#define POOL_ALLOCS "allocs"
+#define POOL_SLABS "slabs"
+#define POOL_BYTES "bytes"
+
+// Stats prediction keys.
+#define PREDICTION_PREDICTED "predicted"
+#define PREDICTION_HITS "hits"
+#define PREDICTION_MISSES "misses"
+
+// Stats sticky subnets keys.
+#define STICKY_HONORED "honored"
+#define STICKY_CONFLICTS "conflicts"
+
+// Stats policy keys.
+#define POLICY_CHECKS "checks"
+#define POLICY_CACHE_HITS "cache_hits"
+#define POLICY_DENIED "denied"
+
+// Stats watchdog keys.
+#define WATCHDOG_BUDGET_MSEC "budget_msec"
+#define WATCHDOG_BLOCKED "blocked"
+#define WATCHDOG_STALLS "stalls"
+#define WATCHDOG_HANDLED "handled"
+#define WATCHDOG_BUSY_USEC "busy_usec"
+#define WATCHDOG_RECENT "recent"
+#define WATCHDOG_SLOWEST "slowest"
+
+// Stats shard keys.
+#define SHARD_HANDLED "handled"
+#define SHARD_PENDING "pending"
+#define SHARD_WAIT_USEC "wait_usec"
+#define SHARD_BUSY_USEC "busy_usec"
+
+// Stats watchdog trace keys.
+#define TRACE_HANDLER "handler"
+#define TRACE_TIME "time"
+#define TRACE_DURATION_USEC "duration_usec"
+#define TRACE_PEER "peer"
+#define TRACE_COMMAND "command"
+#define TRACE_NETWORK "network"
+
+// Stats relay keys.
+#define RELAY_LINKS "links"
+#define RELAY_FRAMES "frames"
+#define RELAY_BYTES "bytes"
+#define RELAY_BATCHES "batches"
+#define RELAY_DROPS "drops"
+#define RELAY_SWITCHES "switches"
+#define RELAY_UNICAST "unicast"
+#define RELAY_FLOODED "flooded"
+#define RELAY_SUPPRESSED "suppressed"
+#define RELAY_SEGMENTED "segmented"
+#define RELAY_CAPTURES "captures"
+#define RELAY_CAPTURED "captured"
+#define RELAY_CAPTURE_DROPS "capture_drops"
+#define RELAY_QUEUED "queued"
+#define RELAY_QUEUE_DROPS "queue_drops"
 
 // Status codes
 
@@ -39,7 +212,11 @@ typedef enum {
     // Broker failed to create the requested network.
     VMNET_BROKER_CREATE_FAILURE = 6,
     // Internal or unknown error.
-    VMNET_BROKER_INTERNAL_ERROR = 7
+    VMNET_BROKER_INTERNAL_ERROR = 7,
+    // Broker is busy; the client sent too many requests, or too many networks
+    // are being created. The client library retries busy requests for up to 5
+    // seconds before returning this status.
+    VMNET_BROKER_BUSY = 8
 } vmnet_broker_return_t;
 
 /*!
@@ -73,6 +250,407 @@ xpc_object_t _Nullable vmnet_broker_acquire_network(
     const char *_Nonnull network_name, vmnet_broker_return_t *_Nullable status
 );
 
+/*!
+ * @function vmnet_broker_acquire_network_with_lease
+ *
+ * @abstract
+ * Acquires a shared lock on a configured network like
+ * `vmnet_broker_acquire_network`, keeping the network after this process
+ * terminates for the lease duration.
+ *
+ * @discussion
+ * When the process terminates without releasing the network, the broker keeps
+ * the network for `lease_duration` seconds. If a process acquires the network
+ * with the same `lease_token` before the lease expires, it gets the same
+ * network instead of a new network with a different subnet. This allows a VM
+ * launcher to restart without disrupting running VMs.
+ *
+ * Releasing the network with `vmnet_broker_release_network` ends the lease.
+ *
+ * @param network_name
+ * The name of the network as defined in the broker configuration.
+ *
+ * @param lease_token
+ * A token chosen by the caller, identifying the lease for this network. Must be
+ * the same when acquiring the network after restarting.
+ *
+ * @param lease_duration
+ * Number of seconds to keep the network after this process terminates, between
+ * 1 and `MAX_LEASE_DURATION`.
+ *
+ * @param status
+ * Optional output parameter. On return, contains the status of the operation.
+ *
+ * @result
+ * A retained xpc_object_t serialization on success, or NULL on failure. The
+ * caller is responsible for releasing the returned object using
+ * `xpc_release()`.
+ */
+xpc_object_t _Nullable vmnet_broker_acquire_network_with_lease(
+    const char *_Nonnull network_name,
+    const char *_Nonnull lease_token,
+    uint32_t lease_duration,
+    vmnet_broker_return_t *_Nullable status
+);
+
+/*!
+ * @function vmnet_broker_acquire_relay
+ *
+ * @abstract
+ * Acquires a shared lock on a configured network like
+ * `vmnet_broker_acquire_network`, and returns a socket connected to a vmnet
+ * interface on the network.
+ *
+ * @discussion
+ * For processes that cannot use vmnet, such as QEMU or libkrun. The broker
+ * starts a vmnet interface on the network and forwards frames between the
+ * interface and the returned socket. Every datagram sent or received on the
+ * socket is one ethernet frame.
+ *
+ * Releasing the network with `vmnet_broker_release_network` stops relaying
+ * the network. The relay also stops when the process terminates.
+ *
+ * @param network_name
+ * The name of the network as defined in the broker configuration.
+ *
+ * @param status
+ * Optional output parameter. On return, contains the status of the operation.
+ *
+ * @result
+ * A datagram socket on success, or -1 on failure. The caller is responsible
+ * for closing the socket.
+ */
+int vmnet_broker_acquire_relay(
+    const char *_Nonnull network_name, vmnet_broker_return_t *_Nullable status
+);
+
+/*!
+ * @function vmnet_broker_acquire_ring
+ *
+ * @abstract
+ * Acquires a network like `vmnet_broker_acquire_relay`, and returns a shared
+ * memory region for exchanging frames with the broker.
+ *
+ * @discussion
+ * Frames are exchanged using the rings in the region without system calls, so
+ * relaying frames is faster than with a relay socket. Map the region with
+ * `vmnet_broker_ring_map` from vmnet-broker-ring.h. The doorbell socket is
+ * used only to wake up the other side when a ring becomes non-empty.
+ *
+ * Frames sent when the ring is full are dropped, as with a full socket buffer.
+ *
+ * @param network_name
+ * The name of the network as defined in the broker configuration.
+ *
+ * @param doorbell
+ * On success, set to the doorbell datagram socket. The caller is responsible
+ * for closing the socket.
+ *
+ * @param status
+ * Optional output parameter. On return, contains the status of the operation.
+ *
+ * @result
+ * The shared memory region file descriptor on success, or -1 on failure. The
+ * caller is responsible for closing the descriptor.
+ */
+int vmnet_broker_acquire_ring(
+    const char *_Nonnull network_name,
+    int *_Nonnull doorbell,
+    vmnet_broker_return_t *_Nullable status
+);
+
+/*!
+ * @function vmnet_broker_acquire_vhost_user
+ *
+ * @abstract
+ * Acquires a network like `vmnet_broker_acquire_relay`, and returns a socket
+ * connected to a vhost-user virtio-net backend in the broker.
+ *
+ * @discussion
+ * For QEMU, which can exchange frames with the broker using virtqueues in
+ * guest memory, without system calls per frame and without copying frames sent
+ * by the guest. Pass the socket to QEMU as a vhost-user character device. The
+ * guest memory must be shared, for example using a memory backend with
+ * `share=on`.
+ *
+ * @param network_name
+ * The name of the network as defined in the broker configuration.
+ *
+ * @param status
+ * Optional output parameter. On return, contains the status of the operation.
+ *
+ * @result
+ * A stream socket on success, or -1 on failure. The caller is responsible for
+ * closing the socket.
+ */
+int vmnet_broker_acquire_vhost_user(
+    const char *_Nonnull network_name, vmnet_broker_return_t *_Nullable status
+);
+
+/*!
+ * @function vmnet_broker_acquire_stream
+ *
+ * @abstract
+ * Acquires a network like `vmnet_broker_acquire_relay`, and returns a stream
+ * socket for exchanging frames with the broker.
+ *
+ * @discussion
+ * Every frame sent or received on the socket is prefixed by its length as a
+ * 32 bits big endian integer, as used by QEMU `-netdev stream` and by
+ * libkrun and gvproxy clients using the QEMU protocol. Frames may be written
+ * and read in parts, and many frames may be written in one call.
+ *
+ * Frames sent when the broker cannot write to the socket are dropped, after
+ * buffering up to 64 KiB.
+ *
+ * @param network_name
+ * The name of the network as defined in the broker configuration.
+ *
+ * @param status
+ * Optional output parameter. On return, contains the status of the operation.
+ *
+ * @result
+ * A stream socket on success, or -1 on failure. The caller is responsible for
+ * closing the socket.
+ */
+int vmnet_broker_acquire_stream(
+    const char *_Nonnull network_name, vmnet_broker_return_t *_Nullable status
+);
+
+/*!
+ * @function vmnet_broker_capture
+ *
+ * @abstract
+ * Captures the frames of a relayed network, and returns a stream socket for
+ * reading the frames in pcapng format.
+ *
+ * @discussion
+ * The broker copies frames forwarded by the network switch to the socket,
+ * starting with the pcapng section and interface blocks, so the socket can be
+ * read by `tcpdump -r -` or Wireshark. The network must be relayed, acquired
+ * by a process using `vmnet_broker_acquire_relay` or another relay mode.
+ * Frames are copied by the thread forwarding them, so a capture slows down
+ * forwarding on a busy network, more with a larger snapshot length. When the
+ * reader does not keep up, frames are dropped and reported in the interface
+ * statistics block written when the capture stops.
+ *
+ * The capture stops when the caller closes the socket, or when the last
+ * process relaying the network stops.
+ *
+ * @param network_name
+ * The name of the network as defined in the broker configuration.
+ *
+ * @param snaplen
+ * Maximum number of bytes to capture from every frame, up to 65535, or 0 for
+ * the default of 256 bytes.
+ *
+ * @param filter
+ * Optional capture filter, using a subset of the pcap-filter(7) syntax, such
+ * as `"tcp port 22 or arp"`. NULL or empty to capture all frames.
+ *
+ * @param status
+ * Optional output parameter. On return, contains the status of the operation.
+ * If the network is not relayed, the status is `VMNET_BROKER_NOT_FOUND`. If
+ * the filter is invalid, the status is `VMNET_BROKER_INVALID_REQUEST`.
+ *
+ * @result
+ * A stream socket on success, or -1 on failure. The caller is responsible for
+ * closing the socket.
+ */
+int vmnet_broker_capture(
+    const char *_Nonnull network_name,
+    uint32_t snaplen,
+    const char *_Nullable filter,
+    vmnet_broker_return_t *_Nullable status
+);
+
+/*!
+ * @function vmnet_broker_release_network
+ *
+ * @abstract
+ * Releases a shared lock on a network acquired with
+ * `vmnet_broker_acquire_network`.
+ *
+ * @discussion
+ * Each call releases one reference acquired by this process. When the last
+ * reference is released, the broker stops tracking the network for this
+ * process, and if no other process is using the network, the broker removes
+ * it after a delay.
+ *
+ * The caller must stop using the network before releasing the last reference.
+ * Releasing a network is optional; all references are released when the
+ * process terminates.
+ *
+ * @param network_name
+ * The name of the network acquired by this process.
+ *
+ * @result
+ * `VMNET_BROKER_SUCCESS` on success, or `VMNET_BROKER_NOT_FOUND` if this
+ * process did not acquire the network.
+ */
+vmnet_broker_return_t
+vmnet_broker_release_network(const char *_Nonnull network_name);
+
+/*!
+ * @typedef vmnet_broker_event_handler_t
+ *
+ * @abstract
+ * Handler called for each network lifecycle event.
+ *
+ * @param event
+ * XPC dictionary with the `EVENT_TYPE` key and event specific keys. The event
+ * is valid only during the call.
+ */
+typedef void (^vmnet_broker_event_handler_t)(xpc_object_t _Nonnull event);
+
+/*!
+ * @function vmnet_broker_subscribe
+ *
+ * @abstract
+ * Subscribes to network lifecycle events.
+ *
+ * @discussion
+ * After subscribing, the broker sends an event when a network is created,
+ * acquired, released, scheduled for removal when idle, and removed. The handler
+ * is called on a private queue for each event.
+ *
+ * If the process does not handle events fast enough, the broker stops sending
+ * events and sends a single `EVENT_CATCH_UP` event with the number of dropped
+ * events and the current state of the networks that changed.
+ *
+ * The subscription ends when the process terminates.
+ *
+ * @param handler
+ * Block called for each event.
+ *
+ * @result
+ * `VMNET_BROKER_SUCCESS` on success, or an error status.
+ */
+vmnet_broker_return_t
+vmnet_broker_subscribe(vmnet_broker_event_handler_t _Nonnull handler);
+
+/*!
+ * @function vmnet_broker_network_info
+ *
+ * @abstract
+ * Returns information about networks created by the broker.
+ *
+ * @discussion
+ * The information is recorded when the network is created. Querying the
+ * information does not acquire the network or create it.
+ *
+ * @param network_name
+ * The name of the network, or NULL to return information about all networks.
+ *
+ * @param status
+ * Optional output parameter. On return, contains the status of the operation.
+ * If `network_name` was not created by the broker, the status is
+ * `VMNET_BROKER_NOT_FOUND`.
+ *
+ * @result
+ * A retained XPC array of dictionaries on success, or NULL on failure. Each
+ * dictionary contains the `NETWORK_NAME`, `NETWORK_SUBNET`, `NETWORK_MASK`,
+ * `NETWORK_IPV6_PREFIX`, `NETWORK_PREFIX_LEN`, `NETWORK_MODE`, `NETWORK_PEERS`,
+ * and `NETWORK_AGE` keys. The caller is responsible for releasing the returned
+ * object using `xpc_release()`.
+ */
+xpc_object_t _Nullable vmnet_broker_network_info(
+    const char *_Nullable network_name, vmnet_broker_return_t *_Nullable status
+);
+
+/*!
+ * @function vmnet_broker_stats
+ *
+ * @abstract
+ * Returns broker statistics.
+ *
+ * @discussion
+ * The statistics are intended for monitoring and debugging the broker. The
+ * `STATS_LATENCY` dictionary contains latency statistics for requests
+ * completed immediately (`STATS_LATENCY_IMMEDIATE`), and requests deferred
+ * until a network is created (`STATS_LATENCY_DEFERRED`). Each dictionary
+ * contains the `LATENCY_REQUESTS`, `LATENCY_PENDING`, `LATENCY_MAX_PENDING`,
+ * `LATENCY_WAIT_USEC`, and `LATENCY_MAX_WAIT_USEC` keys.
+ *
+ * The `STATS_LANES` dictionary contains queuing statistics for cheap work in
+ * the fast lane (`STATS_LANE_FAST`), such as acquiring an existing network,
+ * and expensive work in the slow lane (`STATS_LANE_SLOW`), such as creating a
+ * network configuration or dumping statistics. Each dictionary contains the
+ * number of blocks started (`LANE_QUEUED`), the number of blocks waiting and
+ * the maximum (`LANE_DEPTH`, `LANE_MAX_DEPTH`), and the total and maximum time
+ * blocks waited (`LANE_WAIT_USEC`, `LANE_MAX_WAIT_USEC`).
+ *
+ * The `STATS_THROTTLED` and `STATS_BUSY_CREATES` keys count requests rejected
+ * with `VMNET_BROKER_BUSY` because a client exceeded the request rate, or too
+ * many networks were being created. The `STATS_THROTTLED_PEERS` array contains
+ * a dictionary with the `PEER_NAME` and `PEER_THROTTLED` keys for each
+ * connected client with throttled requests.
+ *
+ * The `STATS_MEMORY` dictionary contains the broker resident memory size
+ * (`MEMORY_RSS`) and the number and size of allocated memory blocks
+ * (`MEMORY_MALLOC_BLOCKS`, `MEMORY_MALLOC_BYTES`). The `STATS_POOLS`
+ * dictionary contains a dictionary for each broker object pool, with the
+ * `POOL_IN_USE`, `POOL_ALLOCS`, `POOL_SLABS`, and `POOL_BYTES` keys.
+ *
+ * The `STATS_PREDICTION` dictionary contains the number of networks created
+ * when the broker started because they were predicted from the usage history
+ * (`PREDICTION_PREDICTED`), and how many were acquired (`PREDICTION_HITS`) or
+ * removed without being acquired (`PREDICTION_MISSES`).
+ *
+ * The `STATS_STICKY_SUBNETS` dictionary contains the number of networks
+ * created again with the subnet assigned when the network was last created
+ * (`STICKY_HONORED`), and the number of networks created with a new subnet
+ * because the subnet was used by another network (`STICKY_CONFLICTS`).
+ *
+ * The `STATS_POLICY` dictionary contains the number of access policy checks
+ * (`POLICY_CHECKS`), checks answered from cached decisions
+ * (`POLICY_CACHE_HITS`), and requests denied by the policy (`POLICY_DENIED`).
+ *
+ * The `STATS_WATCHDOG` dictionary contains main queue stalls: the stall budget
+ * (`WATCHDOG_BUDGET_MSEC`), the number of times the main queue was blocked for
+ * more than a second (`WATCHDOG_BLOCKED`), the number of stalls for each
+ * handler (`WATCHDOG_STALLS`), the number of handlers run and the time spent
+ * running them for each handler (`WATCHDOG_HANDLED`, `WATCHDOG_BUSY_USEC`),
+ * and arrays with the most recent stalls (`WATCHDOG_RECENT`) and the slowest
+ * stalls (`WATCHDOG_SLOWEST`). Each stall dictionary contains the
+ * `TRACE_HANDLER`, `TRACE_TIME`, and `TRACE_DURATION_USEC` keys, and
+ * optionally the `TRACE_PEER`, `TRACE_COMMAND`, and `TRACE_NETWORK` keys.
+ *
+ * The `STATS_RELAY` dictionary contains the number of switch ports, one for
+ * every client using `vmnet_broker_acquire_relay` and one for the vmnet
+ * interface of every relayed network (`RELAY_LINKS`), the number of frames and
+ * bytes forwarded (`RELAY_FRAMES`, `RELAY_BYTES`), the number of batches
+ * received (`RELAY_BATCHES`), the number of frames dropped because the
+ * destination was full (`RELAY_DROPS`), the number of switches, one per
+ * relayed network (`RELAY_SWITCHES`), the number of frames forwarded to one
+ * port and flooded to all ports (`RELAY_UNICAST`, `RELAY_FLOODED`), the number
+ * of ARP requests and neighbor solicitations answered by the broker instead of
+ * flooding them (`RELAY_SUPPRESSED`), and the number of frames segmented or
+ * checksummed by the broker for destinations without offloads
+ * (`RELAY_SEGMENTED`). The number of running packet captures
+ * (`RELAY_CAPTURES`), and the number of frames captured and dropped because
+ * the capture reader could not keep up (`RELAY_CAPTURED`,
+ * `RELAY_CAPTURE_DROPS`), are counted since the broker started. On networks
+ * using traffic shaping, the number of frames queued for ports, and dropped
+ * because a port queue was full or the port was full when sending the queued
+ * frames (`RELAY_QUEUED`, `RELAY_QUEUE_DROPS`), are counted as well.
+ *
+ * The `STATS_SHARDS` array contains a dictionary for each network shard, with
+ * the number of blocks run on the shard queue (`SHARD_HANDLED`), the number of
+ * blocks waiting (`SHARD_PENDING`), the time blocks waited
+ * (`SHARD_WAIT_USEC`), and the time spent running them (`SHARD_BUSY_USEC`).
+ *
+ * @param status
+ * Optional output parameter. On return, contains the status of the operation.
+ *
+ * @result
+ * A retained XPC dictionary on success, or NULL on failure. The caller is
+ * responsible for releasing the returned object using `xpc_release()`.
+ */
+xpc_object_t _Nullable vmnet_broker_stats(
+    vmnet_broker_return_t *_Nullable status
+);
+
 /*!
  * @function vmnet_broker_strerror
  *
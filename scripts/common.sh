@@ -8,6 +8,7 @@ group_name="_vmnetbroker"
 install_dir="/Library/Application Support/vmnet-broker"
 launchd_dir="/Library/LaunchDaemons"
 log_dir="/Library/Logs/vmnet-broker"
+state_dir="/var/db/vmnet-broker"
 stop_timeout=5
 
 log() {
@@ -20,6 +20,7 @@ public enum VmnetBroker {
         public static let notFound = Error(VMNET_BROKER_NOT_FOUND)
         public static let createFailure = Error(VMNET_BROKER_CREATE_FAILURE)
         public static let internalError = Error(VMNET_BROKER_INTERNAL_ERROR)
+        public static let busy = Error(VMNET_BROKER_BUSY)
 
         /// The raw status code returned by the vmnet-broker C API.
         public let status: vmnet_broker_return_t
@@ -44,6 +45,39 @@ public enum VmnetBroker {
         }
     }
 
+    /// Information about a network created by the broker.
+    public struct NetworkInfo: Equatable {
+        public let name: String
+        public let mode: String
+        public let subnet: String
+        public let mask: String
+        public let ipv6Prefix: String
+        public let prefixLen: Int
+        public let peers: Int
+        /// Seconds since the network was created.
+        public let age: Int
+
+        init(_ info: xpc_object_t) {
+            func string(_ key: String) -> String {
+                guard let value = xpc_dictionary_get_string(info, key) else {
+                    return ""
+                }
+                return String(cString: value)
+            }
+            func int(_ key: String) -> Int {
+                return Int(xpc_dictionary_get_int64(info, key))
+            }
+            name = string(NETWORK_NAME)
+            mode = string(NETWORK_MODE)
+            subnet = string(NETWORK_SUBNET)
+            mask = string(NETWORK_MASK)
+            ipv6Prefix = string(NETWORK_IPV6_PREFIX)
+            prefixLen = int(NETWORK_PREFIX_LEN)
+            peers = int(NETWORK_PEERS)
+            age = int(NETWORK_AGE)
+        }
+    }
+
     /// AcquireNetwork Acquires a shared lock on a configured network, instantiating
     /// it if necessary.
     ///
@@ -65,4 +99,73 @@ public enum VmnetBroker {
         }
         return serialization
     }
+
+    /// Acquires a shared lock on a configured network like `acquireNetwork(named:)`,
+    /// keeping the network after this process terminates for the lease duration.
+    ///
+    /// When the process terminates without releasing the network, the broker keeps
+    /// the network for `leaseDuration` seconds. If a process acquires the network
+    /// with the same `leaseToken` before the lease expires, it gets the same network
+    /// instead of a new network with a different subnet. This allows a VM launcher
+    /// to restart without disrupting running VMs.
+    ///
+    /// Releasing the network with `releaseNetwork(named:)` ends the lease.
+    ///
+    /// - Parameters:
+    ///   - named: The unique name of the network to acquire.
+    ///   - leaseToken: A token identifying the lease for this network.
+    ///   - leaseDuration: Seconds to keep the network, between 1 and 3600.
+    /// - Returns: An `xpc_object_t` containing the network serialization.
+    /// - Throws: `VmnetBroker.Error` if the operation fails.
+    public static func acquireNetwork(
+        named: String, leaseToken: String, leaseDuration: UInt32
+    ) throws -> xpc_object_t {
+        var status: vmnet_broker_return_t = VMNET_BROKER_SUCCESS
+        guard
+            let serialization = vmnet_broker_acquire_network_with_lease(
+                named, leaseToken, leaseDuration, &status)
+        else {
+            throw Error(status)
+        }
+        return serialization
+    }
+
+    /// Returns information about networks created by the broker.
+    ///
+    /// The information is recorded when the network is created. Querying the
+    /// information does not acquire the network or create it.
+    ///
+    /// - Parameter named: The name of the network, or nil for all networks.
+    /// - Returns: Information about the networks.
+    /// - Throws: `VmnetBroker.Error.notFound` if the network was not created by the
+    ///   broker, or `VmnetBroker.Error` if the operation fails.
+    public static func networkInfo(named: String? = nil) throws -> [NetworkInfo] {
+        var status: vmnet_broker_return_t = VMNET_BROKER_SUCCESS
+        guard let networks = vmnet_broker_network_info(named, &status) else {
+            throw Error(status)
+        }
+        return (0..<xpc_array_get_count(networks)).map {
+            NetworkInfo(xpc_array_get_value(networks, $0))
+        }
+    }
+
+    /// Releases a shared lock on a network acquired with `acquireNetwork(named:)`.
+    ///
+    /// Each call releases one reference acquired by this process. When the last
+    /// reference is released, the broker stops tracking the network for this
+    /// process, and if no other process is using the network, the broker removes
+    /// it after a delay.
+    ///
+    /// The caller must stop using the network before releasing the last
+    /// reference. Releasing a network is optional; all references are released
+    /// when the process terminates.
+    ///
+    /// - Parameter named: The name of the network acquired by this process.
+    /// - Throws: `VmnetBroker.Error` if the operation fails.
+    public static func releaseNetwork(named: String) throws {
+        let status = vmnet_broker_release_network(named)
+        guard status == VMNET_BROKER_SUCCESS else {
+            throw Error(status)
+        }
+    }
 }
@@ -27,6 +27,22 @@ struct AcquireNetworkTests {
         }
     }
 
+    /// Test acquiring a network with a lease
+    @Test
+    func validLease() throws {
+        _ = try VmnetBroker.acquireNetwork(
+            named: "shared", leaseToken: "swift-test", leaseDuration: 10)
+    }
+
+    /// Test acquiring a network with invalid lease returns invalidRequest error
+    @Test
+    func invalidLease() throws {
+        #expect(throws: VmnetBroker.Error.invalidRequest) {
+            try VmnetBroker.acquireNetwork(
+                named: "shared", leaseToken: "swift-test", leaseDuration: 0)
+        }
+    }
+
     /// Test acquiring a non-existing network returns notFound error
     @Test
     func nonExistingNetwork() throws {
@@ -36,6 +52,50 @@ struct AcquireNetworkTests {
     }
 }
 
+/// Test installed vmnet-broker (require installing the vmnet-broker launchd daemon).
+@Suite("VmnetBroker releaseNetwork")
+struct ReleaseNetworkTests {
+
+    /// Test releasing an acquired network
+    @Test
+    func acquiredNetwork() throws {
+        _ = try VmnetBroker.acquireNetwork(named: "shared")
+        try VmnetBroker.releaseNetwork(named: "shared")
+    }
+
+    /// Test releasing a network that was not acquired returns notFound error
+    @Test
+    func nonAcquiredNetwork() throws {
+        #expect(throws: VmnetBroker.Error.notFound) {
+            try VmnetBroker.releaseNetwork(named: "no-such-network")
+        }
+    }
+}
+
+/// Test installed vmnet-broker (require installing the vmnet-broker launchd daemon).
+@Suite("VmnetBroker networkInfo")
+struct NetworkInfoTests {
+
+    /// Test querying an acquired network
+    @Test
+    func acquiredNetwork() throws {
+        _ = try VmnetBroker.acquireNetwork(named: "shared")
+        let networks = try VmnetBroker.networkInfo(named: "shared")
+        #expect(networks.count == 1)
+        #expect(networks[0].name == "shared")
+        #expect(networks[0].mode == "shared")
+        #expect(networks[0].peers >= 1)
+    }
+
+    /// Test querying a non-existing network returns notFound error
+    @Test
+    func nonExistingNetwork() throws {
+        #expect(throws: VmnetBroker.Error.notFound) {
+            try VmnetBroker.networkInfo(named: "no-such-network")
+        }
+    }
+}
+
 @Suite("VmnetBroker.Error validation")
 struct ErrorTests {
 
@@ -55,7 +55,7 @@ check_peers() {
     [ "$output" = "ok" ]
 }
 
-@test "acquire same network 9 times (exceeds MAX_PEER_NETWORKS)" {
+@test "acquire same network 9 times" {
     run --separate-stderr ./test-c --quick shared shared shared shared shared shared shared shared shared
     [ "$status" -eq 0 ]
     [ "$output" = "ok" ]
@@ -87,3 +87,97 @@ check_peers() {
     run --separate-stderr check_peers "$BATS_TEST_TMPDIR" 3
     [ "$status" -eq 0 ]
 }
+
+@test "release acquired networks" {
+    run --separate-stderr ./test-c --quick --release shared host
+    [ "$status" -eq 0 ]
+    [ "$output" = "ok" ]
+}
+
+@test "release network acquired multiple times" {
+    run --separate-stderr ./test-c --quick --release shared shared shared
+    [ "$status" -eq 0 ]
+    [ "$output" = "ok" ]
+}
+
+@test "acquire network with lease after restart" {
+    # The first peer disconnects while holding the lease, so the broker keeps
+    # the network. The second peer reclaims the lease.
+    for i in 1 2; do
+        ./test-c --quick --lease-token bats --lease-duration 10 shared > "$BATS_TEST_TMPDIR/peer$i.out" 2>"$BATS_TEST_TMPDIR/peer$i.err"
+    done
+    run --separate-stderr check_peers "$BATS_TEST_TMPDIR" 2
+    [ "$status" -eq 0 ]
+}
+
+@test "invalid lease duration returns INVALID_REQUEST" {
+    run --separate-stderr ./test-c --quick --lease-token bats --lease-duration 0 shared
+    [ "$status" -eq 1 ]
+    [ "$output" = "fail acquire_network 4" ]
+}
+
+@test "subscribe to network events" {
+    run --separate-stderr ./test-c --quick --subscribe shared
+    [ "$status" -eq 0 ]
+    [ "$output" = "ok" ]
+}
+
+@test "query acquired network info" {
+    run --separate-stderr ./test-c --quick --info shared host
+    [ "$status" -eq 0 ]
+    [ "$output" = "ok" ]
+}
+
+@test "query broker stats" {
+    run --separate-stderr ./test-c --quick --stats shared host
+    [ "$status" -eq 0 ]
+    [ "$output" = "ok" ]
+}
+
+@test "acquire relay sockets" {
+    run --separate-stderr ./test-c --quick --relay --stats shared host
+    [ "$status" -eq 0 ]
+    [ "$output" = "ok" ]
+}
+
+@test "release relayed network acquired multiple times" {
+    run --separate-stderr ./test-c --quick --relay --release shared shared
+    [ "$status" -eq 0 ]
+    [ "$output" = "ok" ]
+}
+
+@test "acquire shared memory rings" {
+    run --separate-stderr ./test-c --quick --ring --stats shared host
+    [ "$status" -eq 0 ]
+    [ "$output" = "ok" ]
+}
+
+@test "acquire vhost-user sockets" {
+    run --separate-stderr ./test-c --quick --vhost-user --stats shared host
+    [ "$status" -eq 0 ]
+    [ "$output" = "ok" ]
+}
+
+@test "acquire stream sockets" {
+    run --separate-stderr ./test-c --quick --stream --stats shared host
+    [ "$status" -eq 0 ]
+    [ "$output" = "ok" ]
+}
+
+@test "capture relayed networks" {
+    run --separate-stderr ./test-c --quick --relay --capture --stats shared host
+    [ "$status" -eq 0 ]
+    [ "$output" = "ok" ]
+}
+
+@test "protocol version 2 requests" {
+    run --separate-stderr ./test-c --quick --protocol shared host
+    [ "$status" -eq 0 ]
+    [ "$output" = "ok" ]
+}
+
+@test "busy requests are retried" {
+    run --separate-stderr ./test-c --quick --busy shared host
+    [ "$status" -eq 0 ]
+    [ "$output" = "ok" ]
+}
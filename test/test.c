@@ -2,22 +2,29 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include <dispatch/dispatch.h>
+#include <errno.h>
 #include <getopt.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/event.h>
+#include <sys/socket.h>
 #include <time.h>
+#include <unistd.h>
 #include <uuid/uuid.h>
 #include <xpc/xpc.h>
 
 #include "common.h"
 #include "log.h"
+#include "vmnet-broker-ring.h"
 #include "vmnet-broker.h"
 
 #define NANOSECONDS_PER_SECOND 1000000000ULL
 
+// The first block of a pcapng capture.
+#define PCAPNG_SECTION_HEADER 0x0a0d0d0a
+
 bool verbose = true;
 
 // Interfaces started by start_interface().
@@ -31,6 +38,11 @@ struct interface {
 static struct interface interfaces[MAX_INTERFACES];
 static int interface_count = 0;
 
+// Sockets acquired by acquire_relay(), acquire_ring(), acquire_vhost_user(),
+// and acquire_stream().
+static int relay_fds[MAX_INTERFACES];
+static int relay_count = 0;
+
 // Used to start and stop interfaces.
 static dispatch_queue_t vmnet_queue;
 
@@ -55,13 +67,39 @@ static struct {
     const char *network_names[MAX_INTERFACES];
     int network_count;
     bool quick;
+    bool release;
+    bool subscribe;
+    bool info;
+    bool stats;
+    bool relay;
+    bool ring;
+    bool vhost_user;
+    bool stream;
+    bool capture;
+    bool protocol;
+    bool busy;
+    const char *lease_token;
+    uint32_t lease_duration;
 } opt = {
     .network_count = 0,
     .quick = false,
+    .release = false,
+    .subscribe = false,
+    .info = false,
+    .stats = false,
+    .relay = false,
+    .ring = false,
+    .vhost_user = false,
+    .stream = false,
+    .capture = false,
+    .protocol = false,
+    .busy = false,
+    .lease_token = NULL,
+    .lease_duration = 60,
 };
 
 // Start with ':' to enable detection of missing argument.
-static const char *short_options = ":hq";
+static const char *short_options = ":hqrsiSRmuTcPbt:d:";
 
 static struct option long_options[] = {
     {
@@ -76,6 +114,84 @@ static struct option long_options[] = {
         .flag = 0,
         .val = 'q',
     },
+    {
+        .name = "release",
+        .has_arg = no_argument,
+        .flag = 0,
+        .val = 'r',
+    },
+    {
+        .name = "subscribe",
+        .has_arg = no_argument,
+        .flag = 0,
+        .val = 's',
+    },
+    {
+        .name = "info",
+        .has_arg = no_argument,
+        .flag = 0,
+        .val = 'i',
+    },
+    {
+        .name = "stats",
+        .has_arg = no_argument,
+        .flag = 0,
+        .val = 'S',
+    },
+    {
+        .name = "relay",
+        .has_arg = no_argument,
+        .flag = 0,
+        .val = 'R',
+    },
+    {
+        .name = "ring",
+        .has_arg = no_argument,
+        .flag = 0,
+        .val = 'm',
+    },
+    {
+        .name = "vhost-user",
+        .has_arg = no_argument,
+        .flag = 0,
+        .val = 'u',
+    },
+    {
+        .name = "stream",
+        .has_arg = no_argument,
+        .flag = 0,
+        .val = 'T',
+    },
+    {
+        .name = "capture",
+        .has_arg = no_argument,
+        .flag = 0,
+        .val = 'c',
+    },
+    {
+        .name = "protocol",
+        .has_arg = no_argument,
+        .flag = 0,
+        .val = 'P',
+    },
+    {
+        .name = "busy",
+        .has_arg = no_argument,
+        .flag = 0,
+        .val = 'b',
+    },
+    {
+        .name = "lease-token",
+        .has_arg = required_argument,
+        .flag = 0,
+        .val = 't',
+    },
+    {
+        .name = "lease-duration",
+        .has_arg = required_argument,
+        .flag = 0,
+        .val = 'd',
+    },
     {0},
 };
 
@@ -84,10 +200,39 @@ static void usage(int code) {
         "\n"
         "Test vmnet-broker client\n"
         "\n"
-        "    test-c [-q|--quick] [-h|--help] [network_name ...]\n"
+        "    test-c [-q|--quick] [-r|--release] [-s|--subscribe] [-i|--info]\n"
+        "           [-S|--stats] [-R|--relay] [-m|--ring] [-u|--vhost-user]\n"
+        "           [-T|--stream] [-c|--capture] [-P|--protocol] [-b|--busy]\n"
+        "           [-t|--lease-token TOKEN] [-d|--lease-duration SECONDS]\n"
+        "           [-h|--help]\n"
+        "           [network_name ...]\n"
         "\n"
         "Options:\n"
         "    -q, --quick    Run quick test and exit immediately\n"
+        "    -r, --release  Release networks after stopping interfaces\n"
+        "    -s, --subscribe\n"
+        "                   Subscribe to network events and log them\n"
+        "    -i, --info     Log acquired networks info\n"
+        "    -S, --stats    Log broker stats after acquiring networks\n"
+        "    -R, --relay    Acquire relay sockets instead of starting "
+        "interfaces\n"
+        "    -m, --ring     Acquire shared memory rings instead of starting "
+        "interfaces\n"
+        "    -u, --vhost-user\n"
+        "                   Acquire vhost-user sockets instead of starting "
+        "interfaces\n"
+        "    -T, --stream   Acquire stream sockets instead of starting "
+        "interfaces\n"
+        "    -c, --capture  Capture relayed networks and check the capture "
+        "header\n"
+        "    -P, --protocol Test protocol version 2 requests instead of "
+        "starting\n"
+        "                   interfaces\n"
+        "    -b, --busy     Test busy replies instead of starting interfaces\n"
+        "    -t, --lease-token TOKEN\n"
+        "                   Acquire networks with a lease\n"
+        "    -d, --lease-duration SECONDS\n"
+        "                   Lease duration (default: 60)\n"
         "    -h, --help     Show this help message\n"
         "\n"
         "Arguments:\n"
@@ -125,6 +270,45 @@ static void parse_options(int argc, char *argv[]) {
         case 'q':
             opt.quick = true;
             break;
+        case 'r':
+            opt.release = true;
+            break;
+        case 's':
+            opt.subscribe = true;
+            break;
+        case 'i':
+            opt.info = true;
+            break;
+        case 'S':
+            opt.stats = true;
+            break;
+        case 'R':
+            opt.relay = true;
+            break;
+        case 'm':
+            opt.ring = true;
+            break;
+        case 'u':
+            opt.vhost_user = true;
+            break;
+        case 'T':
+            opt.stream = true;
+            break;
+        case 'c':
+            opt.capture = true;
+            break;
+        case 'P':
+            opt.protocol = true;
+            break;
+        case 'b':
+            opt.busy = true;
+            break;
+        case 't':
+            opt.lease_token = optarg;
+            break;
+        case 'd':
+            opt.lease_duration = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
         case ':':
             ERRORF("Option %s requires an argument", optname);
             usage(1);
@@ -166,6 +350,14 @@ static void parse_options(int argc, char *argv[]) {
     if (opt.quick) {
         INFO("running in quick mode");
     }
+
+    if (opt.lease_token) {
+        INFOF(
+            "using lease token '%s' duration %u seconds",
+            opt.lease_token,
+            opt.lease_duration
+        );
+    }
 }
 
 static uint64_t gettime(void) {
@@ -176,15 +368,50 @@ static uint64_t gettime(void) {
     return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
 }
 
+// Subscribe to network events and log them.
+static void subscribe(void) {
+    INFO("subscribing to network events");
+
+    vmnet_broker_return_t broker_status = vmnet_broker_subscribe(
+        ^(xpc_object_t event) {
+            const char *type = xpc_dictionary_get_string(event, EVENT_TYPE);
+            const char *name = xpc_dictionary_get_string(event, NETWORK_NAME);
+            INFOF(
+                "received event '%s' network '%s' peers %lld",
+                type ? type : "(null)",
+                name ? name : "(null)",
+                xpc_dictionary_get_int64(event, NETWORK_PEERS)
+            );
+        }
+    );
+    if (broker_status != VMNET_BROKER_SUCCESS) {
+        ERRORF(
+            "failed to subscribe: (%d) %s",
+            broker_status,
+            vmnet_broker_strerror(broker_status)
+        );
+        fail("subscribe", broker_status);
+    }
+
+    INFO("subscribed to network events");
+}
+
 // Acquire network from broker and create vmnet_network_ref.
 static vmnet_network_ref acquire_network(const char *network_name) {
     INFOF("acquiring network '%s'", network_name);
 
     uint64_t start_time = gettime();
     vmnet_broker_return_t broker_status;
-    xpc_object_t serialization = vmnet_broker_acquire_network(
-        network_name, &broker_status
-    );
+    xpc_object_t serialization;
+    if (opt.lease_token) {
+        serialization = vmnet_broker_acquire_network_with_lease(
+            network_name, opt.lease_token, opt.lease_duration, &broker_status
+        );
+    } else {
+        serialization = vmnet_broker_acquire_network(
+            network_name, &broker_status
+        );
+    }
     uint64_t end_time = gettime();
 
     if (serialization == NULL) {
@@ -241,6 +468,823 @@ static vmnet_network_ref acquire_network(const char *network_name) {
     return network;
 }
 
+#define TEST_FRAME_SIZE 60
+
+// Broadcast frame from a locally administered address, using the local
+// experimental ethertype ignored by other hosts.
+static void init_test_frame(unsigned char *frame) {
+    memset(frame, 0, TEST_FRAME_SIZE);
+    memset(frame, 0xff, 6);
+    frame[6] = 0x02;
+    frame[12] = 0x88;
+    frame[13] = 0xb5;
+}
+
+// Acquire network relay socket from broker and send a frame to the network.
+static void acquire_relay(const char *network_name) {
+    INFOF("acquiring relay for network '%s'", network_name);
+
+    uint64_t start_time = gettime();
+    vmnet_broker_return_t broker_status;
+    int fd = vmnet_broker_acquire_relay(network_name, &broker_status);
+    uint64_t end_time = gettime();
+
+    if (fd == -1) {
+        ERRORF(
+            "failed to acquire relay for network '%s': (%d) %s",
+            network_name,
+            broker_status,
+            vmnet_broker_strerror(broker_status)
+        );
+        fail("acquire_relay", broker_status);
+    }
+
+    double elapsed_seconds = (double)(end_time - start_time) /
+                             NANOSECONDS_PER_SECOND;
+    INFOF(
+        "acquired relay for network '%s' from broker: fd=%d in %.6f s",
+        network_name,
+        fd,
+        elapsed_seconds
+    );
+
+    unsigned char frame[TEST_FRAME_SIZE];
+    init_test_frame(frame);
+    if (send(fd, frame, sizeof(frame), 0) < 0) {
+        int err = errno;
+        ERRORF("failed to send frame to relay: %s", strerror(err));
+        fail("send_frame", err);
+    }
+
+    relay_fds[relay_count++] = fd;
+}
+
+// Acquire network shared memory region from broker and send a frame to the
+// network.
+static void acquire_ring(const char *network_name) {
+    INFOF("acquiring ring for network '%s'", network_name);
+
+    uint64_t start_time = gettime();
+    vmnet_broker_return_t broker_status;
+    int doorbell;
+    int fd = vmnet_broker_acquire_ring(network_name, &doorbell, &broker_status);
+    uint64_t end_time = gettime();
+
+    if (fd == -1) {
+        ERRORF(
+            "failed to acquire ring for network '%s': (%d) %s",
+            network_name,
+            broker_status,
+            vmnet_broker_strerror(broker_status)
+        );
+        fail("acquire_ring", broker_status);
+    }
+
+    double elapsed_seconds = (double)(end_time - start_time) /
+                             NANOSECONDS_PER_SECOND;
+    INFOF(
+        "acquired ring for network '%s' from broker: fd=%d doorbell=%d in "
+        "%.6f s",
+        network_name,
+        fd,
+        doorbell,
+        elapsed_seconds
+    );
+
+    struct vmnet_broker_ring_channel channel;
+    if (vmnet_broker_ring_map(fd, VMNET_BROKER_RING_CLIENT, &channel) < 0) {
+        int err = errno;
+        ERRORF("failed to map ring: %s", strerror(err));
+        fail("map_ring", err);
+    }
+    close(fd);
+
+    void *buf = vmnet_broker_ring_reserve(&channel.tx);
+    init_test_frame(buf);
+    vmnet_broker_ring_commit(&channel.tx, TEST_FRAME_SIZE);
+    if (vmnet_broker_ring_publish(&channel.tx)) {
+        char c = 0;
+        if (send(doorbell, &c, 1, 0) < 0) {
+            int err = errno;
+            ERRORF("failed to ring doorbell: %s", strerror(err));
+            fail("ring_doorbell", err);
+        }
+    }
+
+    vmnet_broker_ring_unmap(&channel);
+
+    relay_fds[relay_count++] = doorbell;
+}
+
+// Acquire network vhost-user socket from broker and check that the broker
+// negotiates the virtio-net features.
+static void acquire_vhost_user(const char *network_name) {
+    INFOF("acquiring vhost-user socket for network '%s'", network_name);
+
+    uint64_t start_time = gettime();
+    vmnet_broker_return_t broker_status;
+    int fd = vmnet_broker_acquire_vhost_user(network_name, &broker_status);
+    uint64_t end_time = gettime();
+
+    if (fd == -1) {
+        ERRORF(
+            "failed to acquire vhost-user socket for network '%s': (%d) %s",
+            network_name,
+            broker_status,
+            vmnet_broker_strerror(broker_status)
+        );
+        fail("acquire_vhost_user", broker_status);
+    }
+
+    double elapsed_seconds = (double)(end_time - start_time) /
+                             NANOSECONDS_PER_SECOND;
+    INFOF(
+        "acquired vhost-user socket for network '%s' from broker: fd=%d in "
+        "%.6f s",
+        network_name,
+        fd,
+        elapsed_seconds
+    );
+
+    // VHOST_USER_GET_FEATURES request, version 1.
+    uint32_t request[3] = {1, 0x1, 0};
+    if (send(fd, request, sizeof(request), 0) < 0) {
+        int err = errno;
+        ERRORF("failed to send vhost-user request: %s", strerror(err));
+        fail("send_request", err);
+    }
+
+    // Reply header and 64 bits features.
+    unsigned char reply[20];
+    if (recv(fd, reply, sizeof(reply), MSG_WAITALL) != sizeof(reply)) {
+        int err = errno;
+        ERRORF("failed to receive vhost-user reply: %s", strerror(err));
+        fail("recv_reply", err);
+    }
+
+    uint64_t features;
+    memcpy(&features, reply + 12, sizeof(features));
+    INFOF("vhost-user features: 0x%llx", (unsigned long long)features);
+    // VIRTIO_F_VERSION_1.
+    if (!(features & (1ULL << 32))) {
+        ERRORF(
+            "vhost-user features 0x%llx missing VIRTIO_F_VERSION_1",
+            (unsigned long long)features
+        );
+        fail("get_features", EPROTO);
+    }
+
+    relay_fds[relay_count++] = fd;
+}
+
+// Acquire network stream socket from broker and send a length prefixed frame
+// to the network.
+static void acquire_stream(const char *network_name) {
+    INFOF("acquiring stream socket for network '%s'", network_name);
+
+    uint64_t start_time = gettime();
+    vmnet_broker_return_t broker_status;
+    int fd = vmnet_broker_acquire_stream(network_name, &broker_status);
+    uint64_t end_time = gettime();
+
+    if (fd == -1) {
+        ERRORF(
+            "failed to acquire stream socket for network '%s': (%d) %s",
+            network_name,
+            broker_status,
+            vmnet_broker_strerror(broker_status)
+        );
+        fail("acquire_stream", broker_status);
+    }
+
+    double elapsed_seconds = (double)(end_time - start_time) /
+                             NANOSECONDS_PER_SECOND;
+    INFOF(
+        "acquired stream socket for network '%s' from broker: fd=%d in %.6f s",
+        network_name,
+        fd,
+        elapsed_seconds
+    );
+
+    // The frame length as a 32 bits big endian integer, and the frame.
+    unsigned char message[4 + TEST_FRAME_SIZE] = {
+        0,
+        0,
+        TEST_FRAME_SIZE >> 8,
+        TEST_FRAME_SIZE & 0xff,
+    };
+    init_test_frame(message + 4);
+    if (send(fd, message, sizeof(message), 0) < 0) {
+        int err = errno;
+        ERRORF("failed to send frame to stream: %s", strerror(err));
+        fail("send_frame", err);
+    }
+
+    relay_fds[relay_count++] = fd;
+}
+
+// Protocol version 2 replies received by test_protocol(), in order.
+#define MAX_REPLIES 16
+
+static xpc_connection_t protocol_connection;
+static xpc_object_t replies[MAX_REPLIES];
+static int reply_count = 0;
+static int replies_taken = 0;
+static dispatch_semaphore_t reply_received;
+
+// Replies to protocol version 2 requests. Runs on the connection queue.
+static void handle_protocol_event(xpc_object_t event) {
+    if (xpc_get_type(event) != XPC_TYPE_DICTIONARY ||
+        xpc_dictionary_get_value(event, REPLY_ID) == NULL) {
+        return;
+    }
+    if (reply_count == MAX_REPLIES) {
+        ERROR("too many protocol replies");
+        fail("protocol_reply", E2BIG);
+    }
+    replies[reply_count++] = xpc_retain(event);
+    dispatch_semaphore_signal(reply_received);
+}
+
+static void connect_protocol(void) {
+    reply_count = 0;
+    replies_taken = 0;
+    reply_received = dispatch_semaphore_create(0);
+    protocol_connection = xpc_connection_create_mach_service(
+        MACH_SERVICE_NAME, NULL, 0
+    );
+    xpc_connection_set_event_handler(protocol_connection, ^(xpc_object_t e) {
+        handle_protocol_event(e);
+    });
+    xpc_connection_resume(protocol_connection);
+}
+
+static void disconnect_protocol(void) {
+    xpc_connection_cancel(protocol_connection);
+    xpc_release(protocol_connection);
+    for (int i = 0; i < reply_count; i++) {
+        xpc_release(replies[i]);
+    }
+    dispatch_release(reply_received);
+}
+
+// Send a request and wait for the reply. Returns the reply error.
+static int64_t send_sync(const char *step, xpc_object_t message) {
+    xpc_object_t reply = xpc_connection_send_message_with_reply_sync(
+        protocol_connection, message
+    );
+    xpc_release(message);
+    if (xpc_get_type(reply) != XPC_TYPE_DICTIONARY) {
+        ERRORF("%s: invalid reply", step);
+        fail(step, EPROTO);
+    }
+    int64_t error = xpc_dictionary_get_int64(reply, REPLY_ERROR);
+    int64_t version = xpc_dictionary_get_int64(reply, REPLY_VERSION);
+    xpc_release(reply);
+    // Hello replies are checked by the version.
+    return version ? version : error;
+}
+
+// Send a protocol version 2 request without waiting for the reply.
+static void send_request(int64_t opcode, uint64_t id, const char *network) {
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_int64(message, REQUEST_OPCODE, opcode);
+    xpc_dictionary_set_uint64(message, REQUEST_ID, id);
+    if (network) {
+        xpc_dictionary_set_string(message, REQUEST_NETWORK_NAME, network);
+    }
+    xpc_connection_send_message(protocol_connection, message);
+    xpc_release(message);
+}
+
+// Wait for the next reply, and return its request ID.
+static uint64_t wait_reply(const char *step) {
+    dispatch_time_t timeout = dispatch_time(
+        DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC
+    );
+    if (dispatch_semaphore_wait(reply_received, timeout) != 0) {
+        ERRORF("%s: timeout waiting for reply", step);
+        fail(step, ETIMEDOUT);
+    }
+    return xpc_dictionary_get_uint64(replies[replies_taken++], REPLY_ID);
+}
+
+// Return the reply to a request, checking that the request has one reply.
+static xpc_object_t find_reply(const char *step, uint64_t id) {
+    xpc_object_t found = NULL;
+    for (int i = 0; i < reply_count; i++) {
+        if (xpc_dictionary_get_uint64(replies[i], REPLY_ID) != id) {
+            continue;
+        }
+        if (found) {
+            ERRORF("%s: duplicate reply to request %llu", step, id);
+            fail(step, EPROTO);
+        }
+        found = replies[i];
+    }
+    if (found == NULL) {
+        ERRORF("%s: no reply to request %llu", step, id);
+        fail(step, EPROTO);
+    }
+    return found;
+}
+
+static void expect_error(const char *step, int64_t error, int64_t expected) {
+    if (error != expected) {
+        ERRORF("%s: expected %lld, got %lld", step, expected, error);
+        fail(step, error ? (int)error : EPROTO);
+    }
+}
+
+// Test protocol version negotiation, opcode dispatch, and replies to many
+// outstanding requests on a new connection.
+static void test_protocol(const char *network_name) {
+    INFOF("testing protocol version 2 with network '%s'", network_name);
+    connect_protocol();
+
+    // Opcodes and request IDs require protocol version 2.
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_int64(message, REQUEST_OPCODE, OPCODE_STATS);
+    expect_error(
+        "v1_opcode",
+        send_sync("v1_opcode", message),
+        VMNET_BROKER_INVALID_REQUEST
+    );
+
+    message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_STATS);
+    xpc_dictionary_set_uint64(message, REQUEST_ID, 1);
+    expect_error(
+        "v1_request_id",
+        send_sync("v1_request_id", message),
+        VMNET_BROKER_INVALID_REQUEST
+    );
+
+    message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_HELLO);
+    xpc_dictionary_set_int64(message, REQUEST_VERSION, 0);
+    expect_error(
+        "hello_invalid",
+        send_sync("hello_invalid", message),
+        VMNET_BROKER_INVALID_REQUEST
+    );
+
+    // The broker uses the latest version it supports.
+    message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_HELLO);
+    xpc_dictionary_set_int64(message, REQUEST_VERSION, PROTOCOL_VERSION + 1);
+    expect_error("hello", send_sync("hello", message), PROTOCOL_VERSION_2);
+    INFO("negotiated protocol version 2");
+
+    // Opcodes are dispatched to the request handler, and replies are sent as
+    // messages with the request ID.
+    send_request(OPCODE_STATS, 1, NULL);
+    send_request(1000, 2, NULL);
+    wait_reply("dispatch");
+    wait_reply("dispatch");
+    xpc_object_t reply = find_reply("dispatch", 1);
+    expect_error("stats", xpc_dictionary_get_int64(reply, REPLY_ERROR), 0);
+    if (xpc_dictionary_get_value(reply, REPLY_STATS) == NULL) {
+        ERROR("stats reply without stats");
+        fail("stats", EPROTO);
+    }
+    reply = find_reply("dispatch", 2);
+    expect_error(
+        "unknown_opcode",
+        xpc_dictionary_get_int64(reply, REPLY_ERROR),
+        VMNET_BROKER_INVALID_REQUEST
+    );
+    INFO("dispatched opcodes");
+
+    // Protocol version 1 requests keep working.
+    message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_STATS);
+    expect_error("v1_stats", send_sync("v1_stats", message), 0);
+
+    // Acquiring a network that does not exist waits until the network is
+    // created, so the reply to the next request is sent first.
+    send_request(OPCODE_INFO, 3, network_name);
+    wait_reply("info");
+    reply = find_reply("info", 3);
+    bool exists = xpc_dictionary_get_int64(reply, REPLY_ERROR) == 0;
+
+    // Releasing the network before the acquire completes is deferred after
+    // the acquire, and releases the last reference while the network is
+    // created.
+    send_request(OPCODE_ACQUIRE, 4, network_name);
+    send_request(OPCODE_STATS, 5, NULL);
+    send_request(OPCODE_RELEASE, 6, network_name);
+    uint64_t first = wait_reply("acquire");
+    uint64_t second = wait_reply("acquire");
+    uint64_t third = wait_reply("acquire");
+    reply = find_reply("acquire", 4);
+    expect_error("acquire", xpc_dictionary_get_int64(reply, REPLY_ERROR), 0);
+    if (xpc_dictionary_get_value(reply, REPLY_NETWORK) == NULL) {
+        ERROR("acquire reply without network");
+        fail("acquire", EPROTO);
+    }
+    reply = find_reply("acquire", 5);
+    expect_error("stats", xpc_dictionary_get_int64(reply, REPLY_ERROR), 0);
+    reply = find_reply("acquire", 6);
+    expect_error("release", xpc_dictionary_get_int64(reply, REPLY_ERROR), 0);
+    if (!exists && first != 5) {
+        ERROR("reply to acquire a new network was not sent last");
+        fail("out_of_order", EPROTO);
+    }
+    // Requests for the same network complete in order.
+    if (first == 6 || (second == 6 && third == 4)) {
+        ERROR("reply to release was sent before reply to acquire");
+        fail("release_order", EPROTO);
+    }
+    INFOF(
+        "received replies %s (network %s)",
+        first == 5 ? "out of order" : "in order",
+        exists ? "existed" : "created"
+    );
+
+    disconnect_protocol();
+
+    INFO("tested protocol version 2");
+}
+
+// Send a protocol version 1 stats request and wait for the reply. The caller
+// must release the reply.
+static xpc_object_t send_stats(const char *step) {
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_STATS);
+    xpc_object_t reply = xpc_connection_send_message_with_reply_sync(
+        protocol_connection, message
+    );
+    xpc_release(message);
+    if (xpc_get_type(reply) != XPC_TYPE_DICTIONARY) {
+        ERRORF("%s: invalid reply", step);
+        fail(step, EPROTO);
+    }
+    return reply;
+}
+
+// Requests sent to exceed the peer request burst (200 requests).
+#define BUSY_REQUESTS 1000
+
+// Test that requests exceeding the peer request rate are rejected with a retry
+// hint, that the client library retries them, and that networks created
+// concurrently below the create limit are not rejected.
+static void test_busy(void) {
+    INFO("testing busy replies");
+    connect_protocol();
+
+    // Requests are sent faster than the broker refills the peer tokens, so a
+    // request is rejected before all requests are sent.
+    xpc_object_t reply = NULL;
+    int sent;
+    for (sent = 1; sent <= BUSY_REQUESTS; sent++) {
+        reply = send_stats("burst");
+        if (xpc_dictionary_get_int64(reply, REPLY_ERROR) != 0) {
+            break;
+        }
+        xpc_release(reply);
+        reply = NULL;
+    }
+    if (reply == NULL) {
+        ERRORF("burst: %d requests were not throttled", BUSY_REQUESTS);
+        fail("burst", EPROTO);
+    }
+    expect_error(
+        "burst",
+        xpc_dictionary_get_int64(reply, REPLY_ERROR),
+        VMNET_BROKER_BUSY
+    );
+    int64_t retry_after = xpc_dictionary_get_int64(reply, REPLY_RETRY_AFTER);
+    xpc_release(reply);
+    if (retry_after < 1) {
+        ERRORF("burst: invalid retry_after %lld", retry_after);
+        fail("retry_after", EPROTO);
+    }
+    INFOF(
+        "throttled after %d requests, retry after %lld ms", sent, retry_after
+    );
+
+    // The request is admitted after waiting the time in the hint.
+    usleep((useconds_t)retry_after * 1000);
+    reply = send_stats("retry_after");
+    expect_error(
+        "retry_after", xpc_dictionary_get_int64(reply, REPLY_ERROR), 0
+    );
+    xpc_release(reply);
+    disconnect_protocol();
+
+    // The client library uses another connection with its own tokens. It
+    // retries busy requests, so all requests succeed, and the broker counts
+    // the throttled requests.
+    uint64_t start = gettime();
+    uint64_t first_throttled = 0;
+    bool retried = false;
+    for (sent = 1; sent <= BUSY_REQUESTS && !retried; sent++) {
+        vmnet_broker_return_t status;
+        xpc_object_t stats = vmnet_broker_stats(&status);
+        if (stats == NULL) {
+            ERRORF("client_retry: %s", vmnet_broker_strerror(status));
+            fail("client_retry", status);
+        }
+        uint64_t throttled = xpc_dictionary_get_uint64(stats, STATS_THROTTLED);
+        xpc_release(stats);
+        if (sent == 1) {
+            first_throttled = throttled;
+        } else {
+            retried = throttled > first_throttled;
+        }
+    }
+    if (!retried) {
+        ERRORF("client_retry: %d requests were not throttled", BUSY_REQUESTS);
+        fail("client_retry", EPROTO);
+    }
+    INFOF(
+        "client retried throttled request after %d requests in %.3f seconds",
+        sent - 1,
+        (double)(gettime() - start) / NANOSECONDS_PER_SECOND
+    );
+
+    // Acquire all networks at once, so networks that do not exist are created
+    // concurrently. The broker has fewer builtin networks than the create
+    // limit (4), so the requests must not be rejected.
+    connect_protocol();
+    xpc_object_t message = xpc_dictionary_create_empty();
+    xpc_dictionary_set_string(message, REQUEST_COMMAND, COMMAND_HELLO);
+    xpc_dictionary_set_int64(message, REQUEST_VERSION, PROTOCOL_VERSION_2);
+    expect_error("hello", send_sync("hello", message), PROTOCOL_VERSION_2);
+
+    reply = send_stats("busy_creates");
+    uint64_t busy_creates = xpc_dictionary_get_uint64(
+        reply, STATS_BUSY_CREATES
+    );
+    xpc_release(reply);
+
+    for (int i = 0; i < opt.network_count; i++) {
+        send_request(OPCODE_ACQUIRE, i + 1, opt.network_names[i]);
+    }
+    for (int i = 0; i < opt.network_count; i++) {
+        wait_reply("create");
+    }
+    for (int i = 0; i < opt.network_count; i++) {
+        reply = find_reply("create", i + 1);
+        expect_error("create", xpc_dictionary_get_int64(reply, REPLY_ERROR), 0);
+    }
+
+    reply = send_stats("busy_creates");
+    uint64_t rejected = xpc_dictionary_get_uint64(reply, STATS_BUSY_CREATES) -
+                        busy_creates;
+    xpc_release(reply);
+    if (rejected) {
+        ERRORF("%llu concurrent creates were rejected", rejected);
+        fail("busy_creates", EPROTO);
+    }
+
+    // Networks are released when disconnecting.
+    disconnect_protocol();
+
+    INFO("tested busy replies");
+}
+
+// Capture a relayed network, and check that the capture starts with a pcapng
+// section header block.
+static void capture_network(const char *network_name) {
+    INFOF("capturing network '%s'", network_name);
+
+    vmnet_broker_return_t broker_status;
+    int fd = vmnet_broker_capture(network_name, 0, NULL, &broker_status);
+    if (fd == -1) {
+        ERRORF(
+            "failed to capture network '%s': (%d) %s",
+            network_name,
+            broker_status,
+            vmnet_broker_strerror(broker_status)
+        );
+        fail("capture_network", broker_status);
+    }
+
+    uint32_t block_type;
+    ssize_t n = recv(fd, &block_type, sizeof(block_type), MSG_WAITALL);
+    if (n != sizeof(block_type)) {
+        int err = n < 0 ? errno : EIO;
+        ERRORF("failed to read capture: %s", strerror(err));
+        fail("read_capture", err);
+    }
+    if (block_type != PCAPNG_SECTION_HEADER) {
+        ERRORF("invalid capture block type: 0x%08x", block_type);
+        fail("read_capture", EINVAL);
+    }
+
+    INFOF("captured network '%s'", network_name);
+    close(fd);
+}
+
+// Release network acquired by acquire_network().
+static void release_network(const char *network_name) {
+    INFOF("releasing network '%s'", network_name);
+
+    vmnet_broker_return_t broker_status = vmnet_broker_release_network(
+        network_name
+    );
+    if (broker_status != VMNET_BROKER_SUCCESS) {
+        ERRORF(
+            "failed to release network '%s': (%d) %s",
+            network_name,
+            broker_status,
+            vmnet_broker_strerror(broker_status)
+        );
+        fail("release_network", broker_status);
+    }
+
+    INFOF("released network '%s'", network_name);
+}
+
+// Log network info from the broker.
+static void log_network_info(const char *network_name) {
+    INFOF("querying network '%s' info", network_name);
+
+    vmnet_broker_return_t broker_status;
+    xpc_object_t networks = vmnet_broker_network_info(
+        network_name, &broker_status
+    );
+    if (networks == NULL) {
+        ERRORF(
+            "failed to query network '%s' info: (%d) %s",
+            network_name,
+            broker_status,
+            vmnet_broker_strerror(broker_status)
+        );
+        fail("network_info", broker_status);
+    }
+
+    for (size_t i = 0; i < xpc_array_get_count(networks); i++) {
+        xpc_object_t info = xpc_array_get_value(networks, i);
+        INFOF(
+            "network '%s' mode '%s' subnet '%s' mask '%s' ipv6_prefix '%s' "
+            "prefix_len %lld peers %lld age %lld",
+            xpc_dictionary_get_string(info, NETWORK_NAME),
+            xpc_dictionary_get_string(info, NETWORK_MODE),
+            xpc_dictionary_get_string(info, NETWORK_SUBNET),
+            xpc_dictionary_get_string(info, NETWORK_MASK),
+            xpc_dictionary_get_string(info, NETWORK_IPV6_PREFIX),
+            xpc_dictionary_get_int64(info, NETWORK_PREFIX_LEN),
+            xpc_dictionary_get_int64(info, NETWORK_PEERS),
+            xpc_dictionary_get_int64(info, NETWORK_AGE)
+        );
+    }
+
+    xpc_release(networks);
+}
+
+// Log broker stats.
+static void log_stats(void) {
+    INFO("querying broker stats");
+
+    vmnet_broker_return_t broker_status;
+    xpc_object_t stats = vmnet_broker_stats(&broker_status);
+    if (stats == NULL) {
+        ERRORF(
+            "failed to query broker stats: (%d) %s",
+            broker_status,
+            vmnet_broker_strerror(broker_status)
+        );
+        fail("stats", broker_status);
+    }
+
+    xpc_object_t latency = xpc_dictionary_get_dictionary(stats, STATS_LATENCY);
+    const char *names[] = {STATS_LATENCY_IMMEDIATE, STATS_LATENCY_DEFERRED};
+    for (size_t i = 0; i < ARRAY_SIZE(names); i++) {
+        xpc_object_t dict = xpc_dictionary_get_dictionary(latency, names[i]);
+        INFOF(
+            "latency '%s' requests %llu pending %lld max_pending %lld "
+            "wait_usec %llu max_wait_usec %llu",
+            names[i],
+            xpc_dictionary_get_uint64(dict, LATENCY_REQUESTS),
+            xpc_dictionary_get_int64(dict, LATENCY_PENDING),
+            xpc_dictionary_get_int64(dict, LATENCY_MAX_PENDING),
+            xpc_dictionary_get_uint64(dict, LATENCY_WAIT_USEC),
+            xpc_dictionary_get_uint64(dict, LATENCY_MAX_WAIT_USEC)
+        );
+    }
+
+    xpc_object_t lanes = xpc_dictionary_get_dictionary(stats, STATS_LANES);
+    const char *lane_names[] = {STATS_LANE_FAST, STATS_LANE_SLOW};
+    for (size_t i = 0; i < ARRAY_SIZE(lane_names); i++) {
+        xpc_object_t dict = xpc_dictionary_get_dictionary(lanes, lane_names[i]);
+        INFOF(
+            "lane '%s' queued %llu depth %lld max_depth %lld wait_usec %llu "
+            "max_wait_usec %llu",
+            lane_names[i],
+            xpc_dictionary_get_uint64(dict, LANE_QUEUED),
+            xpc_dictionary_get_int64(dict, LANE_DEPTH),
+            xpc_dictionary_get_int64(dict, LANE_MAX_DEPTH),
+            xpc_dictionary_get_uint64(dict, LANE_WAIT_USEC),
+            xpc_dictionary_get_uint64(dict, LANE_MAX_WAIT_USEC)
+        );
+    }
+
+    xpc_object_t memory = xpc_dictionary_get_dictionary(stats, STATS_MEMORY);
+    INFOF(
+        "memory rss %llu malloc_blocks %llu malloc_bytes %llu",
+        xpc_dictionary_get_uint64(memory, MEMORY_RSS),
+        xpc_dictionary_get_uint64(memory, MEMORY_MALLOC_BLOCKS),
+        xpc_dictionary_get_uint64(memory, MEMORY_MALLOC_BYTES)
+    );
+
+    xpc_object_t pools = xpc_dictionary_get_dictionary(stats, STATS_POOLS);
+    xpc_dictionary_apply(pools, ^bool(const char *name, xpc_object_t pool) {
+        INFOF(
+            "pool '%s' in_use %lld allocs %llu slabs %lld bytes %llu",
+            name,
+            xpc_dictionary_get_int64(pool, POOL_IN_USE),
+            xpc_dictionary_get_uint64(pool, POOL_ALLOCS),
+            xpc_dictionary_get_int64(pool, POOL_SLABS),
+            xpc_dictionary_get_uint64(pool, POOL_BYTES)
+        );
+        return true;
+    });
+
+    xpc_object_t prediction = xpc_dictionary_get_dictionary(
+        stats, STATS_PREDICTION
+    );
+    INFOF(
+        "prediction predicted %llu hits %llu misses %llu",
+        xpc_dictionary_get_uint64(prediction, PREDICTION_PREDICTED),
+        xpc_dictionary_get_uint64(prediction, PREDICTION_HITS),
+        xpc_dictionary_get_uint64(prediction, PREDICTION_MISSES)
+    );
+
+    xpc_object_t sticky = xpc_dictionary_get_dictionary(
+        stats, STATS_STICKY_SUBNETS
+    );
+    INFOF(
+        "sticky subnets honored %llu conflicts %llu",
+        xpc_dictionary_get_uint64(sticky, STICKY_HONORED),
+        xpc_dictionary_get_uint64(sticky, STICKY_CONFLICTS)
+    );
+
+    xpc_object_t policy = xpc_dictionary_get_dictionary(stats, STATS_POLICY);
+    INFOF(
+        "policy checks %llu cache_hits %llu denied %llu",
+        xpc_dictionary_get_uint64(policy, POLICY_CHECKS),
+        xpc_dictionary_get_uint64(policy, POLICY_CACHE_HITS),
+        xpc_dictionary_get_uint64(policy, POLICY_DENIED)
+    );
+
+    xpc_object_t watchdog = xpc_dictionary_get_dictionary(
+        stats, STATS_WATCHDOG
+    );
+    xpc_object_t handled = xpc_dictionary_get_dictionary(
+        watchdog, WATCHDOG_HANDLED
+    );
+    xpc_object_t busy = xpc_dictionary_get_dictionary(
+        watchdog, WATCHDOG_BUSY_USEC
+    );
+    INFOF(
+        "watchdog budget_msec %lld blocked %llu requests %llu busy_usec %llu",
+        xpc_dictionary_get_int64(watchdog, WATCHDOG_BUDGET_MSEC),
+        xpc_dictionary_get_uint64(watchdog, WATCHDOG_BLOCKED),
+        xpc_dictionary_get_uint64(handled, "request"),
+        xpc_dictionary_get_uint64(busy, "request")
+    );
+    xpc_object_t slowest = xpc_dictionary_get_array(watchdog, WATCHDOG_SLOWEST);
+    xpc_array_apply(slowest, ^bool(size_t index, xpc_object_t trace) {
+        (void)index;
+        const char *network = xpc_dictionary_get_string(trace, TRACE_NETWORK);
+        INFOF(
+            "stall handler '%s' duration_usec %llu network '%s'",
+            xpc_dictionary_get_string(trace, TRACE_HANDLER),
+            xpc_dictionary_get_uint64(trace, TRACE_DURATION_USEC),
+            network ? network : ""
+        );
+        return true;
+    });
+
+    xpc_object_t relay = xpc_dictionary_get_dictionary(stats, STATS_RELAY);
+    INFOF(
+        "relay links %lld frames %llu bytes %llu batches %llu drops %llu "
+        "switches %lld unicast %llu flooded %llu suppressed %llu "
+        "segmented %llu captures %lld captured %llu capture_drops %llu "
+        "queued %llu queue_drops %llu",
+        xpc_dictionary_get_int64(relay, RELAY_LINKS),
+        xpc_dictionary_get_uint64(relay, RELAY_FRAMES),
+        xpc_dictionary_get_uint64(relay, RELAY_BYTES),
+        xpc_dictionary_get_uint64(relay, RELAY_BATCHES),
+        xpc_dictionary_get_uint64(relay, RELAY_DROPS),
+        xpc_dictionary_get_int64(relay, RELAY_SWITCHES),
+        xpc_dictionary_get_uint64(relay, RELAY_UNICAST),
+        xpc_dictionary_get_uint64(relay, RELAY_FLOODED),
+        xpc_dictionary_get_uint64(relay, RELAY_SUPPRESSED),
+        xpc_dictionary_get_uint64(relay, RELAY_SEGMENTED),
+        xpc_dictionary_get_int64(relay, RELAY_CAPTURES),
+        xpc_dictionary_get_uint64(relay, RELAY_CAPTURED),
+        xpc_dictionary_get_uint64(relay, RELAY_CAPTURE_DROPS),
+        xpc_dictionary_get_uint64(relay, RELAY_QUEUED),
+        xpc_dictionary_get_uint64(relay, RELAY_QUEUE_DROPS)
+    );
+
+    xpc_release(stats);
+}
+
 // Start interface from network and add to interfaces list.
 static void
 start_interface(vmnet_network_ref network, const char *network_name) {
@@ -421,12 +1465,44 @@ int main(int argc, char *argv[]) {
     setup_kq();
     setup_vmnet();
 
-    // Acquire networks and start interfaces.
+    if (opt.subscribe) {
+        subscribe();
+    }
+
+    // Busy tests acquire networks on their own connections.
+    if (opt.busy) {
+        test_busy();
+        ok();
+    }
+
+    // Acquire networks and start interfaces, or acquire relays.
     for (int i = 0; i < opt.network_count; i++) {
         const char *name = opt.network_names[i];
-        vmnet_network_ref network = acquire_network(name);
-        start_interface(network, name);
-        CFRelease(network);
+        if (opt.protocol) {
+            test_protocol(name);
+        } else if (opt.vhost_user) {
+            acquire_vhost_user(name);
+        } else if (opt.stream) {
+            acquire_stream(name);
+        } else if (opt.ring) {
+            acquire_ring(name);
+        } else if (opt.relay) {
+            acquire_relay(name);
+        } else {
+            vmnet_network_ref network = acquire_network(name);
+            start_interface(network, name);
+            CFRelease(network);
+        }
+        if (opt.capture) {
+            capture_network(name);
+        }
+        if (opt.info) {
+            log_network_info(name);
+        }
+    }
+
+    if (opt.stats) {
+        log_stats();
     }
 
     // Wait for termination signal (interactive mode only).
@@ -435,12 +1511,22 @@ int main(int argc, char *argv[]) {
         wait_error = wait_for_termination();
     }
 
-    // Stop all interfaces.
+    // Stop all interfaces and close relays.
     stop_interfaces();
+    while (relay_count > 0) {
+        close(relay_fds[--relay_count]);
+    }
 
     if (wait_error) {
         fail("kevent", wait_error);
     }
 
+    // Release networks (optional, released on exit).
+    if (opt.release) {
+        for (int i = 0; i < opt.network_count; i++) {
+            release_network(opt.network_names[i]);
+        }
+    }
+
     ok();
 }